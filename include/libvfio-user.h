@@ -39,6 +39,7 @@
 #define LIB_VFIO_USER_H
 
 #include <stdint.h>
+#include <sys/mman.h>
 #include <sys/uio.h>
 #include <unistd.h>
 #include <syslog.h>
@@ -48,6 +49,7 @@
 #include "pci_caps/msix.h"
 #include "pci_caps/pm.h"
 #include "pci_caps/px.h"
+#include "pci_caps/sriov.h"
 #include "pci_defs.h"
 #include "vfio-user.h"
 
@@ -80,8 +82,40 @@ typedef struct vfu_ctx vfu_ctx_t;
  */
 #define LIBVFIO_USER_FLAG_ATTACH_NB  (1 << 0)
 
+/*
+ * The context does not listen on a socket of its own: the path given to
+ * vfu_create_ctx() is the device name and connections are routed to it by a
+ * shared listener, see vfu_listener_add_ctx().
+ */
+#define LIBVFIO_USER_FLAG_SHARED     (1 << 1)
+
+/*
+ * Listen on a SOCK_SEQPACKET socket instead of a SOCK_STREAM one: each message,
+ * along with any file descriptors, must then be sent in a single sendmsg() and
+ * is received in a single recvmsg(). The client must connect with
+ * SOCK_SEQPACKET. Cannot be combined with LIBVFIO_USER_FLAG_SHARED.
+ */
+#define LIBVFIO_USER_FLAG_SEQPACKET  (1 << 2)
+
+/*
+ * Run each request in a coroutine of its own, so that a callback waiting in
+ * vfu_dma_read(), vfu_dma_write() or vfu_yield() suspends only its request
+ * while vfu_run_ctx() goes on with others. Replies may then be sent out of
+ * order. DMA unmaps, resets and migration state changes wait for the requests
+ * in flight to complete, and hold back the next ones until they have. Callbacks
+ * run on a 256 KiB stack.
+ */
+#define LIBVFIO_USER_FLAG_COROUTINES (1 << 3)
+
+/*
+ * VFU_TRANS_TCP listens on a TCP socket, so that the client can run on another
+ * host. File descriptors cannot be passed over it: regions are never
+ * mappable, and the server accesses DMA regions with VFIO_USER_DMA_READ and
+ * VFIO_USER_DMA_WRITE messages.
+ */
 typedef enum {
     VFU_TRANS_SOCK,
+    VFU_TRANS_TCP,
     VFU_TRANS_MAX
 } vfu_trans_t;
 
@@ -94,8 +128,9 @@ typedef enum {
  * initialized, this can be overridden with vfu_setup_device_nr_irqs.
  *
  * @trans: transport type
- * @path: path to socket file.
- * @flags: context flags
+ * @path: path to socket file, or "host:port" to listen on for VFU_TRANS_TCP
+ * @flags: context flags, LIBVFIO_USER_FLAG_SHARED and
+ *  LIBVFIO_USER_FLAG_SEQPACKET are for VFU_TRANS_SOCK only
  * @pvt: private data
  * @dev_type: device type
  *
@@ -105,6 +140,52 @@ vfu_ctx_t *
 vfu_create_ctx(vfu_trans_t trans, const char *path,
                int flags, void *pvt, vfu_dev_type_t dev_type);
 
+/**
+ * Creates a realized context from @tmpl, a realized context used as a template
+ * for identical devices, which is much cheaper than setting up each device
+ * from scratch. The clone starts with a copy of the template's config space
+ * and capabilities, and has the same IRQ counts, DMA and reset callbacks. The
+ * region table is shared with the template rather than copied, so
+ * vfu_setup_region() fails on the clone and, while it has clones, on the
+ * template, which must be destroyed after all of them. Region callbacks are
+ * passed the clone, whose private data is @pvt.
+ *
+ * Templates with migration, multiple functions, SR-IOV or doorbell areas
+ * cannot be cloned. The template itself can be used as a device as well.
+ *
+ * @tmpl: the template context
+ * @path: path to socket file, or device name with LIBVFIO_USER_FLAG_SHARED
+ * @flags: context flags
+ * @pvt: private data
+ *
+ * @returns the vfu_ctx to be used or NULL on error. Sets errno.
+ */
+vfu_ctx_t *
+vfu_clone_ctx(vfu_ctx_t *tmpl, const char *path, int flags, void *pvt);
+
+#define VFU_PCI_MAX_FUNCTIONS   8
+
+/**
+ * Creates a context for another function of a multi-function PCI device. The
+ * new function is served over the connection of @vfu_ctx, which is function 0,
+ * and shares its DMA controller, so guest memory is mapped once for all
+ * functions. Config space, regions, IRQs and the reset callback are set up per
+ * function with the usual vfu_setup_*() calls on the returned context;
+ * DMA, migration and the transport are only set up through function 0.
+ *
+ * Functions must be created before function 0 is realized, which realizes them
+ * as well. They are destroyed along with function 0, or individually with
+ * vfu_destroy_ctx().
+ *
+ * @vfu_ctx: the function 0 context
+ * @fn: function number, 1 to VFU_PCI_MAX_FUNCTIONS - 1
+ * @pvt: private data
+ *
+ * @returns the function context or NULL on error. Sets errno.
+ */
+vfu_ctx_t *
+vfu_create_function(vfu_ctx_t *vfu_ctx, uint8_t fn, void *pvt);
+
 /*
  * Finalizes the device making it ready for vfu_attach_ctx(). This function is
  * mandatory to be called before vfu_attach_ctx().
@@ -132,31 +213,169 @@ vfu_attach_ctx(vfu_ctx_t *vfu_ctx);
 /**
  * Return a file descriptor suitable for waiting on via epoll() or similar. This
  * should not be cached, as it may change after a successful vfu_attach_ctx().
+ * Once attached, it is readable whenever vfu_run_ctx() has requests to
+ * process, including those received while waiting for the reply to a DMA
+ * transfer, and those to resume, see vfu_yield().
  */
 int
 vfu_get_poll_fd(vfu_ctx_t *vfu_ctx);
 
+typedef struct vfu_listener vfu_listener_t;
+
+/**
+ * Creates a listening socket shared by many contexts. Clients name the device
+ * they want in the "device" field of the VFIO_USER_VERSION JSON, and the
+ * connection is routed to the context of that name. This avoids a socket per
+ * device, and devices can be added and removed without creating sockets.
+ *
+ * @path: path to socket file.
+ * @flags: LIBVFIO_USER_FLAG_ATTACH_NB makes vfu_listener_accept() non-blocking
+ *
+ * @returns the listener or NULL on error. Sets errno.
+ */
+vfu_listener_t *
+vfu_create_listener(const char *path, int flags);
+
+/**
+ * Adds a context created with LIBVFIO_USER_FLAG_SHARED to the listener, under
+ * the path given to vfu_create_ctx(). vfu_attach_ctx() on such a context fails
+ * with EAGAIN until a connection has been routed to it, and succeeds
+ * afterwards. Once the client disconnects, the context can be routed a new
+ * connection. Destroying the context removes it from the listener.
+ *
+ * @returns: 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_listener_add_ctx(vfu_listener_t *listener, vfu_ctx_t *vfu_ctx);
+
+/**
+ * Accepts one connection, receives the client version and routes the
+ * connection to the named context, completing version negotiation on its
+ * behalf. The connection is closed if the device does not exist (ENOENT) or
+ * already has a client (EBUSY).
+ *
+ * A non-blocking listener receives the versions of up to 16 connections at a
+ * time as they arrive, and routes the first one complete. Once routed, the
+ * connection is a blocking one like that of any other context.
+ *
+ * @returns the context the connection was routed to, or NULL on error. Sets
+ * errno, EAGAIN or EWOULDBLOCK meaning no connection is ready to be routed for
+ * a non-blocking listener.
+ */
+vfu_ctx_t *
+vfu_listener_accept(vfu_listener_t *listener);
+
+/**
+ * Returns the file descriptor to poll, which becomes readable when a
+ * connection is pending or, for a non-blocking listener, when more of a
+ * version has arrived.
+ */
+int
+vfu_listener_get_poll_fd(vfu_listener_t *listener);
+
+/**
+ * Destroys the listener. Its contexts keep any connection they have, but no
+ * longer receive new ones.
+ */
+void
+vfu_destroy_listener(vfu_listener_t *listener);
+
 /**
  * Polls the vfu_ctx and processes the command received from client.
  * - Blocking vfu_ctx:
  *   Blocks until new request is received from client and continues processing
- *   the requests. Exits only in case of error or if the client disconnects.
+ *   the requests. Exits only in case of error or if the client disconnects,
+ *   or, with LIBVFIO_USER_FLAG_COROUTINES, returns 0 rather than block while
+ *   requests are ready to resume, see vfu_yield().
  * - Non-blocking vfu_ctx(LIBVFIO_USER_FLAG_ATTACH_NB):
- *   Processes one request from client if it's available, otherwise it
- *   immediately returns and the caller is responsible for periodically
- *   calling again.
+ *   Processes the requests from client that are available, if any, and then
+ *   immediately returns; the caller is responsible for periodically calling
+ *   again. Only the requests returned by a single read of the socket are
+ *   processed, so that a client pipelining requests can't keep it from
+ *   returning.
  *
  * @vfu_ctx: The libvfio-user context to poll
  *
  * @returns 0 on success, -1 on error, with errno set as follows:
  *
  * EAGAIN/EWOULDBLOCK: no more commands to process
+ * EBUSY: the context is over its rate limits, see vfu_setup_rate_limit()
  * ENOTCONN: client closed connection, vfu_attach_ctx() should be called again
  * Other errno values are also possible.
  */
 int
 vfu_run_ctx(vfu_ctx_t *vfu_ctx);
 
+/*
+ * Limits on the message traffic of a context, so that it can't starve others
+ * sharing its event loop: region accesses by the client, and DMA the server
+ * does with messages. Each limit is a token bucket, filling at the given rate
+ * per second up to the burst; a rate of 0 means no limit, and a burst of 0 one
+ * second's worth.
+ */
+typedef struct {
+    uint64_t ops_per_sec;       /* region accesses and DMA messages */
+    uint64_t ops_burst;
+    uint64_t bytes_per_sec;     /* data they carry */
+    uint64_t bytes_burst;
+} vfu_rate_limit_t;
+
+/**
+ * Sets up rate limiting. Once the context has gone over a limit, vfu_run_ctx()
+ * holds back its requests until the bucket has filled again: a blocking
+ * context sleeps, while a non-blocking one returns -1 with errno set to EBUSY,
+ * and the caller should not poll it for the delay vfu_get_rate_limit_stats()
+ * reports. Not to be called while vfu_run_ctx() runs.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @limit: the limits, or NULL for none
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_setup_rate_limit(vfu_ctx_t *vfu_ctx, const vfu_rate_limit_t *limit);
+
+typedef struct {
+    uint64_t nr_throttled;      /* times requests were held back */
+    uint64_t throttled_ns;      /* for how long in total */
+    uint64_t delay_ns;          /* until they no longer are, or 0 */
+} vfu_rate_limit_stats_t;
+
+/**
+ * Gets the rate limiting counters of the context, all zero if it has never
+ * had limits.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @stats: where to store the counters
+ */
+void
+vfu_get_rate_limit_stats(vfu_ctx_t *vfu_ctx, vfu_rate_limit_stats_t *stats);
+
+/**
+ * Hands region reads and writes to a pool of worker threads, so that a slow
+ * region callback doesn't hold up accesses to other regions. Accesses to the
+ * same region (of the same function) are still made one after the other, in
+ * the order the client sent them, and each is replied to by its worker as
+ * soon as it completes, so replies may come out of order. Config space and
+ * migration region accesses, as well as all other requests, are still
+ * processed by vfu_run_ctx(), after the region accesses received before them
+ * have completed.
+ *
+ * Region callbacks may then run in several threads at once. Their DMA
+ * messages, for memory the client hasn't given a file descriptor for, are
+ * exchanged alongside vfu_run_ctx()'s: whichever thread receives a reply
+ * hands it to the one waiting for it.
+ *
+ * Must be called before vfu_realize_ctx().
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @nr_workers: number of worker threads
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_setup_region_workers(vfu_ctx_t *vfu_ctx, unsigned int nr_workers);
+
 /**
  * Destroys libvfio-user context.
  *
@@ -301,6 +520,145 @@ vfu_setup_region(vfu_ctx_t *vfu_ctx, int region_idx, size_t size,
                  struct iovec *mmap_areas, uint32_t nr_mmap_areas,
                  int fd);
 
+typedef struct vfu_doorbells vfu_doorbells_t;
+
+/**
+ * Sets up a region, like vfu_setup_region(), with an area of @nr_doorbells
+ * consecutive 32-bit doorbell registers at @offset that the client maps and
+ * writes to directly, so ringing a doorbell costs no message at all. The area
+ * is backed by shared memory that the device polls with vfu_doorbells_poll()
+ * or vfu_doorbells_wait().
+ *
+ * Accesses to the doorbell area via VFIO_USER_REGION_READ/WRITE are handled by
+ * the library, and writes wake up vfu_doorbells_wait(). The rest of the region
+ * is handled by @region_access, and isn't mappable.
+ *
+ * The doorbells are owned by the context and released with it.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @region_idx: region index
+ * @size: size of the region
+ * @region_access: callback function to access the rest of the region
+ * @flags: region flags (VFU_REGION_FLAG_*)
+ * @offset: page-aligned offset of the doorbell area within the region
+ * @nr_doorbells: number of doorbells
+ *
+ * @returns the doorbells on success, NULL on error. Sets errno.
+ */
+vfu_doorbells_t *
+vfu_setup_region_doorbells(vfu_ctx_t *vfu_ctx, int region_idx, size_t size,
+                           vfu_region_access_cb_t *region_access, int flags,
+                           size_t offset, uint32_t nr_doorbells);
+
+/**
+ * Checks which doorbells have been written with a new value since the last
+ * call. Doorbells are compared several at a time with SIMD instructions where
+ * available, so polling many idle doorbells is cheap.
+ *
+ * Only one thread may poll a given set of doorbells.
+ *
+ * @dbs: the doorbells
+ * @changed: bitmap of nr_doorbells bits, set for each doorbell that changed
+ *
+ * @returns the number of doorbells that changed.
+ */
+int
+vfu_doorbells_poll(vfu_doorbells_t *dbs, uint64_t *changed);
+
+/**
+ * Polls the doorbells like vfu_doorbells_poll(), busy-waiting for up to
+ * @spin_us microseconds for a change, and then sleeping for up to @timeout_ms
+ * milliseconds before polling once more. The sleep ends early if a doorbell is
+ * written through a message, or if the file descriptor returned by
+ * vfu_doorbells_get_fd() is written to, e.g. to stop the device thread.
+ *
+ * Writes through the client's mapping can't wake a sleeping thread; they are
+ * picked up when it next polls.
+ *
+ * @returns the number of doorbells that changed, which is 0 on timeout, or -1
+ * on error. Sets errno.
+ */
+int
+vfu_doorbells_wait(vfu_doorbells_t *dbs, uint64_t *changed,
+                   unsigned int spin_us, int timeout_ms);
+
+/**
+ * Returns the value of a doorbell as of the last poll.
+ */
+uint32_t
+vfu_doorbells_read(vfu_doorbells_t *dbs, uint32_t idx);
+
+/**
+ * Returns an eventfd that is signalled when a doorbell is written through a
+ * message, for use with epoll() or similar.
+ */
+int
+vfu_doorbells_get_fd(vfu_doorbells_t *dbs);
+
+/**
+ * Called when the client sets VF Enable in the SR-IOV capability of @vfu_ctx,
+ * with @num_vfs being NumVFs, or clears it, with @num_vfs being 0. VFs that
+ * don't exist yet can be created here with vfu_create_vf().
+ *
+ * @returns 0 on success, -1 on error with errno set, in which case the write
+ * to the capability fails.
+ */
+typedef int (vfu_sriov_cb_t)(vfu_ctx_t *vfu_ctx, uint16_t num_vfs);
+
+/**
+ * Sets up the callback for VF Enable changes. The SR-IOV capability itself is
+ * added with vfu_pci_add_capability(), with TotalVFs, First VF Offset, VF
+ * Stride, VF Device ID and Supported Page Sizes filled in; the remaining
+ * fields are emulated. As routing IDs are relative to function 0 and limited
+ * to 8 bits, First VF Offset + (TotalVFs - 1) * VF Stride must not exceed 255.
+ *
+ * @vfu_ctx: the physical function context
+ * @sriov: the callback
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_setup_device_sriov_cb(vfu_ctx_t *vfu_ctx, vfu_sriov_cb_t *sriov);
+
+/**
+ * Sets up a VF BAR, which is shared by all VFs of @vfu_ctx. @size is per VF,
+ * must be a power of two and is what the VF BAR in the SR-IOV capability
+ * reports when sized. @region_access is called with the VF context.
+ *
+ * @vfu_ctx: the physical function context
+ * @region_idx: VFU_PCI_DEV_BAR0_REGION_IDX to VFU_PCI_DEV_BAR5_REGION_IDX
+ * @size: size of the BAR of each VF
+ * @region_access: callback function to access the region
+ * @flags: region flags, must include VFU_REGION_FLAG_MEM
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_setup_vf_region(vfu_ctx_t *vfu_ctx, int region_idx, size_t size,
+                    vfu_region_access_cb_t *region_access, int flags);
+
+/**
+ * Creates a virtual function of an SR-IOV physical function. VFs are cheap:
+ * they share the connection, DMA controller and VF BARs of the physical
+ * function, and only have their own config space, IRQs and reset callback,
+ * which are set up with the usual vfu_setup_*() calls on the returned context.
+ *
+ * VFs can be created at any time after the SR-IOV capability has been added,
+ * including from the vfu_sriov_cb_t callback. The client can only reach them
+ * while VF Enable is set and @vf_idx is less than NumVFs. They are realized
+ * with the physical function, or when VF Enable is set; VFs created while it
+ * is already set must be realized with vfu_realize_ctx(). They are destroyed
+ * with the physical function or individually with vfu_destroy_ctx().
+ *
+ * @vfu_ctx: the physical function context, which must be function 0
+ * @vf_idx: 0-based index of the VF, less than TotalVFs
+ * @pvt: private data
+ *
+ * @returns the VF context or NULL on error. Sets errno.
+ */
+vfu_ctx_t *
+vfu_create_vf(vfu_ctx_t *vfu_ctx, uint16_t vf_idx, void *pvt);
+
 /*
  * Returns the size of the area needed to hold the migration registers at the
  * beginning of the migration region; guaranteed to be page aligned.
@@ -432,6 +790,60 @@ int
 vfu_setup_device_dma(vfu_ctx_t *vfu_ctx, vfu_dma_register_cb_t *dma_register,
                      vfu_dma_unregister_cb_t *dma_unregister);
 
+/**
+ * Emulate an IOMMU in front of the device. The client then establishes I/O
+ * virtual address mappings onto its DMA regions with VFIO_USER_IOMMU_MAP, and
+ * every address the device passes to vfu_addr_to_sg() and friends is
+ * translated through them. A VFIO_USER_IOMMU_MAP that fails adds none of its
+ * mappings. Recent translations are cached, and VFIO_USER_IOMMU_UNMAP
+ * invalidates the cache for the ranges it removes.
+ *
+ * Without this, addresses are taken to be the guest physical addresses of
+ * VFIO_USER_DMA_MAP, and VFIO_USER_IOMMU_MAP/UNMAP fail with ENOTSUP.
+ *
+ * vfu_setup_device_dma() must have been called prior to using this function.
+ *
+ * @vfu_ctx: the libvfio-user context
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_setup_device_iommu(vfu_ctx_t *vfu_ctx);
+
+typedef struct vfu_dma_group vfu_dma_group_t;
+
+/**
+ * Creates a group of contexts whose DMA regions come from the same client, so
+ * that they can share local mappings of them. Contexts in a group that are
+ * given the same region (the same file, offset, size and protection) map it
+ * only once between them, however many devices the client attaches.
+ *
+ * @returns the group or NULL on error. Sets errno.
+ */
+vfu_dma_group_t *
+vfu_dma_group_create(void);
+
+/**
+ * Destroys a DMA group. All contexts in it must have been destroyed first.
+ */
+void
+vfu_dma_group_destroy(vfu_dma_group_t *group);
+
+/**
+ * Adds the context to a DMA group. Contexts in a group may be run from
+ * different threads.
+ *
+ * vfu_setup_device_dma() must have been called prior to using this function,
+ * and no DMA regions may have been added yet.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @group: the group created with vfu_dma_group_create()
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_setup_device_dma_group(vfu_ctx_t *vfu_ctx, vfu_dma_group_t *group);
+
 enum vfu_dev_irq_type {
     VFU_DEV_INTX_IRQ,
     VFU_DEV_MSI_IRQ,
@@ -583,10 +995,18 @@ vfu_setup_device_migration_callbacks(vfu_ctx_t *vfu_ctx,
  * libvfio-user takes care of using the correct IRQ type (IRQ index: INTx or
  * MSI/X), the caller only needs to specify the sub-index.
  *
+ * If the client hasn't provided an eventfd for the vector, the interrupt is
+ * posted as a VFIO_USER_VM_INTERRUPT message, on the connection of function 0
+ * for other functions and VFs. Interrupts triggered while vfu_run_ctx()
+ * processes requests are batched into one message, sent after the replies once
+ * no more requests are pending. Clients must accept such messages with the
+ * "vm_interrupt" capability, except over VFU_TRANS_TCP.
+ *
  * @vfu_ctx: the libvfio-user context to trigger interrupt
  * @subindex: vector subindex to trigger interrupt on
  *
- * @returns 0 on success, or -1 on failure. Sets errno.
+ * @returns 0 on success, or -1 on failure. Sets errno: ENOENT if there is no
+ *  eventfd for the vector and the client doesn't accept posted interrupts.
  */
 int
 vfu_irq_trigger(vfu_ctx_t *vfu_ctx, uint32_t subindex);
@@ -617,6 +1037,146 @@ int
 vfu_addr_to_sg(vfu_ctx_t *vfu_ctx, vfu_dma_addr_t dma_addr, size_t len,
                dma_sg_t *sg, int max_sg, int prot);
 
+/*
+ * A guest physical address span to translate with vfu_addr_to_sg_batch().
+ *
+ * @dma_addr: the guest physical address
+ * @len: size of memory to be mapped
+ * @prot: protection as defined in <sys/mman.h>
+ */
+typedef struct {
+    vfu_dma_addr_t dma_addr;
+    size_t len;
+    int prot;
+} vfu_dma_range_t;
+
+/**
+ * Like vfu_addr_to_sg(), but translates a batch of guest physical address
+ * spans, such as the buffers of a ring of descriptors, in a single call. Each
+ * span is translated into exactly one scatter/gather entry; region lookups are
+ * shared between consecutive spans that fall in the same region.
+ *
+ * vfu_setup_device_dma() must have been called prior to using this function.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @in: array of spans to translate
+ * @n: number of elements in @in
+ * @sg: array of @n elements that receives the scatter/gather entries
+ * @errs: array of @n elements that receives, for each span, 0 on success or an
+ *        errno value on failure: ENOENT if the span is invalid, EACCES on
+ *        protection violation, ENOSPC if the span crosses DMA regions (use
+ *        vfu_addr_to_sg() for it instead)
+ *
+ * @returns the number of spans translated successfully, or -1 on failure. Sets
+ * errno.
+ */
+int
+vfu_addr_to_sg_batch(vfu_ctx_t *vfu_ctx, const vfu_dma_range_t *in, int n,
+                     dma_sg_t *sg, int *errs);
+
+/*
+ * Read-only snapshot of a guest DMA region, see vfu_get_dma_table(). The
+ * layout of this structure and of vfu_dma_table_t is part of the ABI.
+ *
+ * @iova: guest DMA range
+ * @vaddr: local mapping of the range, or NULL if it isn't mappable
+ * @prot: protection as defined in <sys/mman.h>
+ * @dirty_bitmap: one bit per page of the range, or NULL if dirty page logging
+ *   isn't enabled
+ */
+typedef struct {
+    struct iovec iova;
+    void *vaddr;
+    uint32_t prot;
+    uint8_t *dirty_bitmap;
+} vfu_dma_table_region_t;
+
+/*
+ * The guest DMA regions, kept up to date by libvfio-user as the client adds
+ * and removes them.
+ *
+ * @dirty_pgsize: dirty page granularity, 0 if dirty page logging isn't enabled
+ * @nregions: number of elements in @regions
+ * @regions: the guest DMA regions
+ */
+typedef struct {
+    size_t dirty_pgsize;
+    uint32_t nregions;
+    const vfu_dma_table_region_t *regions;
+} vfu_dma_table_t;
+
+/**
+ * Returns the guest DMA region table for use with vfu_iova_to_vaddr(). The
+ * table lives as long as the context and is only modified from within
+ * vfu_run_ctx(), so it can be retrieved once and used from the thread that
+ * runs the context.
+ *
+ * The table is indexed by guest physical address; if an IOMMU is emulated (see
+ * vfu_setup_device_iommu()), device addresses must go through vfu_addr_to_sg()
+ * instead.
+ *
+ * vfu_setup_device_dma() must have been called prior to using this function.
+ *
+ * @vfu_ctx: the libvfio-user context
+ *
+ * @returns the table on success, NULL on failure. Sets errno.
+ */
+const vfu_dma_table_t *
+vfu_get_dma_table(vfu_ctx_t *vfu_ctx);
+
+/**
+ * Translates a guest physical address span that lies within a single mappable
+ * DMA region to a pointer in the program's virtual memory, without the
+ * overhead of vfu_addr_to_sg() and vfu_map_sg(). If @prot includes PROT_WRITE,
+ * the pages are marked dirty.
+ *
+ * Unlike vfu_map_sg(), no reference is taken on the region: the pointer must
+ * not be used after the region's dma_unregister callback returns.
+ *
+ * @dma: table returned by vfu_get_dma_table()
+ * @dma_addr: the guest physical address
+ * @len: size of memory to be accessed
+ * @prot: protection as defined in <sys/mman.h>
+ *
+ * @returns the local address, or NULL if the span isn't within a single
+ * mappable region or @prot isn't permitted.
+ */
+static inline void *
+vfu_iova_to_vaddr(const vfu_dma_table_t *dma, vfu_dma_addr_t dma_addr,
+                  size_t len, int prot)
+{
+    uint32_t i;
+
+    for (i = 0; i < dma->nregions; i++) {
+        const vfu_dma_table_region_t *r = &dma->regions[i];
+        size_t offset = (char *)dma_addr - (char *)r->iova.iov_base;
+        size_t pg;
+
+        if ((char *)dma_addr < (char *)r->iova.iov_base ||
+            offset >= r->iova.iov_len) {
+            continue;
+        }
+
+        if (r->vaddr == NULL || len == 0 || len > r->iova.iov_len - offset ||
+            ((uint32_t)prot & r->prot) != (uint32_t)prot) {
+            return NULL;
+        }
+
+        if ((prot & PROT_WRITE) && r->dirty_bitmap != NULL) {
+            for (pg = offset / dma->dirty_pgsize;
+                 pg <= (offset + len - 1) / dma->dirty_pgsize; pg++) {
+                /* Other threads may share the byte. */
+                __atomic_fetch_or(&r->dirty_bitmap[pg / 8],
+                                  (uint8_t)(1 << (pg % 8)), __ATOMIC_RELAXED);
+            }
+        }
+
+        return (char *)r->vaddr + offset;
+    }
+
+    return NULL;
+}
+
 /**
  * Maps a list scatter/gather entries from the guest's physical address space
  * to the program's virtual memory. It is the caller's responsibility to remove
@@ -651,7 +1211,12 @@ vfu_unmap_sg(vfu_ctx_t *vfu_ctx, const dma_sg_t *sg,
              struct iovec *iov, int cnt);
 
 /**
- * Read from the dma region exposed by the client.
+ * Read from the dma region exposed by the client. If the segment is mappable,
+ * the data is copied directly from the local mapping of the region. Otherwise
+ * it is requested from the client; transfers larger than the client's maximum
+ * message size are split into several VFIO_USER_DMA_READ messages, a number of
+ * which are outstanding at the same time. With LIBVFIO_USER_FLAG_COROUTINES, a
+ * request waiting for the replies lets vfu_run_ctx() process others meanwhile.
  *
  * @vfu_ctx: the libvfio-user context
  * @sg: a DMA segment obtained from dma_addr_to_sg
@@ -663,7 +1228,10 @@ int
 vfu_dma_read(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, void *data);
 
 /**
- * Write to the dma region exposed by the client.
+ * Write to the dma region exposed by the client. Like vfu_dma_read(), mappable
+ * segments are written directly, marking the pages dirty if dirty page logging
+ * is enabled; otherwise the data is sent in pipelined VFIO_USER_DMA_WRITE
+ * messages.
  *
  * @vfu_ctx: the libvfio-user context
  * @sg: a DMA segment obtained from dma_addr_to_sg
@@ -674,6 +1242,285 @@ vfu_dma_read(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, void *data);
 int
 vfu_dma_write(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, void *data);
 
+/**
+ * Suspends the request being processed so that vfu_run_ctx() can go on with
+ * others; it's resumed by the next call to vfu_run_ctx(), the poll fd staying
+ * readable meanwhile. Callbacks waiting for something other than the client,
+ * e.g. I/O to a backend, call it until that completes.
+ *
+ * @vfu_ctx: the libvfio-user context, created with LIBVFIO_USER_FLAG_COROUTINES
+ *
+ * @returns 0 on success, -1 on failure. Sets errno: EINVAL if not called from
+ * a callback processing a request, ENOTCONN if the client has gone.
+ */
+int
+vfu_yield(vfu_ctx_t *vfu_ctx);
+
+/**
+ * Copies data to the memory described by a list of scatter/gather entries,
+ * as obtained by vfu_addr_to_sg(), filling the entries in order. Entries
+ * that are mappable are written directly (large copies bypass the CPU cache)
+ * and have their pages marked dirty; the rest are written with
+ * vfu_dma_write().
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @sg: array of scatter/gather entries
+ * @cnt: number of scatter/gather entries
+ * @src: data to copy
+ * @len: number of bytes to copy, must not exceed the total length of @sg
+ *
+ * @returns 0 on success, -1 on failure. Sets errno.
+ */
+int
+vfu_sg_copy_to(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, int cnt, const void *src,
+               size_t len);
+
+/**
+ * Copies data from the memory described by a list of scatter/gather entries,
+ * the counterpart of vfu_sg_copy_to().
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @sg: array of scatter/gather entries
+ * @cnt: number of scatter/gather entries
+ * @dst: buffer to copy into
+ * @len: number of bytes to copy, must not exceed the total length of @sg
+ *
+ * @returns 0 on success, -1 on failure. Sets errno.
+ */
+int
+vfu_sg_copy_from(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, int cnt, void *dst,
+                 size_t len);
+
+/**
+ * Sets how large direct copies to client memory, by vfu_dma_write() and
+ * vfu_sg_copy_to(), must be to bypass the CPU cache. By default, it's half the
+ * size of the last-level cache.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @threshold: size in bytes, 0 for the default, SIZE_MAX to never bypass it
+ *
+ * @returns 0 on success, -1 on failure. Sets errno.
+ */
+int
+vfu_setup_dma_copy_threshold(vfu_ctx_t *vfu_ctx, size_t threshold);
+
+/*
+ * Virtqueue processing.
+ *
+ * Helpers for virtio devices to consume buffers from a split or packed
+ * virtqueue (VIRTIO 1.1 section 2.6 and 2.7) that lives in guest DMA memory.
+ * The rings are translated once when the queue is created; descriptor buffers
+ * are translated as they are popped, and are returned as local iovecs, so all
+ * of the queue memory must be in mappable DMA regions.
+ *
+ * Ring fields are assumed to be in the host's byte order, i.e. the device must
+ * be little endian, as all VIRTIO 1.x devices are.
+ */
+
+typedef struct vfu_virtq vfu_virtq_t;
+
+/* The queue uses the packed layout (VIRTIO_F_RING_PACKED). */
+#define VFU_VIRTQ_F_PACKED      (1 << 0)
+/* VIRTIO_F_EVENT_IDX was negotiated. */
+#define VFU_VIRTQ_F_EVENT_IDX   (1 << 1)
+
+typedef struct {
+    uint32_t flags;             /* VFU_VIRTQ_F_* */
+    uint16_t size;              /* number of descriptors */
+    vfu_dma_addr_t desc;        /* descriptor table or ring */
+    vfu_dma_addr_t driver;      /* available ring, or driver event area */
+    vfu_dma_addr_t device;      /* used ring, or device event area */
+    uint32_t irq_subindex;      /* vector to trigger via vfu_irq_trigger() */
+} vfu_virtq_info_t;
+
+/*
+ * A descriptor chain popped from a virtqueue: @out_num device-readable iovecs
+ * followed by @in_num device-writable ones. Writable buffers are marked dirty
+ * when popped.
+ */
+typedef struct {
+    uint16_t id;                /* head index or buffer ID */
+    uint16_t ndescs;            /* ring slots used by the chain */
+    uint32_t out_num;
+    uint32_t in_num;
+    struct iovec *iov;
+} vfu_virtq_elem_t;
+
+/**
+ * Attaches to a virtqueue the driver has set up. All ring addresses are in the
+ * same address space as vfu_addr_to_sg().
+ *
+ * The queue keeps references to the DMA regions containing the rings, so it
+ * must be destroyed from the dma_unregister callback of any of them, and the
+ * device must not use iovecs returned by vfu_virtq_pop() after their regions
+ * have been unregistered.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @info: queue location and parameters
+ *
+ * @returns the virtqueue on success, NULL on failure. Sets errno.
+ */
+vfu_virtq_t *
+vfu_virtq_create(vfu_ctx_t *vfu_ctx, const vfu_virtq_info_t *info);
+
+/**
+ * Detaches from a virtqueue and releases the ring references.
+ *
+ * @vq: the virtqueue, may be NULL
+ */
+void
+vfu_virtq_destroy(vfu_virtq_t *vq);
+
+/**
+ * Pops up to @max_elems available descriptor chains. The driver's available
+ * index is read once for the whole batch. Indirect descriptors are supported.
+ *
+ * @vq: the virtqueue
+ * @elems: array to fill in
+ * @max_elems: size of @elems
+ * @iov: iovec storage shared by all chains popped, pointed to by @elems
+ * @max_iov: size of @iov; chains that don't fit are left in the ring
+ *
+ * @returns the number of chains popped, which may be 0, or -1 on error. Sets
+ * errno: ENOBUFS if the first chain doesn't fit in @iov, EINVAL for a
+ * malformed chain, and the errors of vfu_addr_to_sg() for bad buffers.
+ */
+int
+vfu_virtq_pop(vfu_virtq_t *vq, vfu_virtq_elem_t *elems, int max_elems,
+              struct iovec *iov, int max_iov);
+
+/**
+ * Returns a batch of chains to the driver, publishing them with a single
+ * index (or flags) update, and triggers the queue's interrupt unless the
+ * driver suppressed it, honouring VIRTIO_F_EVENT_IDX.
+ *
+ * @vq: the virtqueue
+ * @elems: chains previously popped from @vq
+ * @lens: number of bytes written to each chain
+ * @n: number of chains
+ *
+ * @returns 0 on success, -1 on failure to trigger the interrupt. Sets errno.
+ */
+int
+vfu_virtq_push(vfu_virtq_t *vq, const vfu_virtq_elem_t *elems,
+               const uint32_t *lens, int n);
+
+/*
+ * NVMe queue pairs.
+ *
+ * Helpers for NVMe-like devices to consume a submission queue (SQ) and post to
+ * its completion queue (CQ), both in guest DMA memory (NVMe 1.4 section 4.1).
+ * Each SQ is paired with its own CQ. Shadow doorbells (NVMe 1.4 section
+ * 5.8, Doorbell Buffer Config) are supported: once they are set up, the
+ * driver only writes to the doorbell registers when the device asks for it
+ * via the EventIdx buffer, which the device does only once it runs out of
+ * work.
+ */
+
+typedef struct vfu_nvme_qp vfu_nvme_qp_t;
+
+#define VFU_NVME_SQE_SIZE   64
+#define VFU_NVME_CQE_SIZE   16
+
+typedef struct {
+    uint16_t qid;               /* queue ID, reported in completions */
+    uint16_t sq_size;           /* number of SQ entries */
+    uint16_t cq_size;           /* number of CQ entries */
+    vfu_dma_addr_t sq_addr;
+    vfu_dma_addr_t cq_addr;
+    bool irq_enabled;
+    uint32_t irq_subindex;      /* vector to trigger via vfu_irq_trigger() */
+} vfu_nvme_qp_info_t;
+
+typedef struct {
+    uint32_t dw0;               /* command specific */
+    uint16_t cid;               /* command identifier */
+    uint16_t status;            /* status field, without the phase tag */
+} vfu_nvme_cpl_t;
+
+/**
+ * Attaches to a queue pair the driver has created. Like virtqueues (see
+ * vfu_virtq_create()), the queues must be in mappable DMA regions, and the
+ * queue pair must be destroyed when they are unregistered.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @info: queue location and parameters
+ *
+ * @returns the queue pair on success, NULL on failure. Sets errno.
+ */
+vfu_nvme_qp_t *
+vfu_nvme_qp_create(vfu_ctx_t *vfu_ctx, const vfu_nvme_qp_info_t *info);
+
+/**
+ * Releases a queue pair.
+ *
+ * @qp: the queue pair, may be NULL
+ */
+void
+vfu_nvme_qp_destroy(vfu_nvme_qp_t *qp);
+
+/**
+ * Switches the queue pair to shadow doorbells, as configured by the Doorbell
+ * Buffer Config command. The slots used for this queue pair are derived from
+ * its queue ID and the doorbell stride.
+ *
+ * @qp: the queue pair
+ * @dbbuf: shadow doorbell buffer address (PRP1 of the command)
+ * @eibuf: EventIdx buffer address (PRP2 of the command)
+ * @stride: doorbell stride in bytes, i.e. 4 << CAP.DSTRD
+ *
+ * @returns 0 on success, -1 on failure. Sets errno.
+ */
+int
+vfu_nvme_qp_set_shadow(vfu_nvme_qp_t *qp, vfu_dma_addr_t dbbuf,
+                       vfu_dma_addr_t eibuf, uint32_t stride);
+
+/**
+ * Handles a trapped write to the SQ tail doorbell.
+ *
+ * @returns 0 on success, -1 if @tail is out of range. Sets errno.
+ */
+int
+vfu_nvme_qp_sq_doorbell(vfu_nvme_qp_t *qp, uint16_t tail);
+
+/**
+ * Handles a trapped write to the CQ head doorbell.
+ *
+ * @returns 0 on success, -1 if @head is out of range. Sets errno.
+ */
+int
+vfu_nvme_qp_cq_doorbell(vfu_nvme_qp_t *qp, uint16_t head);
+
+/**
+ * Copies up to @max submitted commands out of the SQ. With shadow doorbells,
+ * the driver is asked to ring the doorbell again only when the SQ is found to
+ * be empty.
+ *
+ * @qp: the queue pair
+ * @sqes: buffer for @max entries of VFU_NVME_SQE_SIZE bytes
+ * @max: maximum number of entries to fetch
+ *
+ * @returns the number of entries fetched, or -1 on error. Sets errno.
+ */
+int
+vfu_nvme_qp_fetch(vfu_nvme_qp_t *qp, void *sqes, int max);
+
+/**
+ * Posts a batch of completions to the CQ, setting the phase tag, SQ head
+ * pointer and SQ identifier, and triggers the queue's interrupt once for the
+ * batch if enabled.
+ *
+ * @qp: the queue pair
+ * @cpls: the completions
+ * @n: number of completions
+ *
+ * @returns the number of completions posted, less than @n if the CQ is full,
+ * or -1 on error. Sets errno. Failing to trigger the interrupt isn't an error:
+ * it's logged, and triggered again by the next call, even for no completions.
+ */
+int
+vfu_nvme_qp_complete(vfu_nvme_qp_t *qp, const vfu_nvme_cpl_t *cpls, int n);
+
 /*
  * Supported PCI regions.
  *
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2019 Nutanix Inc. All rights reserved.
+ *
+ * Authors: Thanos Makatos <thanos@nutanix.com>
+ *          Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *          Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * Single Root I/O Virtualization (PCIE 9.3.3).
+ */
+
+#ifndef LIB_VFIO_USER_PCI_CAPS_SRIOV_H
+#define LIB_VFIO_USER_PCI_CAPS_SRIOV_H
+
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct sriovcap {
+    struct pcie_ext_cap_hdr hdr;
+    uint32_t cap;
+    uint16_t ctrl;
+    uint16_t status;
+    uint16_t initial_vfs;
+    uint16_t total_vfs;
+    uint16_t num_vfs;
+    uint8_t fdl;
+    uint8_t res1;
+    uint16_t vf_offset;
+    uint16_t vf_stride;
+    uint16_t res2;
+    uint16_t vf_did;
+    uint32_t sup_pgsize;
+    uint32_t sys_pgsize;
+    uint32_t bar[PCI_SRIOV_NUM_BARS];
+    uint32_t vfm;
+} __attribute__((packed));
+_Static_assert(sizeof(struct sriovcap) == PCI_EXT_CAP_SRIOV_SIZEOF,
+               "bad SR-IOV Capability size");
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIB_VFIO_USER_PCI_CAPS_SRIOV_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
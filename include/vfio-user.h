@@ -65,6 +65,9 @@ enum vfio_user_command {
     VFIO_USER_VM_INTERRUPT              = 12,
     VFIO_USER_DEVICE_RESET              = 13,
     VFIO_USER_DIRTY_PAGES               = 14,
+    VFIO_USER_IOMMU_MAP                 = 15,
+    VFIO_USER_IOMMU_UNMAP               = 16,
+    VFIO_USER_DEVICE_GET_ALL_INFO       = 17,
     VFIO_USER_MAX,
 };
 
@@ -85,7 +88,8 @@ struct vfio_user_header {
 #define VFIO_USER_F_TYPE_REPLY      1
         uint32_t    no_reply : 1;
         uint32_t    error    : 1;
-        uint32_t    resvd    : 26;
+        uint32_t    function : 8;
+        uint32_t    resvd    : 18;
     } flags;
     uint32_t    error_no;
 } __attribute__((packed));
@@ -112,6 +116,18 @@ struct vfio_user_region_access {
     uint8_t     data[];
 } __attribute__((packed));
 
+/*
+ * Table entry of VFIO_USER_IOMMU_MAP and VFIO_USER_IOMMU_UNMAP; @gpa and @prot
+ * are ignored by the latter.
+ */
+struct vfio_user_iommu_mapping {
+    uint64_t    iova;
+    uint64_t    size;
+    uint64_t    gpa;
+    uint32_t    prot;
+    uint32_t    flags;
+} __attribute__((packed));
+
 struct vfio_user_dma_region_access {
     uint64_t    addr;
     uint32_t    count;
@@ -0,0 +1,473 @@
+/*
+ * Copyright (c) 2020 Nutanix Inc. All rights reserved.
+ *
+ * Authors: Thanos Makatos <thanos@nutanix.com>
+ *          Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *          Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * Stackful coroutines on top of ucontext, in which requests can wait without
+ * stalling vfu_run_ctx().
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "coroutine.h"
+
+#define CO_STACK_SIZE (256 * 1024)
+
+struct coroutine {
+    ucontext_t              uc;
+    co_sched_t              *sched;
+    void                    *stack;     /* guard page included */
+    co_fn_t                 *fn;
+    void                    *arg;
+    int                     ret;
+    bool                    done;
+    bool                    cancelled;
+    bool                    barrier;    /* see co_order() */
+    /* Replies waited for, see co_wait_reply(). */
+    uint16_t                first_id;
+    size_t                  nr_ids;
+    struct vfio_user_header *hdr;
+    void                    **datap;
+    struct coroutine        *next;
+};
+
+struct co_sched {
+    ucontext_t              main;
+    struct coroutine        *free;      /* completed, kept for their stacks */
+    struct coroutine        *waiting;   /* for replies */
+    struct coroutine        *ready;     /* yielded, oldest first */
+    struct coroutine        **ready_tail;
+    size_t                  nr_ready;
+    size_t                  nr_cancelled; /* that haven't completed yet */
+    size_t                  nr_live;    /* that haven't completed yet */
+    /* Held back by co_order() until barrier completes, oldest first. */
+    struct coroutine        *held;
+    struct coroutine        **held_tail;
+    size_t                  nr_held;
+    struct coroutine        *barrier;
+    bool                    draining;   /* barrier waits for the others */
+};
+
+static __thread struct coroutine *current;
+
+co_sched_t *
+co_sched_create(void)
+{
+    co_sched_t *sched;
+
+    sched = calloc(1, sizeof(*sched));
+    if (sched == NULL) {
+        return NULL;
+    }
+    sched->ready_tail = &sched->ready;
+    sched->held_tail = &sched->held;
+    return sched;
+}
+
+void
+co_sched_destroy(co_sched_t *sched)
+{
+    struct coroutine *co;
+
+    if (sched == NULL) {
+        return;
+    }
+
+    assert(sched->waiting == NULL && sched->ready == NULL &&
+           sched->held == NULL);
+
+    while ((co = sched->free) != NULL) {
+        sched->free = co->next;
+        munmap(co->stack, CO_STACK_SIZE + getpagesize());
+        free(co);
+    }
+    free(sched);
+}
+
+static struct coroutine *
+co_alloc(co_sched_t *sched)
+{
+    struct coroutine *co;
+    int err;
+
+    co = calloc(1, sizeof(*co));
+    if (co == NULL) {
+        return NULL;
+    }
+    co->sched = sched;
+
+    co->stack = mmap(NULL, CO_STACK_SIZE + getpagesize(),
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (co->stack == MAP_FAILED) {
+        err = errno;
+        free(co);
+        errno = err;
+        return NULL;
+    }
+
+    /* Overflowing the stack faults rather than corrupting memory. */
+    if (mprotect(co->stack, getpagesize(), PROT_NONE) == -1) {
+        err = errno;
+        munmap(co->stack, CO_STACK_SIZE + getpagesize());
+        free(co);
+        errno = err;
+        return NULL;
+    }
+
+    return co;
+}
+
+static void
+co_entry(unsigned int lo, unsigned int hi)
+{
+    struct coroutine *co = (void *)(uintptr_t)((uint64_t)hi << 32 | lo);
+
+    co->ret = co->fn(co->arg);
+    co->done = true;
+    /* Back to the main context through uc_link. */
+}
+
+static void
+ready_push(co_sched_t *sched, struct coroutine *co)
+{
+    co->next = NULL;
+    *sched->ready_tail = co;
+    sched->ready_tail = &co->next;
+    sched->nr_ready++;
+}
+
+static struct coroutine *
+ready_pop(co_sched_t *sched)
+{
+    struct coroutine *co = sched->ready;
+
+    if (co != NULL) {
+        sched->ready = co->next;
+        if (sched->ready == NULL) {
+            sched->ready_tail = &sched->ready;
+        }
+        sched->nr_ready--;
+    }
+    return co;
+}
+
+/* Lets the coroutines held back by the barrier that completed go on. */
+static void
+co_release(co_sched_t *sched)
+{
+    struct coroutine *co;
+
+    while ((co = sched->held) != NULL) {
+        sched->held = co->next;
+        if (sched->held == NULL) {
+            sched->held_tail = &sched->held;
+        }
+        sched->nr_held--;
+        ready_push(sched, co);
+        /* The next barrier holds back those after it in turn. */
+        if (co->barrier) {
+            sched->barrier = co;
+            break;
+        }
+    }
+}
+
+static void
+co_switch(struct coroutine *co)
+{
+    co_sched_t *sched = co->sched;
+
+    assert(current == NULL);
+
+    current = co;
+    swapcontext(&sched->main, &co->uc);
+    current = NULL;
+
+    if (co->done) {
+        if (co->cancelled) {
+            sched->nr_cancelled--;
+        }
+        sched->nr_live--;
+        co->next = sched->free;
+        sched->free = co;
+
+        if (co == sched->barrier) {
+            sched->barrier = NULL;
+            co_release(sched);
+        } else if (sched->draining &&
+                   sched->nr_live - sched->nr_held == 1) {
+            sched->draining = false;
+            ready_push(sched, sched->barrier);
+        }
+    }
+}
+
+/* Runs the coroutines cancelled meanwhile to completion. */
+static void
+co_drain(co_sched_t *sched)
+{
+    struct coroutine *co;
+
+    while (sched->nr_cancelled > 0 && (co = ready_pop(sched)) != NULL) {
+        co_switch(co);
+    }
+}
+
+/*
+ * Sets up @co to run co_entry() on its own stack. Kept out of line so that no
+ * caller variable lives across getcontext(), which returns twice.
+ */
+__attribute__((noinline)) static int
+co_init(struct coroutine *co)
+{
+    uintptr_t p = (uintptr_t)co;
+
+    if (getcontext(&co->uc) == -1) {
+        return -errno;
+    }
+    co->uc.uc_stack.ss_sp = (char *)co->stack + getpagesize();
+    co->uc.uc_stack.ss_size = CO_STACK_SIZE;
+    co->uc.uc_link = &co->sched->main;
+    makecontext(&co->uc, (void (*)(void))co_entry, 2, (unsigned int)p,
+                (unsigned int)((uint64_t)p >> 32));
+    return 0;
+}
+
+int
+co_spawn(co_sched_t *sched, co_fn_t *fn, void *arg, int *retp)
+{
+    struct coroutine *co;
+    int ret;
+
+    assert(sched != NULL);
+    assert(retp != NULL);
+
+    co = sched->free;
+    if (co != NULL) {
+        sched->free = co->next;
+    } else {
+        co = co_alloc(sched);
+        if (co == NULL) {
+            return -errno;
+        }
+    }
+
+    ret = co_init(co);
+    if (ret < 0) {
+        co->next = sched->free;
+        sched->free = co;
+        return ret;
+    }
+    co->fn = fn;
+    co->arg = arg;
+    co->done = false;
+    co->cancelled = false;
+    co->barrier = false;
+    sched->nr_live++;
+
+    co_switch(co);
+    *retp = co->done ? co->ret : 0;
+    co_drain(sched);
+    return 0;
+}
+
+bool
+co_self(co_sched_t *sched)
+{
+    return current != NULL && current->sched == sched;
+}
+
+int
+co_yield(co_sched_t *sched)
+{
+    struct coroutine *co = current;
+
+    assert(co_self(sched));
+
+    if (co->cancelled) {
+        return -ENOTCONN;
+    }
+
+    ready_push(sched, co);
+    swapcontext(&co->uc, &sched->main);
+
+    return co->cancelled ? -ENOTCONN : 0;
+}
+
+int
+co_wait_reply(co_sched_t *sched, uint16_t first_id, size_t nr,
+              struct vfio_user_header *hdr, void **datap)
+{
+    struct coroutine *co = current;
+
+    assert(co_self(sched));
+
+    if (co->cancelled) {
+        return -ENOTCONN;
+    }
+
+    co->first_id = first_id;
+    co->nr_ids = nr;
+    co->hdr = hdr;
+    co->datap = datap;
+    co->next = sched->waiting;
+    sched->waiting = co;
+    swapcontext(&co->uc, &sched->main);
+
+    return co->cancelled ? -ENOTCONN : 0;
+}
+
+int
+co_order(co_sched_t *sched, bool barrier)
+{
+    struct coroutine *co = current;
+
+    assert(co_self(sched));
+
+    if (co->cancelled) {
+        return -ENOTCONN;
+    }
+
+    if (sched->barrier != NULL || sched->held != NULL) {
+        co->barrier = barrier;
+        co->next = NULL;
+        *sched->held_tail = co;
+        sched->held_tail = &co->next;
+        sched->nr_held++;
+        swapcontext(&co->uc, &sched->main);
+        if (co->cancelled) {
+            return -ENOTCONN;
+        }
+    } else if (barrier) {
+        sched->barrier = co;
+    }
+
+    /* Released barriers are set by co_release(). */
+    if (sched->barrier == co && sched->nr_live - sched->nr_held > 1) {
+        sched->draining = true;
+        swapcontext(&co->uc, &sched->main);
+    }
+
+    return co->cancelled ? -ENOTCONN : 0;
+}
+
+bool
+co_dispatch_reply(co_sched_t *sched, const struct vfio_user_header *hdr,
+                  void *data)
+{
+    struct coroutine **p, *co;
+
+    assert(sched != NULL);
+
+    for (p = &sched->waiting; (co = *p) != NULL; p = &co->next) {
+        if ((uint16_t)(hdr->msg_id - co->first_id) < co->nr_ids) {
+            *p = co->next;
+            *co->hdr = *hdr;
+            *co->datap = data;
+            co_switch(co);
+            co_drain(sched);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool
+co_has_ready(co_sched_t *sched)
+{
+    return sched->ready != NULL;
+}
+
+void
+co_run_ready(co_sched_t *sched)
+{
+    struct coroutine *co;
+    size_t n;
+
+    /* Those yielding again wait for the next call. */
+    for (n = sched->nr_ready; n > 0 && (co = ready_pop(sched)) != NULL; n--) {
+        co_switch(co);
+    }
+    co_drain(sched);
+}
+
+static void
+co_mark_cancelled(co_sched_t *sched, struct coroutine *co)
+{
+    if (!co->cancelled) {
+        co->cancelled = true;
+        sched->nr_cancelled++;
+    }
+}
+
+void
+co_cancel(co_sched_t *sched)
+{
+    struct coroutine *co;
+
+    assert(sched != NULL);
+
+    for (co = sched->ready; co != NULL; co = co->next) {
+        co_mark_cancelled(sched, co);
+    }
+    while ((co = sched->waiting) != NULL) {
+        sched->waiting = co->next;
+        co_mark_cancelled(sched, co);
+        ready_push(sched, co);
+    }
+    while ((co = sched->held) != NULL) {
+        sched->held = co->next;
+        co_mark_cancelled(sched, co);
+        ready_push(sched, co);
+    }
+    sched->held_tail = &sched->held;
+    sched->nr_held = 0;
+    if (sched->draining) {
+        sched->draining = false;
+        co_mark_cancelled(sched, sched->barrier);
+        ready_push(sched, sched->barrier);
+    }
+
+    if (co_self(sched)) {
+        co_mark_cancelled(sched, current);
+    } else {
+        co_drain(sched);
+    }
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2020 Nutanix Inc. All rights reserved.
+ *
+ * Authors: Thanos Makatos <thanos@nutanix.com>
+ *          Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *          Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#ifndef LIB_VFIO_USER_COROUTINE_H
+#define LIB_VFIO_USER_COROUTINE_H
+
+#include "private.h"
+
+/*
+ * Coroutines for LIBVFIO_USER_FLAG_COROUTINES: each request runs in one, and
+ * waits by switching back to vfu_run_ctx(), which is said to run in the main
+ * context. Coroutines are only ever resumed from the main context.
+ */
+
+typedef struct co_sched co_sched_t;
+
+typedef int (co_fn_t)(void *arg);
+
+co_sched_t *
+co_sched_create(void);
+
+/* All coroutines must have completed. */
+void
+co_sched_destroy(co_sched_t *sched);
+
+/*
+ * Runs @fn in a new coroutine until it returns or waits, and sets @retp to
+ * what it returned, or to 0 if it's waiting. Returns 0 or -errno.
+ */
+int
+co_spawn(co_sched_t *sched, co_fn_t *fn, void *arg, int *retp);
+
+/* Whether the caller runs in one of @sched's coroutines. */
+bool
+co_self(co_sched_t *sched);
+
+/*
+ * Suspends the calling coroutine until co_run_ready(). Returns 0, or -ENOTCONN
+ * if it's been cancelled.
+ */
+int
+co_yield(co_sched_t *sched);
+
+/*
+ * Orders the request of the calling coroutine with respect to the others: if
+ * @barrier, suspends it until those in flight complete, and holds back those
+ * calling this after it until it completes itself. Returns 0, or -ENOTCONN if
+ * it's been cancelled.
+ */
+int
+co_order(co_sched_t *sched, bool barrier);
+
+/*
+ * Suspends the calling coroutine until co_dispatch_reply() hands it, in @hdr
+ * and @datap, the reply to one of the @nr commands whose message IDs start at
+ * @first_id. Returns 0, or -ENOTCONN if it's been cancelled.
+ */
+int
+co_wait_reply(co_sched_t *sched, uint16_t first_id, size_t nr,
+              struct vfio_user_header *hdr, void **datap);
+
+/*
+ * Resumes the coroutine waiting for the reply @hdr, handing it @data, the body
+ * it then frees. Returns false if none is.
+ */
+bool
+co_dispatch_reply(co_sched_t *sched, const struct vfio_user_header *hdr,
+                  void *data);
+
+bool
+co_has_ready(co_sched_t *sched);
+
+/* Resumes the coroutines that yielded, once each. */
+void
+co_run_ready(co_sched_t *sched);
+
+/*
+ * Makes the waits of all coroutines fail, and, if called from the main
+ * context, runs them to completion right away; otherwise that's done as soon
+ * as the main context resumes.
+ */
+void
+co_cancel(co_sched_t *sched);
+
+#endif /* LIB_VFIO_USER_COROUTINE_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
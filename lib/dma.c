@@ -40,10 +40,20 @@
 #include <stdlib.h>
 
 #include <errno.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DMA_COPY_X86
+#endif
 
 #include "dma.h"
+#include "iommu.h"
 #include "private.h"
 
+/* Threshold used if the size of the last-level cache is unknown. */
+#define DMA_COPY_NT_THRESHOLD (256 * 1024)
+
 static inline ssize_t
 fd_get_blocksize(int fd)
 {
@@ -70,6 +80,144 @@ fds_are_same_file(int fd1, int fd2)
             st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino);
 }
 
+/*
+ * A mapping shared by the DMA controllers of a group, keyed by the identity of
+ * the file and the mapped range.
+ */
+struct dma_mapping {
+    dev_t               dev;
+    ino_t               ino;
+    off_t               offset;
+    size_t              len;
+    uint32_t            prot;
+    void                *base;
+    int                 refcnt;
+    struct dma_mapping  *next;
+};
+
+struct vfu_dma_group {
+    pthread_mutex_t     lock;
+    struct dma_mapping  *mappings;
+};
+
+vfu_dma_group_t *
+vfu_dma_group_create(void)
+{
+    vfu_dma_group_t *group;
+    int ret;
+
+    group = calloc(1, sizeof(*group));
+    if (group == NULL) {
+        return ERROR_PTR(ENOMEM);
+    }
+
+    ret = pthread_mutex_init(&group->lock, NULL);
+    if (ret != 0) {
+        free(group);
+        return ERROR_PTR(ret);
+    }
+
+    return group;
+}
+
+void
+vfu_dma_group_destroy(vfu_dma_group_t *group)
+{
+    if (group == NULL) {
+        return;
+    }
+
+    assert(group->mappings == NULL);
+
+    pthread_mutex_destroy(&group->lock);
+    free(group);
+}
+
+/*
+ * Takes a reference to the group's mapping of the given range of @fd, mapping
+ * it if no other controller in the group has. Returns 0 or -errno.
+ */
+static int
+dma_group_map(vfu_dma_group_t *group, int fd, off_t offset, size_t len,
+              uint32_t prot, struct dma_mapping **mappingp)
+{
+    struct dma_mapping *mapping;
+    struct stat st;
+    int ret = 0;
+
+    if (fstat(fd, &st) != 0) {
+        return -errno;
+    }
+
+    pthread_mutex_lock(&group->lock);
+
+    for (mapping = group->mappings; mapping != NULL; mapping = mapping->next) {
+        if (mapping->dev == st.st_dev && mapping->ino == st.st_ino &&
+            mapping->offset == offset && mapping->len == len &&
+            mapping->prot == prot) {
+            mapping->refcnt++;
+            goto out;
+        }
+    }
+
+    mapping = calloc(1, sizeof(*mapping));
+    if (mapping == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    mapping->base = mmap(NULL, len, prot, MAP_SHARED, fd, offset);
+    if (mapping->base == MAP_FAILED) {
+        ret = -errno;
+        free(mapping);
+        mapping = NULL;
+        goto out;
+    }
+
+    // Do not dump.
+    madvise(mapping->base, len, MADV_DONTDUMP);
+
+    mapping->dev = st.st_dev;
+    mapping->ino = st.st_ino;
+    mapping->offset = offset;
+    mapping->len = len;
+    mapping->prot = prot;
+    mapping->refcnt = 1;
+    mapping->next = group->mappings;
+    group->mappings = mapping;
+
+out:
+    pthread_mutex_unlock(&group->lock);
+    *mappingp = mapping;
+    return ret;
+}
+
+/* Drops a reference taken by dma_group_map(). Returns 0 or -errno. */
+static int
+dma_group_unmap(vfu_dma_group_t *group, struct dma_mapping *mapping)
+{
+    struct dma_mapping **prevp;
+    int ret = 0;
+
+    pthread_mutex_lock(&group->lock);
+
+    if (--mapping->refcnt == 0) {
+        for (prevp = &group->mappings; *prevp != mapping;
+             prevp = &(*prevp)->next) {
+            assert(*prevp != NULL);
+        }
+        *prevp = mapping->next;
+
+        if (munmap(mapping->base, mapping->len) != 0) {
+            ret = -errno;
+        }
+        free(mapping);
+    }
+
+    pthread_mutex_unlock(&group->lock);
+    return ret;
+}
+
 dma_controller_t *
 dma_controller_create(vfu_ctx_t *vfu_ctx, int max_regions)
 {
@@ -82,15 +230,52 @@ dma_controller_create(vfu_ctx_t *vfu_ctx, int max_regions)
         return dma;
     }
 
+    dma->table_regions = calloc(max_regions, sizeof(*dma->table_regions));
+    if (dma->table_regions == NULL) {
+        free(dma);
+        return NULL;
+    }
+
     dma->vfu_ctx = vfu_ctx;
     dma->max_regions = max_regions;
     dma->nregions = 0;
     memset(dma->regions, 0, max_regions * sizeof(dma->regions[0]));
     dma->dirty_pgsize = 0;
+    dma->iommu = NULL;
+    dma->group = NULL;
+    dma->table.regions = dma->table_regions;
+    dma->table.nregions = 0;
+    dma->table.dirty_pgsize = 0;
 
     return dma;
 }
 
+/*
+ * Refreshes the snapshot of the regions handed out by vfu_get_dma_table();
+ * must be called whenever the regions or dirty page logging change.
+ */
+static void
+dma_controller_update_table(dma_controller_t *dma)
+{
+    int i;
+
+    if (dma->table_regions == NULL) {
+        return;
+    }
+
+    for (i = 0; i < dma->nregions; i++) {
+        vfu_dma_table_region_t *t = &dma->table_regions[i];
+        dma_memory_region_t *region = &dma->regions[i];
+
+        t->iova = region->info.iova;
+        t->vaddr = region->info.vaddr;
+        t->prot = region->info.prot;
+        t->dirty_bitmap = (uint8_t *)region->dirty_bitmap;
+    }
+    dma->table.nregions = dma->nregions;
+    dma->table.dirty_pgsize = dma->dirty_pgsize;
+}
+
 void
 MOCK_DEFINE(dma_controller_unmap_region)(dma_controller_t *dma,
                                          dma_memory_region_t *region)
@@ -100,7 +285,13 @@ MOCK_DEFINE(dma_controller_unmap_region)(dma_controller_t *dma,
     assert(dma != NULL);
     assert(region != NULL);
 
-    err = munmap(region->info.mapping.iov_base, region->info.mapping.iov_len);
+    if (region->shared != NULL) {
+        err = dma_group_unmap(dma->group, region->shared);
+        region->shared = NULL;
+    } else {
+        err = munmap(region->info.mapping.iov_base,
+                     region->info.mapping.iov_len);
+    }
     if (err != 0) {
         vfu_log(dma->vfu_ctx, LOG_DEBUG, "failed to unmap fd=%d "
                 "mapping=[%p, %p): %m",
@@ -172,6 +363,7 @@ MOCK_DEFINE(dma_controller_remove_region)(dma_controller_t *dma,
         }
 
         array_remove(&dma->regions, sizeof (*region), idx, &dma->nregions);
+        dma_controller_update_table(dma);
         return 0;
     }
     return -ENOENT;
@@ -202,6 +394,12 @@ dma_controller_remove_regions(dma_controller_t *dma)
 
     memset(dma->regions, 0, dma->max_regions * sizeof(dma->regions[0]));
     dma->nregions = 0;
+    dma_controller_update_table(dma);
+
+    /* IOVA mappings go away with the regions they point to. */
+    if (dma->iommu != NULL) {
+        iommu_reset(dma->iommu);
+    }
 }
 
 void
@@ -212,6 +410,8 @@ dma_controller_destroy(dma_controller_t *dma)
     }
 
     dma_controller_remove_regions(dma);
+    iommu_destroy(dma->iommu);
+    free(dma->table_regions);
     free(dma);
 }
 
@@ -225,15 +425,25 @@ dma_map_region(dma_controller_t *dma, dma_memory_region_t *region)
     offset = ROUND_DOWN(region->offset, region->info.page_size);
     mmap_len = ROUND_UP(region->info.iova.iov_len, region->info.page_size);
 
-    mmap_base = mmap(NULL, mmap_len, region->info.prot, MAP_SHARED,
-                     region->fd, offset);
+    if (dma->group != NULL) {
+        int ret = dma_group_map(dma->group, region->fd, offset, mmap_len,
+                                region->info.prot, &region->shared);
 
-    if (mmap_base == MAP_FAILED) {
-        return -errno;
-    }
+        if (ret != 0) {
+            return ret;
+        }
+        mmap_base = region->shared->base;
+    } else {
+        mmap_base = mmap(NULL, mmap_len, region->info.prot, MAP_SHARED,
+                         region->fd, offset);
 
-    // Do not dump.
-    madvise(mmap_base, mmap_len, MADV_DONTDUMP);
+        if (mmap_base == MAP_FAILED) {
+            return -errno;
+        }
+
+        // Do not dump.
+        madvise(mmap_base, mmap_len, MADV_DONTDUMP);
+    }
 
     region->info.mapping.iov_base = mmap_base;
     region->info.mapping.iov_len = mmap_len;
@@ -351,6 +561,7 @@ MOCK_DEFINE(dma_controller_add_region)(dma_controller_t *dma,
     }
 
     dma->nregions++;
+    dma_controller_update_table(dma);
 
     return idx;
 
@@ -378,7 +589,8 @@ _dma_addr_sg_split(const dma_controller_t *dma,
                 size_t region_len = MIN(region_end - dma_addr, len);
 
                 if (cnt < max_sg) {
-                    ret = dma_init_sg(dma, sg, dma_addr, region_len, prot, idx);
+                    ret = dma_init_sg(dma, &sg[cnt], dma_addr, region_len,
+                                      prot, idx);
                     if (ret < 0) {
                         return ret;
                     }
@@ -412,6 +624,157 @@ out:
     return cnt;
 }
 
+int
+_dma_addr_sg_iommu(const dma_controller_t *dma,
+                   vfu_dma_addr_t dma_addr, size_t len,
+                   dma_sg_t *sg, int max_sg, int prot)
+{
+    int cnt = 0;
+    int ret;
+
+    if (len == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // Each IOVA mapping is contiguous in guest physical memory.
+    while (len > 0) {
+        struct iommu_mapping m;
+        vfu_dma_addr_t gpa;
+        size_t chunk;
+
+        if (!iommu_lookup(dma->iommu, dma_addr, &m)) {
+            errno = ENOENT;
+            return -1;
+        }
+        if (((uint32_t)prot & m.prot) != (uint32_t)prot) {
+            errno = EACCES;
+            return -1;
+        }
+
+        chunk = MIN(len, (size_t)(m.iova + m.size - dma_addr));
+        gpa = m.gpa + (dma_addr - m.iova);
+
+        ret = _dma_addr_sg_split(dma, gpa, chunk,
+                                 cnt < max_sg ? &sg[cnt] : NULL,
+                                 MAX(max_sg - cnt, 0), prot);
+        if (ret == -1) {
+            return ret;
+        }
+        cnt += ret < 0 ? -ret - 1 : ret;
+
+        dma_addr += chunk;
+        len -= chunk;
+    }
+
+    if (cnt > max_sg) {
+        cnt = -cnt - 1;
+    }
+    errno = 0;
+    return cnt;
+}
+
+/*
+ * Returns the index of the region containing @dma_addr, or -1 if there isn't
+ * one.
+ */
+static int
+dma_find_region(const dma_controller_t *dma, vfu_dma_addr_t dma_addr)
+{
+    int idx;
+
+    for (idx = 0; idx < dma->nregions; idx++) {
+        const struct iovec *iova = &dma->regions[idx].info.iova;
+
+        if (dma_addr >= iova->iov_base && dma_addr < iov_end(iova)) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+int
+dma_map_addr(dma_controller_t *dma, vfu_dma_addr_t dma_addr, size_t len,
+             int prot, dma_sg_t *sg, void **vaddr)
+{
+    struct iovec iov;
+    int ret;
+
+    assert(dma != NULL);
+    assert(sg != NULL);
+    assert(vaddr != NULL);
+
+    ret = dma_addr_to_sg(dma, dma_addr, len, sg, 1, prot);
+    if (ret < -1) {
+        vfu_log(dma->vfu_ctx, LOG_ERR, "%p-%p isn't within a single DMA "
+                "region", dma_addr, dma_addr + len);
+        return -EINVAL;
+    } else if (ret < 0) {
+        return -errno;
+    }
+    if (!sg->mappable) {
+        return -EFAULT;
+    }
+
+    ret = dma_map_sg(dma, sg, &iov, 1);
+    if (ret < 0) {
+        return ret;
+    }
+    *vaddr = iov.iov_base;
+    return 0;
+}
+
+int
+dma_addr_to_sg_batch(const dma_controller_t *dma, const vfu_dma_range_t *in,
+                     int n, dma_sg_t *sg, int *errs)
+{
+    int idx = -1;
+    int cnt = 0;
+    int i;
+
+    assert(dma != NULL);
+
+    for (i = 0; i < n && dma->iommu != NULL; i++) {
+        int ret = _dma_addr_sg_iommu(dma, in[i].dma_addr, in[i].len, &sg[i], 1,
+                                     in[i].prot);
+
+        errs[i] = ret == 1 ? 0 : ret == -1 ? errno : ENOSPC;
+        cnt += ret == 1;
+    }
+
+    for (i = 0; i < n && dma->iommu == NULL; i++) {
+        const struct iovec *iova = NULL;
+
+        /* Descriptors usually point into the same region as their neighbours. */
+        if (idx != -1) {
+            iova = &dma->regions[idx].info.iova;
+        }
+        if (iova == NULL || in[i].dma_addr < iova->iov_base ||
+            in[i].dma_addr >= iov_end(iova)) {
+            idx = dma_find_region(dma, in[i].dma_addr);
+            if (idx == -1) {
+                errs[i] = ENOENT;
+                continue;
+            }
+            iova = &dma->regions[idx].info.iova;
+        }
+
+        if (in[i].len == 0) {
+            errs[i] = ENOENT;
+        } else if (in[i].len > (size_t)(iov_end(iova) - in[i].dma_addr)) {
+            errs[i] = ENOSPC;
+        } else if (dma_init_sg(dma, &sg[i], in[i].dma_addr, in[i].len,
+                               in[i].prot, idx) < 0) {
+            errs[i] = errno;
+        } else {
+            errs[i] = 0;
+            cnt++;
+        }
+    }
+
+    return cnt;
+}
+
 static ssize_t
 get_bitmap_size(size_t region_size, size_t pgsize)
 {
@@ -463,6 +826,7 @@ int dma_controller_dirty_page_logging_start(dma_controller_t *dma, size_t pgsize
         }
     }
     dma->dirty_pgsize = pgsize;
+    dma_controller_update_table(dma);
     return 0;
 }
 
@@ -481,6 +845,7 @@ int dma_controller_dirty_page_logging_stop(dma_controller_t *dma)
         dma->regions[i].dirty_bitmap = NULL;
     }
     dma->dirty_pgsize = 0;
+    dma_controller_update_table(dma);
     return 0;
 }
 
@@ -501,7 +866,8 @@ dma_controller_dirty_page_get(dma_controller_t *dma, vfu_dma_addr_t addr,
      * is purely for simplifying the implementation. We MUST allow arbitrary
      * IOVAs.
      */
-    ret = dma_addr_to_sg(dma, addr, len, &sg, 1, PROT_NONE);
+    /* Dirty pages are tracked by guest physical address, not by IOVA. */
+    ret = _dma_addr_sg_split(dma, addr, len, &sg, 1, PROT_NONE);
     if (ret != 1 || sg.dma_addr != addr || sg.length != len) {
         return -ENOTSUP;
     }
@@ -530,4 +896,118 @@ dma_controller_dirty_page_get(dma_controller_t *dma, vfu_dma_addr_t addr,
     return 0;
 }
 
+typedef void dma_copy_fn_t(char *dst, const char *src, size_t len);
+
+#ifdef DMA_COPY_X86
+__attribute__((target("sse2"))) static void
+dma_copy_nt_sse2(char *dst, const char *src, size_t len)
+{
+    size_t head = MIN(-(uintptr_t)dst & 15, len);
+
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    len -= head;
+
+    for (; len >= 64; len -= 64, dst += 64, src += 64) {
+        const __m128i *s = (const __m128i *)src;
+        __m128i *d = (__m128i *)dst;
+        __m128i x0 = _mm_loadu_si128(s);
+        __m128i x1 = _mm_loadu_si128(s + 1);
+        __m128i x2 = _mm_loadu_si128(s + 2);
+        __m128i x3 = _mm_loadu_si128(s + 3);
+
+        _mm_stream_si128(d, x0);
+        _mm_stream_si128(d + 1, x1);
+        _mm_stream_si128(d + 2, x2);
+        _mm_stream_si128(d + 3, x3);
+    }
+    /* Make the streaming stores visible before anyone is told of them. */
+    _mm_sfence();
+    memcpy(dst, src, len);
+}
+
+__attribute__((target("avx"))) static void
+dma_copy_nt_avx(char *dst, const char *src, size_t len)
+{
+    size_t head = MIN(-(uintptr_t)dst & 31, len);
+
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    len -= head;
+
+    for (; len >= 128; len -= 128, dst += 128, src += 128) {
+        const __m256i *s = (const __m256i *)src;
+        __m256i *d = (__m256i *)dst;
+        __m256i x0 = _mm256_loadu_si256(s);
+        __m256i x1 = _mm256_loadu_si256(s + 1);
+        __m256i x2 = _mm256_loadu_si256(s + 2);
+        __m256i x3 = _mm256_loadu_si256(s + 3);
+
+        _mm256_stream_si256(d, x0);
+        _mm256_stream_si256(d + 1, x1);
+        _mm256_stream_si256(d + 2, x2);
+        _mm256_stream_si256(d + 3, x3);
+    }
+    _mm_sfence();
+    memcpy(dst, src, len);
+}
+#endif /* DMA_COPY_X86 */
+
+static void
+dma_copy_plain(char *dst, const char *src, size_t len)
+{
+    memcpy(dst, src, len);
+}
+
+/* Picked by dma_copy_init() for the CPU we run on. */
+static dma_copy_fn_t *dma_copy_nt = dma_copy_plain;
+static size_t dma_copy_nt_threshold = DMA_COPY_NT_THRESHOLD;
+
+/*
+ * By default, copies larger than half the last-level cache bypass it: they
+ * would evict most of it anyway, and the device is unlikely to read the data
+ * back soon.
+ */
+__attribute__((constructor)) static void
+dma_copy_init(void)
+{
+    long llc_size = -1;
+
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    llc_size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (llc_size <= 0) {
+        llc_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    }
+#endif
+    if (llc_size > 0) {
+        dma_copy_nt_threshold = MAX((size_t)llc_size / 2,
+                                    DMA_COPY_NT_THRESHOLD);
+    }
+
+#ifdef DMA_COPY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx")) {
+        dma_copy_nt = dma_copy_nt_avx;
+    } else if (__builtin_cpu_supports("sse2")) {
+        dma_copy_nt = dma_copy_nt_sse2;
+    }
+#endif
+}
+
+void
+dma_copy_to_client(void *dst, const void *src, size_t len, size_t threshold)
+{
+    if (threshold == 0) {
+        threshold = dma_copy_nt_threshold;
+    }
+
+    if (len >= threshold) {
+        dma_copy_nt(dst, src, len);
+    } else {
+        memcpy(dst, src, len);
+    }
+}
+
 /* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
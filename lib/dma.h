@@ -80,6 +80,8 @@
 #define iov_end(iov) ((iov)->iov_base + (iov)->iov_len)
 
 struct vfu_ctx;
+struct iommu;
+struct dma_mapping;
 
 typedef struct {
     vfu_dma_info_t info;
@@ -87,6 +89,7 @@ typedef struct {
     off_t offset;               // File offset
     int refcnt;                 // Number of users of this region
     char *dirty_bitmap;         // Dirty page bitmap
+    struct dma_mapping *shared; // Group mapping, NULL if mapped privately
 } dma_memory_region_t;
 
 typedef struct {
@@ -94,6 +97,10 @@ typedef struct {
     int nregions;
     struct vfu_ctx *vfu_ctx;
     size_t dirty_pgsize;        // Dirty page granularity
+    vfu_dma_table_t table;      // Public snapshot of the regions
+    vfu_dma_table_region_t *table_regions;
+    struct iommu *iommu;        // IOVA translation, NULL if not emulated
+    vfu_dma_group_t *group;     // Shares mappings with other contexts
     dma_memory_region_t regions[0];
 } dma_controller_t;
 
@@ -130,6 +137,12 @@ _dma_addr_sg_split(const dma_controller_t *dma,
                    vfu_dma_addr_t dma_addr, uint32_t len,
                    dma_sg_t *sg, int max_sg, int prot);
 
+// Helper for dma_addr_to_sg() when addresses are translated by an IOMMU.
+int
+_dma_addr_sg_iommu(const dma_controller_t *dma,
+                   vfu_dma_addr_t dma_addr, size_t len,
+                   dma_sg_t *sg, int max_sg, int prot);
+
 static bool
 _dma_should_mark_dirty(const dma_controller_t *dma, int prot)
 {
@@ -161,8 +174,10 @@ _dma_bitmap_get_pgrange(const dma_controller_t *dma,
     assert(start != NULL);
     assert(end != NULL);
 
-    *start = _get_pgstart(dma->dirty_pgsize, region->info.iova.iov_base, sg->offset);
-    *end = _get_pgend(dma->dirty_pgsize, sg->length, *start);
+    *start = _get_pgstart(dma->dirty_pgsize, region->info.iova.iov_base,
+                          (uint64_t)region->info.iova.iov_base + sg->offset);
+    *end = _get_pgend(dma->dirty_pgsize,
+                      sg->length + sg->offset % dma->dirty_pgsize, *start);
 }
 
 static void
@@ -178,10 +193,32 @@ _dma_mark_dirty(const dma_controller_t *dma, const dma_memory_region_t *region,
 
     _dma_bitmap_get_pgrange(dma, region, sg, &start, &end);
     for (i = start; i <= end; i++) {
-        region->dirty_bitmap[i / CHAR_BIT] |= 1 << (i % CHAR_BIT);
+        /* Callbacks in different threads may share a byte. */
+        __atomic_fetch_or(&region->dirty_bitmap[i / CHAR_BIT],
+                          1 << (i % CHAR_BIT), __ATOMIC_RELAXED);
     }
 }
 
+/*
+ * Marks @len bytes at @offset within @sg dirty, for stores the device made
+ * through a long-lived mapping rather than through a fresh translation.
+ */
+static inline void
+dma_sg_mark_dirty(const dma_controller_t *dma, const dma_sg_t *sg,
+                  size_t offset, size_t len)
+{
+    dma_sg_t part;
+
+    if (likely(!_dma_should_mark_dirty(dma, PROT_WRITE))) {
+        return;
+    }
+
+    part = *sg;
+    part.offset += offset;
+    part.length = len;
+    _dma_mark_dirty(dma, &dma->regions[sg->region], &part);
+}
+
 static inline int
 dma_init_sg(const dma_controller_t *dma, dma_sg_t *sg, vfu_dma_addr_t dma_addr,
             uint32_t len, int prot, int region_index)
@@ -229,6 +266,11 @@ dma_addr_to_sg(const dma_controller_t *dma,
     const dma_memory_region_t *const region = &dma->regions[region_hint];
     const void *region_end = iov_end(&region->info.iova);
 
+    // The device sees IOVAs that must be translated first.
+    if (unlikely(dma->iommu != NULL)) {
+        return _dma_addr_sg_iommu(dma, dma_addr, len, sg, max_sg, prot);
+    }
+
     // Fast path: single region.
     if (likely(max_sg > 0 && len > 0 &&
                dma_addr >= region->info.iova.iov_base &&
@@ -249,6 +291,10 @@ dma_addr_to_sg(const dma_controller_t *dma,
     return cnt;
 }
 
+int
+dma_addr_to_sg_batch(const dma_controller_t *dma, const vfu_dma_range_t *in,
+                     int n, dma_sg_t *sg, int *errs);
+
 static inline int
 dma_map_sg(dma_controller_t *dma, const dma_sg_t *sg, struct iovec *iov,
            int cnt)
@@ -281,6 +327,42 @@ dma_map_sg(dma_controller_t *dma, const dma_sg_t *sg, struct iovec *iov,
     return 0;
 }
 
+/*
+ * Maps a span that must lie within a single mappable region and takes a
+ * reference on the region, for guest structures such as rings that the device
+ * keeps using. The reference is dropped with dma_unmap_sg() on @sg.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int
+dma_map_addr(dma_controller_t *dma, vfu_dma_addr_t dma_addr, size_t len,
+             int prot, dma_sg_t *sg, void **vaddr);
+
+/*
+ * Returns the local address of the memory described by @sg, or NULL if its
+ * region isn't mapped into our address space (or has since been replaced).
+ */
+static inline void *
+dma_sg_vaddr(const dma_controller_t *dma, const dma_sg_t *sg)
+{
+    const dma_memory_region_t *region;
+
+    assert(sg != NULL);
+
+    if (dma == NULL || !sg->mappable || sg->region >= dma->nregions) {
+        return NULL;
+    }
+    region = &dma->regions[sg->region];
+
+    if (region->info.vaddr == NULL ||
+        region->info.iova.iov_base != sg->dma_addr ||
+        sg->offset + sg->length > region->info.iova.iov_len) {
+        return NULL;
+    }
+
+    return region->info.vaddr + sg->offset;
+}
+
 static inline void
 dma_unmap_sg(dma_controller_t *dma, const dma_sg_t *sg,
 	     UNUSED struct iovec *iov, int cnt)
@@ -309,6 +391,15 @@ dma_unmap_sg(dma_controller_t *dma, const dma_sg_t *sg,
     return;
 }
 
+/*
+ * Copies to client memory, like memcpy(). Copies of at least @threshold bytes
+ * use non-temporal stores if the CPU has them, so that they don't evict the
+ * device's working set from the cache. A @threshold of 0 picks one from the
+ * size of the last-level cache.
+ */
+void
+dma_copy_to_client(void *dst, const void *src, size_t len, size_t threshold);
+
 int
 dma_controller_dirty_page_logging_start(dma_controller_t *dma, size_t pgsize);
 
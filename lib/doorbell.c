@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2020 Nutanix Inc. All rights reserved.
+ *
+ * Authors: Thanos Makatos <thanos@nutanix.com>
+ *          Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *          Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * Doorbell registers the client writes to through a shared memory mapping,
+ * and the device polls.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "common.h"
+#include "doorbell.h"
+
+void
+doorbells_destroy(vfu_doorbells_t *dbs)
+{
+    if (dbs == NULL) {
+        return;
+    }
+
+    if (dbs->area != NULL) {
+        munmap(dbs->area, dbs->size);
+    }
+    if (dbs->fd != -1) {
+        close(dbs->fd);
+    }
+    if (dbs->efd != -1) {
+        close(dbs->efd);
+    }
+    free(dbs->seen);
+    free(dbs);
+}
+
+ssize_t
+doorbells_access(vfu_doorbells_t *dbs, char *buf, size_t count,
+                 uint64_t offset, bool is_write)
+{
+    char *p = (char *)dbs->area + (offset - dbs->offset);
+
+    assert(doorbells_contain(dbs, offset, count));
+
+    if (!is_write) {
+        memcpy(buf, p, count);
+        return count;
+    }
+
+    memcpy(p, buf, count);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (eventfd_write(dbs->efd, 1) < 0) {
+        return -errno;
+    }
+    return count;
+}
+
+vfu_doorbells_t *
+vfu_setup_region_doorbells(vfu_ctx_t *vfu_ctx, int region_idx, size_t size,
+                           vfu_region_access_cb_t *region_access, int flags,
+                           size_t offset, uint32_t nr_doorbells)
+{
+    struct iovec area;
+    vfu_doorbells_t *dbs;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+
+    if (nr_doorbells == 0 || !PAGE_ALIGNED(offset) || offset >= size) {
+        return ERROR_PTR(EINVAL);
+    }
+
+    dbs = calloc(1, sizeof(*dbs));
+    if (dbs == NULL) {
+        return ERROR_PTR(ENOMEM);
+    }
+    dbs->vfu_ctx = vfu_ctx;
+    dbs->fd = dbs->efd = -1;
+    dbs->offset = offset;
+    dbs->size = ROUND_UP(nr_doorbells * sizeof(uint32_t), PAGE_SIZE);
+    dbs->nr = nr_doorbells;
+
+    if (offset + dbs->size > size) {
+        ret = EINVAL;
+        goto err;
+    }
+
+    dbs->seen = calloc(nr_doorbells, sizeof(uint32_t));
+    if (dbs->seen == NULL) {
+        ret = ENOMEM;
+        goto err;
+    }
+
+    /*
+     * The client maps the area at its offset in the region, so the file
+     * covers the whole region, but only the area is ever backed by memory.
+     */
+    dbs->fd = memfd_create("vfio-user-doorbells", MFD_CLOEXEC);
+    if (dbs->fd == -1 || ftruncate(dbs->fd, offset + dbs->size) == -1) {
+        ret = errno;
+        goto err;
+    }
+    dbs->area = mmap(NULL, dbs->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     dbs->fd, offset);
+    if (dbs->area == MAP_FAILED) {
+        dbs->area = NULL;
+        ret = errno;
+        goto err;
+    }
+
+    dbs->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (dbs->efd == -1) {
+        ret = errno;
+        goto err;
+    }
+
+    area.iov_base = (void *)offset;
+    area.iov_len = dbs->size;
+    if (vfu_setup_region(vfu_ctx, region_idx, size, region_access, flags,
+                         &area, 1, dbs->fd) < 0) {
+        ret = errno;
+        goto err;
+    }
+
+    doorbells_destroy(vfu_ctx->reg_info[region_idx].doorbells);
+    vfu_ctx->reg_info[region_idx].doorbells = dbs;
+    return dbs;
+
+err:
+    vfu_log(vfu_ctx, LOG_ERR, "failed to set up doorbells for region %d: %s",
+            region_idx, strerror(ret));
+    doorbells_destroy(dbs);
+    return ERROR_PTR(ret);
+}
+
+static inline void
+doorbells_changed(vfu_doorbells_t *dbs, uint64_t *changed, uint32_t i,
+                  uint32_t val)
+{
+    dbs->seen[i] = val;
+    changed[i / 64] |= 1ULL << (i % 64);
+}
+
+int
+vfu_doorbells_poll(vfu_doorbells_t *dbs, uint64_t *changed)
+{
+    const volatile uint32_t *area = dbs->area;
+    uint32_t i = 0;
+    int n = 0;
+
+    assert(dbs != NULL);
+    assert(changed != NULL);
+
+    memset(changed, 0, ROUND_UP(dbs->nr, 64) / 8);
+
+#ifdef __SSE2__
+    /* Four doorbells per comparison; the area is page aligned. */
+    for (; i + 4 <= dbs->nr; i += 4) {
+        __m128i cur = _mm_load_si128((const __m128i *)&dbs->area[i]);
+        __m128i old = _mm_loadu_si128((const __m128i *)&dbs->seen[i]);
+        int same = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(cur,
+                                                                    old)));
+        uint32_t vals[4];
+        int j;
+
+        if (likely(same == 0xf)) {
+            continue;
+        }
+        _mm_storeu_si128((__m128i *)vals, cur);
+        for (j = 0; j < 4; j++) {
+            if (!(same & (1 << j))) {
+                doorbells_changed(dbs, changed, i + j, vals[j]);
+                n++;
+            }
+        }
+    }
+#endif
+
+    for (; i < dbs->nr; i++) {
+        uint32_t val = area[i];
+
+        if (val != dbs->seen[i]) {
+            doorbells_changed(dbs, changed, i, val);
+            n++;
+        }
+    }
+
+    /* Order the doorbell reads before reading what they announce. */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return n;
+}
+
+static inline uint64_t
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+int
+vfu_doorbells_wait(vfu_doorbells_t *dbs, uint64_t *changed,
+                   unsigned int spin_us, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = dbs->efd, .events = POLLIN };
+    uint64_t start = 0;
+    eventfd_t val;
+    int n;
+
+    assert(dbs != NULL);
+
+    for (;;) {
+        n = vfu_doorbells_poll(dbs, changed);
+        if (n > 0) {
+            return n;
+        }
+        if (start == 0) {
+            start = now_us();
+        } else if (now_us() - start >= spin_us) {
+            break;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    if (poll(&pfd, 1, timeout_ms) < 0) {
+        return ERROR_INT(errno);
+    }
+    /* Drain the wakeups; the doorbells themselves tell what happened. */
+    (void) eventfd_read(dbs->efd, &val);
+
+    return vfu_doorbells_poll(dbs, changed);
+}
+
+uint32_t
+vfu_doorbells_read(vfu_doorbells_t *dbs, uint32_t idx)
+{
+    assert(dbs != NULL);
+    assert(idx < dbs->nr);
+
+    return dbs->seen[idx];
+}
+
+int
+vfu_doorbells_get_fd(vfu_doorbells_t *dbs)
+{
+    assert(dbs != NULL);
+
+    return dbs->efd;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2020 Nutanix Inc. All rights reserved.
+ *
+ * Authors: Thanos Makatos <thanos@nutanix.com>
+ *          Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *          Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#ifndef LIB_VFIO_USER_DOORBELL_H
+#define LIB_VFIO_USER_DOORBELL_H
+
+#include "private.h"
+
+struct vfu_doorbells {
+    vfu_ctx_t   *vfu_ctx;
+    int         fd;         /* memfd backing the doorbell area */
+    int         efd;        /* eventfd signalled on trapped writes */
+    size_t      offset;     /* of the area within the region */
+    size_t      size;       /* of the area, page aligned */
+    uint32_t    nr;
+    uint32_t    *area;      /* our mapping of the area */
+    uint32_t    *seen;      /* values as of the last poll */
+};
+
+void
+doorbells_destroy(vfu_doorbells_t *dbs);
+
+static inline bool
+doorbells_contain(const vfu_doorbells_t *dbs, uint64_t offset, size_t count)
+{
+    return dbs != NULL && offset >= dbs->offset &&
+           offset + count <= dbs->offset + dbs->size;
+}
+
+/* Handles a region access to the doorbell area that wasn't via the mapping. */
+ssize_t
+doorbells_access(vfu_doorbells_t *dbs, char *buf, size_t count,
+                 uint64_t offset, bool is_write);
+
+#endif /* LIB_VFIO_USER_DOORBELL_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2020 Nutanix Inc. All rights reserved.
+ *
+ * Authors: Thanos Makatos <thanos@nutanix.com>
+ *          Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *          Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "dma.h"
+#include "iommu.h"
+#include "private.h"
+#include "workers.h"
+
+static struct iommu_mapping *
+iotlb_entry(iommu_t *iommu, vfu_dma_addr_t iova)
+{
+    size_t idx = ((uintptr_t)iova >> IOTLB_PAGE_SHIFT) % IOTLB_NR_ENTRIES;
+
+    return &iommu->iotlb[idx];
+}
+
+static bool
+mapping_contains(const struct iommu_mapping *m, vfu_dma_addr_t iova)
+{
+    return m->size != 0 && iova >= m->iova && iova < m->iova + m->size;
+}
+
+iommu_t *
+iommu_create(vfu_ctx_t *vfu_ctx)
+{
+    iommu_t *iommu = calloc(1, sizeof(*iommu));
+
+    if (iommu == NULL) {
+        return NULL;
+    }
+
+    iommu->vfu_ctx = vfu_ctx;
+    return iommu;
+}
+
+void
+iommu_destroy(iommu_t *iommu)
+{
+    if (iommu == NULL) {
+        return;
+    }
+
+    free(iommu->mappings);
+    free(iommu);
+}
+
+void
+iommu_reset(iommu_t *iommu)
+{
+    assert(iommu != NULL);
+
+    iommu->nr_mappings = 0;
+    memset(iommu->iotlb, 0, sizeof(iommu->iotlb));
+}
+
+/* Returns the index of the first mapping that ends after @iova. */
+static size_t
+iommu_find(const iommu_t *iommu, vfu_dma_addr_t iova)
+{
+    size_t lo = 0, hi = iommu->nr_mappings;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct iommu_mapping *m = &iommu->mappings[mid];
+
+        if (m->iova + m->size <= iova) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Workers translate region accesses concurrently, so they leave the IOTLB to
+ * the other threads and search the mappings, which only change while they're
+ * idle.
+ */
+bool
+iommu_lookup(iommu_t *iommu, vfu_dma_addr_t iova, struct iommu_mapping *m)
+{
+    struct iommu_mapping *entry = NULL;
+    size_t idx;
+
+    assert(iommu != NULL);
+    assert(m != NULL);
+
+    if (!workers_self()) {
+        entry = iotlb_entry(iommu, iova);
+        if (likely(mapping_contains(entry, iova))) {
+            *m = *entry;
+            return true;
+        }
+    }
+
+    idx = iommu_find(iommu, iova);
+    if (idx == iommu->nr_mappings ||
+        !mapping_contains(&iommu->mappings[idx], iova)) {
+        return false;
+    }
+
+    *m = iommu->mappings[idx];
+    if (entry != NULL) {
+        *entry = *m;
+    }
+    return true;
+}
+
+static int
+iommu_map(iommu_t *iommu, const struct vfio_user_iommu_mapping *mapping)
+{
+    vfu_dma_addr_t iova = (vfu_dma_addr_t)mapping->iova;
+    struct iommu_mapping *m;
+    size_t idx;
+
+    if (mapping->size == 0 || mapping->flags != 0 ||
+        mapping->iova + mapping->size < mapping->iova) {
+        return -EINVAL;
+    }
+
+    idx = iommu_find(iommu, iova);
+    if (idx < iommu->nr_mappings &&
+        iommu->mappings[idx].iova < iova + mapping->size) {
+        return -EEXIST;
+    }
+
+    if (iommu->nr_mappings == iommu->max_mappings) {
+        size_t max_mappings = MAX(iommu->max_mappings * 2, 16);
+
+        m = realloc(iommu->mappings, max_mappings * sizeof(*m));
+        if (m == NULL) {
+            return -ENOMEM;
+        }
+        iommu->mappings = m;
+        iommu->max_mappings = max_mappings;
+    }
+
+    m = &iommu->mappings[idx];
+    memmove(m + 1, m, (iommu->nr_mappings - idx) * sizeof(*m));
+    m->iova = iova;
+    m->size = mapping->size;
+    m->gpa = (vfu_dma_addr_t)mapping->gpa;
+    m->prot = mapping->prot;
+    iommu->nr_mappings++;
+
+    return 0;
+}
+
+static int
+iommu_unmap(iommu_t *iommu, const struct vfio_user_iommu_mapping *mapping)
+{
+    struct iommu_mapping *m;
+    size_t idx;
+
+    idx = iommu_find(iommu, (vfu_dma_addr_t)mapping->iova);
+    if (idx == iommu->nr_mappings) {
+        return -ENOENT;
+    }
+    m = &iommu->mappings[idx];
+    if (m->iova != (vfu_dma_addr_t)mapping->iova || m->size != mapping->size) {
+        return -ENOENT;
+    }
+
+    memmove(m, m + 1, (iommu->nr_mappings - idx - 1) * sizeof(*m));
+    iommu->nr_mappings--;
+
+    return 0;
+}
+
+/*
+ * Drops the IOTLB entries overlapping any of the @nr removed mappings, in a
+ * single pass over the IOTLB.
+ */
+static void
+iotlb_invalidate(iommu_t *iommu, const struct vfio_user_iommu_mapping *mappings,
+                 size_t nr)
+{
+    size_t i, j;
+
+    for (i = 0; i < IOTLB_NR_ENTRIES; i++) {
+        struct iommu_mapping *entry = &iommu->iotlb[i];
+
+        for (j = 0; j < nr && entry->size != 0; j++) {
+            uint64_t start = (uint64_t)entry->iova;
+
+            if (start < mappings[j].iova + mappings[j].size &&
+                mappings[j].iova < start + entry->size) {
+                entry->size = 0;
+            }
+        }
+    }
+}
+
+int
+handle_iommu_map_or_unmap(vfu_ctx_t *vfu_ctx, uint32_t size, bool map,
+                          struct vfio_user_iommu_mapping *mappings)
+{
+    iommu_t *iommu;
+    size_t nr, i;
+    int ret = 0;
+
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->dma == NULL || vfu_ctx->dma->iommu == NULL) {
+        vfu_log(vfu_ctx, LOG_ERR, "IOMMU emulation not enabled");
+        return -ENOTSUP;
+    }
+    iommu = vfu_ctx->dma->iommu;
+
+    if (size % sizeof(*mappings) != 0) {
+        vfu_log(vfu_ctx, LOG_ERR, "bad size of IOMMU mappings %u", size);
+        return -EINVAL;
+    }
+    nr = size / sizeof(*mappings);
+
+    for (i = 0; i < nr; i++) {
+        struct vfio_user_iommu_mapping *m = &mappings[i];
+
+        vfu_log(vfu_ctx, LOG_DEBUG, "%s IOMMU mapping [%#lx, %#lx) -> %#lx "
+                "prot=%#x", map ? "adding" : "removing", m->iova,
+                m->iova + m->size, m->gpa, m->prot);
+
+        ret = map ? iommu_map(iommu, m) : iommu_unmap(iommu, m);
+        if (ret < 0) {
+            vfu_log(vfu_ctx, LOG_ERR, "failed to %s IOMMU mapping [%#lx, %#lx): "
+                    "%s", map ? "add" : "remove", m->iova, m->iova + m->size,
+                    strerror(-ret));
+            break;
+        }
+    }
+
+    if (map && ret < 0) {
+        /* Mapping is all or nothing, so the client knows where it stands. */
+        while (i-- > 0) {
+            (void) iommu_unmap(iommu, &mappings[i]);
+        }
+    } else if (!map) {
+        /* Mappings before a failing one have been removed regardless. */
+        iotlb_invalidate(iommu, mappings, i);
+    }
+
+    return ret;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2020 Nutanix Inc. All rights reserved.
+ *
+ * Authors: Thanos Makatos <thanos@nutanix.com>
+ *          Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *          Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * Emulated IOMMU: translates device-visible IOVAs into the guest physical
+ * addresses of the DMA controller, using mappings pushed by the client with
+ * VFIO_USER_IOMMU_MAP/UNMAP. Recent translations are cached in a small IOTLB.
+ */
+
+#ifndef LIB_VFIO_USER_IOMMU_H
+#define LIB_VFIO_USER_IOMMU_H
+
+#include "libvfio-user.h"
+
+#define IOTLB_NR_ENTRIES    64
+#define IOTLB_PAGE_SHIFT    12
+
+struct iommu_mapping {
+    vfu_dma_addr_t  iova;
+    size_t          size;
+    vfu_dma_addr_t  gpa;
+    uint32_t        prot;
+};
+
+/* An IOTLB entry caches the mapping a page was last translated through. */
+typedef struct iommu {
+    vfu_ctx_t               *vfu_ctx;
+    struct iommu_mapping    *mappings;      /* sorted by IOVA */
+    size_t                  nr_mappings;
+    size_t                  max_mappings;
+    struct iommu_mapping    iotlb[IOTLB_NR_ENTRIES];
+} iommu_t;
+
+iommu_t *
+iommu_create(vfu_ctx_t *vfu_ctx);
+
+void
+iommu_destroy(iommu_t *iommu);
+
+/* Removes all mappings, e.g. when the client goes away. */
+void
+iommu_reset(iommu_t *iommu);
+
+/*
+ * Copies the mapping @iova falls in to @m, returns false if there isn't one.
+ */
+bool
+iommu_lookup(iommu_t *iommu, vfu_dma_addr_t iova, struct iommu_mapping *m);
+
+int
+handle_iommu_map_or_unmap(vfu_ctx_t *vfu_ctx, uint32_t size, bool map,
+                          struct vfio_user_iommu_mapping *mappings);
+
+#endif /* LIB_VFIO_USER_IOMMU_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -32,7 +32,9 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <string.h>
 #include <sys/eventfd.h>
+#include <sys/param.h>
 
 #include "irq.h"
 #include "tran_sock.h"
@@ -154,6 +156,12 @@ irqs_reset(vfu_ctx_t *vfu_ctx)
             efds[i] = -1;
         }
     }
+
+    /* They were for the client that's gone. */
+    for (i = 0; i < (vfu_ctx->irqs->max_ivs + 63) / 64; i++) {
+        __atomic_store_n(&vfu_ctx->irqs->pending[i], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&vfu_ctx->irq_defer, false, __ATOMIC_SEQ_CST);
 }
 
 static int
@@ -388,21 +396,145 @@ validate_irq_subindex(vfu_ctx_t *vfu_ctx, uint32_t subindex)
     return true;
 }
 
+/*
+ * Sends the pending interrupts of @fn as posted VFIO_USER_VM_INTERRUPT
+ * messages on the connection of @fn0, each carrying as many sub-indexes as
+ * fit.
+ */
+static int
+irqs_flush_function(vfu_ctx_t *fn0, vfu_ctx_t *fn)
+{
+    vfu_irqs_t *irqs = fn->irqs;
+    size_t max_per_msg, n = 0, i;
+    uint32_t *subindexes;
+    uint64_t bits;
+    int ret = 0;
+
+    subindexes = alloca(irqs->max_ivs * sizeof(uint32_t));
+    for (i = 0; i < (irqs->max_ivs + 63) / 64; i++) {
+        if (__atomic_load_n(&irqs->pending[i], __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        bits = __atomic_exchange_n(&irqs->pending[i], 0, __ATOMIC_SEQ_CST);
+        while (bits != 0) {
+            subindexes[n++] = i * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+        }
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+
+    max_per_msg = (fn0->max_msg_size - sizeof(struct vfio_user_header)) /
+                  sizeof(uint32_t);
+
+    for (i = 0; i < n && ret == 0; i += max_per_msg) {
+        /* [0] is for the header. */
+        struct iovec iovecs[2] = {
+            [1] = {
+                .iov_base = subindexes + i,
+                .iov_len = MIN(n - i, max_per_msg) * sizeof(uint32_t)
+            }
+        };
+        struct send_req req = {
+            .type = SEND_POSTED,
+            .msg_id = __atomic_fetch_add(&fn0->next_msg_id, 1,
+                                         __ATOMIC_RELAXED),
+            .cmd = VFIO_USER_VM_INTERRUPT,
+            .function = fn->rid,
+            .iovecs = iovecs,
+            .nr_iovecs = ARRAY_SIZE(iovecs)
+        };
+
+        ret = send_msg(fn0, &req);
+    }
+
+    if (ret < 0) {
+        vfu_log(fn, LOG_ERR, "failed to post interrupts: %s", strerror(-ret));
+    }
+    return ret;
+}
+
+/*
+ * Posts the pending interrupts of function 0 and, if any of them triggered
+ * one, of the other functions and VFs, all of which share its connection.
+ */
+int
+irqs_flush(vfu_ctx_t *vfu_ctx)
+{
+    int ret = 0, err;
+    uint16_t i;
+
+    assert(vfu_ctx->parent == NULL);
+
+    if (vfu_ctx->irqs != NULL) {
+        ret = irqs_flush_function(vfu_ctx, vfu_ctx);
+    }
+
+    if (!__atomic_exchange_n(&vfu_ctx->irq_fn_pending, false,
+                             __ATOMIC_SEQ_CST)) {
+        return ret;
+    }
+
+    for (i = 1; i < VFU_PCI_MAX_FUNCTIONS; i++) {
+        if (vfu_ctx->functions[i] != NULL &&
+            vfu_ctx->functions[i]->irqs != NULL) {
+            err = irqs_flush_function(vfu_ctx, vfu_ctx->functions[i]);
+            ret = ret < 0 ? ret : err;
+        }
+    }
+    for (i = 0; i < vfu_ctx->sriov.total_vfs; i++) {
+        if (vfu_ctx->sriov.vfs[i] != NULL &&
+            vfu_ctx->sriov.vfs[i]->irqs != NULL) {
+            err = irqs_flush_function(vfu_ctx, vfu_ctx->sriov.vfs[i]);
+            ret = ret < 0 ? ret : err;
+        }
+    }
+    return ret;
+}
+
 int
 vfu_irq_trigger(vfu_ctx_t *vfu_ctx, uint32_t subindex)
 {
+    vfu_ctx_t *fn0;
     eventfd_t val = 1;
+    int ret;
 
     if (!validate_irq_subindex(vfu_ctx, subindex)) {
         return ERROR_INT(EINVAL);
     }
 
-    if (vfu_ctx->irqs->efds[subindex] == -1) {
-        vfu_log(vfu_ctx, LOG_ERR, "no fd for interrupt %d", subindex);
+    if (vfu_ctx->irqs->efds[subindex] != -1) {
+        return eventfd_write(vfu_ctx->irqs->efds[subindex], val);
+    }
+
+    /* Other functions and VFs post through function 0, see irqs_flush(). */
+    fn0 = vfu_ctx->parent != NULL ? vfu_ctx->parent : vfu_ctx;
+
+    if (!fn0->client_vm_interrupt) {
         return ERROR_INT(ENOENT);
     }
 
-    return eventfd_write(vfu_ctx->irqs->efds[subindex], val);
+    __atomic_fetch_or(&vfu_ctx->irqs->pending[subindex / 64],
+                      1ULL << (subindex % 64), __ATOMIC_SEQ_CST);
+    if (vfu_ctx != fn0) {
+        __atomic_store_n(&fn0->irq_fn_pending, true, __ATOMIC_SEQ_CST);
+    }
+
+    /*
+     * process_request() clears irq_defer before flushing, so either it sees
+     * the bits set above or we see irq_defer cleared.
+     */
+    if (__atomic_load_n(&fn0->irq_defer, __ATOMIC_SEQ_CST)) {
+        return 0;
+    }
+
+    ret = irqs_flush(fn0);
+    if (ret < 0) {
+        return ERROR_INT(-ret);
+    }
+    return 0;
 }
 
 /* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -47,14 +47,20 @@
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <time.h>
 
+#include "coroutine.h"
 #include "dma.h"
+#include "doorbell.h"
+#include "iommu.h"
 #include "irq.h"
 #include "libvfio-user.h"
 #include "migration.h"
 #include "pci.h"
 #include "private.h"
+#include "rate_limit.h"
 #include "tran_sock.h"
+#include "workers.h"
 
 static void vfu_reset_ctx(vfu_ctx_t *vfu_ctx, const char *reason);
 
@@ -96,10 +102,38 @@ get_vfio_caps_size(bool is_migr_reg, vfu_reg_info_t *reg)
     return type_size + sparse_size;
 }
 
+/*
+ * Allocate the fds sent along with the sparse mmap capability of a region, one
+ * per area.
+ */
+static int
+dev_get_sparse_fds(vfu_ctx_t *vfu_ctx, vfu_reg_info_t *vfu_reg, int **fds,
+                   size_t *nr_fds)
+{
+    int i;
+
+    /*
+     * FIXME need to figure out how to break message into smaller messages
+     * so that we don't exceed client_max_fds
+     */
+    assert(vfu_reg->nr_mmap_areas <= vfu_ctx->client_max_fds);
+
+    *fds = malloc(vfu_reg->nr_mmap_areas * sizeof(int));
+    if (*fds == NULL) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < vfu_reg->nr_mmap_areas; i++) {
+        (*fds)[i] = vfu_reg->fd;
+    }
+    *nr_fds = vfu_reg->nr_mmap_areas;
+    return 0;
+}
+
 /*
  * Populate the sparse mmap capability information to vfio-client.
  * Sparse mmap information stays after struct vfio_region_info and cap_offest
- * points accordingly.
+ * points accordingly. The fds are not allocated if "fds" is NULL.
  */
 static int
 dev_get_caps(vfu_ctx_t *vfu_ctx, vfu_reg_info_t *vfu_reg, bool is_migr_reg,
@@ -111,8 +145,6 @@ dev_get_caps(vfu_ctx_t *vfu_ctx, vfu_reg_info_t *vfu_reg, bool is_migr_reg,
 
     assert(vfu_ctx != NULL);
     assert(vfio_reg != NULL);
-    assert(fds != NULL);
-    assert(nr_fds != NULL);
 
     header = (struct vfio_info_cap_header*)(vfio_reg + 1);
 
@@ -136,20 +168,17 @@ dev_get_caps(vfu_ctx_t *vfu_ctx, vfu_reg_info_t *vfu_reg, bool is_migr_reg,
             sparse = (struct vfio_region_info_cap_sparse_mmap*)header;
         }
 
-        /*
-         * FIXME need to figure out how to break message into smaller messages
-         * so that we don't exceed client_max_fds
-         */
-        assert(nr_mmap_areas <= vfu_ctx->client_max_fds);
+        if (fds != NULL) {
+            int ret = dev_get_sparse_fds(vfu_ctx, vfu_reg, fds, nr_fds);
 
-        *fds = malloc(nr_mmap_areas * sizeof(int));
-        if (*fds == NULL) {
-            return -ENOMEM;
+            if (ret < 0) {
+                return ret;
+            }
         }
         sparse->header.id = VFIO_REGION_INFO_CAP_SPARSE_MMAP;
         sparse->header.version = 1;
         sparse->header.next = 0;
-        sparse->nr_areas = *nr_fds = nr_mmap_areas;
+        sparse->nr_areas = nr_mmap_areas;
 
         for (i = 0; i < nr_mmap_areas; i++) {
             struct iovec *iov = &vfu_reg->mmap_areas[i];
@@ -157,7 +186,6 @@ dev_get_caps(vfu_ctx_t *vfu_ctx, vfu_reg_info_t *vfu_reg, bool is_migr_reg,
             vfu_log(vfu_ctx, LOG_DEBUG, "%s: area %d [%p, %p)", __func__,
                     i, iov->iov_base, iov_end(iov));
 
-            (*fds)[i] = vfu_reg->fd;
             sparse->areas[i].offset = (uintptr_t)iov->iov_base;
             sparse->areas[i].size = iov->iov_len;
         }
@@ -218,6 +246,10 @@ region_access(vfu_ctx_t *vfu_ctx, size_t region_index, char *buf,
         ret = pci_config_space_access(vfu_ctx, buf, count, offset, is_write);
     } else if (is_migr_reg(vfu_ctx, region_index) && vfu_ctx->migration != NULL) {
         ret = migration_region_access(vfu_ctx, buf, count, offset, is_write);
+    } else if (doorbells_contain(vfu_ctx->reg_info[region_index].doorbells,
+                                 offset, count)) {
+        ret = doorbells_access(vfu_ctx->reg_info[region_index].doorbells,
+                               buf, count, offset, is_write);
     } else {
         vfu_region_access_cb_t *cb = vfu_ctx->reg_info[region_index].cb;
 
@@ -300,6 +332,8 @@ handle_region_access(vfu_ctx_t *vfu_ctx, uint32_t size, uint16_t cmd,
         return -EINVAL;
     }
 
+    rate_limit_charge(vfu_ctx, 1, ra->count);
+
     if (ra->count == 0) {
         return 0;
     }
@@ -338,6 +372,96 @@ handle_region_access(vfu_ctx_t *vfu_ctx, uint32_t size, uint16_t cmd,
     return 0;
 }
 
+/* A region access run by a worker, see vfu_setup_region_workers(). */
+struct region_job {
+    struct work                     work;
+    vfu_ctx_t                       *vfu_ctx;
+    uint16_t                        msg_id;
+    uint16_t                        cmd;
+    bool                            no_reply;
+    size_t                          size;
+    struct vfio_user_region_access  *ra;
+};
+
+static void
+region_job_run(struct work *work)
+{
+    struct region_job *job = (struct region_job *)work;
+    vfu_ctx_t *vfu_ctx = job->vfu_ctx;
+    struct iovec iovecs[2] = { { 0, } };
+    int ret;
+
+    ret = handle_region_access(vfu_ctx, job->size, job->cmd,
+                               &iovecs[1].iov_base, &iovecs[1].iov_len,
+                               job->ra);
+    if (ret < 0) {
+        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: cmd %d failed: %s", job->msg_id,
+                job->cmd, strerror(-ret));
+    }
+
+    if (!job->no_reply) {
+        struct send_req req = {
+            .type = SEND_REPLY,
+            .msg_id = job->msg_id,
+            .iovecs = ret == 0 ? iovecs : NULL,
+            .nr_iovecs = ret == 0 ? 2 : 0,
+            .err = -ret
+        };
+
+        /*
+         * If the connection has gone, vfu_run_ctx() finds out and resets the
+         * context, which it can't do from here.
+         */
+        ret = send_msg(vfu_ctx->parent != NULL ? vfu_ctx->parent : vfu_ctx,
+                       &req);
+        if (ret < 0) {
+            vfu_log(vfu_ctx, LOG_ERR, "failed to reply: %s", strerror(-ret));
+        }
+    }
+
+    free(iovecs[1].iov_base);
+    free(job->ra);
+    free(job);
+}
+
+/*
+ * Hands a region access to the workers, taking over @data. Returns 1 if it's
+ * for vfu_run_ctx() to process instead.
+ */
+static int
+submit_region_access(vfu_ctx_t *fn_ctx, struct vfio_user_header *hdr,
+                     size_t size, void *data)
+{
+    struct vfio_user_region_access *ra = data;
+    struct region_job *job;
+    vfu_ctx_t *vfu_ctx = fn_ctx->parent != NULL ? fn_ctx->parent : fn_ctx;
+
+    if ((hdr->cmd != VFIO_USER_REGION_READ &&
+         hdr->cmd != VFIO_USER_REGION_WRITE) ||
+        size < sizeof(*ra) || ra->region >= fn_ctx->nr_regions ||
+        ra->region == VFU_PCI_DEV_CFG_REGION_IDX ||
+        is_migr_reg(fn_ctx, ra->region)) {
+        return 1;
+    }
+
+    job = calloc(1, sizeof(*job));
+    if (job == NULL) {
+        return -ENOMEM;
+    }
+    job->work.fn = region_job_run;
+    job->vfu_ctx = fn_ctx;
+    job->msg_id = hdr->msg_id;
+    job->cmd = hdr->cmd;
+    job->no_reply = hdr->flags.no_reply;
+    job->size = size;
+    job->ra = ra;
+
+    workers_submit(vfu_ctx->workers,
+                   (uint64_t)hdr->flags.function * VFU_PCI_DEV_NUM_REGIONS +
+                   ra->region, &job->work);
+    return 0;
+}
+
 #define VFU_REGION_SHIFT 40
 
 static inline uint64_t
@@ -395,7 +519,9 @@ dev_get_reginfo(vfu_ctx_t *vfu_ctx, uint32_t index, uint32_t argsz,
         (*vfio_reg)->flags |= VFIO_REGION_INFO_FLAG_MMAP;
     }
 
-    *nr_fds = 0;
+    if (nr_fds != NULL) {
+        *nr_fds = 0;
+    }
     if (caps_size > 0) {
         (*vfio_reg)->flags |= VFIO_REGION_INFO_FLAG_CAPS;
         if (argsz >= (*vfio_reg)->argsz) {
@@ -453,6 +579,251 @@ handle_device_get_info(vfu_ctx_t *vfu_ctx, uint32_t in_size,
     return 0;
 }
 
+static void
+info_cache_free(vfu_ctx_t *vfu_ctx)
+{
+    struct info_cache *cache = vfu_ctx->info_cache;
+    size_t i;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    for (i = 0; cache->reg_caps != NULL && i < vfu_ctx->nr_regions; i++) {
+        free(cache->reg_caps[i]);
+    }
+    free(cache->reg_caps);
+    free(cache->reg_hdr);
+    free(cache);
+    vfu_ctx->info_cache = NULL;
+}
+
+/*
+ * The info replies only depend on the device layout, which is fixed once the
+ * context is realized, so they are built once here instead of on every
+ * request.
+ */
+static int
+info_cache_build(vfu_ctx_t *vfu_ctx)
+{
+    struct vfio_device_info dev_info = { .argsz = sizeof(dev_info) };
+    struct vfio_irq_info irq_info = { .argsz = sizeof(irq_info) };
+    uint32_t all_info_size;
+    struct vfio_region_info *vfio_reg;
+    struct info_cache *cache;
+    size_t i;
+    int ret;
+
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        return -ENOMEM;
+    }
+    vfu_ctx->info_cache = cache;
+
+    ret = handle_device_get_info(vfu_ctx, sizeof(dev_info), &dev_info,
+                                 &cache->dev_info);
+    assert(ret == 0);
+
+    for (i = 0; i < VFU_DEV_NUM_IRQS; i++) {
+        irq_info.index = i;
+        ret = handle_device_get_irq_info(vfu_ctx, sizeof(irq_info), &irq_info,
+                                         &cache->irq_info[i]);
+        assert(ret == 0);
+    }
+
+    all_info_size = sizeof(dev_info) + sizeof(cache->irq_info);
+    cache->reg_hdr = calloc(vfu_ctx->nr_regions, sizeof(*cache->reg_hdr));
+    cache->reg_caps = calloc(vfu_ctx->nr_regions, sizeof(*cache->reg_caps));
+    if (cache->reg_hdr == NULL || cache->reg_caps == NULL) {
+        goto err_out;
+    }
+
+    for (i = 0; i < vfu_ctx->nr_regions; i++) {
+        if (dev_get_reginfo(vfu_ctx, i, sizeof(*vfio_reg), &vfio_reg,
+                            NULL, NULL) < 0) {
+            goto err_out;
+        }
+        cache->reg_hdr[i] = *vfio_reg;
+        free(vfio_reg);
+
+        if (cache->reg_hdr[i].argsz > sizeof(*vfio_reg) &&
+            dev_get_reginfo(vfu_ctx, i, cache->reg_hdr[i].argsz,
+                            &cache->reg_caps[i], NULL, NULL) < 0) {
+            goto err_out;
+        }
+
+        all_info_size += cache->reg_hdr[i].argsz;
+        if (vfu_ctx->reg_info[i].mmap_areas != NULL) {
+            cache->nr_all_fds += vfu_ctx->reg_info[i].nr_mmap_areas;
+        }
+    }
+
+    cache->all_info = cache->dev_info;
+    cache->all_info.argsz = all_info_size;
+
+    return 0;
+
+err_out:
+    info_cache_free(vfu_ctx);
+    return -ENOMEM;
+}
+
+/*
+ * Point "iov" at the cached reply to an info command. Returns 1 if there is
+ * one, 0 if the command must be handled the usual way (including all invalid
+ * requests, so they are logged as before), or -errno.
+ */
+static int
+info_cache_reply(vfu_ctx_t *vfu_ctx, uint16_t cmd, size_t size, void *data,
+                 struct iovec *iov, int **fds, size_t *nr_fds)
+{
+    struct info_cache *cache = vfu_ctx->info_cache;
+    struct vfio_region_info *reg_in = data;
+    struct vfio_device_info *dev_in = data;
+    struct vfio_irq_info *irq_in = data;
+    struct vfio_region_info *reg;
+    int ret;
+
+    if (cache == NULL) {
+        return 0;
+    }
+
+    switch (cmd) {
+    case VFIO_USER_DEVICE_GET_INFO:
+        if (size < sizeof(*dev_in) || dev_in->argsz < sizeof(*dev_in)) {
+            return 0;
+        }
+        iov->iov_base = &cache->dev_info;
+        iov->iov_len = cache->dev_info.argsz;
+        return 1;
+
+    case VFIO_USER_DEVICE_GET_IRQ_INFO:
+        if (size != sizeof(*irq_in) || irq_in->argsz != size ||
+            irq_in->index >= VFU_DEV_NUM_IRQS) {
+            return 0;
+        }
+        iov->iov_base = &cache->irq_info[irq_in->index];
+        iov->iov_len = sizeof(*irq_in);
+        return 1;
+
+    case VFIO_USER_DEVICE_GET_REGION_INFO:
+        if (size < sizeof(*reg_in) || reg_in->index >= vfu_ctx->nr_regions) {
+            return 0;
+        }
+
+        /* The reply is argsz bytes, so only these two sizes are cached. */
+        reg = &cache->reg_hdr[reg_in->index];
+        if (cache->reg_caps[reg_in->index] != NULL &&
+            reg_in->argsz == reg->argsz) {
+            vfu_reg_info_t *vfu_reg = &vfu_ctx->reg_info[reg_in->index];
+
+            reg = cache->reg_caps[reg_in->index];
+            if (vfu_reg->mmap_areas != NULL) {
+                ret = dev_get_sparse_fds(vfu_ctx, vfu_reg, fds, nr_fds);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+        } else if (reg_in->argsz != sizeof(*reg_in)) {
+            return 0;
+        }
+        iov->iov_base = reg;
+        iov->iov_len = reg_in->argsz;
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Replies with the device info, followed by the info of every IRQ index and of
+ * every region, so that the client can discover the device in a single round
+ * trip. The reply points into the info cache.
+ */
+int
+handle_device_get_all_info(vfu_ctx_t *vfu_ctx, uint32_t size,
+                           struct vfio_device_info *in_dev_info,
+                           struct iovec *_iovecs, struct iovec **iovecs,
+                           size_t *nr_iovecs, int **fds, size_t *nr_fds)
+{
+    struct info_cache *cache;
+    size_t i, j, n = 0;
+    struct iovec *iov;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+    assert(in_dev_info != NULL);
+
+    if (size < sizeof(*in_dev_info) ||
+        in_dev_info->argsz < sizeof(*in_dev_info)) {
+        return -EINVAL;
+    }
+
+    /* The cache is dropped when regions or IRQs are set up again. */
+    if (vfu_ctx->info_cache == NULL) {
+        if (!vfu_ctx->realized) {
+            return -EINVAL;
+        }
+        ret = info_cache_build(vfu_ctx);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    cache = vfu_ctx->info_cache;
+
+    if (in_dev_info->argsz < cache->all_info.argsz) {
+        _iovecs[1].iov_base = &cache->all_info;
+        _iovecs[1].iov_len = sizeof(cache->all_info);
+        *iovecs = _iovecs;
+        *nr_iovecs = 2;
+        return 0;
+    }
+
+    if (cache->nr_all_fds > (size_t)vfu_ctx->client_max_fds) {
+        vfu_log(vfu_ctx, LOG_DEBUG, "%zu region fds exceed max_fds %d",
+                cache->nr_all_fds, vfu_ctx->client_max_fds);
+        return -E2BIG;
+    }
+
+    iov = calloc(3 + vfu_ctx->nr_regions, sizeof(*iov));
+    if (iov == NULL) {
+        return -ENOMEM;
+    }
+
+    if (cache->nr_all_fds > 0) {
+        *fds = malloc(cache->nr_all_fds * sizeof(int));
+        if (*fds == NULL) {
+            free(iov);
+            return -ENOMEM;
+        }
+    }
+
+    iov[1].iov_base = &cache->all_info;
+    iov[1].iov_len = sizeof(cache->all_info);
+    iov[2].iov_base = cache->irq_info;
+    iov[2].iov_len = sizeof(cache->irq_info);
+
+    for (i = 0; i < vfu_ctx->nr_regions; i++) {
+        vfu_reg_info_t *vfu_reg = &vfu_ctx->reg_info[i];
+
+        iov[3 + i].iov_base = cache->reg_caps[i] != NULL ?
+                              cache->reg_caps[i] : &cache->reg_hdr[i];
+        iov[3 + i].iov_len = cache->reg_hdr[i].argsz;
+
+        for (j = 0; vfu_reg->mmap_areas != NULL &&
+                    j < (size_t)vfu_reg->nr_mmap_areas; j++) {
+            (*fds)[n++] = vfu_reg->fd;
+        }
+    }
+    assert(n == cache->nr_all_fds);
+
+    *nr_fds = n;
+    *iovecs = iov;
+    *nr_iovecs = 3 + vfu_ctx->nr_regions;
+    return 0;
+}
+
 int
 consume_fd(int *fds, size_t nr_fds, size_t index)
 {
@@ -683,6 +1054,80 @@ validate_header(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr, size_t size)
     return 0;
 }
 
+/*
+ * Returns whether @cmd is addressed to a single function of a multi-function
+ * device rather than to the device as a whole.
+ */
+static bool
+function_cmd(uint16_t cmd)
+{
+    switch (cmd) {
+    case VFIO_USER_DEVICE_GET_INFO:
+    case VFIO_USER_DEVICE_GET_REGION_INFO:
+    case VFIO_USER_DEVICE_GET_IRQ_INFO:
+    case VFIO_USER_DEVICE_GET_ALL_INFO:
+    case VFIO_USER_DEVICE_SET_IRQS:
+    case VFIO_USER_REGION_READ:
+    case VFIO_USER_REGION_WRITE:
+    case VFIO_USER_DEVICE_RESET:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Returns the index of the VF with routing ID @rid relative to PF @vfu_ctx, or
+ * -1 if @rid isn't that of one of its TotalVFs VFs.
+ */
+static int
+sriov_vf_idx(vfu_ctx_t *vfu_ctx, uint8_t rid)
+{
+    struct sriovcap *sriov;
+    uint16_t idx;
+
+    sriov = (void *)pci_config_space_ptr(vfu_ctx, vfu_ctx->sriov.off);
+    if (rid < sriov->vf_offset) {
+        return -1;
+    }
+    rid -= sriov->vf_offset;
+    if (sriov->vf_stride == 0) {
+        idx = rid == 0 ? 0 : UINT16_MAX;
+    } else if (rid % sriov->vf_stride != 0) {
+        return -1;
+    } else {
+        idx = rid / sriov->vf_stride;
+    }
+
+    return idx < vfu_ctx->sriov.total_vfs ? idx : -1;
+}
+
+/*
+ * Returns the context of the function with routing ID @rid relative to
+ * function 0 @vfu_ctx, or NULL if there's no such function.
+ */
+static vfu_ctx_t *
+function_ctx(vfu_ctx_t *vfu_ctx, uint8_t rid)
+{
+    int idx;
+
+    if (rid == 0) {
+        return vfu_ctx;
+    }
+
+    if (rid < VFU_PCI_MAX_FUNCTIONS && vfu_ctx->functions[rid] != NULL) {
+        return vfu_ctx->functions[rid];
+    }
+
+    if (vfu_ctx->sriov.nr_vfs == 0) {
+        return NULL;
+    }
+
+    idx = sriov_vf_idx(vfu_ctx, rid);
+    return idx >= 0 && idx < vfu_ctx->sriov.nr_vfs ?
+           vfu_ctx->sriov.vfs[idx] : NULL;
+}
+
 /*
  * Populates @hdr to contain the header for the next command to be processed.
  * Stores any passed FDs into @fds and the number in @nr_fds.
@@ -749,6 +1194,32 @@ MOCK_DEFINE(should_exec_command)(vfu_ctx_t *vfu_ctx, uint16_t cmd)
     return true;
 }
 
+/*
+ * Whether a request changes what those in flight may rely on, so that it waits
+ * for them to complete and the next ones wait for it, see "Command
+ * Concurrency" in the specification: DMA unmaps, resets, and migration state
+ * changes, device_state being at offset 0 of the migration region.
+ */
+static bool
+is_barrier(vfu_ctx_t *fn_ctx, const struct vfio_user_header *hdr,
+           size_t size, const void *data)
+{
+    const struct vfio_user_region_access *ra = data;
+
+    switch (hdr->cmd) {
+    case VFIO_USER_DMA_UNMAP:
+    case VFIO_USER_IOMMU_UNMAP:
+    case VFIO_USER_DEVICE_RESET:
+        return true;
+    case VFIO_USER_REGION_WRITE:
+        return size >= sizeof(*ra) && ra->region < fn_ctx->nr_regions &&
+               is_migr_reg(fn_ctx, ra->region) &&
+               ra->offset < sizeof(uint32_t);
+    default:
+        return false;
+    }
+}
+
 int
 MOCK_DEFINE(exec_command)(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr,
                           size_t size, int *fds, size_t nr_fds, int **fds_out,
@@ -762,6 +1233,7 @@ MOCK_DEFINE(exec_command)(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr,
     struct vfio_region_info *dev_region_info_in, *dev_region_info_out = NULL;
     void *cmd_data = NULL;
     size_t cmd_data_size;
+    vfu_ctx_t *fn_ctx;
 
     assert(vfu_ctx != NULL);
     assert(hdr != NULL);
@@ -795,6 +1267,52 @@ MOCK_DEFINE(exec_command)(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr,
         }
     }
 
+    fn_ctx = function_ctx(vfu_ctx, hdr->flags.function);
+    if (fn_ctx == NULL ||
+        (fn_ctx != vfu_ctx && !function_cmd(hdr->cmd))) {
+        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: bad function %u for cmd %d",
+                hdr->msg_id, hdr->flags.function, hdr->cmd);
+        free(cmd_data);
+        return -EINVAL;
+    }
+
+    if (vfu_ctx->co != NULL && co_self(vfu_ctx->co)) {
+        ret = co_order(vfu_ctx->co, is_barrier(fn_ctx, hdr, cmd_data_size,
+                                               cmd_data));
+        if (ret < 0) {
+            free(cmd_data);
+            return ret;
+        }
+    }
+
+    ret = info_cache_reply(fn_ctx, hdr->cmd, cmd_data_size, cmd_data,
+                           &_iovecs[1], fds_out, nr_fds_out);
+    if (ret != 0) {
+        if (ret > 0) {
+            *iovecs = _iovecs;
+            *nr_iovecs = 2;
+            /* The reply belongs to the cache. */
+            *free_iovec_data = false;
+            ret = 0;
+        }
+        free(cmd_data);
+        return ret;
+    }
+
+    if (vfu_ctx->workers != NULL) {
+        ret = submit_region_access(fn_ctx, hdr, cmd_data_size, cmd_data);
+        if (ret == 0) {
+            /* The worker replies once it's done. */
+            hdr->flags.no_reply = 1;
+            return 0;
+        } else if (ret < 0) {
+            free(cmd_data);
+            return ret;
+        }
+        /* Requests are processed in order, at least across regions. */
+        workers_wait_idle(vfu_ctx->workers);
+    }
+
     switch (hdr->cmd) {
     case VFIO_USER_DMA_MAP:
     case VFIO_USER_DMA_UNMAP:
@@ -803,13 +1321,20 @@ MOCK_DEFINE(exec_command)(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr,
                                       fds, nr_fds, cmd_data);
         break;
 
+    case VFIO_USER_IOMMU_MAP:
+    case VFIO_USER_IOMMU_UNMAP:
+        ret = handle_iommu_map_or_unmap(vfu_ctx, cmd_data_size,
+                                        hdr->cmd == VFIO_USER_IOMMU_MAP,
+                                        cmd_data);
+        break;
+
     case VFIO_USER_DEVICE_GET_INFO:
         dev_info = calloc(1, sizeof(*dev_info));
         if (dev_info == NULL) {
             ret = -ENOMEM;
             break;
         }
-        ret = handle_device_get_info(vfu_ctx, cmd_data_size, cmd_data,
+        ret = handle_device_get_info(fn_ctx, cmd_data_size, cmd_data,
                                      dev_info);
         if (ret >= 0) {
             _iovecs[1].iov_base = dev_info;
@@ -823,7 +1348,7 @@ MOCK_DEFINE(exec_command)(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr,
 
     case VFIO_USER_DEVICE_GET_REGION_INFO:
         dev_region_info_in = cmd_data;
-        ret = handle_device_get_region_info(vfu_ctx, cmd_data_size,
+        ret = handle_device_get_region_info(fn_ctx, cmd_data_size,
                                             dev_region_info_in,
                                             &dev_region_info_out, fds_out,
                                             nr_fds_out);
@@ -841,7 +1366,7 @@ MOCK_DEFINE(exec_command)(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr,
             ret = -ENOMEM;
             break;
         }
-        ret = handle_device_get_irq_info(vfu_ctx, cmd_data_size, cmd_data,
+        ret = handle_device_get_irq_info(fn_ctx, cmd_data_size, cmd_data,
                                          irq_info);
         if (ret == 0) {
             _iovecs[1].iov_base = irq_info;
@@ -853,14 +1378,22 @@ MOCK_DEFINE(exec_command)(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr,
         }
         break;
 
+    case VFIO_USER_DEVICE_GET_ALL_INFO:
+        ret = handle_device_get_all_info(fn_ctx, cmd_data_size, cmd_data,
+                                         _iovecs, iovecs, nr_iovecs, fds_out,
+                                         nr_fds_out);
+        /* The reply belongs to the cache. */
+        *free_iovec_data = false;
+        break;
+
     case VFIO_USER_DEVICE_SET_IRQS:
-        ret = handle_device_set_irqs(vfu_ctx, cmd_data_size, fds, nr_fds,
+        ret = handle_device_set_irqs(fn_ctx, cmd_data_size, fds, nr_fds,
                                      cmd_data);
         break;
 
     case VFIO_USER_REGION_READ:
     case VFIO_USER_REGION_WRITE:
-        ret = handle_region_access(vfu_ctx, cmd_data_size, hdr->cmd,
+        ret = handle_region_access(fn_ctx, cmd_data_size, hdr->cmd,
                                    &(_iovecs[1].iov_base),
                                    &(_iovecs[1].iov_len),
                                    cmd_data);
@@ -871,7 +1404,7 @@ MOCK_DEFINE(exec_command)(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr,
         break;
 
     case VFIO_USER_DEVICE_RESET:
-        ret = handle_device_reset(vfu_ctx);
+        ret = handle_device_reset(fn_ctx);
         break;
 
     case VFIO_USER_DIRTY_PAGES:
@@ -897,46 +1430,131 @@ MOCK_DEFINE(exec_command)(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr,
     return ret;
 }
 
-int
-MOCK_DEFINE(process_request)(vfu_ctx_t *vfu_ctx)
+/*
+ * Sends the messages queued so far, oldest first. Only called by the thread
+ * that set vfu_ctx->sending.
+ */
+static void
+send_queue_flush(vfu_ctx_t *vfu_ctx)
 {
-    struct vfio_user_header hdr = { 0, };
-    int ret;
-    int *fds = NULL, *fds_out = NULL;
-    size_t nr_fds, i;
-    size_t nr_fds_out = 0;
-    struct iovec _iovecs[2] = { { 0, } };
-    struct iovec *iovecs = NULL;
-    size_t nr_iovecs = 0;
-    bool free_iovec_data = true;
+    struct send_req *req, *next, *fifo;
+
+    while ((req = __atomic_exchange_n(&vfu_ctx->send_queue, NULL,
+                                      __ATOMIC_ACQUIRE)) != NULL) {
+        for (fifo = NULL; req != NULL; req = next) {
+            next = req->next;
+            req->next = fifo;
+            fifo = req;
+        }
 
-    assert(vfu_ctx != NULL);
+        for (req = fifo; req != NULL; req = next) {
+            int ret;
 
-    /*
-     * FIXME if migration device state is VFIO_DEVICE_STATE_STOP then only
-     * migration-related operations should execute. However, some operations
-     * are harmless (e.g. get region info). At the minimum we should fail
-     * accesses to device regions other than the migration region. I'd expect
-     * DMA unmap and get dirty pages to be required even in the stop-and-copy
-     * state.
-     */
+            /* The request belongs to its sender once it's done. */
+            next = req->next;
+            switch (req->type) {
+            case SEND_REPLY:
+                ret = vfu_ctx->tran->reply(vfu_ctx, req->msg_id, req->iovecs,
+                                           req->nr_iovecs, req->fds,
+                                           req->nr_fds, req->err, req->more);
+                break;
+            case SEND_FLUSH:
+                ret = vfu_ctx->tran->flush(vfu_ctx);
+                break;
+            default:
+                ret = vfu_ctx->tran->send_cmd(vfu_ctx, req->msg_id, req->cmd,
+                                              req->iovecs, req->nr_iovecs,
+                                              req->type == SEND_POSTED,
+                                              req->function);
+                break;
+            }
+            req->ret = ret;
+            __atomic_store_n(&req->done, true, __ATOMIC_RELEASE);
+        }
+    }
+}
 
-    nr_fds = vfu_ctx->client_max_fds;
-    fds = alloca(nr_fds * sizeof(int));
+/*
+ * Sends a message on the connection, which may be shared by several threads,
+ * e.g. vfu_run_ctx() replying to the client while device threads issue DMA.
+ *
+ * Senders push their request on a lock-free queue, and whichever of them
+ * finds no other thread sending writes out all queued messages, so that
+ * they're never interleaved on the socket. Requests live on their sender's
+ * stack, which waits until its message has been sent: memory is bounded by
+ * the number of senders, and they are held back while the socket is full.
+ * They sleep on send_cond meanwhile, which is only signalled if some do.
+ */
+int
+send_msg(vfu_ctx_t *vfu_ctx, struct send_req *req)
+{
+    req->done = false;
+    req->next = __atomic_load_n(&vfu_ctx->send_queue, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&vfu_ctx->send_queue, &req->next, req,
+                                        true, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+        ;
+    }
+
+    while (!__atomic_load_n(&req->done, __ATOMIC_ACQUIRE)) {
+        if (!__atomic_exchange_n(&vfu_ctx->sending, true, __ATOMIC_ACQUIRE)) {
+            send_queue_flush(vfu_ctx);
+            __atomic_store_n(&vfu_ctx->sending, false, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&vfu_ctx->send_waiters, __ATOMIC_SEQ_CST) > 0) {
+                pthread_mutex_lock(&vfu_ctx->send_lock);
+                pthread_cond_broadcast(&vfu_ctx->send_cond);
+                pthread_mutex_unlock(&vfu_ctx->send_lock);
+            }
+            continue;
+        }
 
-    ret = get_next_command(vfu_ctx, &hdr, fds, &nr_fds);
-    if (ret <= 0) {
-        return ret;
+        pthread_mutex_lock(&vfu_ctx->send_lock);
+        __atomic_fetch_add(&vfu_ctx->send_waiters, 1, __ATOMIC_SEQ_CST);
+        while (!__atomic_load_n(&req->done, __ATOMIC_ACQUIRE) &&
+               __atomic_load_n(&vfu_ctx->sending, __ATOMIC_SEQ_CST)) {
+            pthread_cond_wait(&vfu_ctx->send_cond, &vfu_ctx->send_lock);
+        }
+        __atomic_fetch_sub(&vfu_ctx->send_waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&vfu_ctx->send_lock);
     }
 
-    ret = exec_command(vfu_ctx, &hdr, ret, fds, nr_fds, &fds_out, &nr_fds_out,
+    return req->ret;
+}
+
+static bool
+has_pending(vfu_ctx_t *vfu_ctx)
+{
+    return vfu_ctx->tran->has_pending != NULL &&
+           vfu_ctx->tran->has_pending(vfu_ctx);
+}
+
+/*
+ * Executes the request whose header has been received, and replies to it.
+ * Sets @more if further requests are already readable.
+ */
+static int
+handle_request(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr, size_t size,
+               int *fds, size_t nr_fds, bool *more)
+{
+    int ret;
+    int *fds_out = NULL;
+    size_t i;
+    size_t nr_fds_out = 0;
+    struct iovec _iovecs[2] = { { 0, } };
+    struct iovec *iovecs = NULL;
+    size_t nr_iovecs = 0;
+    bool free_iovec_data = true;
+
+    *more = false;
+
+    ret = exec_command(vfu_ctx, hdr, size, fds, nr_fds, &fds_out, &nr_fds_out,
                        _iovecs, &iovecs, &nr_iovecs, &free_iovec_data);
 
     for (i = 0; i < nr_fds; i++) {
         if (fds[i] != -1) {
             vfu_log(vfu_ctx, LOG_DEBUG,
                     "closing unexpected fd %d (index %zu) from cmd %u",
-                    fds[i], i, hdr.cmd);
+                    fds[i], i, hdr->cmd);
             close(fds[i]);
         }
     }
@@ -947,8 +1565,8 @@ MOCK_DEFINE(process_request)(vfu_ctx_t *vfu_ctx)
      */
 
     if (ret < 0) {
-        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: cmd %d failed: %s", hdr.msg_id,
-                hdr.cmd, strerror(-ret));
+        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: cmd %d failed: %s", hdr->msg_id,
+                hdr->cmd, strerror(-ret));
 
         if (ret == -ENOTCONN) {
             goto out;
@@ -957,14 +1575,32 @@ MOCK_DEFINE(process_request)(vfu_ctx_t *vfu_ctx)
         ret = 0;
     }
 
-    if (hdr.flags.no_reply) {
+    /* Replies to pipelined requests are sent together, see reply(). */
+    *more = has_pending(vfu_ctx);
+
+    if (hdr->flags.no_reply) {
+        struct send_req req = { .type = SEND_FLUSH };
+
         /*
          * A failed client request is not a failure of process_request() itself.
          */
         ret = 0;
+        if (!*more && vfu_ctx->tran->flush != NULL) {
+            ret = send_msg(vfu_ctx, &req);
+        }
     } else {
-        ret = vfu_ctx->tran->reply(vfu_ctx, hdr.msg_id, iovecs, nr_iovecs,
-                                   fds_out, nr_fds_out, -ret);
+        struct send_req req = {
+            .type = SEND_REPLY,
+            .more = *more,
+            .msg_id = hdr->msg_id,
+            .iovecs = iovecs,
+            .nr_iovecs = nr_iovecs,
+            .fds = fds_out,
+            .nr_fds = nr_fds_out,
+            .err = -ret
+        };
+
+        ret = send_msg(vfu_ctx, &req);
 
         if (ret < 0) {
             vfu_log(vfu_ctx, LOG_ERR, "failed to reply: %s", strerror(-ret));
@@ -982,7 +1618,6 @@ MOCK_DEFINE(process_request)(vfu_ctx_t *vfu_ctx)
 out:
     if (iovecs != NULL) {
         if (free_iovec_data) {
-            size_t i;
             for (i = 1; i < nr_iovecs; i++) {
                 free(iovecs[i].iov_base);
             }
@@ -995,6 +1630,135 @@ out:
     return ret;
 }
 
+struct request {
+    vfu_ctx_t               *vfu_ctx;
+    struct vfio_user_header *hdr;
+    size_t                  size;
+    int                     *fds;
+    size_t                  nr_fds;
+};
+
+/*
+ * Runs a request in its coroutine. @arg is only valid until the request first
+ * waits, so it's copied first.
+ */
+static int
+request_co(void *arg)
+{
+    struct request *req = arg;
+    struct vfio_user_header hdr = *req->hdr;
+    size_t nr_fds = req->nr_fds;
+    int *fds = alloca(nr_fds * sizeof(int));
+    bool more;
+
+    memcpy(fds, req->fds, nr_fds * sizeof(int));
+
+    return handle_request(req->vfu_ctx, &hdr, req->size, fds, nr_fds, &more);
+}
+
+/*
+ * Starts a request in a coroutine of its own, or hands a reply to the request
+ * waiting for it. Either runs until the request completes or waits.
+ */
+static int
+co_process_msg(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr, size_t size,
+               int *fds, size_t nr_fds)
+{
+    struct request req = {
+        .vfu_ctx = vfu_ctx,
+        .hdr = hdr,
+        .size = size,
+        .fds = fds,
+        .nr_fds = nr_fds
+    };
+    void *data = NULL;
+    bool more;
+    int ret;
+
+    if (hdr->flags.type == VFIO_USER_F_TYPE_REPLY) {
+        ret = vfu_ctx->tran->recv_body(vfu_ctx, hdr, &data);
+        if (ret < 0) {
+            return ret;
+        }
+        if (co_dispatch_reply(vfu_ctx->co, hdr, data)) {
+            return 0;
+        }
+        /* Rejected below. */
+        free(data);
+    }
+
+    if (co_spawn(vfu_ctx->co, request_co, &req, &ret) < 0) {
+        vfu_log(vfu_ctx, LOG_WARNING, "msg%#hx: no coroutine, the request "
+                "can't wait", hdr->msg_id);
+        ret = handle_request(vfu_ctx, hdr, size, fds, nr_fds, &more);
+    }
+    return ret;
+}
+
+/*
+ * Sends what was held back while requests were processed, once there are no
+ * more to process or they're throttled: the interrupts they raised and corked
+ * replies, e.g. those that completed before a request that now waits.
+ */
+static void
+requests_done(vfu_ctx_t *vfu_ctx)
+{
+    if (vfu_ctx->tran->flush != NULL) {
+        struct send_req req = { .type = SEND_FLUSH };
+
+        (void) send_msg(vfu_ctx, &req);
+    }
+
+    __atomic_store_n(&vfu_ctx->irq_defer, false, __ATOMIC_SEQ_CST);
+    (void) irqs_flush(vfu_ctx);
+}
+
+int
+MOCK_DEFINE(process_request)(vfu_ctx_t *vfu_ctx)
+{
+    struct vfio_user_header hdr = { 0, };
+    int ret;
+    int *fds = NULL;
+    size_t nr_fds;
+    bool more;
+
+    assert(vfu_ctx != NULL);
+
+    /*
+     * FIXME if migration device state is VFIO_DEVICE_STATE_STOP then only
+     * migration-related operations should execute. However, some operations
+     * are harmless (e.g. get region info). At the minimum we should fail
+     * accesses to device regions other than the migration region. I'd expect
+     * DMA unmap and get dirty pages to be required even in the stop-and-copy
+     * state.
+     */
+
+    nr_fds = vfu_ctx->client_max_fds;
+    fds = alloca(nr_fds * sizeof(int));
+
+    ret = get_next_command(vfu_ctx, &hdr, fds, &nr_fds);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    /* Interrupts the request raises are posted after the reply. */
+    __atomic_store_n(&vfu_ctx->irq_defer, true, __ATOMIC_SEQ_CST);
+
+    if (vfu_ctx->co != NULL) {
+        ret = co_process_msg(vfu_ctx, &hdr, ret, fds, nr_fds);
+        more = has_pending(vfu_ctx);
+    } else {
+        ret = handle_request(vfu_ctx, &hdr, ret, fds, nr_fds, &more);
+    }
+
+    /* Or, if requests are pipelined, after the last one. */
+    if (!more) {
+        requests_done(vfu_ctx);
+    }
+
+    return ret;
+}
+
 int
 vfu_realize_ctx(vfu_ctx_t *vfu_ctx)
 {
@@ -1024,8 +1788,8 @@ vfu_realize_ctx(vfu_ctx_t *vfu_ctx)
         }
     }
 
-    // Set type for region registers.
-    for (i = 0; i < PCI_BARS_NR; i++) {
+    // Set type for region registers; VF BARs are in the PF's SR-IOV capability.
+    for (i = 0; i < PCI_BARS_NR && !vfu_ctx_is_vf(vfu_ctx); i++) {
         if (!(vfu_ctx->reg_info[i].flags & VFU_REGION_FLAG_MEM)) {
             vfu_ctx->pci.config_space->hdr.bars[i].io.region_type |= 0x1;
         }
@@ -1045,12 +1809,16 @@ vfu_realize_ctx(vfu_ctx_t *vfu_ctx)
         }
 
         // FIXME: assert(max_ivs > 0)?
-        size = sizeof(int) * max_ivs;
-        vfu_ctx->irqs = calloc(1, sizeof(vfu_irqs_t) + size);
+        size = ROUND_UP(sizeof(int) * max_ivs, sizeof(uint64_t));
+        vfu_ctx->irqs = calloc(1, sizeof(vfu_irqs_t) + size +
+                                  (max_ivs + 63) / 64 * sizeof(uint64_t));
         if (vfu_ctx->irqs == NULL) {
             // vfu_ctx->pci.config_space should be free'ed by vfu_destroy_ctx().
             return ERROR_INT(ENOMEM);
         }
+        /* The pending bitmap follows the eventfds. */
+        vfu_ctx->irqs->pending = (uint64_t *)((char *)vfu_ctx->irqs->efds +
+                                              size);
 
         // Set context irq information.
         for (i = 0; i < max_ivs; i++) {
@@ -1070,27 +1838,119 @@ vfu_realize_ctx(vfu_ctx_t *vfu_ctx)
         vfu_ctx->pci.config_space->hdr.sts.cl = 0x1;
     }
 
+    for (i = 1; i < VFU_PCI_MAX_FUNCTIONS; i++) {
+        if (vfu_ctx->functions[i] == NULL) {
+            continue;
+        }
+        /* The header couldn't tell the function from the VF. */
+        if (vfu_ctx->sriov.off != 0 && sriov_vf_idx(vfu_ctx, i) >= 0) {
+            vfu_log(vfu_ctx, LOG_ERR, "function %d has the routing ID of VF%d",
+                    i, sriov_vf_idx(vfu_ctx, i));
+            return ERROR_INT(EINVAL);
+        }
+        if (vfu_realize_ctx(vfu_ctx->functions[i]) < 0) {
+            return -1;
+        }
+        /* Multi-function bit, only looked at in function 0. */
+        vfu_ctx->pci.config_space->hdr.htype.raw |= 0x80;
+    }
+
+    for (i = 0; i < vfu_ctx->sriov.total_vfs; i++) {
+        if (vfu_ctx->sriov.vfs[i] != NULL &&
+            vfu_realize_ctx(vfu_ctx->sriov.vfs[i]) < 0) {
+            return -1;
+        }
+    }
+
+    if (info_cache_build(vfu_ctx) < 0) {
+        return ERROR_INT(ENOMEM);
+    }
+
     vfu_ctx->realized = true;
 
     return 0;
 }
 
+/*
+ * Holds back requests while the context is over its rate limits. Returns 0
+ * once they may go on, -EBUSY if the context is non-blocking, or -errno.
+ */
+static int
+throttle(vfu_ctx_t *vfu_ctx, bool blocking)
+{
+    struct timespec ts;
+    uint64_t delay;
+
+    delay = rate_limit_throttle(vfu_ctx->rate_limit);
+    if (delay == 0) {
+        return 0;
+    }
+
+    /* What the requests so far left to send mustn't wait too. */
+    requests_done(vfu_ctx);
+
+    if (!blocking) {
+        return -EBUSY;
+    }
+
+    ts.tv_sec = delay / 1000000000;
+    ts.tv_nsec = delay % 1000000000;
+    return nanosleep(&ts, NULL) == -1 ? -errno : 0;
+}
+
+static bool
+co_ready(vfu_ctx_t *vfu_ctx)
+{
+    return vfu_ctx->co != NULL && co_has_ready(vfu_ctx->co);
+}
+
 int
 vfu_run_ctx(vfu_ctx_t *vfu_ctx)
 {
+    bool resumed = false;
     int err;
     bool blocking;
 
     assert(vfu_ctx != NULL);
 
-    if (!vfu_ctx->realized) {
+    if (!vfu_ctx->realized || vfu_ctx->parent != NULL) {
         return ERROR_INT(EINVAL);
     }
 
     blocking = !(vfu_ctx->flags & LIBVFIO_USER_FLAG_ATTACH_NB);
+    /*
+     * Commands queued while waiting for a reply don't make the poll fd
+     * readable, so they are all processed now, as are the requests already
+     * received, whose replies are sent together. Suspended requests are
+     * resumed once per call, see vfu_yield().
+     */
     do {
+        err = 0;
+        if (!resumed && co_ready(vfu_ctx)) {
+            resumed = true;
+            __atomic_store_n(&vfu_ctx->irq_defer, true, __ATOMIC_SEQ_CST);
+            co_run_ready(vfu_ctx->co);
+            if (!has_pending(vfu_ctx)) {
+                requests_done(vfu_ctx);
+            }
+        }
+        /* Nor do we block while requests are ready to go on. */
+        if (blocking && !has_pending(vfu_ctx) && co_ready(vfu_ctx)) {
+            break;
+        }
+        if (vfu_ctx->rate_limit != NULL) {
+            err = throttle(vfu_ctx, blocking);
+            if (err < 0) {
+                break;
+            }
+        }
         err = process_request(vfu_ctx);
-    } while (err == 0 && blocking);
+    } while (err == 0 && (blocking || has_pending(vfu_ctx)));
+
+    /* The caller comes back for those that are ready. */
+    if (vfu_ctx->tran->wake != NULL) {
+        vfu_ctx->tran->wake(vfu_ctx, co_ready(vfu_ctx));
+    }
 
     return err == 0 ? 0 : ERROR_INT(-err);
 }
@@ -1104,41 +1964,140 @@ free_sparse_mmap_areas(vfu_ctx_t *vfu_ctx)
 
     for (i = 0; i < (int)vfu_ctx->nr_regions; i++) {
         free(vfu_ctx->reg_info[i].mmap_areas);
+        doorbells_destroy(vfu_ctx->reg_info[i].doorbells);
     }
 }
 
+/*
+ * Disables the VFs of a PF that lost its client, which has to set up the
+ * SR-IOV capability again.
+ */
 static void
-vfu_reset_ctx(vfu_ctx_t *vfu_ctx, const char *reason)
+sriov_reset(vfu_ctx_t *vfu_ctx)
 {
-    vfu_log(vfu_ctx, LOG_INFO, "%s: %s", __func__,  reason);
+    struct sriovcap *sriov;
 
-    if (vfu_ctx->reset != NULL) {
-        vfu_ctx->reset(vfu_ctx, VFU_RESET_LOST_CONN);
+    sriov = (void *)pci_config_space_ptr(vfu_ctx, vfu_ctx->sriov.off);
+    if ((sriov->ctrl & PCI_SRIOV_CTRL_VFE) && vfu_ctx->sriov.cb != NULL) {
+        vfu_ctx->sriov.cb(vfu_ctx, 0);
     }
+    sriov->ctrl = 0;
+    sriov->num_vfs = 0;
+    vfu_ctx->sriov.nr_vfs = 0;
+}
 
-    if (vfu_ctx->dma != NULL) {
-        dma_controller_remove_regions(vfu_ctx->dma);
+static void
+reset_function(vfu_ctx_t *vfu_ctx)
+{
+    if (vfu_ctx->reset != NULL) {
+        vfu_ctx->reset(vfu_ctx, VFU_RESET_LOST_CONN);
     }
 
     if (vfu_ctx->irqs != NULL) {
         irqs_reset(vfu_ctx);
     }
+}
+
+static void
+vfu_reset_ctx(vfu_ctx_t *vfu_ctx, const char *reason)
+{
+    int i;
+
+    vfu_log(vfu_ctx, LOG_INFO, "%s: %s", __func__,  reason);
+
+    if (vfu_ctx->workers != NULL) {
+        workers_wait_idle(vfu_ctx->workers);
+    }
+
+    /* Functions go first, as they might still be using DMA regions. */
+    if (vfu_ctx->sriov.off != 0) {
+        sriov_reset(vfu_ctx);
+    }
+    for (i = 0; i < vfu_ctx->sriov.total_vfs; i++) {
+        if (vfu_ctx->sriov.vfs[i] != NULL) {
+            reset_function(vfu_ctx->sriov.vfs[i]);
+        }
+    }
+    for (i = 1; i < VFU_PCI_MAX_FUNCTIONS; i++) {
+        if (vfu_ctx->functions[i] != NULL) {
+            reset_function(vfu_ctx->functions[i]);
+        }
+    }
+    reset_function(vfu_ctx);
+
+    if (vfu_ctx->dma != NULL) {
+        dma_controller_remove_regions(vfu_ctx->dma);
+    }
 
     if (vfu_ctx->tran->detach != NULL) {
         vfu_ctx->tran->detach(vfu_ctx);
     }
+
+    /* Requests waiting for the client fail. */
+    if (vfu_ctx->co != NULL) {
+        co_cancel(vfu_ctx->co);
+    }
+}
+
+static void
+destroy_function(vfu_ctx_t *vfu_ctx)
+{
+    vfu_ctx_t *parent = vfu_ctx->parent;
+    int i;
+
+    for (i = 1; i < VFU_PCI_MAX_FUNCTIONS; i++) {
+        if (parent->functions[i] == vfu_ctx) {
+            parent->functions[i] = NULL;
+        }
+    }
+    for (i = 0; i < parent->sriov.total_vfs; i++) {
+        if (parent->sriov.vfs[i] == vfu_ctx) {
+            parent->sriov.vfs[i] = NULL;
+        }
+    }
+
+    info_cache_free(vfu_ctx);
+    free(vfu_ctx->pci.config_space);
+    if (!vfu_ctx_is_vf(vfu_ctx)) {
+        free_sparse_mmap_areas(vfu_ctx);
+        free(vfu_ctx->reg_info);
+    }
+    free(vfu_ctx->irqs);
+    free(vfu_ctx);
 }
 
 void
 vfu_destroy_ctx(vfu_ctx_t *vfu_ctx)
 {
+    int i;
 
     if (vfu_ctx == NULL) {
         return;
     }
 
+    if (vfu_ctx->parent != NULL) {
+        reset_function(vfu_ctx);
+        destroy_function(vfu_ctx);
+        return;
+    }
+
     vfu_reset_ctx(vfu_ctx, "destroyed");
+    workers_destroy(vfu_ctx->workers);
+
+    for (i = 1; i < VFU_PCI_MAX_FUNCTIONS; i++) {
+        if (vfu_ctx->functions[i] != NULL) {
+            destroy_function(vfu_ctx->functions[i]);
+        }
+    }
+    for (i = 0; i < vfu_ctx->sriov.total_vfs; i++) {
+        if (vfu_ctx->sriov.vfs[i] != NULL) {
+            destroy_function(vfu_ctx->sriov.vfs[i]);
+        }
+    }
+    free(vfu_ctx->sriov.vfs);
+    free(vfu_ctx->sriov.vf_reg_info);
 
+    info_cache_free(vfu_ctx);
     free(vfu_ctx->uuid);
     free(vfu_ctx->pci.config_space);
 
@@ -1149,10 +2108,21 @@ vfu_destroy_ctx(vfu_ctx_t *vfu_ctx)
     if (vfu_ctx->dma != NULL) {
         dma_controller_destroy(vfu_ctx->dma);
     }
-    free_sparse_mmap_areas(vfu_ctx);
-    free(vfu_ctx->reg_info);
+
+    /* The template owns the regions, and must outlive its clones. */
+    assert(vfu_ctx->nr_clones == 0);
+    if (vfu_ctx->tmpl != NULL) {
+        vfu_ctx->tmpl->nr_clones--;
+    } else {
+        free_sparse_mmap_areas(vfu_ctx);
+        free(vfu_ctx->reg_info);
+    }
     free(vfu_ctx->migration);
     free(vfu_ctx->irqs);
+    co_sched_destroy(vfu_ctx->co);
+    free(vfu_ctx->rate_limit);
+    pthread_cond_destroy(&vfu_ctx->send_cond);
+    pthread_mutex_destroy(&vfu_ctx->send_lock);
     free(vfu_ctx);
     // FIXME: Maybe close any open irq efds? Unmap stuff?
 }
@@ -1175,7 +2145,7 @@ vfu_create_ctx(vfu_trans_t trans, const char *path, int flags, void *pvt,
 
     //FIXME: Validate arguments.
 
-    if (trans != VFU_TRANS_SOCK) {
+    if (trans != VFU_TRANS_SOCK && trans != VFU_TRANS_TCP) {
         return ERROR_PTR(ENOTSUP);
     }
 
@@ -1187,13 +2157,17 @@ vfu_create_ctx(vfu_trans_t trans, const char *path, int flags, void *pvt,
     if (vfu_ctx == NULL) {
         return ERROR_PTR(ENOMEM);
     }
+    pthread_mutex_init(&vfu_ctx->send_lock, NULL);
+    pthread_cond_init(&vfu_ctx->send_cond, NULL);
 
     vfu_ctx->dev_type = dev_type;
+    vfu_ctx->trans = trans;
     vfu_ctx->tran = &tran_sock_ops;
     vfu_ctx->tran_data = NULL;
     vfu_ctx->pvt = pvt;
     vfu_ctx->flags = flags;
     vfu_ctx->log_level = LOG_ERR;
+    vfu_ctx->max_msg_size = VFIO_USER_DEFAULT_MAX_MSG_SIZE;
 
     vfu_ctx->uuid = strdup(path);
     if (vfu_ctx->uuid == NULL) {
@@ -1201,6 +2175,14 @@ vfu_create_ctx(vfu_trans_t trans, const char *path, int flags, void *pvt,
         goto err_out;
     }
 
+    if (flags & LIBVFIO_USER_FLAG_COROUTINES) {
+        vfu_ctx->co = co_sched_create();
+        if (vfu_ctx->co == NULL) {
+            err = -errno;
+            goto err_out;
+        }
+    }
+
     /*
      * FIXME: Now we always allocate for migration region. Check if its better
      * to seperate migration region from standard regions in vfu_ctx.reg_info
@@ -1238,7 +2220,267 @@ vfu_create_ctx(vfu_trans_t trans, const char *path, int flags, void *pvt,
 err_out:
     vfu_destroy_ctx(vfu_ctx);
 
-    return ERROR_PTR(-err);
+    return ERROR_PTR(-err);
+}
+
+/*
+ * The clone shares the regions of @tmpl, and gets its own copy of the rest of
+ * the device setup.
+ */
+vfu_ctx_t *
+vfu_clone_ctx(vfu_ctx_t *tmpl, const char *path, int flags, void *pvt)
+{
+    vfu_ctx_t *vfu_ctx;
+    size_t cfg_size;
+    int i;
+
+    assert(tmpl != NULL);
+
+    if (!tmpl->realized || tmpl->parent != NULL || tmpl->tmpl != NULL ||
+        tmpl->migration != NULL || tmpl->sriov.off != 0) {
+        return ERROR_PTR(EINVAL);
+    }
+
+    for (i = 1; i < VFU_PCI_MAX_FUNCTIONS; i++) {
+        if (tmpl->functions[i] != NULL) {
+            return ERROR_PTR(EINVAL);
+        }
+    }
+
+    /* Doorbells are per device state. */
+    for (i = 0; i < (int)tmpl->nr_regions; i++) {
+        if (tmpl->reg_info[i].doorbells != NULL) {
+            return ERROR_PTR(EINVAL);
+        }
+    }
+
+    vfu_ctx = vfu_create_ctx(tmpl->trans, path, flags, pvt, tmpl->dev_type);
+    if (vfu_ctx == NULL) {
+        return NULL;
+    }
+
+    free(vfu_ctx->reg_info);
+    vfu_ctx->reg_info = tmpl->reg_info;
+    vfu_ctx->nr_regions = tmpl->nr_regions;
+    vfu_ctx->tmpl = tmpl;
+    tmpl->nr_clones++;
+
+    vfu_ctx->log = tmpl->log;
+    vfu_ctx->log_level = tmpl->log_level;
+    vfu_ctx->reset = tmpl->reset;
+    memcpy(vfu_ctx->irq_count, tmpl->irq_count, sizeof(vfu_ctx->irq_count));
+
+    /* Capabilities are placed already, so the config space is copied as is. */
+    cfg_size = tmpl->reg_info[VFU_PCI_DEV_CFG_REGION_IDX].size;
+    vfu_ctx->pci = tmpl->pci;
+    vfu_ctx->pci.config_space = malloc(cfg_size);
+    if (vfu_ctx->pci.config_space == NULL) {
+        goto err_out;
+    }
+    memcpy(vfu_ctx->pci.config_space, tmpl->pci.config_space, cfg_size);
+
+    if (tmpl->dma != NULL) {
+        if (vfu_setup_device_dma(vfu_ctx, tmpl->dma_register,
+                                 tmpl->dma_unregister) < 0) {
+            goto err_out;
+        }
+        vfu_ctx->dma->group = tmpl->dma->group;
+        if (tmpl->dma->iommu != NULL && vfu_setup_device_iommu(vfu_ctx) < 0) {
+            goto err_out;
+        }
+    }
+
+    if (vfu_realize_ctx(vfu_ctx) < 0) {
+        goto err_out;
+    }
+
+    return vfu_ctx;
+
+err_out:
+    i = errno;
+    vfu_destroy_ctx(vfu_ctx);
+    return ERROR_PTR(i);
+}
+
+/*
+ * Allocates the context of a function served through function 0 @vfu_ctx. If
+ * @reg_info is NULL, the function gets its own regions.
+ */
+static vfu_ctx_t *
+function_ctx_create(vfu_ctx_t *vfu_ctx, void *pvt, vfu_reg_info_t *reg_info)
+{
+    vfu_ctx_t *fn_ctx;
+    size_t i;
+
+    fn_ctx = calloc(1, sizeof(vfu_ctx_t));
+    if (fn_ctx == NULL) {
+        return NULL;
+    }
+
+    fn_ctx->parent = vfu_ctx;
+    fn_ctx->dev_type = vfu_ctx->dev_type;
+    fn_ctx->pvt = pvt;
+    fn_ctx->flags = vfu_ctx->flags;
+    fn_ctx->log = vfu_ctx->log;
+    fn_ctx->log_level = vfu_ctx->log_level;
+    fn_ctx->dma = vfu_ctx->dma;
+
+    fn_ctx->nr_regions = VFU_PCI_DEV_NUM_REGIONS;
+    fn_ctx->reg_info = reg_info;
+    if (reg_info == NULL) {
+        fn_ctx->reg_info = calloc(fn_ctx->nr_regions,
+                                  sizeof(*fn_ctx->reg_info));
+        if (fn_ctx->reg_info == NULL) {
+            free(fn_ctx);
+            return NULL;
+        }
+        for (i = 0; i < fn_ctx->nr_regions; i++) {
+            fn_ctx->reg_info[i].fd = -1;
+        }
+    }
+
+    fn_ctx->irq_count[VFU_DEV_ERR_IRQ] = 1;
+    fn_ctx->irq_count[VFU_DEV_REQ_IRQ] = 1;
+
+    return fn_ctx;
+}
+
+vfu_ctx_t *
+vfu_create_function(vfu_ctx_t *vfu_ctx, uint8_t fn, void *pvt)
+{
+    vfu_ctx_t *fn_ctx;
+
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->parent != NULL || vfu_ctx->realized || fn == 0 ||
+        fn >= VFU_PCI_MAX_FUNCTIONS) {
+        return ERROR_PTR(EINVAL);
+    }
+
+    if (vfu_ctx->functions[fn] != NULL) {
+        return ERROR_PTR(EEXIST);
+    }
+
+    fn_ctx = function_ctx_create(vfu_ctx, pvt, NULL);
+    if (fn_ctx == NULL) {
+        return ERROR_PTR(ENOMEM);
+    }
+
+    fn_ctx->rid = fn;
+    vfu_ctx->functions[fn] = fn_ctx;
+
+    return fn_ctx;
+}
+
+vfu_ctx_t *
+vfu_create_vf(vfu_ctx_t *vfu_ctx, uint16_t vf_idx, void *pvt)
+{
+    struct sriovcap *sriov;
+    vfu_pci_hdr_t *pf_hdr;
+    vfu_pci_hdr_t *hdr;
+    vfu_ctx_t *vf;
+
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->parent != NULL || vfu_ctx->sriov.off == 0 ||
+        vf_idx >= vfu_ctx->sriov.total_vfs) {
+        return ERROR_PTR(EINVAL);
+    }
+
+    if (vfu_ctx->sriov.vfs[vf_idx] != NULL) {
+        return ERROR_PTR(EEXIST);
+    }
+
+    vf = function_ctx_create(vfu_ctx, pvt, vfu_ctx->sriov.vf_reg_info);
+    if (vf == NULL) {
+        return ERROR_PTR(ENOMEM);
+    }
+
+    if (vfu_pci_init(vf, vfu_ctx->pci.type, PCI_HEADER_TYPE_NORMAL, 0) < 0) {
+        free(vf);
+        return NULL;
+    }
+
+    /* VFs are identified through the SR-IOV capability of the PF instead. */
+    pf_hdr = &vfu_ctx->pci.config_space->hdr;
+    hdr = &vf->pci.config_space->hdr;
+    hdr->id.vid = 0xffff;
+    hdr->id.did = 0xffff;
+    hdr->rid = pf_hdr->rid;
+    hdr->cc = pf_hdr->cc;
+    hdr->ss = pf_hdr->ss;
+
+    /* ext_cap_setup_sriov() checked that it fits. */
+    sriov = (void *)pci_config_space_ptr(vfu_ctx, vfu_ctx->sriov.off);
+    vf->rid = sriov->vf_offset + vf_idx * sriov->vf_stride;
+    vfu_ctx->sriov.vfs[vf_idx] = vf;
+
+    return vf;
+}
+
+int
+vfu_setup_device_sriov_cb(vfu_ctx_t *vfu_ctx, vfu_sriov_cb_t *sriov)
+{
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->parent != NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    vfu_ctx->sriov.cb = sriov;
+    return 0;
+}
+
+int
+vfu_setup_vf_region(vfu_ctx_t *vfu_ctx, int region_idx, size_t size,
+                    vfu_region_access_cb_t *region_access, int flags)
+{
+    vfu_reg_info_t *reg;
+
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->parent != NULL || vfu_ctx->sriov.off == 0 ||
+        region_idx < VFU_PCI_DEV_BAR0_REGION_IDX ||
+        region_idx > VFU_PCI_DEV_BAR5_REGION_IDX ||
+        !(flags & VFU_REGION_FLAG_MEM) || size == 0 ||
+        (size & (size - 1)) != 0 || size > (1UL << 31)) {
+        return ERROR_INT(EINVAL);
+    }
+
+    reg = &vfu_ctx->sriov.vf_reg_info[region_idx];
+    reg->flags = flags;
+    reg->size = size;
+    reg->cb = region_access;
+
+    return 0;
+}
+
+int
+sriov_set_vf_enable(vfu_ctx_t *vfu_ctx, uint16_t num_vfs)
+{
+    struct vfu_sriov *sriov = &vfu_ctx->sriov;
+    uint16_t i;
+
+    if (sriov->cb != NULL && sriov->cb(vfu_ctx, num_vfs) < 0) {
+        return -errno;
+    }
+
+    if (num_vfs == 0) {
+        for (i = 0; i < sriov->nr_vfs; i++) {
+            if (sriov->vfs[i] != NULL) {
+                reset_function(sriov->vfs[i]);
+            }
+        }
+    } else {
+        for (i = 0; i < num_vfs; i++) {
+            if (sriov->vfs[i] != NULL && vfu_realize_ctx(sriov->vfs[i]) < 0) {
+                return -errno;
+            }
+        }
+    }
+
+    sriov->nr_vfs = num_vfs;
+    return 0;
 }
 
 int
@@ -1247,6 +2489,10 @@ vfu_attach_ctx(vfu_ctx_t *vfu_ctx)
 
     assert(vfu_ctx != NULL);
 
+    if (vfu_ctx->parent != NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
     return vfu_ctx->tran->attach(vfu_ctx);
 }
 
@@ -1256,6 +2502,10 @@ vfu_get_poll_fd(vfu_ctx_t *vfu_ctx)
 
     assert(vfu_ctx != NULL);
 
+    if (vfu_ctx->parent != NULL) {
+        vfu_ctx = vfu_ctx->parent;
+    }
+
     return vfu_ctx->tran->get_poll_fd(vfu_ctx);
 }
 
@@ -1339,6 +2589,12 @@ vfu_setup_region(vfu_ctx_t *vfu_ctx, int region_idx, size_t size,
 
     assert(vfu_ctx != NULL);
 
+    /* VF and clone regions are shared, see vfu_setup_vf_region(). */
+    if (vfu_ctx_is_vf(vfu_ctx) || vfu_ctx->tmpl != NULL ||
+        vfu_ctx->nr_clones > 0) {
+        return ERROR_INT(EINVAL);
+    }
+
     if ((mmap_areas == NULL) != (nr_mmap_areas == 0) ||
         (mmap_areas != NULL && fd == -1)) {
         vfu_log(vfu_ctx, LOG_ERR, "invalid mappable region arguments");
@@ -1372,8 +2628,20 @@ vfu_setup_region(vfu_ctx_t *vfu_ctx, int region_idx, size_t size,
         }
     }
 
+    /* The client can't be passed the fd to map the region with. */
+    if (vfu_ctx->trans == VFU_TRANS_TCP && fd != -1) {
+        vfu_log(vfu_ctx, LOG_DEBUG, "region %d is not mappable over TCP",
+                region_idx);
+        mmap_areas = NULL;
+        nr_mmap_areas = 0;
+        fd = -1;
+    }
+
     reg = &vfu_ctx->reg_info[region_idx];
 
+    /* Region info is no longer fixed. */
+    info_cache_free(vfu_ctx);
+
     reg->flags = flags;
     reg->size = size;
     reg->cb = cb;
@@ -1414,6 +2682,25 @@ out:
     return 0;
 }
 
+int
+vfu_setup_region_workers(vfu_ctx_t *vfu_ctx, unsigned int nr_workers)
+{
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->parent != NULL || vfu_ctx->realized) {
+        return ERROR_INT(EINVAL);
+    }
+    if (vfu_ctx->workers != NULL) {
+        return ERROR_INT(EEXIST);
+    }
+
+    vfu_ctx->workers = workers_create(nr_workers);
+    if (vfu_ctx->workers == NULL) {
+        return ERROR_INT(errno);
+    }
+    return 0;
+}
+
 int
 vfu_setup_device_reset_cb(vfu_ctx_t *vfu_ctx, vfu_reset_cb_t *reset)
 {
@@ -1426,21 +2713,85 @@ int
 vfu_setup_device_dma(vfu_ctx_t *vfu_ctx, vfu_dma_register_cb_t *dma_register,
                      vfu_dma_unregister_cb_t *dma_unregister)
 {
+    int i;
 
     assert(vfu_ctx != NULL);
 
+    if (vfu_ctx->parent != NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
     // Create the internal DMA controller.
     vfu_ctx->dma = dma_controller_create(vfu_ctx, VFU_DMA_REGIONS);
     if (vfu_ctx->dma == NULL) {
         return ERROR_INT(ENOMEM);
     }
 
+    for (i = 1; i < VFU_PCI_MAX_FUNCTIONS; i++) {
+        if (vfu_ctx->functions[i] != NULL) {
+            vfu_ctx->functions[i]->dma = vfu_ctx->dma;
+        }
+    }
+
     vfu_ctx->dma_register = dma_register;
     vfu_ctx->dma_unregister = dma_unregister;
 
     return 0;
 }
 
+int
+vfu_setup_device_iommu(vfu_ctx_t *vfu_ctx)
+{
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->dma == NULL || vfu_ctx->parent != NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (vfu_ctx->dma->iommu != NULL) {
+        return 0;
+    }
+
+    vfu_ctx->dma->iommu = iommu_create(vfu_ctx);
+    if (vfu_ctx->dma->iommu == NULL) {
+        return ERROR_INT(ENOMEM);
+    }
+
+    return 0;
+}
+
+int
+vfu_setup_dma_copy_threshold(vfu_ctx_t *vfu_ctx, size_t threshold)
+{
+    assert(vfu_ctx != NULL);
+
+    /* Functions use the DMA controller of function 0. */
+    if (vfu_ctx->parent != NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    vfu_ctx->dma_copy_threshold = threshold;
+    return 0;
+}
+
+int
+vfu_setup_device_dma_group(vfu_ctx_t *vfu_ctx, vfu_dma_group_t *group)
+{
+    assert(vfu_ctx != NULL);
+    assert(group != NULL);
+
+    if (vfu_ctx->dma == NULL || vfu_ctx->parent != NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (vfu_ctx->dma->nregions != 0) {
+        return ERROR_INT(EBUSY);
+    }
+
+    vfu_ctx->dma->group = group;
+    return 0;
+}
+
 int
 vfu_setup_device_nr_irqs(vfu_ctx_t *vfu_ctx, enum vfu_dev_irq_type type,
                          uint32_t count)
@@ -1454,6 +2805,7 @@ vfu_setup_device_nr_irqs(vfu_ctx_t *vfu_ctx, enum vfu_dev_irq_type type,
     }
 
     vfu_ctx->irq_count[type] = count;
+    info_cache_free(vfu_ctx);
 
     return 0;
 }
@@ -1468,7 +2820,7 @@ vfu_setup_device_migration_callbacks(vfu_ctx_t *vfu_ctx,
     assert(vfu_ctx != NULL);
     assert(callbacks != NULL);
 
-    if (vfu_ctx->migr_reg == NULL) {
+    if (vfu_ctx->migr_reg == NULL || vfu_ctx->parent != NULL) {
         vfu_log(vfu_ctx, LOG_ERR, "no device migration region");
         return ERROR_INT(EINVAL);
     }
@@ -1508,6 +2860,35 @@ vfu_addr_to_sg(vfu_ctx_t *vfu_ctx, vfu_dma_addr_t dma_addr,
     return dma_addr_to_sg(vfu_ctx->dma, dma_addr, len, sg, max_sg, prot);
 }
 
+int
+vfu_addr_to_sg_batch(vfu_ctx_t *vfu_ctx, const vfu_dma_range_t *in, int n,
+                     dma_sg_t *sg, int *errs)
+{
+    assert(vfu_ctx != NULL);
+
+    if (unlikely(vfu_ctx->dma == NULL)) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (n < 0 || (n > 0 && (in == NULL || sg == NULL || errs == NULL))) {
+        return ERROR_INT(EINVAL);
+    }
+
+    return dma_addr_to_sg_batch(vfu_ctx->dma, in, n, sg, errs);
+}
+
+const vfu_dma_table_t *
+vfu_get_dma_table(vfu_ctx_t *vfu_ctx)
+{
+    assert(vfu_ctx != NULL);
+
+    if (unlikely(vfu_ctx->dma == NULL)) {
+        return ERROR_PTR(EINVAL);
+    }
+
+    return &vfu_ctx->dma->table;
+}
+
 int
 vfu_map_sg(vfu_ctx_t *vfu_ctx, const dma_sg_t *sg,
 	       struct iovec *iov, int cnt)
@@ -1535,80 +2916,380 @@ vfu_unmap_sg(vfu_ctx_t *vfu_ctx, const dma_sg_t *sg, struct iovec *iov, int cnt)
     return dma_unmap_sg(vfu_ctx->dma, sg, iov, cnt);
 }
 
-int
-vfu_dma_read(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, void *data)
+/*
+ * Server-initiated DMA is split into chunks that fit in the negotiated maximum
+ * message size. Up to DMA_MAX_CHUNKS_IN_FLIGHT chunks are outstanding at any
+ * time: the client may complete them in any order, and replies are matched to
+ * their chunk by message ID.
+ */
+#define DMA_MAX_CHUNKS_IN_FLIGHT 16
+
+static size_t
+dma_chunk_size(vfu_ctx_t *vfu_ctx)
+{
+    return vfu_ctx->max_msg_size - sizeof(struct vfio_user_header) -
+           sizeof(struct vfio_user_dma_region_access);
+}
+
+static int
+dma_send_chunk(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, char *data, bool is_write,
+               uint16_t msg_id, size_t offset)
 {
-    struct vfio_user_dma_region_access *dma_recv;
     struct vfio_user_dma_region_access dma_send;
-    int recv_size;
-    int msg_id = 1, ret;
+    /* [0] is for the header. */
+    struct iovec iovecs[3] = { { 0 } };
+    struct send_req req = { 0 };
+    size_t nr_iovecs = 2;
+
+    dma_send.addr = (uint64_t)sg->dma_addr + sg->offset + offset;
+    dma_send.count = MIN(dma_chunk_size(vfu_ctx), sg->length - offset);
+
+    iovecs[1].iov_base = &dma_send;
+    iovecs[1].iov_len = sizeof(dma_send);
+
+    if (is_write) {
+        iovecs[2].iov_base = data + offset;
+        iovecs[2].iov_len = dma_send.count;
+        nr_iovecs++;
+    }
+
+    req.msg_id = msg_id;
+    req.cmd = is_write ? VFIO_USER_DMA_WRITE : VFIO_USER_DMA_READ;
+    req.iovecs = iovecs;
+    req.nr_iovecs = nr_iovecs;
+
+    return send_msg(vfu_ctx, &req);
+}
+
+/*
+ * Returns 0 on success, EPROTO if the reply doesn't match the chunk it
+ * completes, or -EINVAL if its size is wrong.
+ */
+static int
+dma_recv_chunk(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, char *data, bool is_write,
+               const struct vfio_user_header *hdr, const char *body,
+               size_t offset)
+{
+    struct vfio_user_dma_region_access dma_recv;
+    size_t body_size = hdr->msg_size - sizeof(*hdr);
+    uint64_t addr;
+    size_t count;
+
+    addr = (uint64_t)sg->dma_addr + sg->offset + offset;
+    count = MIN(dma_chunk_size(vfu_ctx), sg->length - offset);
+
+    if (body_size != sizeof(dma_recv) + (is_write ? 0 : count)) {
+        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: bad size: expected=%zu, "
+                "actual=%zu", hdr->msg_id,
+                sizeof(dma_recv) + (is_write ? 0 : count), body_size);
+        return -EINVAL;
+    }
+
+    memcpy(&dma_recv, body, sizeof(dma_recv));
+    if (!is_write) {
+        memcpy(data + offset, body + sizeof(dma_recv), count);
+    }
+
+    /* Some clients leave the count of DMA write replies at zero. */
+    if (dma_recv.addr != addr ||
+        (dma_recv.count != count && (!is_write || dma_recv.count != 0))) {
+        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: bad DMA reply: expected=%#lx-%zu, "
+                "actual=%#lx-%u", hdr->msg_id, addr, count, dma_recv.addr,
+                dma_recv.count);
+        return EPROTO;
+    }
+
+    return 0;
+}
+
+/*
+ * Receives the reply to one of the @nr commands whose message IDs start at
+ * @first_id, which are among those of @wait, and its body. In a coroutine, the
+ * request waits for vfu_run_ctx() to receive it.
+ */
+static int
+get_reply(vfu_ctx_t *vfu_ctx, struct reply_wait *wait, uint16_t first_id,
+          size_t nr, struct vfio_user_header *hdr, void **datap)
+{
+    if (vfu_ctx->co != NULL && co_self(vfu_ctx->co)) {
+        return co_wait_reply(vfu_ctx->co, first_id, nr, hdr, datap);
+    }
+
+    return vfu_ctx->tran->get_reply(vfu_ctx, wait, hdr, datap);
+}
+
+/*
+ * Returns 0 on success, an errno reported by the client if it failed one of
+ * the chunks or replied with something else, or -errno if talking to the
+ * client failed, in which case the connection is no longer usable. The replies
+ * to all chunks sent are received before returning, unless the latter.
+ */
+static int
+dma_transfer_chunks(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, char *data,
+                    bool is_write, struct reply_wait *wait)
+{
+    bool done[DMA_MAX_CHUNKS_IN_FLIGHT] = { false };
+    size_t chunk_size = dma_chunk_size(vfu_ctx);
+    size_t nr_chunks = wait->nr;
+    uint16_t first_id = wait->first_id;
+    size_t head = 0; /* oldest chunk that hasn't completed */
+    size_t tail = 0; /* next chunk to send */
+    int err = 0;
+    int ret;
+
+    while (head < nr_chunks) {
+        struct vfio_user_header hdr;
+        void *body = NULL;
+        size_t idx;
+
+        /* Stop issuing new chunks once the client has failed one. */
+        while (err == 0 && tail < nr_chunks &&
+               tail - head < DMA_MAX_CHUNKS_IN_FLIGHT) {
+            ret = dma_send_chunk(vfu_ctx, sg, data, is_write,
+                                 first_id + tail, tail * chunk_size);
+            if (ret < 0) {
+                return ret;
+            }
+            tail++;
+        }
+
+        if (head == tail) {
+            break;
+        }
+
+        ret = get_reply(vfu_ctx, wait, first_id + head, tail - head, &hdr,
+                        &body);
+        if (ret < 0) {
+            return ret;
+        }
+
+        idx = head + (uint16_t)(hdr.msg_id - (uint16_t)(first_id + head));
+        if (idx >= tail || done[idx % DMA_MAX_CHUNKS_IN_FLIGHT]) {
+            vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: unexpected DMA reply",
+                    hdr.msg_id);
+            free(body);
+            return -EPROTO;
+        }
+
+        if (hdr.flags.error == 1U) {
+            ret = hdr.error_no != 0 ? (int)hdr.error_no : EINVAL;
+        } else {
+            ret = dma_recv_chunk(vfu_ctx, sg, data, is_write, &hdr, body,
+                                 idx * chunk_size);
+        }
+        free(body);
+        if (ret < 0) {
+            return ret;
+        }
+        if (err == 0) {
+            err = ret;
+        }
+
+        done[idx % DMA_MAX_CHUNKS_IN_FLIGHT] = true;
+
+        while (head < tail && done[head % DMA_MAX_CHUNKS_IN_FLIGHT]) {
+            done[head % DMA_MAX_CHUNKS_IN_FLIGHT] = false;
+            head++;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * Outside of a coroutine, the replies are claimed before the first chunk is
+ * sent, so that they're kept for us whichever thread receives them, e.g.
+ * vfu_run_ctx() while a device thread does DMA.
+ */
+static int
+dma_transfer(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, char *data, bool is_write)
+{
+    size_t chunk_size = dma_chunk_size(vfu_ctx);
+    struct reply_wait wait = {
+        .nr = (sg->length + chunk_size - 1) / chunk_size
+    };
+    bool claim;
+    int ret;
+
+    wait.first_id = __atomic_fetch_add(&vfu_ctx->next_msg_id, wait.nr,
+                                       __ATOMIC_RELAXED);
+    rate_limit_charge(vfu_ctx, wait.nr, sg->length);
+
+    claim = vfu_ctx->tran->add_reply_wait != NULL &&
+            (vfu_ctx->co == NULL || !co_self(vfu_ctx->co));
+    if (claim) {
+        vfu_ctx->tran->add_reply_wait(vfu_ctx, &wait);
+    }
+
+    ret = dma_transfer_chunks(vfu_ctx, sg, data, is_write, &wait);
+
+    if (claim) {
+        vfu_ctx->tran->del_reply_wait(vfu_ctx, &wait);
+    }
+    return ret;
+}
+
+/*
+ * Copies directly to/from our own mapping of the client's memory, avoiding the
+ * round trip to the client. Returns -ENOENT if the sg isn't mapped locally.
+ */
+static int
+dma_transfer_direct(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, void *data,
+                    bool is_write)
+{
+    dma_controller_t *dma = vfu_ctx->dma;
+    dma_memory_region_t *region;
+    void *vaddr;
+
+    vaddr = dma_sg_vaddr(dma, sg);
+    if (vaddr == NULL) {
+        return -ENOENT;
+    }
+    region = &dma->regions[sg->region];
+
+    if (!is_write) {
+        memcpy(data, vaddr, sg->length);
+        return 0;
+    }
+
+    if (!(region->info.prot & PROT_WRITE)) {
+        return -EACCES;
+    }
+    dma_copy_to_client(vaddr, data, sg->length, vfu_ctx->dma_copy_threshold);
+    if (_dma_should_mark_dirty(dma, PROT_WRITE)) {
+        _dma_mark_dirty(dma, region, sg);
+    }
+    return 0;
+}
+
+static int
+vfu_dma_transfer(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, void *data, bool is_write)
+{
+    int ret;
 
     assert(vfu_ctx != NULL);
     assert(sg != NULL);
 
-    recv_size = sizeof(*dma_recv) + sg->length;
+    /* Messages for all functions go over the connection of function 0. */
+    if (vfu_ctx->parent != NULL) {
+        vfu_ctx = vfu_ctx->parent;
+    }
 
-    dma_recv = calloc(recv_size, 1);
-    if (dma_recv == NULL) {
-        return ERROR_INT(ENOMEM);
+    if (sg->mappable) {
+        ret = dma_transfer_direct(vfu_ctx, sg, data, is_write);
+        if (ret != -ENOENT) {
+            return ret < 0 ? ERROR_INT(-ret) : 0;
+        }
     }
 
-    dma_send.addr = (uint64_t)sg->dma_addr;
-    dma_send.count = sg->length;
-    ret = vfu_ctx->tran->send_msg(vfu_ctx, msg_id, VFIO_USER_DMA_READ,
-                                  &dma_send, sizeof(dma_send), NULL,
-                                  dma_recv, recv_size);
+    ret = dma_transfer(vfu_ctx, sg, data, is_write);
 
-    if (ret == -ENOMSG) {
-        vfu_reset_ctx(vfu_ctx, "closed");
-        ret = -ENOTCONN;
-    } else if (ret == -ECONNRESET) {
-        vfu_reset_ctx(vfu_ctx, "reset");
+    /*
+     * Replies may be left unread, so the connection can't be used for anything
+     * else any more. A worker leaves the reset to vfu_run_ctx(), which waits
+     * for it.
+     */
+    if (ret < 0 && ret != -ENOTCONN) {
+        const char *reason = "DMA transfer failed";
+
+        if (ret == -ENOMSG) {
+            reason = "closed";
+        } else if (ret == -ECONNRESET) {
+            reason = "reset";
+        } else {
+            vfu_log(vfu_ctx, LOG_ERR, "DMA transfer failed: %s",
+                    strerror(-ret));
+        }
+        if (!workers_self()) {
+            vfu_reset_ctx(vfu_ctx, reason);
+        }
         ret = -ENOTCONN;
-    } else if (ret == 0) {
-        /* FIXME no need for memcpy */
-        memcpy(data, dma_recv->data, sg->length);
+    } else if (ret > 0) {
+        ret = -ret;
     }
 
-    free(dma_recv);
-
     return ret < 0 ? ERROR_INT(-ret) : 0;
 }
 
+int
+vfu_dma_read(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, void *data)
+{
+    return vfu_dma_transfer(vfu_ctx, sg, data, false);
+}
+
 int
 vfu_dma_write(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, void *data)
 {
-    struct vfio_user_dma_region_access *dma_send, dma_recv;
-    int send_size = sizeof(*dma_send) + sg->length;
-    int msg_id = 1, ret;
+    return vfu_dma_transfer(vfu_ctx, sg, data, true);
+}
+
+int
+vfu_yield(vfu_ctx_t *vfu_ctx)
+{
+    int ret;
 
     assert(vfu_ctx != NULL);
-    assert(sg != NULL);
 
-    dma_send = calloc(send_size, 1);
-    if (dma_send == NULL) {
-        return ERROR_INT(ENOMEM);
+    if (vfu_ctx->parent != NULL) {
+        vfu_ctx = vfu_ctx->parent;
     }
-    dma_send->addr = (uint64_t)sg->dma_addr;
-    dma_send->count = sg->length;
-    memcpy(dma_send->data, data, sg->length); /* FIXME no need to copy! */
-    ret = vfu_ctx->tran->send_msg(vfu_ctx, msg_id, VFIO_USER_DMA_WRITE,
-                                  dma_send, send_size, NULL,
-                                  &dma_recv, sizeof(dma_recv));
 
-    if (ret == -ENOMSG) {
-        vfu_reset_ctx(vfu_ctx, "closed");
-        ret = -ENOTCONN;
-    } else if (ret == -ECONNRESET) {
-        vfu_reset_ctx(vfu_ctx, "reset");
-        ret = -ENOTCONN;
+    if (vfu_ctx->co == NULL || !co_self(vfu_ctx->co)) {
+        return ERROR_INT(EINVAL);
     }
 
-    free(dma_send);
-
+    ret = co_yield(vfu_ctx->co);
     return ret < 0 ? ERROR_INT(-ret) : 0;
 }
 
+static int
+vfu_sg_copy(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, int cnt, char *data, size_t len,
+            bool is_write)
+{
+    size_t total = 0;
+    int i;
+
+    assert(vfu_ctx != NULL);
+
+    if (cnt < 0 || (sg == NULL && cnt > 0)) {
+        return ERROR_INT(EINVAL);
+    }
+
+    for (i = 0; i < cnt; i++) {
+        total += sg[i].length;
+    }
+    if (len > total) {
+        return ERROR_INT(EINVAL);
+    }
+
+    for (i = 0; i < cnt && len > 0; i++) {
+        dma_sg_t part = sg[i];
+
+        part.length = MIN((size_t)part.length, len);
+        if (vfu_dma_transfer(vfu_ctx, &part, data, is_write) < 0) {
+            return -1;
+        }
+        data += part.length;
+        len -= part.length;
+    }
+
+    return 0;
+}
+
+int
+vfu_sg_copy_to(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, int cnt, const void *src,
+               size_t len)
+{
+    return vfu_sg_copy(vfu_ctx, sg, cnt, (char *)src, len, true);
+}
+
+int
+vfu_sg_copy_from(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, int cnt, void *dst,
+                 size_t len)
+{
+    return vfu_sg_copy(vfu_ctx, sg, cnt, dst, len, false);
+}
+
 uint64_t
 vfu_region_to_offset(uint32_t region)
 {
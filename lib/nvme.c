@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2020 Nutanix Inc. All rights reserved.
+ *
+ * Authors: Thanos Makatos <thanos@nutanix.com>
+ *          Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *          Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * NVMe submission and completion queue processing over guest DMA memory.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dma.h"
+#include "private.h"
+
+/* Completion queue entry, NVMe 1.4 figure 124. */
+struct nvme_cqe {
+    uint32_t dw0;
+    uint32_t dw1;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;            /* bit 0 is the phase tag */
+};
+
+enum {
+    NVME_MAP_SQ,
+    NVME_MAP_CQ,
+    NVME_MAP_SQ_DB,             /* shadow SQ tail doorbell */
+    NVME_MAP_CQ_DB,             /* shadow CQ head doorbell */
+    NVME_MAP_SQ_EI,             /* SQ EventIdx */
+    NVME_MAP_CQ_EI,             /* CQ EventIdx */
+    NVME_MAP_MAX
+};
+
+struct vfu_nvme_qp {
+    vfu_ctx_t *vfu_ctx;
+    vfu_nvme_qp_info_t info;
+
+    dma_sg_t sgs[NVME_MAP_MAX];
+    bool mapped[NVME_MAP_MAX];
+    char *sq;
+    struct nvme_cqe *cq;
+    uint32_t *sq_db;
+    uint32_t *cq_db;
+    uint32_t *sq_ei;
+    uint32_t *cq_ei;
+
+    uint16_t sq_head;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint16_t cq_tail;
+    bool phase;
+    /* Triggering the interrupt failed, it's retried by the next completion. */
+    bool irq_pending;
+};
+
+static int
+nvme_qp_map(vfu_nvme_qp_t *qp, int idx, vfu_dma_addr_t addr, size_t len,
+            int prot, void **vaddr)
+{
+    int ret;
+
+    ret = dma_map_addr(qp->vfu_ctx->dma, addr, len, prot, &qp->sgs[idx],
+                       vaddr);
+    if (ret == 0) {
+        qp->mapped[idx] = true;
+    }
+    return ret;
+}
+
+static void
+nvme_qp_unmap(vfu_nvme_qp_t *qp, int first, int last)
+{
+    int i;
+
+    for (i = first; i <= last; i++) {
+        if (qp->mapped[i]) {
+            dma_unmap_sg(qp->vfu_ctx->dma, &qp->sgs[i], NULL, 1);
+            qp->mapped[i] = false;
+        }
+    }
+}
+
+static inline void
+nvme_qp_mark_dirty(vfu_nvme_qp_t *qp, int idx, const void *base, const void *p,
+                   size_t len)
+{
+    dma_sg_mark_dirty(qp->vfu_ctx->dma, &qp->sgs[idx],
+                      (const char *)p - (const char *)base, len);
+}
+
+vfu_nvme_qp_t *
+vfu_nvme_qp_create(vfu_ctx_t *vfu_ctx, const vfu_nvme_qp_info_t *info)
+{
+    vfu_nvme_qp_t *qp;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+    assert(info != NULL);
+
+    /* Queues need at least two entries, one of which always stays empty. */
+    if (vfu_ctx->dma == NULL || info->sq_size < 2 || info->cq_size < 2) {
+        return ERROR_PTR(EINVAL);
+    }
+
+    qp = calloc(1, sizeof(*qp));
+    if (qp == NULL) {
+        return ERROR_PTR(ENOMEM);
+    }
+    qp->vfu_ctx = vfu_ctx;
+    qp->info = *info;
+    qp->phase = true;
+
+    ret = nvme_qp_map(qp, NVME_MAP_SQ, info->sq_addr,
+                      (size_t)info->sq_size * VFU_NVME_SQE_SIZE, PROT_READ,
+                      (void **)&qp->sq);
+    if (ret == 0) {
+        ret = nvme_qp_map(qp, NVME_MAP_CQ, info->cq_addr,
+                          (size_t)info->cq_size * VFU_NVME_CQE_SIZE,
+                          PROT_READ | PROT_WRITE, (void **)&qp->cq);
+    }
+    if (ret < 0) {
+        vfu_nvme_qp_destroy(qp);
+        return ERROR_PTR(-ret);
+    }
+
+    return qp;
+}
+
+void
+vfu_nvme_qp_destroy(vfu_nvme_qp_t *qp)
+{
+    if (qp == NULL) {
+        return;
+    }
+
+    nvme_qp_unmap(qp, 0, NVME_MAP_MAX - 1);
+    free(qp);
+}
+
+int
+vfu_nvme_qp_set_shadow(vfu_nvme_qp_t *qp, vfu_dma_addr_t dbbuf,
+                       vfu_dma_addr_t eibuf, uint32_t stride)
+{
+    size_t sq_off, cq_off;
+    int ret;
+
+    assert(qp != NULL);
+
+    if (stride < sizeof(uint32_t)) {
+        return ERROR_INT(EINVAL);
+    }
+
+    /* Same layout as the doorbell registers, NVMe 1.4 section 3.1.24. */
+    sq_off = (size_t)2 * qp->info.qid * stride;
+    cq_off = sq_off + stride;
+
+    nvme_qp_unmap(qp, NVME_MAP_SQ_DB, NVME_MAP_CQ_EI);
+    ret = nvme_qp_map(qp, NVME_MAP_SQ_DB, dbbuf + sq_off, sizeof(uint32_t),
+                      PROT_READ, (void **)&qp->sq_db);
+    if (ret == 0) {
+        ret = nvme_qp_map(qp, NVME_MAP_CQ_DB, dbbuf + cq_off,
+                          sizeof(uint32_t), PROT_READ, (void **)&qp->cq_db);
+    }
+    if (ret == 0) {
+        ret = nvme_qp_map(qp, NVME_MAP_SQ_EI, eibuf + sq_off,
+                          sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                          (void **)&qp->sq_ei);
+    }
+    if (ret == 0) {
+        ret = nvme_qp_map(qp, NVME_MAP_CQ_EI, eibuf + cq_off,
+                          sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                          (void **)&qp->cq_ei);
+    }
+    if (ret < 0) {
+        nvme_qp_unmap(qp, NVME_MAP_SQ_DB, NVME_MAP_CQ_EI);
+        qp->sq_db = qp->cq_db = qp->sq_ei = qp->cq_ei = NULL;
+        return ERROR_INT(-ret);
+    }
+
+    /* Pick up where the doorbell registers left off. */
+    *qp->sq_ei = qp->sq_tail;
+    *qp->cq_ei = qp->cq_head;
+    nvme_qp_mark_dirty(qp, NVME_MAP_SQ_EI, qp->sq_ei, qp->sq_ei,
+                       sizeof(uint32_t));
+    nvme_qp_mark_dirty(qp, NVME_MAP_CQ_EI, qp->cq_ei, qp->cq_ei,
+                       sizeof(uint32_t));
+    return 0;
+}
+
+int
+vfu_nvme_qp_sq_doorbell(vfu_nvme_qp_t *qp, uint16_t tail)
+{
+    assert(qp != NULL);
+
+    if (tail >= qp->info.sq_size) {
+        return ERROR_INT(EINVAL);
+    }
+    qp->sq_tail = tail;
+    return 0;
+}
+
+int
+vfu_nvme_qp_cq_doorbell(vfu_nvme_qp_t *qp, uint16_t head)
+{
+    assert(qp != NULL);
+
+    if (head >= qp->info.cq_size) {
+        return ERROR_INT(EINVAL);
+    }
+    qp->cq_head = head;
+    return 0;
+}
+
+/* Reads a shadow doorbell, rejecting out of range values. */
+static inline int
+nvme_qp_shadow_read(const uint32_t *db, uint16_t size, uint16_t *val)
+{
+    uint32_t v = __atomic_load_n(db, __ATOMIC_ACQUIRE);
+
+    if (v >= size) {
+        return -EINVAL;
+    }
+    *val = v;
+    return 0;
+}
+
+/*
+ * Publishes an EventIdx and then re-reads the shadow doorbell, so that an
+ * update the driver made before seeing the new EventIdx isn't missed.
+ */
+static inline int
+nvme_qp_shadow_arm(vfu_nvme_qp_t *qp, int ei_idx, uint32_t *ei, uint16_t val,
+                   const uint32_t *db, uint16_t size, uint16_t *db_val)
+{
+    __atomic_store_n(ei, val, __ATOMIC_RELEASE);
+    nvme_qp_mark_dirty(qp, ei_idx, ei, ei, sizeof(*ei));
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return nvme_qp_shadow_read(db, size, db_val);
+}
+
+int
+vfu_nvme_qp_fetch(vfu_nvme_qp_t *qp, void *sqes, int max)
+{
+    char *dst = sqes;
+    int n = 0;
+    int ret;
+
+    assert(qp != NULL);
+    assert(sqes != NULL || max == 0);
+
+    if (qp->sq_db != NULL) {
+        ret = nvme_qp_shadow_read(qp->sq_db, qp->info.sq_size, &qp->sq_tail);
+        if (ret < 0) {
+            return ERROR_INT(-ret);
+        }
+    }
+
+    for (;;) {
+        while (n < max && qp->sq_head != qp->sq_tail) {
+            memcpy(dst, qp->sq + (size_t)qp->sq_head * VFU_NVME_SQE_SIZE,
+                   VFU_NVME_SQE_SIZE);
+            dst += VFU_NVME_SQE_SIZE;
+            if (++qp->sq_head == qp->info.sq_size) {
+                qp->sq_head = 0;
+            }
+            n++;
+        }
+
+        /*
+         * While there's work left, leave the EventIdx behind so that the
+         * driver doesn't ring the doorbell for further submissions.
+         */
+        if (qp->sq_db == NULL || qp->sq_head != qp->sq_tail) {
+            break;
+        }
+        ret = nvme_qp_shadow_arm(qp, NVME_MAP_SQ_EI, qp->sq_ei, qp->sq_tail,
+                                 qp->sq_db, qp->info.sq_size, &qp->sq_tail);
+        if (ret < 0) {
+            return ERROR_INT(-ret);
+        }
+        if (qp->sq_head == qp->sq_tail || n == max) {
+            break;
+        }
+    }
+
+    return n;
+}
+
+static inline bool
+nvme_qp_cq_full(const vfu_nvme_qp_t *qp)
+{
+    uint16_t next = qp->cq_tail + 1;
+
+    if (next == qp->info.cq_size) {
+        next = 0;
+    }
+    return next == qp->cq_head;
+}
+
+int
+vfu_nvme_qp_complete(vfu_nvme_qp_t *qp, const vfu_nvme_cpl_t *cpls, int n)
+{
+    int i;
+    int ret;
+
+    assert(qp != NULL);
+    assert(cpls != NULL || n == 0);
+
+    if (qp->cq_db != NULL) {
+        ret = nvme_qp_shadow_read(qp->cq_db, qp->info.cq_size, &qp->cq_head);
+        if (ret < 0) {
+            return ERROR_INT(-ret);
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        struct nvme_cqe *cqe = &qp->cq[qp->cq_tail];
+        uint32_t dw3;
+
+        if (nvme_qp_cq_full(qp)) {
+            /* Ask the driver to tell us when it consumes completions. */
+            if (qp->cq_db == NULL) {
+                break;
+            }
+            ret = nvme_qp_shadow_arm(qp, NVME_MAP_CQ_EI, qp->cq_ei,
+                                     qp->cq_head, qp->cq_db, qp->info.cq_size,
+                                     &qp->cq_head);
+            if (ret < 0) {
+                return ERROR_INT(-ret);
+            }
+            if (nvme_qp_cq_full(qp)) {
+                break;
+            }
+        }
+
+        cqe->dw0 = cpls[i].dw0;
+        cqe->dw1 = 0;
+        cqe->sq_head = qp->sq_head;
+        cqe->sq_id = qp->info.qid;
+        /* The phase tag must be the last thing the driver sees change. */
+        dw3 = cpls[i].cid | (uint32_t)((cpls[i].status << 1) | qp->phase) << 16;
+        __atomic_store_n((uint32_t *)&cqe->cid, dw3, __ATOMIC_RELEASE);
+        nvme_qp_mark_dirty(qp, NVME_MAP_CQ, qp->cq, cqe, sizeof(*cqe));
+
+        if (++qp->cq_tail == qp->info.cq_size) {
+            qp->cq_tail = 0;
+            qp->phase = !qp->phase;
+        }
+    }
+
+    if ((i > 0 || qp->irq_pending) && qp->info.irq_enabled) {
+        /* The completions are posted regardless. */
+        qp->irq_pending = vfu_irq_trigger(qp->vfu_ctx,
+                                          qp->info.irq_subindex) < 0;
+        if (qp->irq_pending) {
+            vfu_log(qp->vfu_ctx, LOG_ERR, "CQ%u: failed to trigger IRQ%u: %m",
+                    qp->info.qid, qp->info.irq_subindex);
+        }
+    }
+    return i;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -85,6 +85,8 @@ cap_size(vfu_ctx_t *vfu_ctx, void *data, bool extended)
         switch (id) {
         case PCI_EXT_CAP_ID_DSN:
             return PCI_EXT_CAP_DSN_SIZEOF;
+        case PCI_EXT_CAP_ID_SRIOV:
+            return PCI_EXT_CAP_SRIOV_SIZEOF;
         case PCI_EXT_CAP_ID_VNDR:
             return ((struct pcie_ext_cap_vsc_hdr *)data)->len;
         default:
@@ -316,6 +318,174 @@ ext_cap_write_dsn(vfu_ctx_t *vfu_ctx, struct pci_cap *cap, char *buf UNUSED,
     return -EPERM;
 }
 
+static ssize_t
+ext_cap_write_sriov_bar(vfu_ctx_t *vfu_ctx, struct sriovcap *sriov, char *buf,
+                        size_t count, size_t off)
+{
+    size_t i = (off - offsetof(struct sriovcap, bar)) / sizeof(uint32_t);
+    uint32_t size;
+    uint32_t val;
+
+    if (count != sizeof(val) || off % sizeof(val) != 0) {
+        return -EINVAL;
+    }
+
+    memcpy(&val, buf, sizeof(val));
+    size = vfu_ctx->sriov.vf_reg_info[VFU_PCI_DEV_BAR0_REGION_IDX + i].size;
+    /*
+     * All VF BARs are 32-bit memory BARs, so only the address bits the BAR
+     * size allows stick; an unimplemented BAR (size 0) stays zero.
+     */
+    sriov->bar[i] = val & ~(size - 1);
+    return count;
+}
+
+static ssize_t
+ext_cap_write_sriov(vfu_ctx_t *vfu_ctx, struct pci_cap *cap, char *buf,
+                    size_t count, loff_t offset)
+{
+    struct sriovcap *sriov = cap_data(vfu_ctx, cap);
+    size_t off = offset - cap->off;
+    uint16_t val16 = 0;
+    uint32_t val32 = 0;
+    int ret;
+
+    if (off >= offsetof(struct sriovcap, bar) &&
+        off < offsetof(struct sriovcap, vfm)) {
+        return ext_cap_write_sriov_bar(vfu_ctx, sriov, buf, count, off);
+    }
+
+    if (count == sizeof(val16)) {
+        memcpy(&val16, buf, sizeof(val16));
+    } else if (count == sizeof(val32)) {
+        memcpy(&val32, buf, sizeof(val32));
+    }
+
+    switch (off) {
+    case offsetof(struct sriovcap, ctrl):
+        if (count != sizeof(val16)) {
+            return -EINVAL;
+        }
+        if ((val16 ^ sriov->ctrl) & PCI_SRIOV_CTRL_VFE) {
+            vfu_log(vfu_ctx, LOG_DEBUG, "%s %u VFs",
+                    (val16 & PCI_SRIOV_CTRL_VFE) ? "enable" : "disable",
+                    sriov->num_vfs);
+            ret = sriov_set_vf_enable(vfu_ctx, (val16 & PCI_SRIOV_CTRL_VFE) ?
+                                               sriov->num_vfs : 0);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        /* VF Migration isn't supported. */
+        sriov->ctrl = val16 & ~(PCI_SRIOV_CTRL_VFM | PCI_SRIOV_CTRL_INTR);
+        return count;
+    case offsetof(struct sriovcap, status):
+        /* VF Migration Status is never set, so there's nothing to clear. */
+        return count;
+    case offsetof(struct sriovcap, num_vfs):
+        if (count != sizeof(val16)) {
+            return -EINVAL;
+        }
+        if (sriov->ctrl & PCI_SRIOV_CTRL_VFE) {
+            return -EBUSY;
+        }
+        if (val16 > sriov->total_vfs) {
+            vfu_log(vfu_ctx, LOG_ERR, "NumVFs %u exceeds TotalVFs %u", val16,
+                    sriov->total_vfs);
+            return -EINVAL;
+        }
+        sriov->num_vfs = val16;
+        return count;
+    case offsetof(struct sriovcap, sys_pgsize):
+        if (count != sizeof(val32)) {
+            return -EINVAL;
+        }
+        if (sriov->ctrl & PCI_SRIOV_CTRL_VFE) {
+            return -EBUSY;
+        }
+        if ((val32 & (val32 - 1)) != 0 || !(val32 & sriov->sup_pgsize)) {
+            vfu_log(vfu_ctx, LOG_ERR, "unsupported System Page Size %#x",
+                    val32);
+            return -EINVAL;
+        }
+        sriov->sys_pgsize = val32;
+        return count;
+    default:
+        vfu_log(vfu_ctx, LOG_ERR, "write to read-only %s register %#zx",
+                cap->name, off);
+        return -EPERM;
+    }
+}
+
+/*
+ * Checks the fields of an SR-IOV capability that the device provides, and
+ * allocates what its VFs share.
+ */
+static int
+ext_cap_setup_sriov(vfu_ctx_t *vfu_ctx, struct sriovcap *sriov)
+{
+    struct vfu_sriov *s = &vfu_ctx->sriov;
+    size_t i;
+
+    if (vfu_ctx->parent != NULL || s->off != 0) {
+        return EINVAL;
+    }
+
+    /* VFs are addressed by the 8-bit routing ID offset in the header. */
+    if (sriov->total_vfs == 0 || sriov->vf_offset == 0 ||
+        (sriov->vf_stride == 0 && sriov->total_vfs > 1) ||
+        sriov->vf_offset + (sriov->total_vfs - 1) * sriov->vf_stride >
+        UINT8_MAX) {
+        vfu_log(vfu_ctx, LOG_ERR, "invalid SR-IOV VF routing IDs");
+        return EINVAL;
+    }
+
+    s->vfs = calloc(sriov->total_vfs, sizeof(*s->vfs));
+    s->vf_reg_info = calloc(VFU_PCI_DEV_NUM_REGIONS, sizeof(*s->vf_reg_info));
+    if (s->vfs == NULL || s->vf_reg_info == NULL) {
+        free(s->vfs);
+        free(s->vf_reg_info);
+        s->vfs = NULL;
+        s->vf_reg_info = NULL;
+        return ENOMEM;
+    }
+
+    for (i = 0; i < VFU_PCI_DEV_NUM_REGIONS; i++) {
+        s->vf_reg_info[i].fd = -1;
+    }
+    s->total_vfs = sriov->total_vfs;
+
+    return 0;
+}
+
+/*
+ * Completes ext_cap_setup_sriov() once the capability is in config space, or
+ * undoes it if placing it failed.
+ */
+static void
+sriov_placed(vfu_ctx_t *vfu_ctx, struct pci_cap *cap, int ret)
+{
+    struct sriovcap *sriov;
+
+    if (ret != 0) {
+        free(vfu_ctx->sriov.vfs);
+        free(vfu_ctx->sriov.vf_reg_info);
+        vfu_ctx->sriov.vfs = NULL;
+        vfu_ctx->sriov.vf_reg_info = NULL;
+        return;
+    }
+
+    sriov = cap_data(vfu_ctx, cap);
+    sriov->ctrl = 0;
+    sriov->status = 0;
+    sriov->num_vfs = 0;
+    memset(sriov->bar, 0, sizeof(sriov->bar));
+    if (sriov->sys_pgsize == 0) {
+        sriov->sys_pgsize = 1; /* 4 KiB */
+    }
+    vfu_ctx->sriov.off = cap->off;
+}
+
 static ssize_t
 ext_cap_write_vendor(vfu_ctx_t *vfu_ctx, struct pci_cap *cap UNUSED, char *buf,
                      size_t count, loff_t offset)
@@ -568,6 +738,10 @@ vfu_pci_add_capability(vfu_ctx_t *vfu_ctx, size_t pos, int flags, void *data)
             cap.name = "Device Serial Number";
             cap.cb = ext_cap_write_dsn;
             break;
+        case PCI_EXT_CAP_ID_SRIOV:
+            cap.name = "SR-IOV";
+            cap.cb = ext_cap_write_sriov;
+            break;
         case PCI_EXT_CAP_ID_VNDR:
             cap.name = "Vendor-Specific";
             cap.cb = ext_cap_write_vendor;
@@ -584,8 +758,19 @@ vfu_pci_add_capability(vfu_ctx_t *vfu_ctx, size_t pos, int flags, void *data)
             return ERROR_INT(EINVAL);
         }
 
+        if (cap.id == PCI_EXT_CAP_ID_SRIOV) {
+            ret = ext_cap_setup_sriov(vfu_ctx, data);
+            if (ret != 0) {
+                return ERROR_INT(ret);
+            }
+        }
+
         ret = ext_cap_place(vfu_ctx, &cap, data);
 
+        if (cap.id == PCI_EXT_CAP_ID_SRIOV) {
+            sriov_placed(vfu_ctx, &cap, ret);
+        }
+
     } else {
         if (vfu_ctx->pci.nr_caps == VFU_MAX_CAPS) {
             return ERROR_INT(ENOSPC);
@@ -33,6 +33,8 @@
 #ifndef LIB_VFIO_USER_PRIVATE_H
 #define LIB_VFIO_USER_PRIVATE_H
 
+#include <pthread.h>
+
 #include "pci_caps.h"
 #include "dma.h"
 
@@ -50,6 +52,18 @@ ERROR_PTR(int err)
     return NULL;
 }
 
+/*
+ * A thread waiting for the replies to the commands whose message IDs are in
+ * [first_id, first_id + nr), see transport_ops.get_reply().
+ */
+struct reply_wait {
+    uint16_t                first_id;
+    size_t                  nr;
+    /* Owned by the transport. */
+    struct reply_wait       *next;
+    void                    *replies;
+};
+
 struct transport_ops {
     int (*init)(vfu_ctx_t *vfu_ctx);
 
@@ -63,15 +77,54 @@ struct transport_ops {
     int (*recv_body)(vfu_ctx_t *vfu_ctx, const struct vfio_user_header *hdr,
                      void **datap);
 
+    /*
+     * If @more is set, further requests are already readable, so the reply
+     * may be held back until flush() or a reply without @more.
+     */
     int (*reply)(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
                  struct iovec *iovecs, size_t nr_iovecs,
-                 int *fds, int count, int err);
+                 int *fds, int count, int err, bool more);
+
+    /* Send the replies held back by reply(). */
+    int (*flush)(vfu_ctx_t *vfu_ctx);
 
-    int (*send_msg)(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
+    /*
+     * Send a server-initiated command without waiting for the reply; iovecs[0]
+     * is reserved for the header. If @no_reply is set, the client doesn't
+     * reply at all. @function is the routing ID of the function it's from.
+     */
+    int (*send_cmd)(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
                     enum vfio_user_command cmd,
-                    void *send_data, size_t send_len,
-                    struct vfio_user_header *hdr,
-                    void *recv_data, size_t recv_len);
+                    struct iovec *iovecs, size_t nr_iovecs, bool no_reply,
+                    uint8_t function);
+
+    /*
+     * Replies to the commands of @wait are kept for get_reply() from then on,
+     * whichever thread receives them, until del_reply_wait(). Called before
+     * the commands are sent.
+     */
+    void (*add_reply_wait)(vfu_ctx_t *vfu_ctx, struct reply_wait *wait);
+    void (*del_reply_wait)(vfu_ctx_t *vfu_ctx, struct reply_wait *wait);
+
+    /*
+     * Receive the next reply to one of the commands of @wait, and its body,
+     * which the caller frees. Replies to commands not waited for this way
+     * are returned by get_request().
+     */
+    int (*get_reply)(vfu_ctx_t *vfu_ctx, struct reply_wait *wait,
+                     struct vfio_user_header *hdr, void **datap);
+
+    /*
+     * Whether get_request() can return a request without blocking, either one
+     * that arrived while waiting for a reply or one already readable.
+     */
+    bool (*has_pending)(vfu_ctx_t *vfu_ctx);
+
+    /*
+     * Keep the poll fd readable while @wake, even though get_request() may
+     * have nothing to return: suspended requests are ready to go on.
+     */
+    void (*wake)(vfu_ctx_t *vfu_ctx, bool wake);
 
     void (*detach)(vfu_ctx_t *vfu_ctx);
     void (*fini)(vfu_ctx_t *vfu_ctx);
@@ -81,11 +134,42 @@ typedef struct {
     int         err_efd;    /* eventfd for irq err */
     int         req_efd;    /* eventfd for irq req */
     uint32_t    max_ivs;    /* maximum number of ivs supported */
+    uint64_t    *pending;   /* bitmap of ivs to post, see irqs_flush() */
     int         efds[0];    /* must be last */
 } vfu_irqs_t;
 
 struct migration;
 
+enum send_type {
+    SEND_CMD,
+    /* A command the client doesn't reply to. */
+    SEND_POSTED,
+    SEND_REPLY,
+    /* Nothing to send, but replies held back must be sent now. */
+    SEND_FLUSH,
+};
+
+/* An outgoing message, see send_msg(). */
+struct send_req {
+    struct send_req         *next;
+    enum send_type          type;
+    /* See transport_ops.reply(). */
+    bool                    more;
+    uint16_t                msg_id;
+    enum vfio_user_command  cmd;
+    /* See transport_ops.send_cmd(). */
+    uint8_t                 function;
+    /* [0] is reserved for the header. */
+    struct iovec            *iovecs;
+    size_t                  nr_iovecs;
+    int                     *fds;
+    int                     nr_fds;
+    int                     err;
+    /* Set by the thread that sent the message. */
+    int                     ret;
+    bool                    done;
+};
+
 typedef struct  {
     /* Region flags, see VFU_REGION_FLAG_READ and friends. */
     uint32_t            flags;
@@ -98,6 +182,8 @@ typedef struct  {
     int nr_mmap_areas;
     /* fd for a mappable region, or -1. */
     int fd;
+    /* Polled doorbell area, see vfu_setup_region_doorbells(). */
+    vfu_doorbells_t *doorbells;
 } vfu_reg_info_t;
 
 struct pci_dev {
@@ -109,6 +195,33 @@ struct pci_dev {
     size_t                  nr_ext_caps;
 };
 
+struct vfu_sriov {
+    /* Offset of the SR-IOV capability, or 0 if there is none. */
+    size_t                  off;
+    vfu_sriov_cb_t          *cb;
+    /* Regions shared by all VFs, only the BARs can be set up. */
+    vfu_reg_info_t          *vf_reg_info;
+    /* VFs by index. */
+    vfu_ctx_t               **vfs;
+    uint16_t                total_vfs;
+    /* Number of VFs the client can reach, 0 unless VF Enable is set. */
+    uint16_t                nr_vfs;
+};
+
+/* Replies to the info commands, built by vfu_realize_ctx(). */
+struct info_cache {
+    struct vfio_device_info     dev_info;
+    struct vfio_irq_info        irq_info[VFU_DEV_NUM_IRQS];
+    /* Region info without capabilities, argsz is the size with them. */
+    struct vfio_region_info     *reg_hdr;
+    /* Region info with capabilities, NULL for regions without any. */
+    struct vfio_region_info     **reg_caps;
+    /* Device info whose argsz is the size of the GET_ALL_INFO reply. */
+    struct vfio_device_info     all_info;
+    /* Number of fds passed in the GET_ALL_INFO reply. */
+    size_t                      nr_all_fds;
+};
+
 struct vfu_ctx {
     void                    *pvt;
     dma_controller_t        *dma;
@@ -118,24 +231,72 @@ struct vfu_ctx {
     size_t                  nr_regions;
     vfu_reg_info_t          *reg_info;
     struct pci_dev          pci;
+    vfu_trans_t             trans;
     struct transport_ops    *tran;
     void                    *tran_data;
     uint64_t                flags;
     char                    *uuid;
     vfu_dma_register_cb_t   *dma_register;
     vfu_dma_unregister_cb_t *dma_unregister;
+    /* See vfu_setup_dma_copy_threshold(). */
+    size_t                  dma_copy_threshold;
 
     int                     client_max_fds;
+    /* Whether interrupts can be posted, see vfu_irq_trigger(). */
+    bool                    client_vm_interrupt;
+    /* Negotiated maximum size of the messages we send, see recv_version(). */
+    size_t                  max_msg_size;
+    /* Message ID of the next server-initiated command. */
+    uint16_t                next_msg_id;
+    /* Messages waiting to be sent, newest first, see send_msg(). */
+    struct send_req         *send_queue;
+    /* Whether a thread is sending the queued messages. */
+    bool                    sending;
+    /* Senders waiting for it on send_cond, under send_lock. */
+    size_t                  send_waiters;
+    pthread_mutex_t         send_lock;
+    pthread_cond_t          send_cond;
+    /* Runs requests with LIBVFIO_USER_FLAG_COROUTINES. */
+    struct co_sched         *co;
+    /* See vfu_setup_rate_limit(). */
+    struct rate_limit       *rate_limit;
+    /* See vfu_setup_region_workers(). */
+    struct workers          *workers;
 
     vfu_reg_info_t          *migr_reg;
     struct migration        *migration;
 
     uint32_t                irq_count[VFU_DEV_NUM_IRQS];
     vfu_irqs_t              *irqs;
+    /* Interrupts to post are held back until the requests are processed. */
+    bool                    irq_defer;
+    /* Other functions have interrupts to post, see irqs_flush(). */
+    bool                    irq_fn_pending;
+    struct info_cache       *info_cache;
     bool                    realized;
     vfu_dev_type_t          dev_type;
+
+    /* Function 0 if this is another function, see vfu_create_function(). */
+    vfu_ctx_t               *parent;
+    /* Routing ID relative to function 0, see function_ctx(). */
+    uint8_t                 rid;
+    /* Other functions of a multi-function device, [0] is unused. */
+    vfu_ctx_t               *functions[VFU_PCI_MAX_FUNCTIONS];
+    struct vfu_sriov        sriov;
+
+    /* Context whose regions this one shares, see vfu_clone_ctx(). */
+    vfu_ctx_t               *tmpl;
+    /* Number of contexts cloned from this one. */
+    size_t                  nr_clones;
 };
 
+static inline bool
+vfu_ctx_is_vf(vfu_ctx_t *vfu_ctx)
+{
+    return vfu_ctx->parent != NULL &&
+           vfu_ctx->reg_info == vfu_ctx->parent->sriov.vf_reg_info;
+}
+
 void
 dump_buffer(const char *prefix, const char *buf, uint32_t count);
 
@@ -145,10 +306,16 @@ consume_fd(int *fds, size_t nr_fds, size_t index);
 vfu_reg_info_t *
 vfu_get_region_info(vfu_ctx_t *vfu_ctx);
 
+int
+sriov_set_vf_enable(vfu_ctx_t *vfu_ctx, uint16_t num_vfs);
+
 long
 dev_get_reginfo(vfu_ctx_t *vfu_ctx, uint32_t index, uint32_t argsz,
                 struct vfio_region_info **vfio_reg, int **fds, size_t *nr_fds);
 
+int
+send_msg(vfu_ctx_t *vfu_ctx, struct send_req *req);
+
 int
 handle_dma_map_or_unmap(vfu_ctx_t *vfu_ctx, uint32_t size, bool map,
                         int *fds, size_t nr_fds,
@@ -159,6 +326,12 @@ handle_device_get_info(vfu_ctx_t *vfu_ctx, uint32_t size,
                        struct vfio_device_info *in_dev_info,
                        struct vfio_device_info *out_dev_info);
 
+int
+handle_device_get_all_info(vfu_ctx_t *vfu_ctx, uint32_t size,
+                           struct vfio_device_info *in_dev_info,
+                           struct iovec *_iovecs, struct iovec **iovecs,
+                           size_t *nr_iovecs, int **fds, size_t *nr_fds);
+
 int
 handle_device_set_irqs(vfu_ctx_t *vfu_ctx, uint32_t size,
                        int *fds, size_t nr_fds, struct vfio_irq_set *irq_set);
@@ -181,6 +354,9 @@ MOCK_DECLARE(int, handle_dirty_pages, vfu_ctx_t *vfu_ctx, uint32_t size,
              struct iovec **iovecs, size_t *nr_iovecs,
              struct vfio_iommu_type1_dirty_bitmap *dirty_bitmap);
 
+MOCK_DECLARE(void *, virtq_map_indirect, vfu_virtq_t *vq, uint64_t addr,
+             uint32_t len, size_t desc_size);
+
 MOCK_DECLARE(bool, should_exec_command, vfu_ctx_t *vfu_ctx, uint16_t cmd);
 
 MOCK_DECLARE(bool, cmd_allowed_when_stopped_and_copying, uint16_t cmd);
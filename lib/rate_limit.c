@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2020 Nutanix Inc. All rights reserved.
+ *
+ * Authors: Thanos Makatos <thanos@nutanix.com>
+ *          Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *          Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * Per-context limits on message traffic, so that a busy device doesn't take
+ * over an event loop it shares with others.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <time.h>
+
+#include "common.h"
+#include "rate_limit.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+static inline uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void
+bucket_setup(struct rate_bucket *b, uint64_t rate, uint64_t burst)
+{
+    b->tat = 0;
+    b->burst_ns = 0;
+    b->ns_per_unit = 0;
+
+    if (rate == 0) {
+        return;
+    }
+
+    if (burst == 0) {
+        burst = rate;
+    }
+    b->ns_per_unit = (double)NSEC_PER_SEC / rate;
+    /* The last unit of the burst is the one that takes it ahead. */
+    b->burst_ns = (burst - 1) * b->ns_per_unit;
+}
+
+static void
+bucket_charge(struct rate_bucket *b, uint64_t now, uint64_t units)
+{
+    uint64_t floor, cost, old, new;
+
+    if (b->ns_per_unit == 0 || units == 0) {
+        return;
+    }
+
+    cost = units * b->ns_per_unit;
+    floor = now > b->burst_ns ? now - b->burst_ns : 0;
+
+    old = __atomic_load_n(&b->tat, __ATOMIC_RELAXED);
+    do {
+        new = MAX(old, floor) + cost;
+    } while (!__atomic_compare_exchange_n(&b->tat, &old, new, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static uint64_t
+bucket_delay(struct rate_bucket *b, uint64_t now)
+{
+    uint64_t tat = __atomic_load_n(&b->tat, __ATOMIC_RELAXED);
+
+    return tat > now ? tat - now : 0;
+}
+
+void
+rate_limit_charge(vfu_ctx_t *vfu_ctx, uint64_t ops, uint64_t bytes)
+{
+    struct rate_limit *rl;
+    uint64_t now;
+
+    if (vfu_ctx->parent != NULL) {
+        vfu_ctx = vfu_ctx->parent;
+    }
+
+    rl = vfu_ctx->rate_limit;
+    if (rl == NULL) {
+        return;
+    }
+
+    now = now_ns();
+    bucket_charge(&rl->ops, now, ops);
+    bucket_charge(&rl->bytes, now, bytes);
+}
+
+uint64_t
+rate_limit_throttle(struct rate_limit *rl)
+{
+    uint64_t now, delay;
+
+    assert(rl != NULL);
+
+    now = now_ns();
+    delay = MAX(bucket_delay(&rl->ops, now), bucket_delay(&rl->bytes, now));
+    if (delay == 0) {
+        return 0;
+    }
+
+    /* Time is counted once, however often the caller comes back meanwhile. */
+    if (now >= rl->throttled_until) {
+        rl->nr_throttled++;
+        rl->throttled_ns += delay;
+    } else if (now + delay > rl->throttled_until) {
+        rl->throttled_ns += now + delay - rl->throttled_until;
+    }
+    rl->throttled_until = MAX(rl->throttled_until, now + delay);
+
+    return delay;
+}
+
+int
+vfu_setup_rate_limit(vfu_ctx_t *vfu_ctx, const vfu_rate_limit_t *limit)
+{
+    static const vfu_rate_limit_t none;
+    struct rate_limit *rl;
+
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->parent != NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (limit == NULL) {
+        limit = &none;
+    }
+
+    rl = vfu_ctx->rate_limit;
+    if (rl == NULL) {
+        rl = calloc(1, sizeof(*rl));
+        if (rl == NULL) {
+            return ERROR_INT(ENOMEM);
+        }
+    }
+
+    bucket_setup(&rl->ops, limit->ops_per_sec, limit->ops_burst);
+    bucket_setup(&rl->bytes, limit->bytes_per_sec, limit->bytes_burst);
+    rl->throttled_until = 0;
+
+    vfu_ctx->rate_limit = rl;
+    return 0;
+}
+
+void
+vfu_get_rate_limit_stats(vfu_ctx_t *vfu_ctx, vfu_rate_limit_stats_t *stats)
+{
+    struct rate_limit *rl;
+    uint64_t now;
+
+    assert(vfu_ctx != NULL);
+    assert(stats != NULL);
+
+    if (vfu_ctx->parent != NULL) {
+        vfu_ctx = vfu_ctx->parent;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+
+    rl = vfu_ctx->rate_limit;
+    if (rl == NULL) {
+        return;
+    }
+
+    now = now_ns();
+    stats->nr_throttled = rl->nr_throttled;
+    stats->throttled_ns = rl->throttled_ns;
+    stats->delay_ns = MAX(bucket_delay(&rl->ops, now),
+                          bucket_delay(&rl->bytes, now));
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2020 Nutanix Inc. All rights reserved.
+ *
+ * Authors: Thanos Makatos <thanos@nutanix.com>
+ *          Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *          Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#ifndef LIB_VFIO_USER_RATE_LIMIT_H
+#define LIB_VFIO_USER_RATE_LIMIT_H
+
+#include "private.h"
+
+/*
+ * Token bucket, kept as the time at which it has no tokens left (GCRA): a
+ * charge pushes it forward, and requests are held back while it's ahead of
+ * the clock.
+ */
+struct rate_bucket {
+    uint64_t    tat;            /* ns, CLOCK_MONOTONIC */
+    uint64_t    burst_ns;       /* how far behind the clock it can lag */
+    double      ns_per_unit;    /* 0 for no limit */
+};
+
+struct rate_limit {
+    struct rate_bucket  ops;
+    struct rate_bucket  bytes;
+    uint64_t            throttled_until;
+    uint64_t            throttled_ns;
+    uint64_t            nr_throttled;
+};
+
+/* Accounts for message traffic of @vfu_ctx, from any thread. */
+void
+rate_limit_charge(vfu_ctx_t *vfu_ctx, uint64_t ops, uint64_t bytes);
+
+/*
+ * Returns for how long, in ns, requests must be held back, and accounts for
+ * it in the throttled time.
+ */
+uint64_t
+rate_limit_throttle(struct rate_limit *rl);
+
+#endif /* LIB_VFIO_USER_RATE_LIMIT_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
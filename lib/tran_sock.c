@@ -34,8 +34,14 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <json.h>
+#include <linux/errqueue.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -47,25 +53,81 @@
 #include "private.h"
 #include "tran_sock.h"
 
-// FIXME: is this the value we want?
-#define SERVER_MAX_FDS 8
-
 #define SERVER_MAX_MSG_SIZE 65536
 
-typedef struct {
-    int listen_fd;
-    int conn_fd;
-} tran_sock_t;
+/*
+ * The most connections a non-blocking listener receives the version of at a
+ * time. Further ones are left in the backlog until there's room.
+ */
+#define MAX_HALF_OPEN 16
 
-int
-MOCK_DEFINE(tran_sock_send_iovec)(int sock, uint16_t msg_id, bool is_reply,
-                                  enum vfio_user_command cmd,
-                                  struct iovec *iovecs, size_t nr_iovecs,
-                                  int *fds, int count, int err)
+/* A connection whose VFIO_USER_VERSION is still arriving. */
+struct half_open {
+    int fd;
+    struct vfio_user_header hdr;
+    void *data;
+    /* Bytes received so far, header included. */
+    size_t len;
+};
+
+struct vfu_listener {
+    int fd;
+    /*
+     * For a non-blocking listener, an epoll instance of fd and the half-open
+     * connections, otherwise -1.
+     */
+    int poll_fd;
+    struct half_open conns[MAX_HALF_OPEN];
+    size_t nr_conns;
+    /* Contexts connections can be routed to, see vfu_listener_add_ctx(). */
+    vfu_ctx_t **ctxs;
+    size_t nr_ctxs;
+};
+
+/*
+ * The most messages queued for get_request() while waiting for replies, beyond
+ * which the client is considered misbehaving.
+ */
+#define MAX_PENDING_MSGS 64
+
+/*
+ * A message received before it's asked for: a client command received while
+ * waiting for a reply, or a reply to a command another thread waits for.
+ */
+struct pending_msg {
+    struct pending_msg *next;
+    struct vfio_user_header hdr;
+    void *data;
+    int *fds;
+    size_t nr_fds;
+};
+
+/*
+ * Replies held back while more requests are readable are coalesced into a
+ * buffer of this size, see tran_sock_reply().
+ */
+#define REPLY_CORK_SIZE 16384
+
+/*
+ * With VFU_TRANS_TCP, DMA writes at least this large are sent with
+ * MSG_ZEROCOPY, which only pays off for large payloads.
+ */
+#define ZEROCOPY_MIN_SIZE 16384
+
+/*
+ * Returns 0 on success, or 1 if MSG_ZEROCOPY was asked for and the payload was
+ * sent with it.
+ */
+static int
+send_iovec(int sock, int sock_flags, uint16_t msg_id, bool is_reply,
+           bool no_reply, uint8_t function, enum vfio_user_command cmd,
+           struct iovec *iovecs, size_t nr_iovecs, int *fds, int count,
+           int err)
 {
     int ret;
     struct vfio_user_header hdr = {.msg_id = msg_id};
     struct msghdr msg;
+    size_t remaining;
     size_t i;
     size_t size = count * sizeof(*fds);
     char *buf;
@@ -87,6 +149,8 @@ MOCK_DEFINE(tran_sock_send_iovec)(int sock, uint16_t msg_id, bool is_reply,
     } else {
         hdr.cmd = cmd;
         hdr.flags.type = VFIO_USER_F_TYPE_COMMAND;
+        hdr.flags.no_reply = no_reply;
+        hdr.flags.function = function;
     }
 
     iovecs[0].iov_base = &hdr;
@@ -95,6 +159,7 @@ MOCK_DEFINE(tran_sock_send_iovec)(int sock, uint16_t msg_id, bool is_reply,
     for (i = 0; i < nr_iovecs; i++) {
         hdr.msg_size += iovecs[i].iov_len;
     }
+    remaining = hdr.msg_size;
 
     msg.msg_iovlen = nr_iovecs;
     msg.msg_iov = iovecs;
@@ -115,7 +180,32 @@ MOCK_DEFINE(tran_sock_send_iovec)(int sock, uint16_t msg_id, bool is_reply,
         memcpy(CMSG_DATA(cmsg), fds, size);
     }
 
-    ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    /*
+     * Only the payload, in the last iovec, is sent from the caller's pages:
+     * the header on our stack is gone by the time the kernel releases them.
+     */
+    if (sock_flags & MSG_ZEROCOPY) {
+        assert(fds == NULL && nr_iovecs > 1);
+        msg.msg_iovlen = --nr_iovecs;
+        ret = sendmsg(sock, &msg, (sock_flags & ~MSG_ZEROCOPY) | MSG_MORE);
+        if (ret != -1) {
+            remaining -= ret;
+            if (remaining > iovecs[nr_iovecs].iov_len) {
+                /* Don't tear the message by sending the payload anyway. */
+                return -ECONNRESET;
+            }
+            msg.msg_iov = &iovecs[nr_iovecs];
+            msg.msg_iovlen = 1;
+            ret = sendmsg(sock, &msg, sock_flags);
+            if (ret == -1 && errno == ENOBUFS) {
+                /* Out of pinned memory, send a copy instead. */
+                sock_flags &= ~MSG_ZEROCOPY;
+                ret = sendmsg(sock, &msg, sock_flags);
+            }
+        }
+    } else {
+        ret = sendmsg(sock, &msg, sock_flags);
+    }
 
     if (ret == -1) {
         /* Treat a failed write due to EPIPE the same as a short write. */
@@ -123,11 +213,21 @@ MOCK_DEFINE(tran_sock_send_iovec)(int sock, uint16_t msg_id, bool is_reply,
             return -ECONNRESET;
         }
         return -errno;
-    } else if ((size_t)ret < hdr.msg_size) {
+    } else if ((size_t)ret < remaining) {
         return -ECONNRESET;
     }
 
-    return 0;
+    return (sock_flags & MSG_ZEROCOPY) ? 1 : 0;
+}
+
+int
+MOCK_DEFINE(tran_sock_send_iovec)(int sock, uint16_t msg_id, bool is_reply,
+                                  enum vfio_user_command cmd,
+                                  struct iovec *iovecs, size_t nr_iovecs,
+                                  int *fds, int count, int err)
+{
+    return send_iovec(sock, MSG_NOSIGNAL, msg_id, is_reply, false, 0, cmd,
+                      iovecs, nr_iovecs, fds, count, err);
 }
 
 int
@@ -158,13 +258,17 @@ tran_sock_send_error(int sock, uint16_t msg_id,
                                 NULL, 0, NULL, 0, error);
 }
 
+/*
+ * Receives at least @min_len bytes into @iov. With MSG_TRUNC in @sock_flags, a
+ * SOCK_SEQPACKET record longer than @iov is not an error, and its full length
+ * is returned.
+ */
 static int
-get_msg(void *data, size_t len, int *fds, size_t *nr_fds, int sock_fd,
-        int sock_flags)
+get_msg_iovec(struct iovec *iov, size_t nr_iov, size_t min_len, int *fds,
+              size_t *nr_fds, int sock_fd, int sock_flags)
 {
     int ret;
-    struct iovec iov = {.iov_base = data, .iov_len = len};
-    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = nr_iov};
     struct cmsghdr *cmsg;
 
     if (nr_fds != NULL && *nr_fds > 0) {
@@ -179,11 +283,12 @@ get_msg(void *data, size_t len, int *fds, size_t *nr_fds, int sock_fd,
         return -errno;
     } else if (ret == 0) {
         return -ENOMSG;
-    } else if ((size_t)ret < len) {
+    } else if ((size_t)ret < min_len) {
         return -ECONNRESET;
     }
 
-    if (msg.msg_flags & MSG_CTRUNC || msg.msg_flags & MSG_TRUNC) {
+    if (msg.msg_flags & MSG_CTRUNC ||
+        (msg.msg_flags & MSG_TRUNC && !(sock_flags & MSG_TRUNC))) {
         return -EFAULT;
     }
 
@@ -208,6 +313,15 @@ get_msg(void *data, size_t len, int *fds, size_t *nr_fds, int sock_fd,
     return ret;
 }
 
+static int
+get_msg(void *data, size_t len, int *fds, size_t *nr_fds, int sock_fd,
+        int sock_flags)
+{
+    struct iovec iov = {.iov_base = data, .iov_len = len};
+
+    return get_msg_iovec(&iov, 1, len, fds, nr_fds, sock_fd, sock_flags);
+}
+
 /*
  * Receive a vfio-user message.  If "len" is set to non-zero, the message should
  * include data of that length, which is stored in the pre-allocated "data"
@@ -218,18 +332,32 @@ get_msg(void *data, size_t len, int *fds, size_t *nr_fds, int sock_fd,
  * better.
  */
 static int
-tran_sock_recv_fds(int sock, struct vfio_user_header *hdr, bool is_reply,
-                   uint16_t *msg_id, void *data, size_t *len, int *fds,
-                   size_t *nr_fds)
+tran_sock_recv_fds(int sock, int sock_type, struct vfio_user_header *hdr,
+                   bool is_reply, uint16_t *msg_id, void *data, size_t *len,
+                   int *fds, size_t *nr_fds)
 {
+    struct iovec iov[2] = {
+        { .iov_base = hdr, .iov_len = sizeof(*hdr) },
+        { .iov_base = data, .iov_len = len != NULL ? *len : 0 }
+    };
+    bool seqpacket = sock_type == SOCK_SEQPACKET;
     int ret;
 
     /* FIXME if ret == -1 then fcntl can overwrite recv's errno */
 
-    ret = get_msg(hdr, sizeof(*hdr), fds, nr_fds, sock, 0);
+    if (seqpacket) {
+        /* The whole message must be received at once, data included. */
+        ret = get_msg_iovec(iov, 2, sizeof(*hdr), fds, nr_fds, sock,
+                            MSG_TRUNC);
+    } else {
+        ret = get_msg(hdr, sizeof(*hdr), fds, nr_fds, sock, 0);
+    }
     if (ret < 0) {
         return ret;
     }
+    if (seqpacket && (size_t)ret != hdr->msg_size) {
+        return -EINVAL;
+    }
 
     if (is_reply) {
         if (msg_id != NULL && hdr->msg_id != *msg_id) {
@@ -255,7 +383,12 @@ tran_sock_recv_fds(int sock, struct vfio_user_header *hdr, bool is_reply,
         }
     }
 
-    if (len != NULL && *len > 0 && hdr->msg_size > sizeof(*hdr)) {
+    if (seqpacket) {
+        if (len != NULL && *len > 0 && hdr->msg_size > sizeof(*hdr) &&
+            hdr->msg_size - sizeof(*hdr) < *len) {
+            return -ECONNRESET;
+        }
+    } else if (len != NULL && *len > 0 && hdr->msg_size > sizeof(*hdr)) {
         ret = recv(sock, data, MIN(hdr->msg_size - sizeof(*hdr), *len),
                    MSG_WAITALL);
         if (ret < 0) {
@@ -272,10 +405,10 @@ tran_sock_recv_fds(int sock, struct vfio_user_header *hdr, bool is_reply,
 }
 
 int
-tran_sock_recv(int sock, struct vfio_user_header *hdr, bool is_reply,
-         uint16_t *msg_id, void *data, size_t *len)
+tran_sock_recv(int sock, int sock_type, struct vfio_user_header *hdr,
+               bool is_reply, uint16_t *msg_id, void *data, size_t *len)
 {
-    return tran_sock_recv_fds(sock, hdr, is_reply, msg_id,
+    return tran_sock_recv_fds(sock, sock_type, hdr, is_reply, msg_id,
                               data, len, NULL, NULL);
 }
 
@@ -285,14 +418,41 @@ tran_sock_recv(int sock, struct vfio_user_header *hdr, bool is_reply,
  * FIXME: this does an unconstrained alloc of client-supplied data.
  */
 int
-tran_sock_recv_alloc(int sock, struct vfio_user_header *hdr, bool is_reply,
-                     uint16_t *msg_id, void **datap, size_t *lenp)
+tran_sock_recv_alloc(int sock, int sock_type, struct vfio_user_header *hdr,
+                     bool is_reply, uint16_t *msg_id, void **datap,
+                     size_t *lenp)
 {
     void *data;
     size_t len;
     int ret;
 
-    ret = tran_sock_recv(sock, hdr, is_reply, msg_id, NULL, NULL);
+    if (sock_type == SOCK_SEQPACKET) {
+        /* Size the buffer from the header, without consuming the message. */
+        ret = get_msg(hdr, sizeof(*hdr), NULL, NULL, sock,
+                      MSG_PEEK | MSG_TRUNC);
+        if (ret < 0) {
+            return ret;
+        }
+        if (hdr->msg_size < sizeof(*hdr)) {
+            return -EINVAL;
+        }
+        len = hdr->msg_size - sizeof(*hdr);
+        data = len > 0 ? calloc(1, len) : NULL;
+        if (len > 0 && data == NULL) {
+            return -errno;
+        }
+        ret = tran_sock_recv(sock, sock_type, hdr, is_reply, msg_id, data,
+                             &len);
+        if (ret != 0) {
+            free(data);
+            return ret;
+        }
+        *datap = data;
+        *lenp = len;
+        return 0;
+    }
+
+    ret = tran_sock_recv(sock, sock_type, hdr, is_reply, msg_id, NULL, NULL);
 
     if (ret != 0) {
         return ret;
@@ -337,7 +497,8 @@ tran_sock_recv_alloc(int sock, struct vfio_user_header *hdr, bool is_reply,
  * messages.
  */
 int
-tran_sock_msg_iovec(int sock, uint16_t msg_id, enum vfio_user_command cmd,
+tran_sock_msg_iovec(int sock, int sock_type, uint16_t msg_id,
+                    enum vfio_user_command cmd,
                     struct iovec *iovecs, size_t nr_iovecs,
                     int *send_fds, size_t send_fd_count,
                     struct vfio_user_header *hdr,
@@ -352,12 +513,13 @@ tran_sock_msg_iovec(int sock, uint16_t msg_id, enum vfio_user_command cmd,
     if (hdr == NULL) {
         hdr = alloca(sizeof(*hdr));
     }
-    return tran_sock_recv_fds(sock, hdr, true, &msg_id, recv_data, &recv_len,
-                              recv_fds, recv_fd_count);
+    return tran_sock_recv_fds(sock, sock_type, hdr, true, &msg_id, recv_data,
+                              &recv_len, recv_fds, recv_fd_count);
 }
 
 int
-tran_sock_msg_fds(int sock, uint16_t msg_id, enum vfio_user_command cmd,
+tran_sock_msg_fds(int sock, int sock_type, uint16_t msg_id,
+                  enum vfio_user_command cmd,
                   void *send_data, size_t send_len,
                   struct vfio_user_header *hdr,
                   void *recv_data, size_t recv_len, int *recv_fds,
@@ -370,25 +532,116 @@ tran_sock_msg_fds(int sock, uint16_t msg_id, enum vfio_user_command cmd,
             .iov_len = send_len
         }
     };
-    return tran_sock_msg_iovec(sock, msg_id, cmd, iovecs, ARRAY_SIZE(iovecs),
-                               NULL, 0, hdr, recv_data, recv_len, recv_fds,
-                               recv_fd_count);
+    return tran_sock_msg_iovec(sock, sock_type, msg_id, cmd, iovecs,
+                               ARRAY_SIZE(iovecs), NULL, 0, hdr, recv_data,
+                               recv_len, recv_fds, recv_fd_count);
 }
 
 int
-tran_sock_msg(int sock, uint16_t msg_id, enum vfio_user_command cmd,
+tran_sock_msg(int sock, int sock_type, uint16_t msg_id,
+              enum vfio_user_command cmd,
               void *send_data, size_t send_len,
               struct vfio_user_header *hdr,
               void *recv_data, size_t recv_len)
 {
-    return tran_sock_msg_fds(sock, msg_id, cmd, send_data, send_len, hdr,
-                             recv_data, recv_len, NULL, NULL);
+    return tran_sock_msg_fds(sock, sock_type, msg_id, cmd, send_data,
+                             send_len, hdr, recv_data, recv_len, NULL, NULL);
 }
 
+/*
+ * Creates a socket bound to @addr, "host:port", where host is a name or an
+ * address, possibly in brackets, and can be empty to bind to any address.
+ */
 static int
-tran_sock_init(vfu_ctx_t *vfu_ctx)
+tcp_bind(const char *addr, int *fdp)
+{
+    struct addrinfo hints = {
+        .ai_flags = AI_PASSIVE,
+        .ai_socktype = SOCK_STREAM
+    };
+    struct addrinfo *res, *ai;
+    char *host, *port;
+    int one = 1;
+    int fd = -1;
+    size_t len;
+    int ret;
+
+    if ((host = strdup(addr)) == NULL) {
+        return -errno;
+    }
+    if ((port = strrchr(host, ':')) == NULL) {
+        free(host);
+        return -EINVAL;
+    }
+    *port++ = '\0';
+    len = strlen(host);
+    if (len >= 2 && host[0] == '[' && host[len - 1] == ']') {
+        host[len - 1] = '\0';
+        memmove(host, host + 1, len - 1);
+    }
+
+    ret = getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &res);
+    free(host);
+    if (ret != 0) {
+        return ret == EAI_SYSTEM ? -errno : -EINVAL;
+    }
+
+    ret = -EADDRNOTAVAIL;
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1) {
+            ret = -errno;
+            continue;
+        }
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == 0 &&
+            bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        ret = -errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd == -1) {
+        return ret;
+    }
+    *fdp = fd;
+    return 0;
+}
+
+static int
+unix_bind(const char *path, int type, int *fdp)
 {
     struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+    int ret;
+
+    ret = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (ret >= (int)sizeof(addr.sun_path)) {
+        return -ENAMETOOLONG;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    if ((fd = socket(AF_UNIX, type, 0)) == -1) {
+        return -errno;
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+
+    *fdp = fd;
+    return 0;
+}
+
+static int
+tran_sock_init(vfu_ctx_t *vfu_ctx)
+{
     tran_sock_t *ts = NULL;
     mode_t mode;
     int ret;
@@ -407,9 +660,30 @@ tran_sock_init(vfu_ctx_t *vfu_ctx)
 
     ts->listen_fd = -1;
     ts->conn_fd = -1;
+    ts->poll_fd = -1;
+    ts->event_fd = -1;
+    ts->pending_tail = &ts->pending;
+    pthread_mutex_init(&ts->lock, NULL);
+    pthread_cond_init(&ts->cond, NULL);
+    ts->seqpacket = vfu_ctx->flags & LIBVFIO_USER_FLAG_SEQPACKET;
+    ts->tcp = vfu_ctx->trans == VFU_TRANS_TCP;
+
+    if (vfu_ctx->flags & LIBVFIO_USER_FLAG_SHARED) {
+        /* The shared listener is a UNIX stream socket. */
+        ret = ts->seqpacket || ts->tcp ? -EINVAL : 0;
+        goto out;
+    }
 
-    if ((ts->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-        ret = -errno;
+    /* start listening business */
+    if (ts->tcp) {
+        ret = ts->seqpacket ? -EINVAL :
+              tcp_bind(vfu_ctx->uuid, &ts->listen_fd);
+    } else {
+        ret = unix_bind(vfu_ctx->uuid,
+                        ts->seqpacket ? SOCK_SEQPACKET : SOCK_STREAM,
+                        &ts->listen_fd);
+    }
+    if (ret < 0) {
         goto out;
     }
 
@@ -422,21 +696,6 @@ tran_sock_init(vfu_ctx_t *vfu_ctx)
         }
     }
 
-    ret = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", vfu_ctx->uuid);
-    if (ret >= (int)sizeof(addr.sun_path)) {
-        ret = -ENAMETOOLONG;
-    }
-    if (ret < 0) {
-        goto out;
-    }
-
-    /* start listening business */
-    ret = bind(ts->listen_fd, (struct sockaddr *)&addr, sizeof(addr));
-    if (ret < 0) {
-        ret = -errno;
-        goto out;
-    }
-
     ret = listen(ts->listen_fd, 0);
     if (ret < 0) {
         ret = -errno;
@@ -446,9 +705,13 @@ out:
     umask(mode);
 
     if (ret != 0) {
-        if (ts->listen_fd != -1) {
+        if (ts != NULL && ts->listen_fd != -1) {
             close(ts->listen_fd);
         }
+        if (ts != NULL) {
+            pthread_cond_destroy(&ts->cond);
+            pthread_mutex_destroy(&ts->lock);
+        }
         free(ts);
         return ret;
     }
@@ -463,7 +726,11 @@ tran_sock_get_poll_fd(vfu_ctx_t *vfu_ctx)
     tran_sock_t *ts = vfu_ctx->tran_data;
 
     if (ts->conn_fd != -1) {
-        return ts->conn_fd;
+        return ts->poll_fd;
+    }
+
+    if (ts->listener != NULL) {
+        return vfu_listener_get_poll_fd(ts->listener);
     }
 
     return ts->listen_fd;
@@ -475,6 +742,9 @@ tran_sock_get_poll_fd(vfu_ctx_t *vfu_ctx)
  * {
  *     "capabilities": {
  *         "max_fds": 32,
+ *         "max_msg_size": 65536,
+ *         "get_all_info": true,
+ *         "vm_interrupt": true,
  *         "migration": {
  *             "pgsize": 4096
  *         }
@@ -485,8 +755,9 @@ tran_sock_get_poll_fd(vfu_ctx_t *vfu_ctx)
  * available in newer library versions, so we don't use it.
  */
 int
-tran_parse_version_json(const char *json_str,
-                        int *client_max_fdsp, size_t *pgsizep)
+tran_parse_version_json(const char *json_str, int *client_max_fdsp,
+                        size_t *max_msg_sizep, size_t *pgsizep,
+                        bool *get_all_infop, bool *vm_interruptp)
 {
     struct json_object *jo_caps = NULL;
     struct json_object *jo_top = NULL;
@@ -519,6 +790,19 @@ tran_parse_version_json(const char *json_str,
         }
     }
 
+    if (json_object_object_get_ex(jo_caps, "max_msg_size", &jo)) {
+        if (json_object_get_type(jo) != json_type_int) {
+            goto out;
+        }
+
+        errno = 0;
+        *max_msg_sizep = (size_t)json_object_get_int64(jo);
+
+        if (errno != 0) {
+            goto out;
+        }
+    }
+
     if (json_object_object_get_ex(jo_caps, "migration", &jo)) {
         struct json_object *jo2 = NULL;
 
@@ -540,6 +824,22 @@ tran_parse_version_json(const char *json_str,
         }
     }
 
+    if (get_all_infop != NULL &&
+        json_object_object_get_ex(jo_caps, "get_all_info", &jo)) {
+        if (json_object_get_type(jo) != json_type_boolean) {
+            goto out;
+        }
+        *get_all_infop = json_object_get_boolean(jo);
+    }
+
+    if (vm_interruptp != NULL &&
+        json_object_object_get_ex(jo_caps, "vm_interrupt", &jo)) {
+        if (json_object_get_type(jo) != json_type_boolean) {
+            goto out;
+        }
+        *vm_interruptp = json_object_get_boolean(jo);
+    }
+
     ret = 0;
 
 out:
@@ -548,62 +848,53 @@ out:
     return ret;
 }
 
+/*
+ * Check the client version received in "cversion", and apply its capabilities
+ * to "vfu_ctx".
+ */
 static int
-recv_version(vfu_ctx_t *vfu_ctx, int sock, uint16_t *msg_idp,
-             struct vfio_user_version **versionp)
+check_version(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
+              const struct vfio_user_header *hdr,
+              struct vfio_user_version *cversion, size_t vlen)
 {
-    struct vfio_user_version *cversion = NULL;
-    struct vfio_user_header hdr;
-    size_t vlen = 0;
-    int ret;
-
-    *versionp = NULL;
-
-    ret = tran_sock_recv_alloc(sock, &hdr, false, msg_idp,
-                               (void **)&cversion, &vlen);
-
-    if (ret < 0) {
-        vfu_log(vfu_ctx, LOG_ERR, "failed to receive version: %s",
-                strerror(-ret));
-        return ret;
-    }
+    int ret = 0;
 
-    if (hdr.cmd != VFIO_USER_VERSION) {
+    if (hdr->cmd != VFIO_USER_VERSION) {
         vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: invalid cmd %hu (expected %u)",
-                *msg_idp, hdr.cmd, VFIO_USER_VERSION);
-        ret = -EINVAL;
-        goto out;
+                msg_id, hdr->cmd, VFIO_USER_VERSION);
+        return -EINVAL;
     }
 
     if (vlen < sizeof(*cversion)) {
         vfu_log(vfu_ctx, LOG_ERR,
-                "msg%#hx: VFIO_USER_VERSION: invalid size %lu", *msg_idp, vlen);
-        ret = -EINVAL;
-        goto out;
+                "msg%#hx: VFIO_USER_VERSION: invalid size %lu", msg_id, vlen);
+        return -EINVAL;
     }
 
     if (cversion->major != LIB_VFIO_USER_MAJOR) {
         vfu_log(vfu_ctx, LOG_ERR, "unsupported client major %hu (must be %u)",
                 cversion->major, LIB_VFIO_USER_MAJOR);
-        ret = -ENOTSUP;
-        goto out;
+        return -ENOTSUP;
     }
 
     vfu_ctx->client_max_fds = 1;
+    vfu_ctx->max_msg_size = VFIO_USER_DEFAULT_MAX_MSG_SIZE;
+    vfu_ctx->client_vm_interrupt = false;
 
     if (vlen > sizeof(*cversion)) {
         const char *json_str = (const char *)cversion->data;
         size_t len = vlen - sizeof(*cversion);
+        size_t max_msg_size = VFIO_USER_DEFAULT_MAX_MSG_SIZE;
         size_t pgsize = 0;
 
         if (json_str[len - 1] != '\0') {
             vfu_log(vfu_ctx, LOG_ERR, "ignoring invalid JSON from client");
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
 
         ret = tran_parse_version_json(json_str, &vfu_ctx->client_max_fds,
-                                      &pgsize);
+                                      &max_msg_size, &pgsize, NULL,
+                                      &vfu_ctx->client_vm_interrupt);
 
         if (ret < 0) {
             /* No client-supplied strings in the log for release build. */
@@ -613,7 +904,7 @@ recv_version(vfu_ctx_t *vfu_ctx, int sock, uint16_t *msg_idp,
 #else
             vfu_log(vfu_ctx, LOG_ERR, "failed to parse client JSON");
 #endif
-            goto out;
+            return ret;
         }
 
         if (vfu_ctx->migration != NULL && pgsize != 0) {
@@ -622,7 +913,7 @@ recv_version(vfu_ctx_t *vfu_ctx, int sock, uint16_t *msg_idp,
             if (ret != 0) {
                 vfu_log(vfu_ctx, LOG_ERR, "refusing client page size of %zu",
                         pgsize);
-                goto out;
+                return ret;
             }
         }
 
@@ -631,15 +922,63 @@ recv_version(vfu_ctx_t *vfu_ctx, int sock, uint16_t *msg_idp,
             vfu_ctx->client_max_fds > VFIO_USER_CLIENT_MAX_FDS_LIMIT) {
             vfu_log(vfu_ctx, LOG_ERR, "refusing client max_fds of %d",
                     vfu_ctx->client_max_fds);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
+        }
+
+        /*
+         * We must be able to fit at least one byte of DMA data in a message
+         * we send to the client.
+         */
+        if (max_msg_size <= sizeof(struct vfio_user_header) +
+                            sizeof(struct vfio_user_dma_region_access)) {
+            vfu_log(vfu_ctx, LOG_ERR, "refusing client max_msg_size of %zu",
+                    max_msg_size);
+            return -EINVAL;
         }
+
+        /* Replies to our messages must fit in what we are willing to receive. */
+        vfu_ctx->max_msg_size = MIN(max_msg_size, SERVER_MAX_MSG_SIZE);
     }
 
-out:
+    /*
+     * Whatever the client says, nothing can be passed over TCP, so interrupts
+     * can only be posted.
+     */
+    if (vfu_ctx->trans == VFU_TRANS_TCP) {
+        vfu_ctx->client_max_fds = 0;
+        vfu_ctx->client_vm_interrupt = true;
+    }
+
+    return ret;
+}
+
+static int
+recv_version(vfu_ctx_t *vfu_ctx, int sock, uint16_t *msg_idp,
+             struct vfio_user_version **versionp)
+{
+    struct vfio_user_version *cversion = NULL;
+    tran_sock_t *ts = vfu_ctx->tran_data;
+    struct vfio_user_header hdr;
+    size_t vlen = 0;
+    int ret;
+
+    *versionp = NULL;
+
+    ret = tran_sock_recv_alloc(sock, ts->seqpacket ? SOCK_SEQPACKET :
+                               SOCK_STREAM, &hdr, false, msg_idp,
+                               (void **)&cversion, &vlen);
+
+    if (ret < 0) {
+        vfu_log(vfu_ctx, LOG_ERR, "failed to receive version: %s",
+                strerror(-ret));
+        return ret;
+    }
+
+    ret = check_version(vfu_ctx, *msg_idp, &hdr, cversion, vlen);
+
     if (ret != 0) {
         // FIXME: spec, is it OK to just have the header?
-        (void) tran_sock_send_error(sock, *msg_idp, hdr.cmd, ret);
+        (void) tran_sock_send_error(sock, *msg_idp, hdr.cmd, -ret);
         free(cversion);
         cversion = NULL;
     }
@@ -655,29 +994,40 @@ send_version(vfu_ctx_t *vfu_ctx, int sock, uint16_t msg_id,
     struct vfio_user_version sversion = { 0 };
     struct iovec iovecs[3] = { { 0 } };
     char server_caps[1024];
-    int slen;
-
-    if (vfu_ctx->migration == NULL) {
-        slen = snprintf(server_caps, sizeof(server_caps),
-            "{"
-                "\"capabilities\":{"
-                    "\"max_fds\":%u,"
-                    "\"max_msg_size\":%u"
-                "}"
-             "}", SERVER_MAX_FDS, SERVER_MAX_MSG_SIZE);
-    } else {
-        slen = snprintf(server_caps, sizeof(server_caps),
-            "{"
-                "\"capabilities\":{"
-                    "\"max_fds\":%u,"
-                    "\"max_msg_size\":%u,"
-                    "\"migration\":{"
-                        "\"pgsize\":%zu"
-                    "}"
-                "}"
-             "}", SERVER_MAX_FDS, SERVER_MAX_MSG_SIZE,
-                  migration_get_pgsize(vfu_ctx->migration));
+    uint32_t functions = 1;
+    int slen, i;
+
+    slen = snprintf(server_caps, sizeof(server_caps),
+        "{"
+            "\"capabilities\":{"
+                "\"max_fds\":%u,"
+                "\"max_msg_size\":%u,"
+                "\"get_all_info\":true",
+                vfu_ctx->trans == VFU_TRANS_TCP ? 0 : SERVER_MAX_FDS,
+                SERVER_MAX_MSG_SIZE);
+
+    if (vfu_ctx->migration != NULL) {
+        slen += snprintf(server_caps + slen, sizeof(server_caps) - slen,
+                ","
+                "\"migration\":{"
+                    "\"pgsize\":%zu"
+                "}", migration_get_pgsize(vfu_ctx->migration));
+    }
+
+    for (i = 1; i < VFU_PCI_MAX_FUNCTIONS; i++) {
+        if (vfu_ctx->functions[i] != NULL) {
+            functions |= 1U << i;
+        }
     }
+    if (functions != 1) {
+        slen += snprintf(server_caps + slen, sizeof(server_caps) - slen,
+                ","
+                "\"functions\":%u", functions);
+    }
+
+    slen += snprintf(server_caps + slen, sizeof(server_caps) - slen,
+            "}"
+         "}");
 
     // FIXME: we should save the client minor here, and check that before trying
     // to send unsupported things.
@@ -720,17 +1070,87 @@ negotiate(vfu_ctx_t *vfu_ctx, int sock)
     return ret;
 }
 
+static void
+conn_close_poll(tran_sock_t *ts)
+{
+    if (ts->poll_fd != -1) {
+        (void) close(ts->poll_fd);
+        ts->poll_fd = -1;
+    }
+    if (ts->event_fd != -1) {
+        (void) close(ts->event_fd);
+        ts->event_fd = -1;
+    }
+    ts->ready = false;
+    ts->wake = false;
+}
+
+/*
+ * Messages can be received before they're asked for, while waiting for a
+ * reply, and are then no longer readable on the socket. The poll fd is an
+ * epoll instance that is also readable while they wait, see ready_update().
+ */
 static int
-tran_sock_attach(vfu_ctx_t *vfu_ctx)
+conn_setup_poll(tran_sock_t *ts)
 {
-    tran_sock_t *ts;
+    struct epoll_event ev = { .events = EPOLLIN };
     int ret;
 
-    assert(vfu_ctx != NULL);
-    assert(vfu_ctx->tran_data != NULL);
+    ts->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ts->event_fd == -1) {
+        return -errno;
+    }
+    ts->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ts->poll_fd == -1 ||
+        epoll_ctl(ts->poll_fd, EPOLL_CTL_ADD, ts->conn_fd, &ev) == -1 ||
+        epoll_ctl(ts->poll_fd, EPOLL_CTL_ADD, ts->event_fd, &ev) == -1) {
+        ret = -errno;
+        conn_close_poll(ts);
+        return ret;
+    }
+    ts->ready = false;
+    return 0;
+}
+
+/*
+ * Replies are already coalesced by tran_sock_reply(), so Nagle's algorithm
+ * would only delay them. Both options are best effort.
+ */
+static void
+tcp_setup_conn(vfu_ctx_t *vfu_ctx, tran_sock_t *ts)
+{
+    int one = 1;
+
+    if (setsockopt(ts->conn_fd, IPPROTO_TCP, TCP_NODELAY, &one,
+                   sizeof(one)) == -1) {
+        vfu_log(vfu_ctx, LOG_DEBUG, "failed to set TCP_NODELAY: %m");
+    }
+
+    ts->zerocopy = setsockopt(ts->conn_fd, SOL_SOCKET, SO_ZEROCOPY, &one,
+                              sizeof(one)) == 0;
+    ts->zc_sent = ts->zc_done = 0;
+}
+
+static int
+tran_sock_attach(vfu_ctx_t *vfu_ctx)
+{
+    tran_sock_t *ts;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+    assert(vfu_ctx->tran_data != NULL);
 
     ts = vfu_ctx->tran_data;
 
+    if (vfu_ctx->flags & LIBVFIO_USER_FLAG_SHARED) {
+        /* The connection is set up by vfu_listener_accept(). */
+        if (ts->conn_fd == -1) {
+            errno = EAGAIN;
+            return -1;
+        }
+        return 0;
+    }
+
     if (ts->conn_fd != -1) {
         vfu_log(vfu_ctx, LOG_ERR, "%s: already attached with fd=%d",
                 __func__, ts->conn_fd);
@@ -743,7 +1163,14 @@ tran_sock_attach(vfu_ctx_t *vfu_ctx)
         return -1;
     }
 
+    if (ts->tcp) {
+        tcp_setup_conn(vfu_ctx, ts);
+    }
+
     ret = negotiate(vfu_ctx, ts->conn_fd);
+    if (ret == 0) {
+        ret = conn_setup_poll(ts);
+    }
     if (ret < 0) {
         close(ts->conn_fd);
         ts->conn_fd = -1;
@@ -754,151 +1181,1470 @@ tran_sock_attach(vfu_ctx_t *vfu_ctx)
     return 0;
 }
 
-static int
-tran_sock_get_request(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr,
-                      int *fds, size_t *nr_fds)
+/*
+ * Reads the completions of MSG_ZEROCOPY sends that have arrived, without
+ * waiting for the others: they are only queued on the socket, which polls
+ * with POLLERR until they're read. If the kernel had to copy the pages anyway,
+ * as it does over loopback, MSG_ZEROCOPY is turned off for the connection.
+ */
+static void
+zerocopy_reap(tran_sock_t *ts)
 {
-    tran_sock_t *ts;
-    int sock_flags = 0;
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) +
+                 CMSG_SPACE(sizeof(struct sockaddr_in6))];
+    struct sock_extended_err *serr;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
 
-    assert(vfu_ctx != NULL);
-    assert(vfu_ctx->tran_data != NULL);
+    while (ts->zc_done != ts->zc_sent) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
 
-    ts = vfu_ctx->tran_data;
+        /* Reading the error queue never blocks. */
+        if (recvmsg(ts->conn_fd, &msg, MSG_ERRQUEUE) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
 
-    if (ts->conn_fd == -1) {
-        vfu_log(vfu_ctx, LOG_ERR, "%s: not connected", __func__);
-        return -ENOTCONN;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP &&
+                  cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 &&
+                  cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+                serr->ee_errno != 0) {
+                continue;
+            }
+            /* Sends [ee_info, ee_data] have completed. */
+            ts->zc_done = serr->ee_data + 1;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                ts->zerocopy = false;
+            }
+        }
     }
+}
 
-    /*
-     * TODO ideally we should set O_NONBLOCK on the fd so that the syscall is
-     * faster (?). I tried that and get short reads, so we need to store the
-     * partially received buffer somewhere and retry.
-     */
-    if (vfu_ctx->flags & LIBVFIO_USER_FLAG_ATTACH_NB) {
-        sock_flags = MSG_DONTWAIT | MSG_WAITALL;
+/*
+ * Messages are received into ts->rx, which can hold the largest one we accept:
+ * in stream mode, as many of them as a single recvmsg() returns, otherwise a
+ * single SOCK_SEQPACKET record. They are then handed out one by one from
+ * there by recv_msg(), which copies out what it doesn't consume right away.
+ */
+
+/*
+ * Returns the size of the message at @off in ts->rx, 0 if it hasn't been
+ * received in full yet, or -EINVAL if its header is bad. The header is copied
+ * to @hdr if non-NULL.
+ */
+static int
+rx_msg_size(const tran_sock_t *ts, size_t off, struct vfio_user_header *hdr)
+{
+    struct vfio_user_header _hdr;
+
+    if (hdr == NULL) {
+        hdr = &_hdr;
+    }
+    if (ts->rx_tail - off < sizeof(*hdr)) {
+        return 0;
+    }
+    memcpy(hdr, ts->rx + off, sizeof(*hdr));
+    if (hdr->msg_size < sizeof(*hdr) || hdr->msg_size > SERVER_MAX_MSG_SIZE) {
+        return -EINVAL;
     }
-    return get_msg(hdr, sizeof(*hdr), fds, nr_fds, ts->conn_fd, sock_flags);
+    return ts->rx_tail - off >= hdr->msg_size ? (int)hdr->msg_size : 0;
 }
 
-static int
-tran_sock_recv_body(vfu_ctx_t *vfu_ctx, const struct vfio_user_header *hdr,
-                    void **datap)
+/* Returns how many more bytes the message at rx_head needs. */
+static size_t
+rx_missing(const tran_sock_t *ts)
 {
-    size_t body_size;
-    tran_sock_t *ts;
-    void *data;
-    int ret;
+    struct vfio_user_header hdr;
+    size_t len = ts->rx_tail - ts->rx_head;
 
-    assert(vfu_ctx != NULL);
-    assert(vfu_ctx->tran_data != NULL);
-    assert(hdr != NULL);
+    if (len < sizeof(hdr)) {
+        return sizeof(hdr) - len;
+    }
+    memcpy(&hdr, ts->rx + ts->rx_head, sizeof(hdr));
+    return hdr.msg_size - len;
+}
 
-    if (hdr->msg_size > SERVER_MAX_MSG_SIZE) {
-        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: size of %u is too large",
-                hdr->msg_id, hdr->msg_size);
-        return -EINVAL;
+/*
+ * Returns the offset of the last message starting in ts->rx. The kernel only
+ * returns fds along with the data they were sent with, and doesn't read past
+ * it, so fds just received belong to that message.
+ */
+static size_t
+rx_last_msg(const tran_sock_t *ts)
+{
+    size_t off = ts->rx_head;
+    int size;
+
+    while ((size = rx_msg_size(ts, off, NULL)) > 0 &&
+           off + size < ts->rx_tail) {
+        off += size;
     }
+    return off;
+}
 
-    ts = vfu_ctx->tran_data;
+static void
+rx_close_fds(tran_sock_t *ts)
+{
+    while (ts->rx_nr_fds > 0) {
+        close(ts->rx_fds[--ts->rx_nr_fds]);
+    }
+}
 
-    body_size = hdr->msg_size - sizeof(*hdr);
+/* Drops the message returned last by rx_next(). */
+static void
+rx_consume(tran_sock_t *ts)
+{
+    ts->rx_head += ts->rx_cur;
+    ts->rx_cur = 0;
+    if (ts->rx_head == ts->rx_tail) {
+        ts->rx_head = ts->rx_tail = 0;
+    }
+}
+
+/* Receives more data into ts->rx with a single recvmsg(). */
+static int
+rx_fill(tran_sock_t *ts, int sock_flags)
+{
+    struct vfio_user_header hdr;
+    int fds[SERVER_MAX_FDS];
+    size_t nr_fds = SERVER_MAX_FDS;
+    struct iovec iov;
+    int ret;
 
-    data = malloc(body_size);
+    if (ts->rx == NULL) {
+        ts->rx = malloc(SERVER_MAX_MSG_SIZE);
+        if (ts->rx == NULL) {
+            return -errno;
+        }
+    }
 
-    if (data == NULL) {
-        return -errno;
+    /* Make room for the rest of the message at rx_head. */
+    if (ts->rx_head > 0) {
+        memmove(ts->rx, ts->rx + ts->rx_head, ts->rx_tail - ts->rx_head);
+        ts->rx_tail -= ts->rx_head;
+        ts->rx_fds_off -= MIN(ts->rx_fds_off, ts->rx_head);
+        ts->rx_head = 0;
     }
 
-    ret = recv(ts->conn_fd, data, body_size, 0);
+    iov.iov_base = ts->rx + ts->rx_tail;
+    iov.iov_len = SERVER_MAX_MSG_SIZE - ts->rx_tail;
+    if (ts->seqpacket) {
+        sock_flags |= MSG_TRUNC;
+    } else if (ts->rx_nr_fds > 0) {
+        /* Fds coming with the next message would have nowhere to go. */
+        iov.iov_len = rx_missing(ts);
+    }
 
+    /* Only the reader touches ts->rx, see recv_msg(). */
+    pthread_mutex_unlock(&ts->lock);
+    ret = get_msg_iovec(&iov, 1, 1, fds, &nr_fds, ts->conn_fd, sock_flags);
+    pthread_mutex_lock(&ts->lock);
     if (ret < 0) {
-        ret = -errno;
-        free(data);
         return ret;
-    } else if (ret == 0) {
-        free(data);
-        return -ENOMSG;
-    } else if (ret != (int)body_size) {
-        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: short read: expected=%zu, actual=%d",
-                hdr->msg_id, body_size, ret);
-        free(data);
-        return -ECONNRESET;
     }
 
-    *datap = data;
+    /* Anything beyond SERVER_MAX_MSG_SIZE has been discarded. */
+    if (ts->seqpacket &&
+        ((size_t)ret < sizeof(hdr) || ret > SERVER_MAX_MSG_SIZE ||
+         (memcpy(&hdr, ts->rx, sizeof(hdr)), hdr.msg_size != (size_t)ret))) {
+        ret = -EINVAL;
+    } else if (nr_fds > 0 && ts->rx_nr_fds > 0) {
+        /* More fds sent with a message that already has some. */
+        ret = -EINVAL;
+    }
+    if (ret < 0) {
+        while (nr_fds > 0) {
+            close(fds[--nr_fds]);
+        }
+        return ret;
+    }
+
+    ts->rx_tail += ret;
+    if (nr_fds > 0) {
+        memcpy(ts->rx_fds, fds, nr_fds * sizeof(int));
+        ts->rx_nr_fds = nr_fds;
+        ts->rx_fds_off = rx_last_msg(ts);
+    }
     return 0;
 }
 
+/*
+ * Returns the next message received, its header in @hdr and the fds sent with
+ * it in @fds, excess ones being closed. Its body is left in ts->rx until the
+ * next call. If a whole message hasn't been received yet, receives more data,
+ * until there is one, or only once with MSG_DONTWAIT in @sock_flags.
+ */
 static int
-tran_sock_reply(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
-                struct iovec *iovecs, size_t nr_iovecs,
-                int *fds, int count, int err)
+rx_next(tran_sock_t *ts, struct vfio_user_header *hdr, int *fds,
+        size_t *nr_fds, int sock_flags)
 {
-    tran_sock_t *ts;
+    bool filled = false;
+    size_t n = 0;
+    int ret;
 
-    assert(vfu_ctx != NULL);
-    assert(vfu_ctx->tran_data != NULL);
+    rx_consume(ts);
 
-    ts = vfu_ctx->tran_data;
+    while ((ret = rx_msg_size(ts, ts->rx_head, hdr)) == 0) {
+        if (filled && (sock_flags & MSG_DONTWAIT)) {
+            return -EAGAIN;
+        }
+        ret = rx_fill(ts, sock_flags);
+        if (ret < 0) {
+            return ret;
+        }
+        filled = true;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    ts->rx_cur = ret;
 
-    // FIXME: SPEC: should the reply include the command? I'd say yes?
-    return tran_sock_send_iovec(ts->conn_fd, msg_id, true, 0,
-                                iovecs, nr_iovecs, fds, count, err);
+    if (ts->rx_nr_fds > 0 && ts->rx_fds_off == ts->rx_head) {
+        if (nr_fds != NULL) {
+            n = MIN(*nr_fds, ts->rx_nr_fds);
+            memcpy(fds, ts->rx_fds, n * sizeof(int));
+        }
+        while (ts->rx_nr_fds > n) {
+            close(ts->rx_fds[--ts->rx_nr_fds]);
+        }
+        ts->rx_nr_fds = 0;
+    }
+    if (nr_fds != NULL) {
+        *nr_fds = n;
+    }
+    return sizeof(*hdr);
 }
 
-static int
-tran_sock_send_msg(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
-              enum vfio_user_command cmd,
-              void *send_data, size_t send_len,
-              struct vfio_user_header *hdr,
-              void *recv_data, size_t recv_len)
+/* Returns the body of the message returned last by rx_next(). */
+static void *
+rx_body(const tran_sock_t *ts)
 {
-    tran_sock_t *ts;
+    return ts->rx + ts->rx_head + sizeof(struct vfio_user_header);
+}
 
-    assert(vfu_ctx != NULL);
-    assert(vfu_ctx->tran_data != NULL);
+static void
+rx_reset(tran_sock_t *ts)
+{
+    ts->rx_head = ts->rx_tail = ts->rx_cur = 0;
+    rx_close_fds(ts);
+}
 
-    ts = vfu_ctx->tran_data;
+static void
+pending_msg_free(struct pending_msg *msg)
+{
+    size_t i;
 
-    return tran_sock_msg(ts->conn_fd, msg_id, cmd, send_data, send_len,
-                         hdr, recv_data, recv_len);
+    if (msg == NULL) {
+        return;
+    }
+    for (i = 0; i < msg->nr_fds; i++) {
+        close(msg->fds[i]);
+    }
+    free(msg->fds);
+    free(msg->data);
+    free(msg);
 }
 
 static void
-tran_sock_detach(vfu_ctx_t *vfu_ctx)
+pending_msgs_free(tran_sock_t *ts)
 {
-    tran_sock_t *ts;
+    struct pending_msg *msg;
 
-    assert(vfu_ctx != NULL);
+    while ((msg = ts->pending) != NULL) {
+        ts->pending = msg->next;
+        pending_msg_free(msg);
+    }
+    ts->pending_tail = &ts->pending;
+    ts->nr_pending = 0;
+    free(ts->body);
+    ts->body = NULL;
+}
 
-    ts = vfu_ctx->tran_data;
+/*
+ * Copies the message just received by rx_next() out of ts->rx, along with its
+ * body and @fds. Closes the latter on failure.
+ */
+static struct pending_msg *
+pending_msg_new(tran_sock_t *ts, const struct vfio_user_header *hdr,
+                int *fds, size_t nr_fds)
+{
+    struct pending_msg *msg;
+    size_t body_size;
 
-    if (ts != NULL && ts->conn_fd != -1) {
-        // FIXME: handle EINTR
-        (void) close(ts->conn_fd);
-        ts->conn_fd = -1;
+    msg = calloc(1, sizeof(*msg));
+    if (msg == NULL) {
+        goto err_out;
+    }
+    msg->hdr = *hdr;
+
+    if (nr_fds > 0) {
+        msg->fds = malloc(nr_fds * sizeof(int));
+        if (msg->fds == NULL) {
+            goto err_out;
+        }
+        memcpy(msg->fds, fds, nr_fds * sizeof(int));
+        msg->nr_fds = nr_fds;
+        nr_fds = 0;
+    }
+
+    body_size = hdr->msg_size - sizeof(*hdr);
+    if (body_size > 0) {
+        msg->data = malloc(body_size);
+        if (msg->data == NULL) {
+            goto err_out;
+        }
+        memcpy(msg->data, rx_body(ts), body_size);
     }
+    return msg;
+
+err_out:
+    while (nr_fds > 0) {
+        close(fds[--nr_fds]);
+    }
+    pending_msg_free(msg);
+    return NULL;
+}
+
+static int
+pending_msg_pop(tran_sock_t *ts, struct vfio_user_header *hdr, int *fds,
+                size_t *nr_fds)
+{
+    struct pending_msg *msg = ts->pending;
+    size_t n = 0;
+
+    ts->pending = msg->next;
+    if (ts->pending == NULL) {
+        ts->pending_tail = &ts->pending;
+    }
+    ts->nr_pending--;
+
+    *hdr = msg->hdr;
+    /* Excess fds are closed when the message is freed. */
+    if (nr_fds != NULL) {
+        n = MIN(*nr_fds, msg->nr_fds);
+        memcpy(fds, msg->fds, n * sizeof(int));
+        *nr_fds = n;
+    }
+    memmove(msg->fds, msg->fds + n, (msg->nr_fds - n) * sizeof(int));
+    msg->nr_fds -= n;
+
+    ts->body = msg->data;
+    msg->data = NULL;
+    pending_msg_free(msg);
+    return sizeof(*hdr);
+}
+
+/*
+ * Whether messages have been received that are yet to be returned. Only looks
+ * at what's been received already, so that vfu_run_ctx() handles the requests
+ * a single read returned before polling again.
+ */
+static bool
+msgs_pending(const tran_sock_t *ts)
+{
+    if (ts->pending != NULL) {
+        return true;
+    }
+
+    /* A bad header is also for get_request() to report. */
+    return ts->conn_fd != -1 && rx_msg_size(ts, ts->rx_head, NULL) != 0;
 }
 
+/*
+ * Makes the poll fd readable while msgs_pending() or woken, see
+ * conn_setup_poll().
+ */
 static void
-tran_sock_fini(vfu_ctx_t *vfu_ctx)
+ready_update(tran_sock_t *ts)
 {
-    tran_sock_t *ts;
+    bool ready = msgs_pending(ts) || ts->wake;
+    uint64_t val = 1;
 
-    assert(vfu_ctx != NULL);
+    if (ready == ts->ready || ts->event_fd == -1) {
+        return;
+    }
+    if (ready) {
+        (void) write(ts->event_fd, &val, sizeof(val));
+    } else {
+        (void) read(ts->event_fd, &val, sizeof(val));
+    }
+    ts->ready = ready;
+}
 
-    ts = vfu_ctx->tran_data;
+/*
+ * Receives the next message as the reader of the connection, see ts->reading.
+ * A reply to commands in ts->waits is kept there for get_reply(). Anything else
+ * is for get_request(): it's returned if @request is set, with its body in
+ * ts->body, and otherwise queued.
+ *
+ * Returns 1 if the message is returned, 0 if it's been kept or queued, or
+ * -errno.
+ */
+static int
+recv_msg(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr, int *fds,
+         size_t *nr_fds, int sock_flags, bool request)
+{
+    tran_sock_t *ts = vfu_ctx->tran_data;
+    struct reply_wait *wait = NULL;
+    struct pending_msg *msg;
+    size_t body_size;
+    size_t no_fds = 0;
+    int ret;
 
-    if (ts != NULL && ts->listen_fd != -1) {
-        // FIXME: handle EINTR
-        (void) close(ts->listen_fd);
-        ts->listen_fd = -1;
+    ts->reading = true;
+    ret = rx_next(ts, hdr, fds, nr_fds, sock_flags);
+    ts->reading = false;
+    if (ret < 0) {
+        goto out;
+    }
+    if (nr_fds == NULL) {
+        nr_fds = &no_fds;
     }
 
-    free(vfu_ctx->tran_data);
-    vfu_ctx->tran_data = NULL;
+    if (hdr->flags.type == VFIO_USER_F_TYPE_REPLY) {
+        for (wait = ts->waits; wait != NULL; wait = wait->next) {
+            if ((uint16_t)(hdr->msg_id - wait->first_id) < wait->nr) {
+                break;
+            }
+        }
+    }
+
+    if (wait == NULL && request) {
+        body_size = hdr->msg_size - sizeof(*hdr);
+        ret = 1;
+        if (body_size > 0) {
+            ts->body = malloc(body_size);
+            if (ts->body == NULL) {
+                ret = -errno;
+                while (*nr_fds > 0) {
+                    close(fds[--*nr_fds]);
+                }
+                goto out;
+            }
+            memcpy(ts->body, rx_body(ts), body_size);
+        }
+        goto out;
+    }
+
+    if (wait != NULL) {
+        while (*nr_fds > 0) {
+            close(fds[--*nr_fds]);
+        }
+    } else if (ts->nr_pending == MAX_PENDING_MSGS) {
+        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: too many messages queued while "
+                "waiting for reply", hdr->msg_id);
+        while (*nr_fds > 0) {
+            close(fds[--*nr_fds]);
+        }
+        ret = -ENOBUFS;
+        goto out;
+    }
+
+    msg = pending_msg_new(ts, hdr, fds, *nr_fds);
+    if (msg == NULL) {
+        ret = -errno;
+        goto out;
+    }
+
+    if (wait != NULL) {
+        msg->next = wait->replies;
+        wait->replies = msg;
+    } else {
+        vfu_log(vfu_ctx, LOG_DEBUG, "msg%#hx: queued cmd %d while waiting for "
+                "reply", hdr->msg_id, hdr->cmd);
+        *ts->pending_tail = msg;
+        ts->pending_tail = &msg->next;
+        ts->nr_pending++;
+    }
+    ret = 0;
+
+out:
+    rx_consume(ts);
+    ready_update(ts);
+    pthread_cond_broadcast(&ts->cond);
+    return ret;
+}
+
+static bool
+tran_sock_has_pending(vfu_ctx_t *vfu_ctx)
+{
+    tran_sock_t *ts;
+    bool ret;
+
+    assert(vfu_ctx != NULL);
+    assert(vfu_ctx->tran_data != NULL);
+
+    ts = vfu_ctx->tran_data;
+
+    pthread_mutex_lock(&ts->lock);
+    ret = msgs_pending(ts);
+    pthread_mutex_unlock(&ts->lock);
+    return ret;
+}
+
+static void
+tran_sock_wake(vfu_ctx_t *vfu_ctx, bool wake)
+{
+    tran_sock_t *ts;
+
+    assert(vfu_ctx != NULL);
+    assert(vfu_ctx->tran_data != NULL);
+
+    ts = vfu_ctx->tran_data;
+
+    pthread_mutex_lock(&ts->lock);
+    ts->wake = wake;
+    ready_update(ts);
+    pthread_mutex_unlock(&ts->lock);
+}
+
+/*
+ * If another thread is reading, waits for it to hand over what it receives,
+ * unless non-blocking.
+ */
+static int
+tran_sock_get_request(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr,
+                      int *fds, size_t *nr_fds)
+{
+    tran_sock_t *ts;
+    int sock_flags = 0;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+    assert(vfu_ctx->tran_data != NULL);
+
+    ts = vfu_ctx->tran_data;
+
+    if (vfu_ctx->flags & LIBVFIO_USER_FLAG_ATTACH_NB) {
+        sock_flags = MSG_DONTWAIT;
+    }
+
+    pthread_mutex_lock(&ts->lock);
+
+    /* The body of the previous one wasn't needed. */
+    free(ts->body);
+    ts->body = NULL;
+
+    while (true) {
+        if (ts->pending != NULL) {
+            ret = pending_msg_pop(ts, hdr, fds, nr_fds);
+            break;
+        }
+        if (ts->conn_fd == -1) {
+            vfu_log(vfu_ctx, LOG_ERR, "%s: not connected", __func__);
+            ret = -ENOTCONN;
+            break;
+        }
+        if (ts->rx_err != 0) {
+            ret = ts->rx_err;
+            break;
+        }
+        if (ts->reading) {
+            if (sock_flags & MSG_DONTWAIT) {
+                ret = -EAGAIN;
+                break;
+            }
+            pthread_cond_wait(&ts->cond, &ts->lock);
+            continue;
+        }
+
+        zerocopy_reap(ts);
+
+        ret = recv_msg(vfu_ctx, hdr, fds, nr_fds, sock_flags, true);
+        if (ret == 1) {
+            ret = sizeof(*hdr);
+            break;
+        } else if (ret < 0) {
+            if (ret != -EAGAIN && ret != -EINTR) {
+                ts->rx_err = ret;
+            }
+            break;
+        }
+
+        /* A reply was kept, go on without reading again if non-blocking. */
+        if ((sock_flags & MSG_DONTWAIT) && !msgs_pending(ts)) {
+            ret = -EAGAIN;
+            break;
+        }
+    }
+
+    ready_update(ts);
+    pthread_mutex_unlock(&ts->lock);
+    return ret;
+}
+
+/* Only the thread calling get_request() uses ts->body. */
+static int
+tran_sock_recv_body(vfu_ctx_t *vfu_ctx, const struct vfio_user_header *hdr,
+                    void **datap)
+{
+    tran_sock_t *ts;
+
+    assert(vfu_ctx != NULL);
+    assert(vfu_ctx->tran_data != NULL);
+    assert(hdr != NULL);
+
+    ts = vfu_ctx->tran_data;
+
+    *datap = ts->body;
+    ts->body = NULL;
+    return 0;
+}
+
+/*
+ * Sends a DMA write with MSG_ZEROCOPY if it's large enough, returns -ENOTSUP
+ * if it should be sent the usual way instead.
+ *
+ * The caller doesn't wait for the kernel to release the pages: the client's
+ * reply, which the caller waits for before reusing them, means it received
+ * the data, so that anything the kernel might still send from them is
+ * discarded as a duplicate. Were the connection to fail instead, it's reset
+ * and its send queue dropped, see tran_sock_detach().
+ */
+static int
+send_zerocopy(tran_sock_t *ts, uint16_t msg_id, bool no_reply,
+              uint8_t function, enum vfio_user_command cmd,
+              struct iovec *iovecs, size_t nr_iovecs)
+{
+    int ret;
+
+    pthread_mutex_lock(&ts->lock);
+    zerocopy_reap(ts);
+    pthread_mutex_unlock(&ts->lock);
+
+    if (!ts->zerocopy || cmd != VFIO_USER_DMA_WRITE || no_reply ||
+        nr_iovecs < 3 || iovecs[nr_iovecs - 1].iov_len < ZEROCOPY_MIN_SIZE) {
+        return -ENOTSUP;
+    }
+
+    ret = send_iovec(ts->conn_fd, MSG_NOSIGNAL | MSG_ZEROCOPY, msg_id,
+                     false, no_reply, function, cmd, iovecs, nr_iovecs,
+                     NULL, 0, 0);
+    if (ret == 1) {
+        pthread_mutex_lock(&ts->lock);
+        ts->zc_sent++;
+        pthread_mutex_unlock(&ts->lock);
+        ret = 0;
+    }
+    return ret;
+}
+
+static int
+cork_flush(tran_sock_t *ts)
+{
+    size_t off = 0;
+    ssize_t ret;
+
+    while (off < ts->cork_len) {
+        ret = send(ts->conn_fd, ts->cork + off, ts->cork_len - off,
+                   MSG_NOSIGNAL);
+        if (ret == -1) {
+            ts->cork_len = 0;
+            /* Treat a failed write due to EPIPE the same as a short write. */
+            return errno == EPIPE ? -ECONNRESET : -errno;
+        }
+        off += ret;
+    }
+
+    ts->cork_len = 0;
+    return 0;
+}
+
+/* Appends the reply to the cork buffer, which must have room for it. */
+static void
+cork_append(tran_sock_t *ts, uint16_t msg_id, struct iovec *iovecs,
+            size_t nr_iovecs, int err)
+{
+    struct vfio_user_header hdr = {
+        .msg_id = msg_id,
+        .flags.type = VFIO_USER_F_TYPE_REPLY,
+        .msg_size = sizeof(hdr)
+    };
+    char *p = ts->cork + ts->cork_len;
+    size_t i;
+
+    if (err != 0) {
+        hdr.flags.error = 1U;
+        hdr.error_no = err;
+    }
+
+    for (i = 1; i < nr_iovecs; i++) {
+        hdr.msg_size += iovecs[i].iov_len;
+    }
+    assert(ts->cork_len + hdr.msg_size <= REPLY_CORK_SIZE);
+
+    memcpy(p, &hdr, sizeof(hdr));
+    p += sizeof(hdr);
+    for (i = 1; i < nr_iovecs; i++) {
+        memcpy(p, iovecs[i].iov_base, iovecs[i].iov_len);
+        p += iovecs[i].iov_len;
+    }
+    ts->cork_len += hdr.msg_size;
+}
+
+/*
+ * If @more is set, the client has already sent further requests: the reply
+ * is held back, and sent along with the following ones in a single send(),
+ * once a reply without @more is sent or the buffer is full. Replies passing
+ * fds, or too large for the buffer, are sent on their own.
+ */
+static int
+tran_sock_reply(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
+                struct iovec *iovecs, size_t nr_iovecs,
+                int *fds, int count, int err, bool more)
+{
+    size_t size = sizeof(struct vfio_user_header);
+    tran_sock_t *ts;
+    size_t i;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+    assert(vfu_ctx->tran_data != NULL);
+
+    ts = vfu_ctx->tran_data;
+
+    for (i = 1; i < nr_iovecs; i++) {
+        size += iovecs[i].iov_len;
+    }
+
+    /* Coalescing would merge SOCK_SEQPACKET records. */
+    if (!ts->seqpacket && count == 0 && size <= REPLY_CORK_SIZE &&
+        (more || ts->cork_len > 0)) {
+        if (ts->cork == NULL) {
+            ts->cork = malloc(REPLY_CORK_SIZE);
+            if (ts->cork == NULL) {
+                return -errno;
+            }
+        }
+        if (ts->cork_len + size > REPLY_CORK_SIZE) {
+            ret = cork_flush(ts);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        cork_append(ts, msg_id, iovecs, nr_iovecs, err);
+        return more ? 0 : cork_flush(ts);
+    }
+
+    ret = cork_flush(ts);
+    if (ret < 0) {
+        return ret;
+    }
+
+    // FIXME: SPEC: should the reply include the command? I'd say yes?
+    return tran_sock_send_iovec(ts->conn_fd, msg_id, true, 0,
+                                iovecs, nr_iovecs, fds, count, err);
+}
+
+static int
+tran_sock_flush(vfu_ctx_t *vfu_ctx)
+{
+    assert(vfu_ctx != NULL);
+    assert(vfu_ctx->tran_data != NULL);
+
+    return cork_flush(vfu_ctx->tran_data);
+}
+
+static int
+tran_sock_send_cmd(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
+                   enum vfio_user_command cmd,
+                   struct iovec *iovecs, size_t nr_iovecs, bool no_reply,
+                   uint8_t function)
+{
+    tran_sock_t *ts;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+    assert(vfu_ctx->tran_data != NULL);
+
+    ts = vfu_ctx->tran_data;
+
+    if (ts->conn_fd == -1) {
+        return -ENOTCONN;
+    }
+
+    /* The client must see our replies before we wait for its own. */
+    ret = cork_flush(ts);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = send_zerocopy(ts, msg_id, no_reply, function, cmd, iovecs,
+                        nr_iovecs);
+    if (ret != -ENOTSUP) {
+        return ret;
+    }
+
+    if (no_reply || function != 0) {
+        return send_iovec(ts->conn_fd, MSG_NOSIGNAL, msg_id, false, no_reply,
+                          function, cmd, iovecs, nr_iovecs, NULL, 0, 0);
+    }
+    return tran_sock_send_iovec(ts->conn_fd, msg_id, false, cmd,
+                                iovecs, nr_iovecs, NULL, 0, 0);
+}
+
+/*
+ * Replies are returned by whichever thread reads the connection, see
+ * recv_msg(): here if none does, else by it, even if it's get_request().
+ */
+static int
+tran_sock_get_reply(vfu_ctx_t *vfu_ctx, struct reply_wait *wait,
+                    struct vfio_user_header *hdr, void **datap)
+{
+    struct pending_msg *msg;
+    tran_sock_t *ts;
+    size_t nr_fds;
+    int *fds;
+    int ret = 0;
+
+    assert(vfu_ctx != NULL);
+    assert(vfu_ctx->tran_data != NULL);
+    assert(wait != NULL);
+    assert(hdr != NULL);
+
+    ts = vfu_ctx->tran_data;
+    fds = alloca(SERVER_MAX_FDS * sizeof(int));
+
+    pthread_mutex_lock(&ts->lock);
+
+    while (wait->replies == NULL) {
+        if (ts->conn_fd == -1) {
+            ret = -ENOTCONN;
+            break;
+        }
+        if (ts->rx_err != 0) {
+            ret = ts->rx_err;
+            break;
+        }
+        if (ts->reading) {
+            pthread_cond_wait(&ts->cond, &ts->lock);
+            continue;
+        }
+
+        nr_fds = SERVER_MAX_FDS;
+        ret = recv_msg(vfu_ctx, hdr, fds, &nr_fds, 0, false);
+        if (ret < 0) {
+            if (ret != -EINTR) {
+                ts->rx_err = ret;
+            }
+            break;
+        }
+    }
+
+    if (ret == 0) {
+        msg = wait->replies;
+        wait->replies = msg->next;
+        *hdr = msg->hdr;
+        *datap = msg->data;
+        msg->data = NULL;
+        pending_msg_free(msg);
+    }
+
+    pthread_mutex_unlock(&ts->lock);
+    return ret;
+}
+
+static void
+tran_sock_add_reply_wait(vfu_ctx_t *vfu_ctx, struct reply_wait *wait)
+{
+    tran_sock_t *ts = vfu_ctx->tran_data;
+
+    pthread_mutex_lock(&ts->lock);
+    wait->replies = NULL;
+    wait->next = ts->waits;
+    ts->waits = wait;
+    pthread_mutex_unlock(&ts->lock);
+}
+
+static void
+tran_sock_del_reply_wait(vfu_ctx_t *vfu_ctx, struct reply_wait *wait)
+{
+    tran_sock_t *ts = vfu_ctx->tran_data;
+    struct reply_wait **p;
+    struct pending_msg *msg;
+
+    pthread_mutex_lock(&ts->lock);
+    for (p = &ts->waits; *p != NULL; p = &(*p)->next) {
+        if (*p == wait) {
+            *p = wait->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ts->lock);
+
+    /* Replies not waited for, e.g. after an error. */
+    while ((msg = wait->replies) != NULL) {
+        wait->replies = msg->next;
+        pending_msg_free(msg);
+    }
+}
+
+static void
+tran_sock_detach(vfu_ctx_t *vfu_ctx)
+{
+    tran_sock_t *ts;
+
+    assert(vfu_ctx != NULL);
+
+    ts = vfu_ctx->tran_data;
+
+    if (ts == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&ts->lock);
+
+    /* Get the reader out of recvmsg(), the fd can't be closed under it. */
+    if (ts->reading) {
+        (void) shutdown(ts->conn_fd, SHUT_RDWR);
+        while (ts->reading) {
+            pthread_cond_wait(&ts->cond, &ts->lock);
+        }
+    }
+
+    if (ts->conn_fd != -1) {
+        /*
+         * Don't send what's left from the pages of MSG_ZEROCOPY sends, they
+         * may have been reused already, see send_zerocopy().
+         */
+        if (ts->zc_done != ts->zc_sent) {
+            struct linger linger = { .l_onoff = 1 };
+
+            (void) setsockopt(ts->conn_fd, SOL_SOCKET, SO_LINGER, &linger,
+                              sizeof(linger));
+        }
+        // FIXME: handle EINTR
+        (void) close(ts->conn_fd);
+        ts->conn_fd = -1;
+    }
+
+    conn_close_poll(ts);
+    pending_msgs_free(ts);
+    rx_reset(ts);
+    ts->rx_err = 0;
+    /* Corked replies are for the client that's gone. */
+    ts->cork_len = 0;
+
+    /* Waiters get -ENOTCONN. */
+    pthread_cond_broadcast(&ts->cond);
+    pthread_mutex_unlock(&ts->lock);
+}
+
+static void
+listener_remove_ctx(struct vfu_listener *listener, vfu_ctx_t *vfu_ctx)
+{
+    size_t i;
+
+    for (i = 0; i < listener->nr_ctxs; i++) {
+        if (listener->ctxs[i] == vfu_ctx) {
+            listener->ctxs[i] = listener->ctxs[--listener->nr_ctxs];
+            return;
+        }
+    }
+}
+
+static void
+tran_sock_fini(vfu_ctx_t *vfu_ctx)
+{
+    tran_sock_t *ts;
+
+    assert(vfu_ctx != NULL);
+
+    ts = vfu_ctx->tran_data;
+
+    if (ts != NULL && ts->listener != NULL) {
+        listener_remove_ctx(ts->listener, vfu_ctx);
+        ts->listener = NULL;
+    }
+
+    if (ts != NULL && ts->listen_fd != -1) {
+        // FIXME: handle EINTR
+        (void) close(ts->listen_fd);
+        ts->listen_fd = -1;
+    }
+
+    if (ts != NULL) {
+        pending_msgs_free(ts);
+        rx_reset(ts);
+        free(ts->cork);
+        free(ts->rx);
+        pthread_cond_destroy(&ts->cond);
+        pthread_mutex_destroy(&ts->lock);
+    }
+
+    free(vfu_ctx->tran_data);
+    vfu_ctx->tran_data = NULL;
+}
+
+vfu_listener_t *
+vfu_create_listener(const char *path, int flags)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct vfu_listener *listener;
+    mode_t mode;
+    size_t i;
+    int ret;
+
+    if (path == NULL || (flags & ~LIBVFIO_USER_FLAG_ATTACH_NB) != 0) {
+        return ERROR_PTR(EINVAL);
+    }
+
+    ret = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (ret >= (int)sizeof(addr.sun_path)) {
+        return ERROR_PTR(ENAMETOOLONG);
+    }
+
+    listener = calloc(1, sizeof(*listener));
+    if (listener == NULL) {
+        return NULL;
+    }
+    listener->poll_fd = -1;
+    for (i = 0; i < MAX_HALF_OPEN; i++) {
+        listener->conns[i].fd = -1;
+    }
+
+    listener->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener->fd == -1) {
+        ret = errno;
+        goto err_out;
+    }
+
+    if (flags & LIBVFIO_USER_FLAG_ATTACH_NB) {
+        ret = fcntl(listener->fd, F_SETFL,
+                    fcntl(listener->fd, F_GETFL, 0) | O_NONBLOCK);
+        if (ret == 0) {
+            listener->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+            ret = listener->poll_fd == -1 ? -1 :
+                  epoll_ctl(listener->poll_fd, EPOLL_CTL_ADD, listener->fd,
+                            &ev);
+        }
+        if (ret < 0) {
+            ret = errno;
+            goto err_out;
+        }
+    }
+
+    /* FIXME SPDK can't easily run as non-root */
+    mode = umask(0000);
+    ret = bind(listener->fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (ret == 0) {
+        ret = listen(listener->fd, SOMAXCONN);
+    }
+    umask(mode);
+
+    if (ret < 0) {
+        ret = errno;
+        goto err_out;
+    }
+
+    return listener;
+
+err_out:
+    if (listener->poll_fd != -1) {
+        close(listener->poll_fd);
+    }
+    if (listener->fd != -1) {
+        close(listener->fd);
+    }
+    free(listener);
+    return ERROR_PTR(ret);
+}
+
+static vfu_ctx_t *
+listener_find_ctx(struct vfu_listener *listener, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < listener->nr_ctxs; i++) {
+        if (strcmp(listener->ctxs[i]->uuid, name) == 0) {
+            return listener->ctxs[i];
+        }
+    }
+
+    return NULL;
+}
+
+int
+vfu_listener_add_ctx(vfu_listener_t *listener, vfu_ctx_t *vfu_ctx)
+{
+    tran_sock_t *ts;
+    vfu_ctx_t **ctxs;
+
+    assert(listener != NULL);
+    assert(vfu_ctx != NULL);
+
+    ts = vfu_ctx->tran_data;
+
+    if (!(vfu_ctx->flags & LIBVFIO_USER_FLAG_SHARED) ||
+        vfu_ctx->parent != NULL || ts->listener != NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (listener_find_ctx(listener, vfu_ctx->uuid) != NULL) {
+        return ERROR_INT(EEXIST);
+    }
+
+    ctxs = realloc(listener->ctxs,
+                   (listener->nr_ctxs + 1) * sizeof(*listener->ctxs));
+    if (ctxs == NULL) {
+        return ERROR_INT(ENOMEM);
+    }
+
+    listener->ctxs = ctxs;
+    listener->ctxs[listener->nr_ctxs++] = vfu_ctx;
+    ts->listener = listener;
+    return 0;
+}
+
+/*
+ * Returns the "device" member of the client's version JSON, which must be
+ * freed by the caller, or NULL if there is none.
+ */
+static char *
+parse_version_device(const struct vfio_user_version *cversion, size_t vlen)
+{
+    const char *json_str = (const char *)cversion->data;
+    struct json_object *jo_top;
+    struct json_object *jo;
+    char *name = NULL;
+
+    if (vlen <= sizeof(*cversion) ||
+        json_str[vlen - sizeof(*cversion) - 1] != '\0') {
+        return NULL;
+    }
+
+    if ((jo_top = json_tokener_parse(json_str)) == NULL) {
+        return NULL;
+    }
+
+    if (json_object_object_get_ex(jo_top, "device", &jo) &&
+        json_object_get_type(jo) == json_type_string) {
+        name = strdup(json_object_get_string(jo));
+    }
+
+    json_object_put(jo_top);
+    return name;
+}
+
+/*
+ * Routes @sock, whose client sent @hdr and @cversion, to the context it names
+ * and completes version negotiation on the context's behalf. Closes @sock on
+ * error.
+ */
+static int
+listener_route(struct vfu_listener *listener, int sock,
+               struct vfio_user_header *hdr,
+               struct vfio_user_version *cversion, size_t vlen,
+               vfu_ctx_t **vfu_ctxp)
+{
+    uint16_t msg_id = hdr->msg_id;
+    vfu_ctx_t *vfu_ctx;
+    tran_sock_t *ts;
+    char *name;
+    int ret;
+
+    if (hdr->cmd != VFIO_USER_VERSION) {
+        ret = -EINVAL;
+        goto err_reply;
+    }
+
+    name = parse_version_device(cversion, vlen);
+    if (name == NULL) {
+        ret = -EINVAL;
+        goto err_reply;
+    }
+
+    vfu_ctx = listener_find_ctx(listener, name);
+    free(name);
+    if (vfu_ctx == NULL) {
+        ret = -ENOENT;
+        goto err_reply;
+    }
+
+    ts = vfu_ctx->tran_data;
+    if (ts->conn_fd != -1) {
+        vfu_log(vfu_ctx, LOG_ERR, "refusing client, already attached");
+        ret = -EBUSY;
+        goto err_reply;
+    }
+
+    ret = check_version(vfu_ctx, msg_id, hdr, cversion, vlen);
+    if (ret < 0) {
+        goto err_reply;
+    }
+
+    ret = send_version(vfu_ctx, sock, msg_id, cversion);
+    if (ret < 0) {
+        vfu_log(vfu_ctx, LOG_ERR, "failed to send version: %s", strerror(-ret));
+        goto out;
+    }
+
+    ts->conn_fd = sock;
+    ret = conn_setup_poll(ts);
+    if (ret < 0) {
+        ts->conn_fd = -1;
+    }
+    *vfu_ctxp = vfu_ctx;
+    goto out;
+
+err_reply:
+    (void) tran_sock_send_error(sock, msg_id, hdr->cmd, -ret);
+out:
+    if (ret < 0) {
+        close(sock);
+    }
+    return ret;
+}
+
+static int
+half_open_add(struct vfu_listener *listener, int sock)
+{
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct half_open *conn = listener->conns;
+
+    while (conn->fd != -1) {
+        conn++;
+    }
+    ev.data.ptr = conn;
+
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) == -1 ||
+        epoll_ctl(listener->poll_fd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+        return -errno;
+    }
+
+    conn->fd = sock;
+    conn->data = NULL;
+    conn->len = 0;
+
+    if (++listener->nr_conns == MAX_HALF_OPEN) {
+        (void) epoll_ctl(listener->poll_fd, EPOLL_CTL_DEL, listener->fd, NULL);
+    }
+    return 0;
+}
+
+/*
+ * Stops waiting for @conn's version, closing it unless the caller has taken
+ * over its socket and data.
+ */
+static void
+half_open_del(struct vfu_listener *listener, struct half_open *conn,
+              bool close_conn)
+{
+    struct epoll_event ev = { .events = EPOLLIN };
+
+    (void) epoll_ctl(listener->poll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    if (close_conn) {
+        close(conn->fd);
+        free(conn->data);
+    }
+    conn->fd = -1;
+    conn->data = NULL;
+
+    if (listener->nr_conns-- == MAX_HALF_OPEN) {
+        (void) epoll_ctl(listener->poll_fd, EPOLL_CTL_ADD, listener->fd, &ev);
+    }
+}
+
+/*
+ * Receives what has arrived of @conn's version without blocking. Returns 0
+ * once all of it has, -EAGAIN if more is to come, or -errno.
+ */
+static int
+half_open_recv(struct half_open *conn)
+{
+    size_t hdr_size = sizeof(conn->hdr);
+    ssize_t ret;
+
+    for (;;) {
+        if (conn->len < hdr_size) {
+            ret = recv(conn->fd, (char *)&conn->hdr + conn->len,
+                       hdr_size - conn->len, 0);
+        } else {
+            ret = recv(conn->fd, (char *)conn->data + conn->len - hdr_size,
+                       conn->hdr.msg_size - conn->len, 0);
+        }
+        if (ret == -1) {
+            return -errno;
+        } else if (ret == 0) {
+            return -ENOMSG;
+        }
+        conn->len += ret;
+
+        if (conn->len == hdr_size) {
+            if (conn->hdr.flags.type != VFIO_USER_F_TYPE_COMMAND ||
+                conn->hdr.msg_size < hdr_size ||
+                conn->hdr.msg_size > SERVER_MAX_MSG_SIZE) {
+                return -EINVAL;
+            }
+            if (conn->hdr.msg_size > hdr_size) {
+                conn->data = calloc(1, conn->hdr.msg_size - hdr_size);
+                if (conn->data == NULL) {
+                    return -errno;
+                }
+            }
+        }
+
+        if (conn->len >= hdr_size && conn->len == conn->hdr.msg_size) {
+            return 0;
+        }
+    }
+}
+
+/*
+ * Accepts a connection if there's room for it and receives what has arrived
+ * of the half-open ones, routing the first whose version is complete. A
+ * half-open connection that fails is dropped.
+ */
+static vfu_ctx_t *
+listener_accept_nb(struct vfu_listener *listener)
+{
+    struct epoll_event events[MAX_HALF_OPEN + 1];
+    struct half_open *conn = NULL;
+    struct vfio_user_header hdr;
+    vfu_ctx_t *vfu_ctx = NULL;
+    void *data;
+    size_t vlen;
+    int i, nr;
+    int sock;
+    int ret;
+
+    if (listener->nr_conns < MAX_HALF_OPEN) {
+        sock = accept(listener->fd, NULL, NULL);
+        if (sock == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return NULL;
+        }
+        if (sock != -1) {
+            ret = half_open_add(listener, sock);
+            if (ret < 0) {
+                close(sock);
+                return ERROR_PTR(-ret);
+            }
+        }
+    }
+
+    nr = epoll_wait(listener->poll_fd, events, ARRAY_SIZE(events), 0);
+    if (nr == -1) {
+        return NULL;
+    }
+
+    for (i = 0; i < nr && conn == NULL; i++) {
+        struct half_open *c = events[i].data.ptr;
+
+        if (c == NULL) {
+            continue;
+        }
+        ret = half_open_recv(c);
+        if (ret == 0) {
+            conn = c;
+        } else if (ret != -EAGAIN && ret != -EWOULDBLOCK && ret != -EINTR) {
+            half_open_del(listener, c, true);
+        }
+    }
+
+    if (conn == NULL) {
+        return ERROR_PTR(EAGAIN);
+    }
+
+    sock = conn->fd;
+    hdr = conn->hdr;
+    data = conn->data;
+    vlen = conn->len - sizeof(hdr);
+    half_open_del(listener, conn, false);
+
+    /* Once routed, the connection blocks like that of any context. */
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) & ~O_NONBLOCK) == -1) {
+        ret = -errno;
+        close(sock);
+    } else {
+        ret = listener_route(listener, sock, &hdr, data, vlen, &vfu_ctx);
+    }
+    free(data);
+
+    return ret < 0 ? ERROR_PTR(-ret) : vfu_ctx;
+}
+
+vfu_ctx_t *
+vfu_listener_accept(vfu_listener_t *listener)
+{
+    struct vfio_user_version *cversion = NULL;
+    struct vfio_user_header hdr;
+    vfu_ctx_t *vfu_ctx = NULL;
+    size_t vlen = 0;
+    int sock;
+    int ret;
+
+    assert(listener != NULL);
+
+    if (listener->poll_fd != -1) {
+        return listener_accept_nb(listener);
+    }
+
+    sock = accept(listener->fd, NULL, NULL);
+    if (sock == -1) {
+        return NULL;
+    }
+
+    ret = tran_sock_recv_alloc(sock, SOCK_STREAM, &hdr, false, NULL,
+                               (void **)&cversion, &vlen);
+    if (ret < 0) {
+        close(sock);
+    } else {
+        ret = listener_route(listener, sock, &hdr, cversion, vlen, &vfu_ctx);
+    }
+    free(cversion);
+
+    return ret < 0 ? ERROR_PTR(-ret) : vfu_ctx;
+}
+
+int
+vfu_listener_get_poll_fd(vfu_listener_t *listener)
+{
+    assert(listener != NULL);
+
+    return listener->poll_fd != -1 ? listener->poll_fd : listener->fd;
+}
+
+void
+vfu_destroy_listener(vfu_listener_t *listener)
+{
+    size_t i;
+
+    if (listener == NULL) {
+        return;
+    }
+
+    for (i = 0; i < listener->nr_ctxs; i++) {
+        tran_sock_t *ts = listener->ctxs[i]->tran_data;
+
+        ts->listener = NULL;
+    }
+
+    for (i = 0; i < MAX_HALF_OPEN; i++) {
+        if (listener->conns[i].fd != -1) {
+            (void) close(listener->conns[i].fd);
+            free(listener->conns[i].data);
+        }
+    }
+
+    // FIXME: handle EINTR
+    if (listener->poll_fd != -1) {
+        (void) close(listener->poll_fd);
+    }
+    (void) close(listener->fd);
+    free(listener->ctxs);
+    free(listener);
 }
 
 struct transport_ops tran_sock_ops = {
@@ -908,7 +2654,13 @@ struct transport_ops tran_sock_ops = {
     .get_request = tran_sock_get_request,
     .recv_body = tran_sock_recv_body,
     .reply = tran_sock_reply,
-    .send_msg = tran_sock_send_msg,
+    .flush = tran_sock_flush,
+    .send_cmd = tran_sock_send_cmd,
+    .add_reply_wait = tran_sock_add_reply_wait,
+    .del_reply_wait = tran_sock_del_reply_wait,
+    .get_reply = tran_sock_get_reply,
+    .has_pending = tran_sock_has_pending,
+    .wake = tran_sock_wake,
     .detach = tran_sock_detach,
     .fini = tran_sock_fini
 };
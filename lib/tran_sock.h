@@ -33,28 +33,103 @@
 #ifndef LIB_VFIO_USER_TRAN_SOCK_H
 #define LIB_VFIO_USER_TRAN_SOCK_H
 
+#include <pthread.h>
+
 #include "libvfio-user.h"
 
 /*
  * These are not public routines, but for convenience, they are used by the
  * sample/test code as well as privately within libvfio-user.
  *
- * Note there is currently only one transport - talking over a UNIX socket.
+ * The same code talks over a UNIX socket (VFU_TRANS_SOCK) or a TCP one
+ * (VFU_TRANS_TCP).
  */
 
 /* The largest number of fd's we are prepared to receive. */
 // FIXME: value?
 #define VFIO_USER_CLIENT_MAX_FDS_LIMIT (1024)
 
+/*
+ * The maximum message size to assume if the other end doesn't specify one, see
+ * "max_msg_size" in the version capabilities.
+ */
+#define VFIO_USER_DEFAULT_MAX_MSG_SIZE (4096)
+
+// FIXME: is this the value we want?
+#define SERVER_MAX_FDS 8
+
 extern struct transport_ops tran_sock_ops;
 
+struct pending_msg;
+struct reply_wait;
+struct vfu_listener;
+
+typedef struct {
+    int listen_fd;
+    int conn_fd;
+    /*
+     * Once connected, returned by get_poll_fd(): an epoll instance watching
+     * conn_fd and event_fd, which is readable while messages received wait,
+     * or while woken by wake().
+     */
+    int poll_fd;
+    int event_fd;
+    bool ready;
+    bool wake;
+    /* Shared listener, if LIBVFIO_USER_FLAG_SHARED. */
+    struct vfu_listener *listener;
+    /*
+     * Protects what follows, except the cork, and what's received. One thread
+     * at a time reads the connection, reading being set meanwhile: the others
+     * wait on cond for it to hand them what they want, see recv_msg().
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool reading;
+    /* The error the connection failed with, for all to return. */
+    int rx_err;
+    /* Messages for get_request(), oldest first. */
+    struct pending_msg *pending;
+    struct pending_msg **pending_tail;
+    size_t nr_pending;
+    /* Body of the message get_request() returned last, until claimed. */
+    void *body;
+    /* Commands whose replies threads wait for, see add_reply_wait(). */
+    struct reply_wait *waits;
+    /* Replies held back by tran_sock_reply(), cork_len bytes long. */
+    char *cork;
+    size_t cork_len;
+    /* LIBVFIO_USER_FLAG_SEQPACKET */
+    bool seqpacket;
+    /*
+     * Data received, see rx_next(): messages from rx_head to rx_tail, the one
+     * at rx_head being rx_cur bytes long once returned.
+     */
+    char *rx;
+    size_t rx_head;
+    size_t rx_tail;
+    size_t rx_cur;
+    /* Fds received with the message at rx_fds_off. */
+    int rx_fds[SERVER_MAX_FDS];
+    size_t rx_nr_fds;
+    size_t rx_fds_off;
+    /* VFU_TRANS_TCP, and whether DMA writes use MSG_ZEROCOPY on conn_fd. */
+    bool tcp;
+    bool zerocopy;
+    /* MSG_ZEROCOPY sends issued and completed, see zerocopy_reap(). */
+    uint32_t zc_sent;
+    uint32_t zc_done;
+} tran_sock_t;
+
 /*
  * Parse JSON supplied from the other side into the known parameters. Note: they
- * will not be set if not found in the JSON.
+ * will not be set if not found in the JSON. @get_all_infop and @vm_interruptp
+ * can be NULL.
  */
 int
 tran_parse_version_json(const char *json_str, int *client_max_fdsp,
-                        size_t *pgsizep);
+                        size_t *max_msg_sizep, size_t *pgsizep,
+                        bool *get_all_infop, bool *vm_interruptp);
 
 /*
  * Send a message to the other end.  The iovecs array should leave the first
@@ -74,11 +149,12 @@ tran_sock_send(int sock, uint16_t msg_id, bool is_reply,
 /*
  * Receive a message from the other end, and place the data into the given
  * buffer. If data is supplied by the other end, it must be exactly *len in
- * size.
+ * size. @sock_type is the type of @sock, SOCK_STREAM or SOCK_SEQPACKET, as for
+ * all the receiving helpers below.
  */
 int
-tran_sock_recv(int sock, struct vfio_user_header *hdr, bool is_reply,
-               uint16_t *msg_id, void *data, size_t *len);
+tran_sock_recv(int sock, int sock_type, struct vfio_user_header *hdr,
+               bool is_reply, uint16_t *msg_id, void *data, size_t *len);
 
 /*
  * Receive a message from the other end, but automatically allocate a buffer for
@@ -86,8 +162,9 @@ tran_sock_recv(int sock, struct vfio_user_header *hdr, bool is_reply,
  * NULL.
  */
 int
-tran_sock_recv_alloc(int sock, struct vfio_user_header *hdr, bool is_reply,
-                     uint16_t *msg_id, void **datap, size_t *lenp);
+tran_sock_recv_alloc(int sock, int sock_type, struct vfio_user_header *hdr,
+                     bool is_reply, uint16_t *msg_id, void **datap,
+                     size_t *lenp);
 
 /*
  * Send and receive a message to the other end, using iovecs for the send. The
@@ -106,7 +183,7 @@ tran_sock_recv_alloc(int sock, struct vfio_user_header *hdr, bool is_reply,
  * original value of @recv_fd_count.
  */
 int
-tran_sock_msg_iovec(int sock, uint16_t msg_id,
+tran_sock_msg_iovec(int sock, int sock_type, uint16_t msg_id,
                     enum vfio_user_command cmd,
                     struct iovec *iovecs, size_t nr_iovecs,
                     int *send_fds, size_t send_fd_count,
@@ -119,7 +196,7 @@ tran_sock_msg_iovec(int sock, uint16_t msg_id,
  * header if non-NULL.
  */
 int
-tran_sock_msg(int sock, uint16_t msg_id,
+tran_sock_msg(int sock, int sock_type, uint16_t msg_id,
               enum vfio_user_command cmd,
               void *send_data, size_t send_len,
               struct vfio_user_header *hdr,
@@ -130,7 +207,7 @@ tran_sock_msg(int sock, uint16_t msg_id,
  * tran_sock_msg_iovec for the semantics of @recv_fds and @recv_fd_count.
  */
 int
-tran_sock_msg_fds(int sock, uint16_t msg_id,
+tran_sock_msg_fds(int sock, int sock_type, uint16_t msg_id,
                   enum vfio_user_command cmd,
                   void *send_data, size_t send_len,
                   struct vfio_user_header *hdr,
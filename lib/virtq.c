@@ -0,0 +1,680 @@
+/*
+ * Copyright (c) 2020 Nutanix Inc. All rights reserved.
+ *
+ * Authors: Thanos Makatos <thanos@nutanix.com>
+ *          Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *          Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * Virtqueue processing over guest DMA memory, see VIRTIO 1.1 sections 2.6
+ * (split virtqueues) and 2.7 (packed virtqueues).
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "dma.h"
+#include "private.h"
+
+#define VIRTQ_MAX_SIZE              32768
+
+#define VIRTQ_DESC_F_NEXT           (1 << 0)
+#define VIRTQ_DESC_F_WRITE          (1 << 1)
+#define VIRTQ_DESC_F_INDIRECT       (1 << 2)
+#define VIRTQ_DESC_F_AVAIL          (1 << 7)
+#define VIRTQ_DESC_F_USED           (1 << 15)
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  (1 << 0)
+
+#define VIRTQ_EVENT_F_ENABLE        0
+#define VIRTQ_EVENT_F_DISABLE       1
+#define VIRTQ_EVENT_F_DESC          2
+
+/* Split virtqueue layout, naturally aligned. */
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct virtq_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];            /* followed by used_event */
+};
+
+struct virtq_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct virtq_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct virtq_used_elem ring[]; /* followed by avail_event */
+};
+
+/* Packed virtqueue layout. */
+struct virtq_packed_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+};
+
+struct virtq_event {
+    uint16_t off_wrap;
+    uint16_t flags;
+};
+
+struct vfu_virtq {
+    vfu_ctx_t *vfu_ctx;
+    vfu_virtq_info_t info;
+
+    dma_sg_t rings[3];          /* descriptors, driver and device areas */
+    union {
+        struct virtq_desc *desc;
+        struct virtq_packed_desc *packed_desc;
+    };
+    union {
+        struct virtq_avail *avail;
+        struct virtq_event *driver_event;
+    };
+    union {
+        struct virtq_used *used;
+        struct virtq_event *device_event;
+    };
+
+    uint16_t last_avail_idx;
+    uint16_t used_idx;
+    /* Packed only. */
+    bool avail_wrap;
+    bool used_wrap;
+};
+
+/*
+ * Memory ordering with the driver: loads of indices and flags that publish
+ * descriptors are acquires, stores that publish used entries are releases, and
+ * the used index is ordered before the interrupt suppression check with a full
+ * barrier (VIRTIO 1.1 section 2.6.7.2).
+ */
+static inline uint16_t
+load_acquire16(const uint16_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+store_release16(uint16_t *p, uint16_t v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+/*
+ * The driver can change descriptors at any time, so each is loaded once and
+ * only the copy is checked and used.
+ */
+static inline struct virtq_desc
+virtq_desc_load(const struct virtq_desc *p)
+{
+    struct virtq_desc d = {
+        .addr = __atomic_load_n(&p->addr, __ATOMIC_RELAXED),
+        .len = __atomic_load_n(&p->len, __ATOMIC_RELAXED),
+        .flags = __atomic_load_n(&p->flags, __ATOMIC_RELAXED),
+        .next = __atomic_load_n(&p->next, __ATOMIC_RELAXED),
+    };
+
+    return d;
+}
+
+static inline struct virtq_packed_desc
+virtq_packed_desc_load(const struct virtq_packed_desc *p)
+{
+    struct virtq_packed_desc d = {
+        .addr = __atomic_load_n(&p->addr, __ATOMIC_RELAXED),
+        .len = __atomic_load_n(&p->len, __ATOMIC_RELAXED),
+        .id = __atomic_load_n(&p->id, __ATOMIC_RELAXED),
+        .flags = __atomic_load_n(&p->flags, __ATOMIC_RELAXED),
+    };
+
+    return d;
+}
+
+static inline bool
+vring_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx)
+{
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+/* Marks guest memory the device wrote to through a ring mapping. */
+static inline void
+virtq_mark_dirty(vfu_virtq_t *vq, int ring, const void *base, const void *p,
+                 size_t len)
+{
+    dma_sg_mark_dirty(vq->vfu_ctx->dma, &vq->rings[ring],
+                      (const char *)p - (const char *)base, len);
+}
+
+vfu_virtq_t *
+vfu_virtq_create(vfu_ctx_t *vfu_ctx, const vfu_virtq_info_t *info)
+{
+    size_t sizes[3];
+    int prots[3] = { PROT_READ, PROT_READ, PROT_READ | PROT_WRITE };
+    vfu_dma_addr_t addrs[3];
+    void *vaddrs[3];
+    vfu_virtq_t *vq;
+    int i, ret;
+
+    assert(vfu_ctx != NULL);
+    assert(info != NULL);
+
+    if (vfu_ctx->dma == NULL || info->size == 0 ||
+        info->size > VIRTQ_MAX_SIZE) {
+        return ERROR_PTR(EINVAL);
+    }
+
+    if (info->flags & VFU_VIRTQ_F_PACKED) {
+        sizes[0] = sizeof(struct virtq_packed_desc) * info->size;
+        sizes[1] = sizeof(struct virtq_event);
+        sizes[2] = sizeof(struct virtq_event);
+        /* The device writes used descriptors back into the ring. */
+        prots[0] |= PROT_WRITE;
+    } else {
+        if ((info->size & (info->size - 1)) != 0) {
+            return ERROR_PTR(EINVAL);
+        }
+        sizes[0] = sizeof(struct virtq_desc) * info->size;
+        sizes[1] = sizeof(struct virtq_avail) +
+                   sizeof(uint16_t) * (info->size + 1);
+        sizes[2] = sizeof(struct virtq_used) +
+                   sizeof(struct virtq_used_elem) * info->size +
+                   sizeof(uint16_t);
+    }
+    addrs[0] = info->desc;
+    addrs[1] = info->driver;
+    addrs[2] = info->device;
+
+    vq = calloc(1, sizeof(*vq));
+    if (vq == NULL) {
+        return ERROR_PTR(ENOMEM);
+    }
+    vq->vfu_ctx = vfu_ctx;
+    vq->info = *info;
+    vq->avail_wrap = true;
+    vq->used_wrap = true;
+
+    for (i = 0; i < 3; i++) {
+        ret = dma_map_addr(vfu_ctx->dma, addrs[i], sizes[i], prots[i],
+                           &vq->rings[i], &vaddrs[i]);
+        if (ret < 0) {
+            for (i--; i >= 0; i--) {
+                dma_unmap_sg(vfu_ctx->dma, &vq->rings[i], NULL, 1);
+            }
+            free(vq);
+            return ERROR_PTR(-ret);
+        }
+    }
+
+    vq->desc = vaddrs[0];
+    vq->avail = vaddrs[1];
+    vq->used = vaddrs[2];
+
+    return vq;
+}
+
+void
+vfu_virtq_destroy(vfu_virtq_t *vq)
+{
+    int i;
+
+    if (vq == NULL) {
+        return;
+    }
+
+    for (i = 0; i < 3; i++) {
+        dma_unmap_sg(vq->vfu_ctx->dma, &vq->rings[i], NULL, 1);
+    }
+    free(vq);
+}
+
+/*
+ * Appends the local iovecs for a descriptor buffer to @iov, returning how many
+ * were added or -errno.
+ */
+static int
+virtq_map_buf(vfu_virtq_t *vq, uint64_t addr, uint32_t len, bool writable,
+              struct iovec *iov, int max_iov)
+{
+    dma_controller_t *dma = vq->vfu_ctx->dma;
+    dma_sg_t sg[8];
+    int cnt, i;
+
+    if (max_iov <= 0) {
+        return -ENOBUFS;
+    }
+
+    cnt = dma_addr_to_sg(dma, (vfu_dma_addr_t)(uintptr_t)addr, len, sg,
+                         MIN(max_iov, (int)ARRAY_SIZE(sg)),
+                         writable ? PROT_READ | PROT_WRITE : PROT_READ);
+    if (cnt < -1) {
+        return -ENOBUFS;
+    } else if (cnt < 0) {
+        return -errno;
+    }
+
+    for (i = 0; i < cnt; i++) {
+        iov[i].iov_base = dma_sg_vaddr(dma, &sg[i]);
+        if (iov[i].iov_base == NULL) {
+            return -EFAULT;
+        }
+        iov[i].iov_len = sg[i].length;
+    }
+
+    return cnt;
+}
+
+/*
+ * Adds a descriptor's buffer to @elem. Device-readable buffers must come
+ * before device-writable ones.
+ */
+static int
+virtq_elem_add(vfu_virtq_t *vq, vfu_virtq_elem_t *elem, uint64_t addr,
+               uint32_t len, bool writable, int max_iov)
+{
+    int used = elem->out_num + elem->in_num;
+    int ret;
+
+    if (!writable && elem->in_num > 0) {
+        return -EINVAL;
+    }
+
+    ret = virtq_map_buf(vq, addr, len, writable, elem->iov + used,
+                        max_iov - used);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (writable) {
+        elem->in_num += ret;
+    } else {
+        elem->out_num += ret;
+    }
+    return 0;
+}
+
+/* Returns a local pointer to an indirect descriptor table. */
+void *
+MOCK_DEFINE(virtq_map_indirect)(vfu_virtq_t *vq, uint64_t addr, uint32_t len,
+                                size_t desc_size)
+{
+    struct iovec iov;
+    int ret;
+
+    if (len == 0 || len % desc_size != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ret = virtq_map_buf(vq, addr, len, false, &iov, 1);
+    if (ret != 1) {
+        /* An indirect table spanning regions isn't supported. */
+        errno = ret == -ENOBUFS ? EINVAL : -ret;
+        return NULL;
+    }
+    return iov.iov_base;
+}
+
+static int
+virtq_split_pop_one(vfu_virtq_t *vq, uint16_t head, vfu_virtq_elem_t *elem,
+                    int max_iov)
+{
+    const struct virtq_desc *table = vq->desc;
+    uint32_t table_size = vq->info.size;
+    bool indirect = false;
+    uint32_t i = head;
+    uint32_t n = 0;
+    int ret;
+
+    for (;;) {
+        struct virtq_desc d;
+
+        if (i >= table_size || n++ >= table_size) {
+            /* Out of bounds or a loop in the chain. */
+            return -EINVAL;
+        }
+        d = virtq_desc_load(&table[i]);
+
+        if (d.flags & VIRTQ_DESC_F_INDIRECT) {
+            if (indirect || (d.flags & VIRTQ_DESC_F_NEXT)) {
+                return -EINVAL;
+            }
+            table = virtq_map_indirect(vq, d.addr, d.len, sizeof(d));
+            if (table == NULL) {
+                return -errno;
+            }
+            table_size = d.len / sizeof(d);
+            indirect = true;
+            i = 0;
+            n = 0;
+            continue;
+        }
+
+        ret = virtq_elem_add(vq, elem, d.addr, d.len,
+                             d.flags & VIRTQ_DESC_F_WRITE, max_iov);
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (!(d.flags & VIRTQ_DESC_F_NEXT)) {
+            break;
+        }
+        i = d.next;
+    }
+
+    elem->id = head;
+    elem->ndescs = 1;
+    return 0;
+}
+
+static int
+virtq_split_pop(vfu_virtq_t *vq, vfu_virtq_elem_t *elems, int max_elems,
+                struct iovec *iov, int max_iov)
+{
+    uint16_t avail_idx = load_acquire16(&vq->avail->idx);
+    uint16_t mask = vq->info.size - 1;
+    int n = 0;
+    int ret;
+
+    if ((uint16_t)(avail_idx - vq->last_avail_idx) > vq->info.size) {
+        vfu_log(vq->vfu_ctx, LOG_ERR, "bad available index %u (last %u)",
+                avail_idx, vq->last_avail_idx);
+        return -EINVAL;
+    }
+
+    while (n < max_elems && vq->last_avail_idx != avail_idx) {
+        vfu_virtq_elem_t *elem = &elems[n];
+        uint16_t head = vq->avail->ring[vq->last_avail_idx & mask];
+
+        memset(elem, 0, sizeof(*elem));
+        elem->iov = iov;
+        ret = virtq_split_pop_one(vq, head, elem, max_iov);
+        if (ret == -ENOBUFS && n > 0) {
+            break;
+        } else if (ret < 0) {
+            return ret;
+        }
+
+        iov += elem->out_num + elem->in_num;
+        max_iov -= elem->out_num + elem->in_num;
+        vq->last_avail_idx++;
+        n++;
+    }
+
+    if ((vq->info.flags & VFU_VIRTQ_F_EVENT_IDX) && n > 0) {
+        uint16_t *avail_event = (uint16_t *)&vq->used->ring[vq->info.size];
+
+        *avail_event = vq->last_avail_idx;
+        virtq_mark_dirty(vq, 2, vq->used, avail_event, sizeof(*avail_event));
+    }
+
+    return n;
+}
+
+static int
+virtq_packed_pop_one(vfu_virtq_t *vq, vfu_virtq_elem_t *elem, int max_iov)
+{
+    uint16_t size = vq->info.size;
+    uint16_t idx = vq->last_avail_idx;
+    uint16_t n;
+    int ret;
+
+    for (n = 0; n < size; n++) {
+        struct virtq_packed_desc d =
+            virtq_packed_desc_load(&vq->packed_desc[idx]);
+        bool last = !(d.flags & VIRTQ_DESC_F_NEXT);
+
+        if (d.flags & VIRTQ_DESC_F_INDIRECT) {
+            const struct virtq_packed_desc *table;
+            uint32_t i, table_size;
+
+            if (n > 0 || !last) {
+                return -EINVAL;
+            }
+            table = virtq_map_indirect(vq, d.addr, d.len, sizeof(d));
+            if (table == NULL) {
+                return -errno;
+            }
+            table_size = d.len / sizeof(d);
+            for (i = 0; i < table_size; i++) {
+                struct virtq_packed_desc t = virtq_packed_desc_load(&table[i]);
+
+                ret = virtq_elem_add(vq, elem, t.addr, t.len,
+                                     t.flags & VIRTQ_DESC_F_WRITE, max_iov);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+        } else {
+            ret = virtq_elem_add(vq, elem, d.addr, d.len,
+                                 d.flags & VIRTQ_DESC_F_WRITE, max_iov);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        if (++idx == size) {
+            idx = 0;
+        }
+        if (last) {
+            /* The buffer ID is in the last descriptor of the chain. */
+            elem->id = d.id;
+            elem->ndescs = n + 1;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+static int
+virtq_packed_pop(vfu_virtq_t *vq, vfu_virtq_elem_t *elems, int max_elems,
+                 struct iovec *iov, int max_iov)
+{
+    int n = 0;
+    int ret;
+
+    while (n < max_elems) {
+        vfu_virtq_elem_t *elem = &elems[n];
+        struct virtq_packed_desc *d = &vq->packed_desc[vq->last_avail_idx];
+        uint16_t flags = load_acquire16(&d->flags);
+
+        if (!!(flags & VIRTQ_DESC_F_AVAIL) != vq->avail_wrap ||
+            !!(flags & VIRTQ_DESC_F_USED) == vq->avail_wrap) {
+            break;
+        }
+
+        memset(elem, 0, sizeof(*elem));
+        elem->iov = iov;
+        ret = virtq_packed_pop_one(vq, elem, max_iov);
+        if (ret == -ENOBUFS && n > 0) {
+            break;
+        } else if (ret < 0) {
+            return ret;
+        }
+
+        iov += elem->out_num + elem->in_num;
+        max_iov -= elem->out_num + elem->in_num;
+        vq->last_avail_idx += elem->ndescs;
+        if (vq->last_avail_idx >= vq->info.size) {
+            vq->last_avail_idx -= vq->info.size;
+            vq->avail_wrap = !vq->avail_wrap;
+        }
+        n++;
+    }
+
+    return n;
+}
+
+int
+vfu_virtq_pop(vfu_virtq_t *vq, vfu_virtq_elem_t *elems, int max_elems,
+              struct iovec *iov, int max_iov)
+{
+    int ret;
+
+    assert(vq != NULL);
+    assert(elems != NULL || max_elems == 0);
+
+    if (vq->info.flags & VFU_VIRTQ_F_PACKED) {
+        ret = virtq_packed_pop(vq, elems, max_elems, iov, max_iov);
+    } else {
+        ret = virtq_split_pop(vq, elems, max_elems, iov, max_iov);
+    }
+
+    if (ret < 0) {
+        return ERROR_INT(-ret);
+    }
+    return ret;
+}
+
+static bool
+virtq_split_push(vfu_virtq_t *vq, const vfu_virtq_elem_t *elems,
+                 const uint32_t *lens, int n)
+{
+    uint16_t mask = vq->info.size - 1;
+    uint16_t old_idx = vq->used_idx;
+    uint16_t used_event;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        struct virtq_used_elem *e = &vq->used->ring[vq->used_idx++ & mask];
+
+        e->id = elems[i].id;
+        e->len = lens[i];
+        virtq_mark_dirty(vq, 2, vq->used, e, sizeof(*e));
+    }
+    store_release16(&vq->used->idx, vq->used_idx);
+    virtq_mark_dirty(vq, 2, vq->used, &vq->used->idx, sizeof(uint16_t));
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (!(vq->info.flags & VFU_VIRTQ_F_EVENT_IDX)) {
+        return !(vq->avail->flags & VIRTQ_AVAIL_F_NO_INTERRUPT);
+    }
+    used_event = vq->avail->ring[vq->info.size];
+    return vring_need_event(used_event, vq->used_idx, old_idx);
+}
+
+static bool
+virtq_packed_push(vfu_virtq_t *vq, const vfu_virtq_elem_t *elems,
+                  const uint32_t *lens, int n)
+{
+    struct virtq_packed_desc *first = &vq->packed_desc[vq->used_idx];
+    uint16_t first_flags = 0;
+    uint16_t old_idx = vq->used_idx;
+    bool old_wrap = vq->used_wrap;
+    uint16_t off_wrap, event_off, event_flags;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        struct virtq_packed_desc *d = &vq->packed_desc[vq->used_idx];
+        uint16_t flags = vq->used_wrap ?
+                         VIRTQ_DESC_F_AVAIL | VIRTQ_DESC_F_USED : 0;
+
+        d->id = elems[i].id;
+        d->len = lens[i];
+        /* The driver may only see the batch once it is complete. */
+        if (i == 0) {
+            first_flags = flags;
+        } else {
+            d->flags = flags;
+        }
+        virtq_mark_dirty(vq, 0, vq->packed_desc, d, sizeof(*d));
+
+        vq->used_idx += elems[i].ndescs;
+        if (vq->used_idx >= vq->info.size) {
+            vq->used_idx -= vq->info.size;
+            vq->used_wrap = !vq->used_wrap;
+        }
+    }
+    if (n > 0) {
+        store_release16(&first->flags, first_flags);
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    event_flags = vq->driver_event->flags;
+    if (event_flags != VIRTQ_EVENT_F_DESC ||
+        !(vq->info.flags & VFU_VIRTQ_F_EVENT_IDX)) {
+        return event_flags != VIRTQ_EVENT_F_DISABLE;
+    }
+
+    /*
+     * Bring the event offset into the same wrap as the new used index, so that
+     * the split ring's wraparound arithmetic applies.
+     */
+    off_wrap = vq->driver_event->off_wrap;
+    event_off = off_wrap & ~(1 << 15);
+    if (!!(off_wrap >> 15) != vq->used_wrap) {
+        event_off -= vq->info.size;
+    }
+    if (old_wrap != vq->used_wrap) {
+        old_idx -= vq->info.size;
+    }
+    return vring_need_event(event_off, vq->used_idx, old_idx);
+}
+
+int
+vfu_virtq_push(vfu_virtq_t *vq, const vfu_virtq_elem_t *elems,
+               const uint32_t *lens, int n)
+{
+    bool notify;
+
+    assert(vq != NULL);
+    assert(n == 0 || (elems != NULL && lens != NULL));
+
+    if (n <= 0) {
+        return 0;
+    }
+
+    if (vq->info.flags & VFU_VIRTQ_F_PACKED) {
+        notify = virtq_packed_push(vq, elems, lens, n);
+    } else {
+        notify = virtq_split_push(vq, elems, lens, n);
+    }
+
+    if (notify) {
+        return vfu_irq_trigger(vq->vfu_ctx, vq->info.irq_subindex);
+    }
+    return 0;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
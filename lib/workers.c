@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2020 Nutanix Inc. All rights reserved.
+ *
+ * Authors: Thanos Makatos <thanos@nutanix.com>
+ *          Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *          Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "workers.h"
+
+struct worker {
+    struct workers  *pool;
+    pthread_t       thread;
+    pthread_cond_t  cond;       /* work queued, or stopping */
+    struct work     *head;
+    struct work     **tail;
+};
+
+struct workers {
+    pthread_mutex_t lock;
+    pthread_cond_t  idle;       /* nr_pending dropped to 0 */
+    size_t          nr_pending; /* submitted and not completed */
+    bool            stop;
+    unsigned int    nr;
+    struct worker   workers[];
+};
+
+static __thread bool in_worker;
+
+static void *
+worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct workers *pool = w->pool;
+    struct work *work;
+
+    in_worker = true;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (w->head == NULL && !pool->stop) {
+            pthread_cond_wait(&w->cond, &pool->lock);
+        }
+        work = w->head;
+        if (work == NULL) {
+            break;
+        }
+        w->head = work->next;
+        if (w->head == NULL) {
+            w->tail = &w->head;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        work->fn(work);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->nr_pending == 0) {
+            pthread_cond_broadcast(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void
+workers_stop(workers_t *pool, unsigned int nr_started)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    for (i = 0; i < pool->nr; i++) {
+        pthread_cond_signal(&pool->workers[i].cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < nr_started; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (i = 0; i < pool->nr; i++) {
+        pthread_cond_destroy(&pool->workers[i].cond);
+    }
+    pthread_cond_destroy(&pool->idle);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+workers_t *
+workers_create(unsigned int nr)
+{
+    workers_t *pool;
+    unsigned int i;
+    int err;
+
+    if (nr == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pool = calloc(1, sizeof(*pool) + nr * sizeof(struct worker));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->nr = nr;
+
+    for (i = 0; i < nr; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].tail = &pool->workers[i].head;
+        pthread_cond_init(&pool->workers[i].cond, NULL);
+    }
+
+    for (i = 0; i < nr; i++) {
+        err = pthread_create(&pool->workers[i].thread, NULL, worker_main,
+                             &pool->workers[i]);
+        if (err != 0) {
+            workers_stop(pool, i);
+            errno = err;
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+void
+workers_destroy(workers_t *pool)
+{
+    if (pool != NULL) {
+        workers_stop(pool, pool->nr);
+    }
+}
+
+void
+workers_submit(workers_t *pool, uint64_t key, struct work *work)
+{
+    struct worker *w;
+
+    assert(pool != NULL);
+    assert(work != NULL);
+
+    w = &pool->workers[key % pool->nr];
+    work->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    *w->tail = work;
+    w->tail = &work->next;
+    pool->nr_pending++;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void
+workers_wait_idle(workers_t *pool)
+{
+    assert(pool != NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->nr_pending > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+bool
+workers_self(void)
+{
+    return in_worker;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
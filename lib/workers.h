@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2020 Nutanix Inc. All rights reserved.
+ *
+ * Authors: Thanos Makatos <thanos@nutanix.com>
+ *          Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *          Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#ifndef LIB_VFIO_USER_WORKERS_H
+#define LIB_VFIO_USER_WORKERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Thread pool in which work items with the same key run one after the other,
+ * in the order submitted, see vfu_setup_region_workers().
+ */
+
+typedef struct workers workers_t;
+
+struct work {
+    void        (*fn)(struct work *work);
+    struct work *next;
+};
+
+/* Returns NULL on error, sets errno. */
+workers_t *
+workers_create(unsigned int nr);
+
+/* Completes the work submitted so far first. */
+void
+workers_destroy(workers_t *pool);
+
+void
+workers_submit(workers_t *pool, uint64_t key, struct work *work);
+
+/* Waits until all work submitted so far has completed. */
+void
+workers_wait_idle(workers_t *pool);
+
+/* Whether the caller is one of the workers of a pool. */
+bool
+workers_self(void);
+
+#endif /* LIB_VFIO_USER_WORKERS_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
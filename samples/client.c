@@ -44,6 +44,10 @@
 #include <pthread.h>
 #include <openssl/md5.h>
 #include <linux/limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "libvfio-user.h"
@@ -51,6 +55,9 @@
 
 #define CLIENT_MAX_FDS (32)
 
+/* Deliberately small so that the server has to split DMA into chunks. */
+#define CLIENT_MAX_MSG_SIZE (1024)
+
 static char *irq_to_str[] = {
     [VFU_DEV_INTX_IRQ] = "INTx",
     [VFU_DEV_MSI_IRQ] = "MSI",
@@ -59,6 +66,12 @@ static char *irq_to_str[] = {
     [VFU_DEV_REQ_IRQ] = "REQ"
 };
 
+/* SOCK_SEQPACKET if the server was started with -s. */
+static int sock_type = SOCK_STREAM;
+
+/* Whether to connect over TCP, to a server started with -t. */
+static bool tcp;
+
 void
 vfu_log(UNUSED vfu_ctx_t *vfu_ctx, UNUSED int level,
         const char *fmt, ...)
@@ -72,16 +85,67 @@ vfu_log(UNUSED vfu_ctx_t *vfu_ctx, UNUSED int level,
     va_end(ap);
 }
 
+/*
+ * Connects to @addr, "host:port". The server may not be listening yet, so
+ * refused connections are retried for a while.
+ */
+static int
+init_tcp_sock(const char *addr)
+{
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    char *host, *port;
+    int one = 1;
+    int i, sock;
+
+    if ((host = strdup(addr)) == NULL) {
+        err(EXIT_FAILURE, NULL);
+    }
+    if ((port = strrchr(host, ':')) == NULL) {
+        errx(EXIT_FAILURE, "bad address %s, expected host:port", addr);
+    }
+    *port++ = '\0';
+    if ((i = getaddrinfo(host, port, &hints, &res)) != 0) {
+        errx(EXIT_FAILURE, "failed to resolve %s: %s", addr, gai_strerror(i));
+    }
+    free(host);
+
+    for (i = 0; ; i++) {
+        sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (sock == -1) {
+            err(EXIT_FAILURE, "failed to open socket");
+        }
+        if (connect(sock, res->ai_addr, res->ai_addrlen) == 0) {
+            break;
+        }
+        if (errno != ECONNREFUSED || i == 50) {
+            err(EXIT_FAILURE, "failed to connect server");
+        }
+        close(sock);
+        usleep(100000);
+    }
+    freeaddrinfo(res);
+
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
+        err(EXIT_FAILURE, "failed to set TCP_NODELAY");
+    }
+    return sock;
+}
+
 static int
 init_sock(const char *path)
 {
     int ret, sock;
 	struct sockaddr_un addr = {.sun_family = AF_UNIX};
 
+	if (tcp) {
+		return init_tcp_sock(path);
+	}
+
 	/* TODO path should be defined elsewhere */
 	ret = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
 
-	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+	if ((sock = socket(AF_UNIX, sock_type, 0)) == -1) {
 		err(EXIT_FAILURE, "failed to open socket %s", path);
 	}
 
@@ -105,11 +169,13 @@ send_version(int sock)
         "{"
             "\"capabilities\":{"
                 "\"max_fds\":%u,"
+                "\"max_msg_size\":%u,"
+                "\"vm_interrupt\":true,"
                 "\"migration\":{"
                     "\"pgsize\":%zu"
                 "}"
             "}"
-         "}", CLIENT_MAX_FDS, sysconf(_SC_PAGESIZE));
+         "}", CLIENT_MAX_FDS, CLIENT_MAX_MSG_SIZE, sysconf(_SC_PAGESIZE));
 
     cversion.major = LIB_VFIO_USER_MAJOR;
     cversion.minor = LIB_VFIO_USER_MINOR;
@@ -130,14 +196,15 @@ send_version(int sock)
 }
 
 static void
-recv_version(int sock, int *server_max_fds, size_t *pgsize)
+recv_version(int sock, int *server_max_fds, size_t *pgsize,
+             bool *get_all_info)
 {
     struct vfio_user_version *sversion = NULL;
     struct vfio_user_header hdr;
     size_t vlen;
     int ret;
 
-    ret = tran_sock_recv_alloc(sock, &hdr, true, NULL,
+    ret = tran_sock_recv_alloc(sock, sock_type, &hdr, true, NULL,
                                (void **)&sversion, &vlen);
 
     if (ret < 0) {
@@ -171,16 +238,20 @@ recv_version(int sock, int *server_max_fds, size_t *pgsize)
 
     *server_max_fds = 1;
     *pgsize = sysconf(_SC_PAGESIZE);
+    *get_all_info = false;
 
     if (vlen > sizeof(*sversion)) {
         const char *json_str = (const char *)sversion->data;
         size_t len = vlen - sizeof(*sversion);
+        size_t server_max_msg_size;
 
         if (json_str[len - 1] != '\0') {
             errx(EXIT_FAILURE, "ignoring invalid JSON from server");
         }
 
-        ret = tran_parse_version_json(json_str, server_max_fds, pgsize);
+        ret = tran_parse_version_json(json_str, server_max_fds,
+                                      &server_max_msg_size, pgsize,
+                                      get_all_info, NULL);
 
         if (ret < 0) {
             errx(EXIT_FAILURE, "failed to parse server JSON \"%s\"", json_str);
@@ -191,16 +262,16 @@ recv_version(int sock, int *server_max_fds, size_t *pgsize)
 }
 
 static void
-negotiate(int sock, int *server_max_fds, size_t *pgsize)
+negotiate(int sock, int *server_max_fds, size_t *pgsize, bool *get_all_info)
 {
     send_version(sock);
-    recv_version(sock, server_max_fds, pgsize);
+    recv_version(sock, server_max_fds, pgsize, get_all_info);
 }
 
 static void
 send_device_reset(int sock)
 {
-    int ret = tran_sock_msg(sock, 1, VFIO_USER_DEVICE_RESET,
+    int ret = tran_sock_msg(sock, sock_type, 1, VFIO_USER_DEVICE_RESET,
                             NULL, 0, NULL, NULL, 0);
     if (ret < 0) {
         errx(EXIT_FAILURE, "failed to reset device: %s", strerror(-ret));
@@ -253,7 +324,8 @@ static void
 do_get_device_region_info(int sock, struct vfio_region_info *region_info,
                           int *fds, size_t *nr_fds)
 {
-    int ret = tran_sock_msg_fds(sock, 0xabcd, VFIO_USER_DEVICE_GET_REGION_INFO,
+    int ret = tran_sock_msg_fds(sock, sock_type, 0xabcd,
+                                VFIO_USER_DEVICE_GET_REGION_INFO,
                                 region_info, region_info->argsz, NULL,
                                 region_info, region_info->argsz, fds, nr_fds);
     if (ret < 0) {
@@ -292,11 +364,47 @@ mmap_sparse_areas(int *fds, struct vfio_region_info_cap_sparse_mmap *sparse)
     }
 }
 
+/*
+ * Returns whether this is the migration region. @nr_fds is the number of fds
+ * available on input and the number consumed by the region on output.
+ */
+static bool
+show_region_info(struct vfio_region_info *region_info, int *fds,
+                 size_t *nr_fds)
+{
+    struct vfio_region_info_cap_sparse_mmap *sparse = NULL;
+    uint32_t index = region_info->index;
+    size_t cap_sz;
+    bool migr = false;
+
+    cap_sz = region_info->argsz - sizeof(struct vfio_region_info);
+    if (cap_sz) {
+        migr = get_region_vfio_caps((struct vfio_info_cap_header *)
+                                    (region_info + 1), &sparse);
+    }
+    if (sparse != NULL) {
+        assert(*nr_fds >= sparse->nr_areas);
+        *nr_fds = sparse->nr_areas;
+    } else {
+        *nr_fds = 0;
+    }
+
+    printf("client: %s: region_info[%d] offset %#llx flags %#x size %llu "
+           "cap_sz %lu #FDs %lu\n", __func__, index, region_info->offset,
+           region_info->flags, region_info->size, cap_sz, *nr_fds);
+
+    if (migr && sparse != NULL) {
+        assert((index == VFU_PCI_DEV_BAR1_REGION_IDX && *nr_fds == 2) ||
+               (index == VFU_PCI_DEV_MIGR_REGION_IDX && *nr_fds == 1));
+        mmap_sparse_areas(fds, sparse);
+    }
+    return migr;
+}
+
 static bool
 get_device_region_info(int sock, uint32_t index)
 {
     struct vfio_region_info *region_info;
-    size_t cap_sz;
     size_t size = sizeof(struct vfio_region_info);
     int fds[CLIENT_MAX_FDS] = { 0 };
     size_t nr_fds = ARRAY_SIZE(fds);
@@ -320,24 +428,7 @@ get_device_region_info(int sock, uint32_t index)
         nr_fds = 0;
     }
 
-    cap_sz = region_info->argsz - sizeof(struct vfio_region_info);
-    printf("client: %s: region_info[%d] offset %#llx flags %#x size %llu "
-           "cap_sz %lu #FDs %lu\n", __func__, index, region_info->offset,
-           region_info->flags, region_info->size, cap_sz, nr_fds);
-    if (cap_sz) {
-        struct vfio_region_info_cap_sparse_mmap *sparse = NULL;
-        if (get_region_vfio_caps((struct vfio_info_cap_header*)(region_info + 1),
-                                 &sparse)) {
-            if (sparse != NULL) {
-                assert((index == VFU_PCI_DEV_BAR1_REGION_IDX && nr_fds == 2) ||
-                       (index == VFU_PCI_DEV_MIGR_REGION_IDX && nr_fds == 1));
-                assert(nr_fds == sparse->nr_areas);
-                mmap_sparse_areas(fds, sparse);
-            }
-            return true;
-        }
-    }
-    return false;
+    return show_region_info(region_info, fds, &nr_fds);
 }
 
 /*
@@ -366,7 +457,7 @@ get_device_info(int sock, struct vfio_device_info *dev_info)
 
     dev_info->argsz = sizeof(*dev_info);
 
-    ret = tran_sock_msg(sock, msg_id,
+    ret = tran_sock_msg(sock, sock_type, msg_id,
                         VFIO_USER_DEVICE_GET_INFO,
                         dev_info, sizeof(*dev_info),
                         NULL,
@@ -385,6 +476,77 @@ get_device_info(int sock, struct vfio_device_info *dev_info)
            dev_info->flags, dev_info->num_regions, dev_info->num_irqs);
 }
 
+
+/*
+ * Discovers the device with a single VFIO_USER_DEVICE_GET_ALL_INFO, once we
+ * know how large the reply is. Returns the index of the migration region if
+ * found, -1 otherwise.
+ */
+static int
+get_device_all_info(int sock, struct vfio_device_info *dev_info)
+{
+    uint16_t msg_id = 0xa11;
+    struct vfio_region_info *region_info;
+    int fds[CLIENT_MAX_FDS] = { 0 };
+    size_t nr_fds = ARRAY_SIZE(fds);
+    size_t off, size, fd_off = 0;
+    int migr_reg_index = -1;
+    unsigned int i;
+    char *buf;
+    int ret;
+
+    dev_info->argsz = sizeof(*dev_info);
+    ret = tran_sock_msg(sock, sock_type, msg_id, VFIO_USER_DEVICE_GET_ALL_INFO,
+                        dev_info, sizeof(*dev_info), NULL,
+                        dev_info, sizeof(*dev_info));
+    if (ret < 0) {
+        errx(EXIT_FAILURE, "failed to get device info size: %s",
+             strerror(-ret));
+    }
+
+    size = dev_info->argsz;
+    buf = calloc(1, size);
+    if (buf == NULL) {
+        err(EXIT_FAILURE, "failed to allocate device info");
+    }
+    ret = tran_sock_msg_fds(sock, sock_type, msg_id + 1,
+                            VFIO_USER_DEVICE_GET_ALL_INFO,
+                            dev_info, sizeof(*dev_info), NULL, buf, size,
+                            fds, &nr_fds);
+    if (ret < 0) {
+        errx(EXIT_FAILURE, "failed to get all device info: %s",
+             strerror(-ret));
+    }
+    memcpy(dev_info, buf, sizeof(*dev_info));
+    assert(dev_info->argsz == size);
+
+    if (dev_info->num_regions != 10) {
+        errx(EXIT_FAILURE, "bad number of device regions %d",
+             dev_info->num_regions);
+    }
+
+    printf("client: devinfo: flags %#x, num_regions %d, num_irqs %d\n",
+           dev_info->flags, dev_info->num_regions, dev_info->num_irqs);
+
+    off = sizeof(*dev_info) + dev_info->num_irqs * sizeof(struct vfio_irq_info);
+    for (i = 0; i < dev_info->num_regions; i++) {
+        size_t nr_region_fds = nr_fds - fd_off;
+
+        region_info = (struct vfio_region_info *)(buf + off);
+        assert(off + region_info->argsz <= size);
+        if (show_region_info(region_info, fds + fd_off, &nr_region_fds)) {
+            assert(migr_reg_index == -1);
+            migr_reg_index = i;
+        }
+        fd_off += nr_region_fds;
+        off += region_info->argsz;
+    }
+    assert(off == size && fd_off == nr_fds);
+
+    free(buf);
+    return migr_reg_index;
+}
+
 static int
 configure_irqs(int sock)
 {
@@ -399,7 +561,7 @@ configure_irqs(int sock)
             .argsz = sizeof(vfio_irq_info),
             .index = i
         };
-        ret = tran_sock_msg(sock, msg_id,
+        ret = tran_sock_msg(sock, sock_type, msg_id,
                             VFIO_USER_DEVICE_GET_IRQ_INFO,
                             &vfio_irq_info, sizeof(vfio_irq_info),
                             NULL,
@@ -430,7 +592,8 @@ configure_irqs(int sock)
     iovecs[1].iov_base = &irq_set;
     iovecs[1].iov_len = sizeof(irq_set);
 
-    ret = tran_sock_msg_iovec(sock, msg_id, VFIO_USER_DEVICE_SET_IRQS,
+    ret = tran_sock_msg_iovec(sock, sock_type, msg_id,
+                              VFIO_USER_DEVICE_SET_IRQS,
                               iovecs, ARRAY_SIZE(iovecs),
                               &irq_fd, 1,
                               NULL, NULL, 0, NULL, 0);
@@ -485,7 +648,7 @@ access_region(int sock, int region, bool is_write, uint64_t offset,
     }
 
     pthread_mutex_lock(&mutex);
-    ret = tran_sock_msg_iovec(sock, msg_id--, op,
+    ret = tran_sock_msg_iovec(sock, sock_type, msg_id--, op,
                               send_iovecs, nr_send_iovecs,
                               NULL, 0, NULL,
                               recv_data, recv_data_len, NULL, 0);
@@ -549,46 +712,61 @@ wait_for_irq(int irq_fd)
     printf("client: INTx triggered!\n");
 }
 
-static void
+static int
+find_dma_region(struct vfio_user_dma_region *dma_regions, int nr_dma_regions,
+                struct vfio_user_dma_region_access *dma_access)
+{
+    int i;
+
+    for (i = 0; i < nr_dma_regions; i++) {
+        if (dma_access->addr >= dma_regions[i].addr &&
+            dma_access->addr + dma_access->count <=
+            dma_regions[i].addr + dma_regions[i].size) {
+            return i;
+        }
+    }
+    errx(EXIT_FAILURE, "bad DMA access %#lx-%#lx", dma_access->addr,
+         dma_access->addr + dma_access->count - 1);
+}
+
+static size_t
 handle_dma_write(int sock, struct vfio_user_dma_region *dma_regions,
                  int nr_dma_regions, int *dma_region_fds)
 {
     struct vfio_user_dma_region_access dma_access;
     struct vfio_user_header hdr;
     int ret, i;
-    size_t size = sizeof(dma_access);
+    size_t size;
+    size_t count;
     uint16_t msg_id = 0xcafe;
+    off_t offset;
+    void *buf;
     void *data;
 
-    ret = tran_sock_recv(sock, &hdr, false, &msg_id, &dma_access, &size);
+    /* The data must be received along with the header with SOCK_SEQPACKET. */
+    ret = tran_sock_recv_alloc(sock, sock_type, &hdr, false, &msg_id, &buf,
+                               &size);
     if (ret < 0) {
         errx(EXIT_FAILURE, "failed to receive DMA read: %s", strerror(-ret));
     }
-
-    data = calloc(dma_access.count, 1);
-    if (data == NULL) {
-        err(EXIT_FAILURE, NULL);
+    if (size < sizeof(dma_access)) {
+        errx(EXIT_FAILURE, "bad DMA write size %zu", size);
     }
-
-    if (recv(sock, data, dma_access.count, 0) == -1) {
-        err(EXIT_FAILURE, "failed to recieve DMA read data");
+    memcpy(&dma_access, buf, sizeof(dma_access));
+    if (size - sizeof(dma_access) != dma_access.count) {
+        errx(EXIT_FAILURE, "bad DMA write count %u", dma_access.count);
     }
+    data = (char *)buf + sizeof(dma_access);
 
-    for (i = 0; i < nr_dma_regions; i++) {
-        if (dma_regions[i].addr == dma_access.addr) {
-            ret = pwrite(dma_region_fds[i], data, dma_access.count,
-                         dma_regions[i].offset);
-            if (ret < 0) {
-                err(EXIT_FAILURE,
-                    "failed to write data to fd=%d at %#lx-%#lx",
-                        dma_region_fds[i],
-                        dma_regions[i].offset,
-                        dma_regions[i].offset + dma_access.count - 1);
-            }
-            break;
-	    }
+    i = find_dma_region(dma_regions, nr_dma_regions, &dma_access);
+    offset = dma_regions[i].offset + (dma_access.addr - dma_regions[i].addr);
+    ret = pwrite(dma_region_fds[i], data, dma_access.count, offset);
+    if (ret < 0) {
+        err(EXIT_FAILURE, "failed to write data to fd=%d at %#lx-%#lx",
+            dma_region_fds[i], offset, offset + dma_access.count - 1);
     }
 
+    count = dma_access.count;
     dma_access.count = 0;
     ret = tran_sock_send(sock, msg_id, true, VFIO_USER_DMA_WRITE,
                          &dma_access, sizeof(dma_access));
@@ -596,10 +774,11 @@ handle_dma_write(int sock, struct vfio_user_dma_region *dma_regions,
         errx(EXIT_FAILURE, "failed to send reply of DMA write: %s",
              strerror(-ret));
     }
-    free(data);
+    free(buf);
+    return count;
 }
 
-static void
+static size_t
 handle_dma_read(int sock, struct vfio_user_dma_region *dma_regions,
                 int nr_dma_regions, int *dma_region_fds)
 {
@@ -608,9 +787,11 @@ handle_dma_read(int sock, struct vfio_user_dma_region *dma_regions,
     int ret, i, response_sz;
     size_t size = sizeof(dma_access);
     uint16_t msg_id = 0xcafe;
+    off_t offset;
     void *data;
 
-    ret = tran_sock_recv(sock, &hdr, false, &msg_id, &dma_access, &size);
+    ret = tran_sock_recv(sock, sock_type, &hdr, false, &msg_id, &dma_access,
+                         &size);
     if (ret < 0) {
         errx(EXIT_FAILURE, "failed to recieve DMA read");
     }
@@ -620,35 +801,46 @@ handle_dma_read(int sock, struct vfio_user_dma_region *dma_regions,
     if (response == NULL) {
         err(EXIT_FAILURE, NULL);
     }
+    response->addr = dma_access.addr;
     response->count = dma_access.count;
     data = (char *)response->data;
 
-    for (i = 0; i < nr_dma_regions; i++) {
-        if (dma_regions[i].addr == dma_access.addr) {
-            if (pread(dma_region_fds[i], data, dma_access.count, dma_regions[i].offset) == -1) {
-                err(EXIT_FAILURE, "failed to write data at %#lx-%#lx",
-                    dma_regions[i].offset,
-                    dma_regions[i].offset + dma_access.count);
-            }
-            break;
-	    }
+    i = find_dma_region(dma_regions, nr_dma_regions, &dma_access);
+    offset = dma_regions[i].offset + (dma_access.addr - dma_regions[i].addr);
+    if (pread(dma_region_fds[i], data, dma_access.count, offset) == -1) {
+        err(EXIT_FAILURE, "failed to read data at %#lx-%#lx",
+            offset, offset + dma_access.count - 1);
     }
 
     ret = tran_sock_send(sock, msg_id, true, VFIO_USER_DMA_READ,
                          response, response_sz);
     if (ret < 0) {
-        errx(EXIT_FAILURE, "failed to send reply of DMA write: %s",
+        errx(EXIT_FAILURE, "failed to send reply of DMA read: %s",
              strerror(-ret));
     }
     free(response);
+    return dma_access.count;
 }
 
+/*
+ * The server writes 4096 bytes to the region that is not mappable and reads
+ * them back; as our maximum message size is smaller than that, each transfer
+ * arrives as several chunks.
+ */
 static void
 handle_dma_io(int sock, struct vfio_user_dma_region *dma_regions,
               int nr_dma_regions, int *dma_region_fds)
 {
-    handle_dma_write(sock, dma_regions, nr_dma_regions, dma_region_fds);
-    handle_dma_read(sock, dma_regions, nr_dma_regions, dma_region_fds);
+    size_t count;
+
+    for (count = 0; count < 4096; ) {
+        count += handle_dma_write(sock, dma_regions, nr_dma_regions,
+                                  dma_region_fds);
+    }
+    for (count = 0; count < 4096; ) {
+        count += handle_dma_read(sock, dma_regions, nr_dma_regions,
+                                 dma_region_fds);
+    }
 }
 
 static void
@@ -687,7 +879,7 @@ get_dirty_bitmaps(int sock, struct vfio_user_dma_region *dma_regions,
      */
     dirty_bitmap.argsz = sizeof(dirty_bitmap) + ARRAY_SIZE(bitmaps) * sizeof(struct vfio_iommu_type1_dirty_bitmap_get);
     dirty_bitmap.flags = VFIO_IOMMU_DIRTY_PAGES_FLAG_GET_BITMAP;
-    ret = tran_sock_msg_iovec(sock, 0, VFIO_USER_DIRTY_PAGES,
+    ret = tran_sock_msg_iovec(sock, sock_type, 0, VFIO_USER_DIRTY_PAGES,
                               iovecs, ARRAY_SIZE(iovecs),
                               NULL, 0,
                               &hdr, data, ARRAY_SIZE(data), NULL, 0);
@@ -711,7 +903,9 @@ enum migration {
 static void
 usage(char *argv0)
 {
-    fprintf(stderr, "Usage: %s [-h] [-m src|dst] /path/to/socket\n",
+    fprintf(stderr, "Usage: %s [-h] [-s] /path/to/socket | -t host:port\n"
+            "  -s: connect with SOCK_SEQPACKET, for a server started with -s\n"
+            "  -t: connect over TCP, for a server started with -t\n",
             basename(argv0));
 }
 
@@ -931,6 +1125,7 @@ migrate_to(char *old_sock_path, int *server_max_fds,
     char *sock_path;
     struct stat sb;
     __u32 device_state = VFIO_DEVICE_STATE_RESUMING;
+    bool get_all_info;
     __u64 data_offset, data_len;
     size_t i;
 	MD5_CTX md5_ctx;
@@ -955,8 +1150,13 @@ migrate_to(char *old_sock_path, int *server_max_fds,
             path_to_server,
             "-v",
             sock_path,
+            NULL,
             NULL
         };
+        if (sock_type == SOCK_SEQPACKET) {
+            _argv[2] = "-s";
+            _argv[3] = sock_path;
+        }
         ret = execvp(_argv[0] , _argv);
         if (ret != 0) {
             err(EXIT_FAILURE, "failed to start destination server (%s)",
@@ -980,7 +1180,7 @@ migrate_to(char *old_sock_path, int *server_max_fds,
     sock = init_sock(sock_path);
     free(sock_path);
 
-    negotiate(sock, server_max_fds, pgsize);
+    negotiate(sock, server_max_fds, pgsize, &get_all_info);
 
     /* XXX set device state to resuming */
     ret = access_region(sock, migr_reg_index, true,
@@ -1069,25 +1269,105 @@ static void
 map_dma_regions(int sock, int max_fds, struct vfio_user_dma_region *dma_regions,
                 int *dma_region_fds, int nr_dma_regions)
 {
-    int i, ret;
+    int i, j, ret;
 
     for (i = 0; i < nr_dma_regions / max_fds; i++) {
         struct iovec iovecs[2] = { { 0, } };
+        int fds[max_fds];
+        int nr_fds = 0;
 
         /* [0] is for the header. */
         iovecs[1].iov_base = dma_regions + (i * max_fds);
         iovecs[1].iov_len = sizeof(*dma_regions) * max_fds;
 
-        ret = tran_sock_msg_iovec(sock, 0x1234 + i, VFIO_USER_DMA_MAP,
-                                  iovecs, ARRAY_SIZE(iovecs),
-                                  dma_region_fds + (i * max_fds), max_fds,
-                                  NULL, NULL, 0, NULL, 0);
+        /* Only mappable regions are accompanied by a file descriptor. */
+        for (j = i * max_fds; j < (i + 1) * max_fds; j++) {
+            if (dma_regions[j].flags & VFIO_USER_F_DMA_REGION_MAPPABLE) {
+                fds[nr_fds++] = dma_region_fds[j];
+            }
+        }
+
+        ret = tran_sock_msg_iovec(sock, sock_type, 0x1234 + i,
+                                  VFIO_USER_DMA_MAP, iovecs, ARRAY_SIZE(iovecs),
+                                  fds, nr_fds, NULL, NULL, 0, NULL, 0);
         if (ret < 0) {
             errx(EXIT_FAILURE, "failed to map DMA regions: %s", strerror(-ret));
         }
     }
 }
 
+/*
+ * Over TCP, the server can't be given an eventfd, so it posts interrupts as
+ * VFIO_USER_VM_INTERRUPT messages.
+ */
+static void
+wait_for_irq_msg(int sock)
+{
+    struct vfio_user_header hdr;
+    uint32_t *subindexes;
+    size_t size;
+    int ret;
+
+    ret = tran_sock_recv_alloc(sock, sock_type, &hdr, false, NULL,
+                               (void **)&subindexes, &size);
+    if (ret < 0) {
+        errx(EXIT_FAILURE, "failed to receive interrupt: %s", strerror(-ret));
+    }
+    if (hdr.cmd != VFIO_USER_VM_INTERRUPT || !hdr.flags.no_reply ||
+        size != sizeof(*subindexes) || subindexes[0] != 0) {
+        errx(EXIT_FAILURE, "bad interrupt message");
+    }
+    free(subindexes);
+    printf("client: INTx triggered!\n");
+}
+
+/*
+ * Nothing can be mapped over TCP: give the server a DMA region that it can
+ * only access with messages, have it trigger an interrupt, and serve the DMA
+ * that follows it.
+ */
+static void
+access_over_tcp(int sock)
+{
+    struct vfio_user_dma_region dma_region = {
+        .size = sysconf(_SC_PAGESIZE),
+        .prot = PROT_READ | PROT_WRITE
+    };
+    int dma_region_fd;
+    time_t t;
+    FILE *fp;
+    int ret;
+
+    fp = tmpfile();
+    if (fp == NULL) {
+        err(EXIT_FAILURE, "failed to create DMA file");
+    }
+    dma_region_fd = fileno(fp);
+    if (ftruncate(dma_region_fd, dma_region.size) == -1) {
+        err(EXIT_FAILURE, "failed to truncate file");
+    }
+
+    ret = tran_sock_msg(sock, sock_type, 0x1234, VFIO_USER_DMA_MAP,
+                        &dma_region, sizeof(dma_region), NULL, NULL, 0);
+    if (ret < 0) {
+        errx(EXIT_FAILURE, "failed to map DMA region: %s", strerror(-ret));
+    }
+
+    t = time(NULL) + 1;
+    access_bar0(sock, &t);
+
+    wait_for_irq_msg(sock);
+
+    handle_dma_io(sock, &dma_region, 1, &dma_region_fd);
+
+    ret = tran_sock_msg(sock, sock_type, 0x1235, VFIO_USER_DMA_UNMAP,
+                        &dma_region, sizeof(dma_region), NULL, NULL, 0);
+    if (ret < 0) {
+        errx(EXIT_FAILURE, "failed to unmap DMA region: %s", strerror(-ret));
+    }
+    fclose(fp);
+}
+
 int main(int argc, char *argv[])
 {
 	int ret, sock, irq_fd;
@@ -1098,6 +1378,7 @@ int main(int argc, char *argv[])
     FILE *fp;
     int server_max_fds;
     size_t pgsize;
+    bool get_all_info;
     int nr_dma_regions;
     struct vfio_iommu_type1_dirty_bitmap dirty_bitmap = {0};
     int opt;
@@ -1110,11 +1391,17 @@ int main(int argc, char *argv[])
     unsigned char md5sum[MD5_DIGEST_LENGTH];
     size_t bar1_size = 0x3000; /* FIXME get this value from region info */
 
-    while ((opt = getopt(argc, argv, "h")) != -1) {
+    while ((opt = getopt(argc, argv, "hst")) != -1) {
         switch (opt) {
             case 'h':
                 usage(argv[0]);
                 exit(EXIT_SUCCESS);
+            case 's':
+                sock_type = SOCK_SEQPACKET;
+                break;
+            case 't':
+                tcp = true;
+                break;
             default:
                 usage(argv[0]);
                 exit(EXIT_FAILURE);
@@ -1133,7 +1420,7 @@ int main(int argc, char *argv[])
      *
      * Do intial negotiation with the server, and discover parameters.
      */
-    negotiate(sock, &server_max_fds, &pgsize);
+    negotiate(sock, &server_max_fds, &pgsize, &get_all_info);
 
     /* try to access a bogus region, we should get an error */
     ret = access_region(sock, 0xdeadbeef, false, 0, &ret, sizeof(ret));
@@ -1143,11 +1430,16 @@ int main(int argc, char *argv[])
              ret);
     }
 
-    /* XXX VFIO_USER_DEVICE_GET_INFO */
-    get_device_info(sock, &client_dev_info);
+    if (get_all_info) {
+        /* XXX VFIO_USER_DEVICE_GET_ALL_INFO */
+        migr_reg_index = get_device_all_info(sock, &client_dev_info);
+    } else {
+        /* XXX VFIO_USER_DEVICE_GET_INFO */
+        get_device_info(sock, &client_dev_info);
 
-    /* XXX VFIO_USER_DEVICE_GET_REGION_INFO */
-    migr_reg_index = get_device_regions_info(sock, &client_dev_info);
+        /* XXX VFIO_USER_DEVICE_GET_REGION_INFO */
+        migr_reg_index = get_device_regions_info(sock, &client_dev_info);
+    }
     if (migr_reg_index == -1) {
         errx(EXIT_FAILURE, "could not find migration region");
     }
@@ -1167,6 +1459,13 @@ int main(int argc, char *argv[])
     /* XXX VFIO_USER_DEVICE_RESET */
     send_device_reset(sock);
 
+    if (tcp) {
+        /* The rest of the demo relies on passing file descriptors. */
+        access_over_tcp(sock);
+        close(sock);
+        return EXIT_SUCCESS;
+    }
+
     /*
      * XXX VFIO_USER_DMA_MAP
      *
@@ -1196,6 +1495,13 @@ int main(int argc, char *argv[])
         dma_region_fds[i] = fileno(fp);
     }
 
+    /*
+     * The server can access mappable regions directly, so make the last one
+     * (which is mapped again after migration) not mappable so that it has to
+     * send us DMA messages.
+     */
+    dma_regions[nr_dma_regions - 1].flags = 0;
+
     map_dma_regions(sock, server_max_fds, dma_regions, dma_region_fds,
                     nr_dma_regions);
 
@@ -1207,7 +1513,7 @@ int main(int argc, char *argv[])
 
     dirty_bitmap.argsz = sizeof(dirty_bitmap);
     dirty_bitmap.flags = VFIO_IOMMU_DIRTY_PAGES_FLAG_START;
-    ret = tran_sock_msg(sock, 0, VFIO_USER_DIRTY_PAGES,
+    ret = tran_sock_msg(sock, sock_type, 0, VFIO_USER_DIRTY_PAGES,
                         &dirty_bitmap, sizeof(dirty_bitmap),
                         NULL, NULL, 0);
     if (ret != 0) {
@@ -1234,7 +1540,7 @@ int main(int argc, char *argv[])
 
     dirty_bitmap.argsz = sizeof(dirty_bitmap);
     dirty_bitmap.flags = VFIO_IOMMU_DIRTY_PAGES_FLAG_STOP;
-    ret = tran_sock_msg(sock, 0, VFIO_USER_DIRTY_PAGES,
+    ret = tran_sock_msg(sock, sock_type, 0, VFIO_USER_DIRTY_PAGES,
                         &dirty_bitmap, sizeof(dirty_bitmap),
                         NULL, NULL, 0);
     if (ret != 0) {
@@ -1249,7 +1555,7 @@ int main(int argc, char *argv[])
      *
      * unmap the first group of the DMA regions
      */
-    ret = tran_sock_msg(sock, 7, VFIO_USER_DMA_UNMAP,
+    ret = tran_sock_msg(sock, sock_type, 7, VFIO_USER_DMA_UNMAP,
                         dma_regions, sizeof(*dma_regions) * server_max_fds,
                         NULL, NULL, 0);
     if (ret < 0) {
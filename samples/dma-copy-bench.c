@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2019, Nutanix Inc. All rights reserved.
+ *     Author: Thanos Makatos <thanos@nutanix.com>
+ *             Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *             Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * Measures copies to client memory done with and without non-temporal stores,
+ * to pick a threshold for vfu_setup_dma_copy_threshold(). For each size, it
+ * reports the copy throughput and how long reading the device's working set
+ * takes afterwards, which the copy may have evicted from the cache.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dma.h"
+
+#define WORKING_SET_SIZE (1 << 20)
+#define ITERATIONS 32
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t
+read_working_set(const uint64_t *ws)
+{
+    uint64_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < WORKING_SET_SIZE / sizeof(*ws); i += 8) {
+        sum += ws[i];
+    }
+    return sum;
+}
+
+static void
+bench(char *dst, const char *src, size_t len, const uint64_t *ws,
+      size_t threshold, const char *name)
+{
+    uint64_t copy_ns = 0, read_ns = 0, start;
+    volatile uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        sum += read_working_set(ws);
+        start = now_ns();
+        dma_copy_to_client(dst, src, len, threshold);
+        copy_ns += now_ns() - start;
+        start = now_ns();
+        sum += read_working_set(ws);
+        read_ns += now_ns() - start;
+    }
+
+    printf("%10zu %-8s %8.2f GB/s %10.1f us\n", len, name,
+           (double)len * ITERATIONS / copy_ns,
+           (double)read_ns / ITERATIONS / 1000);
+}
+
+int
+main(void)
+{
+    size_t max_len = 64 << 20;
+    uint64_t *ws;
+    char *src, *dst;
+    size_t len;
+
+    src = malloc(max_len);
+    dst = malloc(max_len);
+    ws = malloc(WORKING_SET_SIZE);
+    if (src == NULL || dst == NULL || ws == NULL) {
+        err(EXIT_FAILURE, "failed to allocate buffers");
+    }
+    memset(src, 0xa5, max_len);
+    memset(dst, 0, max_len);
+    memset(ws, 0x5a, WORKING_SET_SIZE);
+
+    printf("%10s %-8s %13s %13s\n", "size", "copy", "throughput",
+           "ws read");
+    for (len = 64 << 10; len <= max_len; len *= 2) {
+        bench(dst, src, len, ws, SIZE_MAX, "cached");
+        bench(dst, src, len, ws, 1, "nt");
+    }
+
+    free(ws);
+    free(dst);
+    free(src);
+    return 0;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
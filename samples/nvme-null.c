@@ -0,0 +1,759 @@
+/*
+ * Copyright (c) 2020 Nutanix Inc. All rights reserved.
+ *
+ * Authors: Thanos Makatos <thanos@nutanix.com>
+ *          Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *          Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * nvme-null: an example server emulating a minimal NVMe controller with a single
+ * null namespace: reads and writes complete without transferring any data.
+ * Queues are handled with the vfu_nvme_qp_*() helpers, including shadow
+ * doorbells, so the guest only traps on doorbell writes when the controller
+ * has run out of work.
+ */
+
+#include <stdio.h>
+#include <err.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/param.h>
+
+#include "common.h"
+#include "libvfio-user.h"
+
+#define NR_QUEUES           8       /* admin queue and 7 I/O queues */
+#define MAX_QUEUE_SIZE      256
+#define FETCH_BATCH         16
+#define NS_BLOCKS           (1ULL << 21)    /* 1 GiB of 512 byte blocks */
+#define NVME_PAGE_SIZE      4096
+
+#define NVME_BAR0_SIZE      0x4000
+#define NVME_REG_DBS        0x1000
+
+#define NVME_CC_EN          (1 << 0)
+#define NVME_CC_SHN(cc)     (((cc) >> 14) & 0x3)
+#define NVME_CSTS_RDY       (1 << 0)
+#define NVME_CSTS_CFS       (1 << 1)
+#define NVME_CSTS_SHST_MASK (0x3 << 2)
+#define NVME_CSTS_SHST_DONE (0x2 << 2)
+
+/* Admin commands. */
+#define NVME_ADM_DELETE_SQ  0x00
+#define NVME_ADM_CREATE_SQ  0x01
+#define NVME_ADM_GET_LOG    0x02
+#define NVME_ADM_DELETE_CQ  0x04
+#define NVME_ADM_CREATE_CQ  0x05
+#define NVME_ADM_IDENTIFY   0x06
+#define NVME_ADM_ABORT      0x08
+#define NVME_ADM_SET_FEAT   0x09
+#define NVME_ADM_GET_FEAT   0x0a
+#define NVME_ADM_ASYNC_EV   0x0c
+#define NVME_ADM_DBBUF      0x7c
+
+/* NVM commands. */
+#define NVME_CMD_FLUSH      0x00
+#define NVME_CMD_WRITE      0x01
+#define NVME_CMD_READ       0x02
+
+#define NVME_FEAT_NR_QUEUES 0x07
+
+/* Status field values, without the phase tag. */
+#define NVME_SC_SUCCESS         0x0
+#define NVME_SC_INVALID_OPCODE  0x1
+#define NVME_SC_INVALID_FIELD   0x2
+#define NVME_SC_INVALID_NS      0xb
+#define NVME_SC_LBA_RANGE       0x80
+#define NVME_SC_CQ_INVALID      0x100
+#define NVME_SC_QID_INVALID     0x101
+#define NVME_SC_QSIZE_INVALID   0x102
+#define NVME_SC_DNR             (1 << 14)
+
+/* Controller registers, NVMe 1.4 section 3.1. */
+struct nvme_regs {
+    uint64_t cap;
+    uint32_t vs;
+    uint32_t intms;
+    uint32_t intmc;
+    uint32_t cc;
+    uint32_t rsvd;
+    uint32_t csts;
+    uint32_t nssr;
+    uint32_t aqa;
+    uint64_t asq;
+    uint64_t acq;
+} __attribute__((packed));
+
+struct nvme_sqe {
+    uint8_t opc;
+    uint8_t flags;
+    uint16_t cid;
+    uint32_t nsid;
+    uint64_t rsvd;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __attribute__((packed));
+
+/* A completion queue created by the driver, waiting for its SQ. */
+struct nvme_cq {
+    bool valid;
+    vfu_dma_addr_t addr;
+    uint16_t size;
+    bool ien;
+    uint16_t iv;
+};
+
+struct nvme_queue {
+    vfu_nvme_qp_t *qp;
+    /* Completions that didn't fit in the CQ yet. */
+    vfu_nvme_cpl_t pending[MAX_QUEUE_SIZE];
+    int nr_pending;
+};
+
+struct nvme_ctrl {
+    vfu_ctx_t *vfu_ctx;
+    struct nvme_regs regs;
+    struct nvme_cq cqs[NR_QUEUES];
+    struct nvme_queue queues[NR_QUEUES];
+    vfu_dma_addr_t dbbuf;
+    vfu_dma_addr_t eibuf;
+};
+
+static void
+_log(vfu_ctx_t *vfu_ctx UNUSED, UNUSED int level, char const *msg)
+{
+    fprintf(stderr, "nvme: %s\n", msg);
+}
+
+static void
+_sa_handler(UNUSED int signum)
+{
+}
+
+/* Copies @len bytes, at most two pages, to the buffer described by PRPs. */
+static uint16_t
+copy_to_prps(struct nvme_ctrl *ctrl, const struct nvme_sqe *sqe,
+             const void *buf, size_t len)
+{
+    uint64_t addrs[2] = { sqe->prp1, sqe->prp2 };
+    size_t lens[2];
+    int i;
+
+    lens[0] = MIN(len, NVME_PAGE_SIZE - sqe->prp1 % NVME_PAGE_SIZE);
+    lens[1] = len - lens[0];
+    if (lens[1] > NVME_PAGE_SIZE) {
+        return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+    }
+
+    for (i = 0; i < 2 && lens[i] > 0; i++) {
+        dma_sg_t sg;
+
+        if (vfu_addr_to_sg(ctrl->vfu_ctx, (vfu_dma_addr_t)addrs[i], lens[i],
+                           &sg, 1, PROT_WRITE) != 1 ||
+            vfu_sg_copy_to(ctrl->vfu_ctx, &sg, 1, buf, lens[i]) < 0) {
+            vfu_log(ctrl->vfu_ctx, LOG_ERR, "failed to write PRP %#lx: %m",
+                    addrs[i]);
+            return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+        }
+        buf = (const char *)buf + lens[i];
+    }
+
+    return NVME_SC_SUCCESS;
+}
+
+static void
+set_str(uint8_t *dst, const char *src, size_t len)
+{
+    memset(dst, ' ', len);
+    memcpy(dst, src, MIN(strlen(src), len));
+}
+
+static uint16_t
+identify(struct nvme_ctrl *ctrl, const struct nvme_sqe *sqe)
+{
+    uint8_t data[NVME_PAGE_SIZE] = { 0 };
+    uint32_t val;
+
+    switch (sqe->cdw10 & 0xff) {
+    case 0x00: /* namespace */
+        if (sqe->nsid != 1) {
+            return NVME_SC_INVALID_NS | NVME_SC_DNR;
+        }
+        val = NS_BLOCKS;
+        memcpy(&data[0], &val, sizeof(val));     /* NSZE */
+        memcpy(&data[8], &val, sizeof(val));     /* NCAP */
+        memcpy(&data[16], &val, sizeof(val));    /* NUSE */
+        data[128 + 2] = 9;                       /* LBAF0.LBADS: 512 bytes */
+        break;
+    case 0x01: /* controller */
+        data[0] = 0x58;                          /* VID */
+        data[1] = 0x4e;
+        set_str(&data[4], "0001", 20);           /* SN */
+        set_str(&data[24], "libvfio-user NVMe sample", 40); /* MN */
+        set_str(&data[64], "0.1", 8);            /* FR */
+        data[77] = 5;                            /* MDTS: 128 KiB */
+        val = 0x10400;
+        memcpy(&data[80], &val, sizeof(val));    /* VER */
+        data[257] = 1;                           /* OACS: Doorbell Buffer */
+        data[259] = 3;                           /* AERL */
+        data[512] = 0x66;                        /* SQES */
+        data[513] = 0x44;                        /* CQES */
+        val = 1;
+        memcpy(&data[516], &val, sizeof(val));   /* NN */
+        break;
+    case 0x02: /* active namespace IDs */
+        val = sqe->nsid < 1 ? 1 : 0;
+        memcpy(&data[0], &val, sizeof(val));
+        break;
+    case 0x03: /* namespace identification descriptors */
+        break;
+    default:
+        return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+    }
+
+    return copy_to_prps(ctrl, sqe, data, sizeof(data));
+}
+
+static uint16_t
+create_cq(struct nvme_ctrl *ctrl, const struct nvme_sqe *sqe)
+{
+    uint16_t qid = sqe->cdw10 & 0xffff;
+    uint16_t size = (sqe->cdw10 >> 16) + 1;
+    struct nvme_cq *cq;
+
+    if (qid == 0 || qid >= NR_QUEUES || ctrl->cqs[qid].valid) {
+        return NVME_SC_QID_INVALID | NVME_SC_DNR;
+    }
+    if (size < 2 || size > MAX_QUEUE_SIZE) {
+        return NVME_SC_QSIZE_INVALID | NVME_SC_DNR;
+    }
+    if (!(sqe->cdw11 & 0x1)) {
+        /* Only physically contiguous queues are supported. */
+        return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+    }
+
+    cq = &ctrl->cqs[qid];
+    cq->valid = true;
+    cq->addr = (vfu_dma_addr_t)sqe->prp1;
+    cq->size = size;
+    cq->ien = sqe->cdw11 & 0x2;
+    cq->iv = sqe->cdw11 >> 16;
+    return NVME_SC_SUCCESS;
+}
+
+static int
+create_qp(struct nvme_ctrl *ctrl, uint16_t qid, vfu_dma_addr_t sq_addr,
+          uint16_t sq_size, const struct nvme_cq *cq)
+{
+    vfu_nvme_qp_info_t info = {
+        .qid = qid,
+        .sq_size = sq_size,
+        .cq_size = cq->size,
+        .sq_addr = sq_addr,
+        .cq_addr = cq->addr,
+        .irq_enabled = cq->ien,
+        /* Interrupts are delivered on INTx. */
+        .irq_subindex = 0,
+    };
+    struct nvme_queue *q = &ctrl->queues[qid];
+
+    q->qp = vfu_nvme_qp_create(ctrl->vfu_ctx, &info);
+    if (q->qp == NULL) {
+        vfu_log(ctrl->vfu_ctx, LOG_ERR, "failed to create queue %u: %m", qid);
+        return -1;
+    }
+    q->nr_pending = 0;
+
+    if (ctrl->dbbuf != NULL &&
+        vfu_nvme_qp_set_shadow(q->qp, ctrl->dbbuf, ctrl->eibuf, 4) < 0) {
+        vfu_log(ctrl->vfu_ctx, LOG_ERR, "failed to set up shadow doorbells "
+                "for queue %u: %m", qid);
+        vfu_nvme_qp_destroy(q->qp);
+        q->qp = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static uint16_t
+create_sq(struct nvme_ctrl *ctrl, const struct nvme_sqe *sqe)
+{
+    uint16_t qid = sqe->cdw10 & 0xffff;
+    uint16_t size = (sqe->cdw10 >> 16) + 1;
+    uint16_t cqid = sqe->cdw11 >> 16;
+
+    if (qid == 0 || qid >= NR_QUEUES || ctrl->queues[qid].qp != NULL) {
+        return NVME_SC_QID_INVALID | NVME_SC_DNR;
+    }
+    /* Each SQ must have a CQ of its own. */
+    if (cqid != qid || !ctrl->cqs[cqid].valid) {
+        return NVME_SC_CQ_INVALID | NVME_SC_DNR;
+    }
+    if (size < 2 || size > MAX_QUEUE_SIZE) {
+        return NVME_SC_QSIZE_INVALID | NVME_SC_DNR;
+    }
+    if (!(sqe->cdw11 & 0x1)) {
+        return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+    }
+
+    if (create_qp(ctrl, qid, (vfu_dma_addr_t)sqe->prp1, size,
+                  &ctrl->cqs[cqid]) < 0) {
+        return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+    }
+    return NVME_SC_SUCCESS;
+}
+
+static void
+destroy_qp(struct nvme_ctrl *ctrl, uint16_t qid)
+{
+    vfu_nvme_qp_destroy(ctrl->queues[qid].qp);
+    ctrl->queues[qid].qp = NULL;
+    ctrl->queues[qid].nr_pending = 0;
+}
+
+static uint16_t
+set_dbbuf(struct nvme_ctrl *ctrl, const struct nvme_sqe *sqe)
+{
+    int i;
+
+    if (sqe->prp1 % NVME_PAGE_SIZE != 0 || sqe->prp2 % NVME_PAGE_SIZE != 0) {
+        return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+    }
+
+    ctrl->dbbuf = (vfu_dma_addr_t)sqe->prp1;
+    ctrl->eibuf = (vfu_dma_addr_t)sqe->prp2;
+    for (i = 0; i < NR_QUEUES; i++) {
+        if (ctrl->queues[i].qp != NULL &&
+            vfu_nvme_qp_set_shadow(ctrl->queues[i].qp, ctrl->dbbuf,
+                                   ctrl->eibuf, 4) < 0) {
+            return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+        }
+    }
+    return NVME_SC_SUCCESS;
+}
+
+/*
+ * Executes an admin command. Returns false if the command doesn't complete
+ * (yet).
+ */
+static bool
+admin_cmd(struct nvme_ctrl *ctrl, const struct nvme_sqe *sqe,
+          vfu_nvme_cpl_t *cpl)
+{
+    uint8_t log[NVME_PAGE_SIZE] = { 0 };
+    uint16_t qid = sqe->cdw10 & 0xffff;
+
+    switch (sqe->opc) {
+    case NVME_ADM_CREATE_CQ:
+        cpl->status = create_cq(ctrl, sqe);
+        break;
+    case NVME_ADM_CREATE_SQ:
+        cpl->status = create_sq(ctrl, sqe);
+        break;
+    case NVME_ADM_DELETE_SQ:
+        if (qid == 0 || qid >= NR_QUEUES || ctrl->queues[qid].qp == NULL) {
+            cpl->status = NVME_SC_QID_INVALID | NVME_SC_DNR;
+            break;
+        }
+        destroy_qp(ctrl, qid);
+        break;
+    case NVME_ADM_DELETE_CQ:
+        if (qid == 0 || qid >= NR_QUEUES || !ctrl->cqs[qid].valid ||
+            ctrl->queues[qid].qp != NULL) {
+            cpl->status = NVME_SC_QID_INVALID | NVME_SC_DNR;
+            break;
+        }
+        ctrl->cqs[qid].valid = false;
+        break;
+    case NVME_ADM_IDENTIFY:
+        cpl->status = identify(ctrl, sqe);
+        break;
+    case NVME_ADM_GET_LOG:
+        cpl->status = copy_to_prps(ctrl, sqe, log,
+                                   MIN(sizeof(log),
+                                       ((sqe->cdw10 >> 16) + 1) * 4));
+        break;
+    case NVME_ADM_SET_FEAT:
+    case NVME_ADM_GET_FEAT:
+        if ((sqe->cdw10 & 0xff) == NVME_FEAT_NR_QUEUES) {
+            cpl->dw0 = (NR_QUEUES - 2) | (NR_QUEUES - 2) << 16;
+        }
+        break;
+    case NVME_ADM_ABORT:
+        cpl->dw0 = 1;   /* not aborted */
+        break;
+    case NVME_ADM_ASYNC_EV:
+        /* There are no events to report. */
+        return false;
+    case NVME_ADM_DBBUF:
+        cpl->status = set_dbbuf(ctrl, sqe);
+        break;
+    default:
+        cpl->status = NVME_SC_INVALID_OPCODE | NVME_SC_DNR;
+        break;
+    }
+    return true;
+}
+
+static void
+io_cmd(const struct nvme_sqe *sqe, vfu_nvme_cpl_t *cpl)
+{
+    uint64_t slba = sqe->cdw10 | (uint64_t)sqe->cdw11 << 32;
+    uint64_t nlb = (sqe->cdw12 & 0xffff) + 1;
+
+    if (sqe->nsid != 1) {
+        cpl->status = NVME_SC_INVALID_NS | NVME_SC_DNR;
+        return;
+    }
+
+    switch (sqe->opc) {
+    case NVME_CMD_READ:
+    case NVME_CMD_WRITE:
+        if (slba + nlb > NS_BLOCKS) {
+            cpl->status = NVME_SC_LBA_RANGE | NVME_SC_DNR;
+        }
+        break;
+    case NVME_CMD_FLUSH:
+        break;
+    default:
+        cpl->status = NVME_SC_INVALID_OPCODE | NVME_SC_DNR;
+        break;
+    }
+}
+
+/* Posts completions, keeping those that don't fit for later. */
+static int
+post(struct nvme_queue *q, const vfu_nvme_cpl_t *cpls, int n)
+{
+    int ret = vfu_nvme_qp_complete(q->qp, cpls, n);
+
+    if (ret < 0) {
+        return ret;
+    }
+    memcpy(&q->pending[q->nr_pending], &cpls[ret],
+           (n - ret) * sizeof(*cpls));
+    q->nr_pending += n - ret;
+    return 0;
+}
+
+static void
+process_queue(struct nvme_ctrl *ctrl, uint16_t qid)
+{
+    struct nvme_queue *q = &ctrl->queues[qid];
+    struct nvme_sqe sqes[FETCH_BATCH];
+    vfu_nvme_cpl_t cpls[FETCH_BATCH];
+    int i, m, n;
+
+    if (q->nr_pending > 0) {
+        int nr_pending = q->nr_pending;
+
+        q->nr_pending = 0;
+        if (post(q, q->pending, nr_pending) < 0) {
+            goto err;
+        }
+        if (q->nr_pending > 0) {
+            /* Wait for the driver to consume completions. */
+            return;
+        }
+    }
+
+    while (q->nr_pending == 0) {
+        n = vfu_nvme_qp_fetch(q->qp, sqes, FETCH_BATCH);
+        if (n <= 0) {
+            if (n < 0) {
+                goto err;
+            }
+            break;
+        }
+
+        for (i = 0, m = 0; i < n; i++) {
+            vfu_nvme_cpl_t *cpl = &cpls[m];
+
+            memset(cpl, 0, sizeof(*cpl));
+            cpl->cid = sqes[i].cid;
+            if (qid == 0) {
+                m += admin_cmd(ctrl, &sqes[i], cpl);
+            } else {
+                io_cmd(&sqes[i], cpl);
+                m++;
+            }
+        }
+
+        if (post(q, cpls, m) < 0) {
+            goto err;
+        }
+    }
+    return;
+
+err:
+    vfu_log(ctrl->vfu_ctx, LOG_ERR, "queue %u failed: %m", qid);
+    ctrl->regs.csts |= NVME_CSTS_CFS;
+}
+
+static void
+reset(struct nvme_ctrl *ctrl)
+{
+    int i;
+
+    for (i = 0; i < NR_QUEUES; i++) {
+        destroy_qp(ctrl, i);
+    }
+    memset(ctrl->cqs, 0, sizeof(ctrl->cqs));
+    ctrl->dbbuf = ctrl->eibuf = NULL;
+    ctrl->regs.csts &= ~(NVME_CSTS_RDY | NVME_CSTS_CFS);
+}
+
+static void
+set_cc(struct nvme_ctrl *ctrl, uint32_t cc)
+{
+    uint32_t old = ctrl->regs.cc;
+    struct nvme_cq acq = {
+        .valid = true,
+        .addr = (vfu_dma_addr_t)ctrl->regs.acq,
+        .size = ((ctrl->regs.aqa >> 16) & 0xfff) + 1,
+        .ien = true,
+    };
+
+    ctrl->regs.cc = cc;
+
+    if ((cc & NVME_CC_EN) && !(old & NVME_CC_EN)) {
+        if (create_qp(ctrl, 0, (vfu_dma_addr_t)ctrl->regs.asq,
+                      (ctrl->regs.aqa & 0xfff) + 1, &acq) < 0) {
+            ctrl->regs.csts |= NVME_CSTS_CFS;
+            return;
+        }
+        ctrl->regs.csts |= NVME_CSTS_RDY;
+    } else if (!(cc & NVME_CC_EN) && (old & NVME_CC_EN)) {
+        reset(ctrl);
+    }
+
+    ctrl->regs.csts &= ~NVME_CSTS_SHST_MASK;
+    if (NVME_CC_SHN(cc) != 0) {
+        ctrl->regs.csts |= NVME_CSTS_SHST_DONE;
+    }
+}
+
+static void
+doorbell(struct nvme_ctrl *ctrl, unsigned int idx, uint32_t val)
+{
+    uint16_t qid = idx / 2;
+    struct nvme_queue *q = &ctrl->queues[qid];
+    int ret;
+
+    if (qid >= NR_QUEUES || q->qp == NULL) {
+        vfu_log(ctrl->vfu_ctx, LOG_ERR, "doorbell %u for unknown queue", idx);
+        return;
+    }
+
+    if (idx % 2 == 0) {
+        ret = vfu_nvme_qp_sq_doorbell(q->qp, val);
+    } else {
+        ret = vfu_nvme_qp_cq_doorbell(q->qp, val);
+    }
+    if (ret < 0) {
+        vfu_log(ctrl->vfu_ctx, LOG_ERR, "bad doorbell %u value %u", idx, val);
+        return;
+    }
+
+    process_queue(ctrl, qid);
+}
+
+static ssize_t
+bar0_access(vfu_ctx_t *vfu_ctx, char * const buf, size_t count, loff_t offset,
+            const bool is_write)
+{
+    struct nvme_ctrl *ctrl = vfu_get_private(vfu_ctx);
+    struct nvme_regs regs;
+    uint32_t val;
+
+    if (offset >= NVME_REG_DBS) {
+        if (!is_write) {
+            memset(buf, 0, count);
+        } else if (count == sizeof(val) && offset % sizeof(val) == 0) {
+            memcpy(&val, buf, sizeof(val));
+            doorbell(ctrl, (offset - NVME_REG_DBS) / sizeof(val), val);
+        }
+        return count;
+    }
+
+    if ((size_t)offset + count > sizeof(regs)) {
+        if (!is_write) {
+            memset(buf, 0, count);
+        }
+        return count;
+    }
+
+    if (!is_write) {
+        memcpy(buf, (char *)&ctrl->regs + offset, count);
+        return count;
+    }
+
+    /* Only the admin queue attributes and CC are writable. */
+    regs = ctrl->regs;
+    memcpy((char *)&regs + offset, buf, count);
+    ctrl->regs.aqa = regs.aqa;
+    ctrl->regs.asq = regs.asq;
+    ctrl->regs.acq = regs.acq;
+    if (regs.cc != ctrl->regs.cc) {
+        set_cc(ctrl, regs.cc);
+    }
+    return count;
+}
+
+static int
+dma_unregister(vfu_ctx_t *vfu_ctx, UNUSED vfu_dma_info_t *info)
+{
+    struct nvme_ctrl *ctrl = vfu_get_private(vfu_ctx);
+    int i;
+
+    /*
+     * The queues may be in the region going away; it's a fatal error for the
+     * controller, which must be reset.
+     */
+    for (i = 0; i < NR_QUEUES; i++) {
+        if (ctrl->queues[i].qp != NULL) {
+            destroy_qp(ctrl, i);
+            ctrl->regs.csts |= NVME_CSTS_CFS;
+        }
+    }
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct sigaction act = { .sa_handler = _sa_handler };
+    struct nvme_ctrl ctrl = { 0 };
+    bool verbose = false;
+    vfu_ctx_t *vfu_ctx;
+    int opt;
+    int ret;
+
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        switch (opt) {
+            case 'v':
+                verbose = true;
+                break;
+            default: /* '?' */
+                fprintf(stderr, "Usage: %s [-v] <socketpath>\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc) {
+        errx(EXIT_FAILURE, "missing vfio-user socket path");
+    }
+
+    sigemptyset(&act.sa_mask);
+    if (sigaction(SIGINT, &act, NULL) == -1) {
+        err(EXIT_FAILURE, "failed to register signal handler");
+    }
+
+    /* MQES, CQR, TO of 500ms, and the NVM command set. */
+    ctrl.regs.cap = (MAX_QUEUE_SIZE - 1) | (1ULL << 16) | (1ULL << 24) |
+                    (1ULL << 37);
+    ctrl.regs.vs = 0x10400;
+
+    vfu_ctx = vfu_create_ctx(VFU_TRANS_SOCK, argv[optind], 0, &ctrl,
+                             VFU_DEV_TYPE_PCI);
+    if (vfu_ctx == NULL) {
+        if (errno == EINTR) {
+            printf("interrupted\n");
+            exit(EXIT_SUCCESS);
+        }
+        err(EXIT_FAILURE, "failed to initialize device emulation");
+    }
+    ctrl.vfu_ctx = vfu_ctx;
+
+    ret = vfu_setup_log(vfu_ctx, _log, verbose ? LOG_DEBUG : LOG_ERR);
+    if (ret < 0) {
+        err(EXIT_FAILURE, "failed to setup log");
+    }
+
+    ret = vfu_pci_init(vfu_ctx, VFU_PCI_TYPE_CONVENTIONAL,
+                       PCI_HEADER_TYPE_NORMAL, 0);
+    if (ret < 0) {
+        err(EXIT_FAILURE, "vfu_pci_init() failed");
+    }
+
+    vfu_pci_set_id(vfu_ctx, 0x4e58, 0x0001, 0x0, 0x0);
+    /* Mass storage, non-volatile memory, NVMe. */
+    vfu_pci_set_class(vfu_ctx, 0x01, 0x08, 0x02);
+
+    ret = vfu_setup_region(vfu_ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                           NVME_BAR0_SIZE, &bar0_access,
+                           VFU_REGION_FLAG_RW | VFU_REGION_FLAG_MEM, NULL, 0,
+                           -1);
+    if (ret < 0) {
+        err(EXIT_FAILURE, "failed to setup region");
+    }
+
+    ret = vfu_setup_device_nr_irqs(vfu_ctx, VFU_DEV_INTX_IRQ, 1);
+    if (ret < 0) {
+        err(EXIT_FAILURE, "failed to setup irq counts");
+    }
+
+    ret = vfu_setup_device_dma(vfu_ctx, NULL, dma_unregister);
+    if (ret < 0) {
+        err(EXIT_FAILURE, "failed to setup DMA");
+    }
+
+    ret = vfu_realize_ctx(vfu_ctx);
+    if (ret < 0) {
+        err(EXIT_FAILURE, "failed to realize device");
+    }
+
+    ret = vfu_attach_ctx(vfu_ctx);
+    if (ret < 0) {
+        err(EXIT_FAILURE, "failed to attach device");
+    }
+
+    ret = vfu_run_ctx(vfu_ctx);
+    if (ret != 0) {
+        if (errno != ENOTCONN && errno != EINTR) {
+            err(EXIT_FAILURE, "failed to run device emulation");
+        }
+    }
+
+    reset(&ctrl);
+    vfu_destroy_ctx(vfu_ctx);
+    return EXIT_SUCCESS;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
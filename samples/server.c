@@ -49,6 +49,7 @@
 
 struct dma_regions {
     struct iovec iova;
+    void *vaddr;
     uint32_t prot;
 };
 
@@ -166,6 +167,7 @@ dma_register(vfu_ctx_t *vfu_ctx, vfu_dma_info_t *info)
     }
 
     server_data->regions[idx].iova = info->iova;
+    server_data->regions[idx].vaddr = info->vaddr;
     server_data->regions[idx].prot = info->prot;
 }
 
@@ -199,13 +201,8 @@ get_md5sum(unsigned char *buf, int len, unsigned char *md5sum)
     return;
 }
 
-/*
- * FIXME this function does DMA write/read using messages. This should be done
- * on a region that is not memory mappable or an area of a region that is not
- * sparsely memory mappable. We should also have a test where the server does
- * DMA directly on the client memory.
- */
-static void do_dma_io(vfu_ctx_t *vfu_ctx, struct server_data *server_data)
+static void
+do_dma_io_region(vfu_ctx_t *vfu_ctx, struct dma_regions *region)
 {
     int count = 4096;
     unsigned char buf[count];
@@ -215,20 +212,18 @@ static void do_dma_io(vfu_ctx_t *vfu_ctx, struct server_data *server_data)
 
     assert(vfu_ctx != NULL);
 
-    ret = vfu_addr_to_sg(vfu_ctx,
-                         (vfu_dma_addr_t)server_data->regions[0].iova.iov_base,
+    ret = vfu_addr_to_sg(vfu_ctx, (vfu_dma_addr_t)region->iova.iov_base,
                          count, &sg, 1, PROT_WRITE);
     if (ret < 0) {
         errx(EXIT_FAILURE, "failed to map %p-%p: %s",
-             server_data->regions[0].iova.iov_base,
-             server_data->regions[0].iova.iov_base + count -1,
+             region->iova.iov_base, region->iova.iov_base + count -1,
              strerror(-ret));
     }
 
     memset(buf, 'A', count);
     get_md5sum(buf, count, md5sum1);
     vfu_log(vfu_ctx, LOG_DEBUG, "%s: WRITE addr %p count %d", __func__,
-           server_data->regions[0].iova.iov_base, count);
+           region->iova.iov_base, count);
     ret = vfu_dma_write(vfu_ctx, &sg, buf);
     if (ret < 0) {
         errx(EXIT_FAILURE, "vfu_dma_write failed: %s", strerror(-ret));
@@ -236,7 +231,7 @@ static void do_dma_io(vfu_ctx_t *vfu_ctx, struct server_data *server_data)
 
     memset(buf, 0, count);
     vfu_log(vfu_ctx, LOG_DEBUG, "%s: READ  addr %p count %d", __func__,
-           server_data->regions[0].iova.iov_base, count);
+           region->iova.iov_base, count);
     ret = vfu_dma_read(vfu_ctx, &sg, buf);
     if (ret < 0) {
         errx(EXIT_FAILURE, "vfu_dma_read failed: %s", strerror(-ret));
@@ -249,6 +244,37 @@ static void do_dma_io(vfu_ctx_t *vfu_ctx, struct server_data *server_data)
     }
 }
 
+/*
+ * Does DMA write/read directly on the first memory mappable region and using
+ * messages on the first region that is not memory mappable; the client expects
+ * the latter.
+ */
+static void do_dma_io(vfu_ctx_t *vfu_ctx, struct server_data *server_data)
+{
+    struct dma_regions *mappable = NULL, *unmappable = NULL;
+    int idx;
+
+    for (idx = 0; idx < NR_DMA_REGIONS; idx++) {
+        struct dma_regions *region = &server_data->regions[idx];
+
+        if (region->iova.iov_len == 0) {
+            continue;
+        }
+        if (region->vaddr != NULL && mappable == NULL) {
+            mappable = region;
+        } else if (region->vaddr == NULL && unmappable == NULL) {
+            unmappable = region;
+        }
+    }
+
+    if (mappable != NULL) {
+        do_dma_io_region(vfu_ctx, mappable);
+    }
+    if (unmappable != NULL) {
+        do_dma_io_region(vfu_ctx, unmappable);
+    }
+}
+
 static int device_reset(vfu_ctx_t *vfu_ctx UNUSED, vfu_reset_type_t type UNUSED)
 {
     vfu_log(vfu_ctx, LOG_DEBUG, "device reset callback");
@@ -418,6 +444,8 @@ int main(int argc, char *argv[])
 {
     int ret;
     bool verbose = false;
+    vfu_trans_t trans = VFU_TRANS_SOCK;
+    int flags = 0;
     char opt;
     struct sigaction act = {.sa_handler = _sa_handler};
     const size_t bar1_size = 0x3000;
@@ -439,13 +467,21 @@ int main(int argc, char *argv[])
         .write_data = &migration_write_data
     };
 
-    while ((opt = getopt(argc, argv, "v")) != -1) {
+    while ((opt = getopt(argc, argv, "stv")) != -1) {
         switch (opt) {
+            case 's':
+                flags |= LIBVFIO_USER_FLAG_SEQPACKET;
+                break;
+            case 't':
+                trans = VFU_TRANS_TCP;
+                break;
             case 'v':
                 verbose = true;
                 break;
             default: /* '?' */
-                errx(EXIT_FAILURE, "Usage: %s [-v] <socketpath>", argv[0]);
+                errx(EXIT_FAILURE,
+                     "Usage: %s [-s] [-v] <socketpath> | -t <host:port>",
+                     argv[0]);
         }
     }
 
@@ -458,7 +494,7 @@ int main(int argc, char *argv[])
         err(EXIT_FAILURE, "failed to register signal handler");
     }
 
-    vfu_ctx = vfu_create_ctx(VFU_TRANS_SOCK, argv[optind], 0, &server_data,
+    vfu_ctx = vfu_create_ctx(trans, argv[optind], flags, &server_data,
                              VFU_DEV_TYPE_PCI);
     if (vfu_ctx == NULL) {
         err(EXIT_FAILURE, "failed to initialize device emulation");
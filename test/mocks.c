@@ -29,6 +29,7 @@
  */
 
 #include <dlfcn.h>
+#include <errno.h>
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stddef.h>
@@ -51,6 +52,7 @@ struct function
     bool patched;
 };
 
+static int (*__real_accept)(int, struct sockaddr *, socklen_t *);
 static int (*__real_close)(int);
 
 static struct function funcs[] = {
@@ -68,7 +70,9 @@ static struct function funcs[] = {
     { .name = "process_request" },
     { .name = "should_exec_command" },
     { .name = "tran_sock_send_iovec" },
+    { .name = "virtq_map_indirect" },
     /* system libs */
+    { .name = "accept" },
     { .name = "bind" },
     { .name = "close" },
     { .name = "listen" },
@@ -151,6 +155,10 @@ void
 dma_controller_unmap_region(dma_controller_t *dma,
                             dma_memory_region_t *region)
 {
+    if (!is_patched("dma_controller_unmap_region")) {
+        __real_dma_controller_unmap_region(dma, region);
+        return;
+    }
     check_expected(dma);
     check_expected(region);
 }
@@ -169,6 +177,9 @@ int
 get_next_command(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr,
                  int *fds, size_t *nr_fds)
 {
+    if (!is_patched("get_next_command")) {
+        return __real_get_next_command(vfu_ctx, hdr, fds, nr_fds);
+    }
     check_expected(vfu_ctx);
     check_expected(hdr);
     check_expected(fds);
@@ -208,6 +219,10 @@ tran_sock_send_iovec(int sock, uint16_t msg_id, bool is_reply,
                      struct iovec *iovecs, size_t nr_iovecs,
                      int *fds, int count, int err)
 {
+    if (!is_patched("tran_sock_send_iovec")) {
+        return __real_tran_sock_send_iovec(sock, msg_id, is_reply, cmd,
+                                           iovecs, nr_iovecs, fds, count, err);
+    }
     check_expected(sock);
     check_expected(msg_id);
     check_expected(is_reply);
@@ -296,8 +311,45 @@ mock_dma_unregister(vfu_ctx_t *vfu_ctx, vfu_dma_info_t *info)
     return mock();
 }
 
+void *
+virtq_map_indirect(vfu_virtq_t *vq, uint64_t addr, uint32_t len,
+                   size_t desc_size)
+{
+    void *table = __real_virtq_map_indirect(vq, addr, len, desc_size);
+    uint32_t *lenp;
+
+    if (is_patched("virtq_map_indirect")) {
+        /* The driver changes the descriptor's length once it's mapped. */
+        lenp = mock_ptr_type(uint32_t *);
+        *lenp = mock();
+    }
+    return table;
+}
+
 /* System-provided funcs. */
 
+int
+accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    int ret;
+
+    if (!is_patched("accept")) {
+        if (__real_accept == NULL) {
+            __real_accept = dlsym(RTLD_NEXT, "accept");
+        }
+
+        return __real_accept(sockfd, addr, addrlen);
+    }
+
+    check_expected(sockfd);
+    ret = mock();
+    if (ret == -1) {
+        /* No pending connection. */
+        errno = EAGAIN;
+    }
+    return ret;
+}
+
 int
 bind(int sockfd UNUSED, const struct sockaddr *addr UNUSED,
      socklen_t addrlen UNUSED)
@@ -12,12 +12,25 @@ else
 fi
 
 sock="/tmp/vfio-user.sock"
-rm -f ${sock}*
-${valgrind} ../samples/server -v ${sock} &
-while [ ! -S ${sock} ]; do
-	sleep 0.1
+
+# Run once over SOCK_STREAM and once over SOCK_SEQPACKET.
+for opts in "" "-s"; do
+    rm -f ${sock}*
+    ${valgrind} ../samples/server -v ${opts} ${sock} &
+    while [ ! -S ${sock} ]; do
+        sleep 0.1
+    done
+    ${valgrind} ../samples/client ${opts} ${sock} || {
+        kill $(jobs -p)
+        exit 1
+    }
+    wait
 done
-${valgrind} ../samples/client ${sock} || {
+
+# Over TCP, the client retries until the server listens.
+addr="127.0.0.1:$((20000 + RANDOM % 10000))"
+${valgrind} ../samples/server -v -t ${addr} &
+${valgrind} ../samples/client -t ${addr} || {
     kill $(jobs -p)
     exit 1
 }
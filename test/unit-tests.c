@@ -34,14 +34,25 @@
 #include <cmocka.h>
 #include <limits.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <assert.h>
 #include <alloca.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #include <linux/pci_regs.h>
+#include <linux/virtio_ring.h>
+#include <sys/eventfd.h>
 #include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "dma.h"
+#include "doorbell.h"
+#include "iommu.h"
+#include "irq.h"
 #include "libvfio-user.h"
 #include "pci.h"
 #include "private.h"
@@ -442,11 +453,6 @@ set_nr_fds(const long unsigned int value,
     return 1;
 }
 
-typedef struct {
-    int fd;
-    int conn_fd;
-} tran_sock_t;
-
 /*
  * Tests that if if exec_command fails then process_request frees passed file
  * descriptors.
@@ -454,7 +460,7 @@ typedef struct {
 static void
 test_process_command_free_passed_fds(void **state UNUSED)
 {
-    tran_sock_t ts = { .fd = 23, .conn_fd = 24 };
+    tran_sock_t ts = { .listen_fd = 23, .conn_fd = 24 };
     vfu_ctx_t vfu_ctx = {
         .client_max_fds = ARRAY_SIZE(fds),
         .migration = (struct migration *)0x8badf00d,
@@ -550,8 +556,11 @@ test_attach_ctx(void **state UNUSED)
 static void
 test_run_ctx(UNUSED void **state)
 {
+    /* Without has_pending, so there are no queued commands. */
+    struct transport_ops tran = { 0 };
     vfu_ctx_t vfu_ctx = {
         .realized = false,
+        .tran = &tran,
     };
 
     // device un-realized
@@ -714,7 +723,7 @@ test_vfu_ctx_create(void **state UNUSED)
     assert_int_equal(0, vfu_realize_ctx(vfu_ctx));
 
     patch("close");
-    expect_value(close, fd, ((tran_sock_t *)vfu_ctx->tran_data)->fd);
+    expect_value(close, fd, ((tran_sock_t *)vfu_ctx->tran_data)->listen_fd);
     will_return(close, 0);
 
     vfu_destroy_ctx(vfu_ctx);
@@ -1277,6 +1286,7 @@ test_dma_addr_to_sg(void **state UNUSED)
     dma_sg_t sg;
     dma_memory_region_t *r;
 
+    memset(dma, 0, sizeof(*dma) + sizeof(dma_memory_region_t));
     dma->nregions = 1;
     r = &dma->regions[0];
     r->info.iova.iov_base = (void *)0x1000;
@@ -1311,6 +1321,1011 @@ test_dma_addr_to_sg(void **state UNUSED)
     /* TODO test more scenarios */
 }
 
+static void
+test_dma_addr_to_sg_batch(void **state UNUSED)
+{
+    dma_controller_t *dma = alloca(sizeof(dma_controller_t) +
+                                   2 * sizeof(dma_memory_region_t));
+    vfu_dma_range_t in[] = {
+        { (vfu_dma_addr_t)0x1000, 0x100, PROT_READ },
+        { (vfu_dma_addr_t)0x1100, 0x100, PROT_READ | PROT_WRITE },
+        { (vfu_dma_addr_t)0x8000, 0x100, PROT_READ },
+        { (vfu_dma_addr_t)0x4f00, 0x200, PROT_READ },
+        { (vfu_dma_addr_t)0x5100, 0x100, PROT_WRITE },
+        { (vfu_dma_addr_t)0x5200, 0x100, PROT_READ },
+    };
+    int errs[ARRAY_SIZE(in)];
+    dma_sg_t sg[ARRAY_SIZE(in)];
+    vfu_ctx_t vfu_ctx = { .dma = dma };
+
+    memset(dma, 0, sizeof(*dma) + 2 * sizeof(dma_memory_region_t));
+    dma->nregions = 2;
+    dma->regions[0].info.iova.iov_base = (void *)0x1000;
+    dma->regions[0].info.iova.iov_len = 0x4000;
+    dma->regions[0].info.vaddr = (void *)0xdeadbeef;
+    dma->regions[0].info.prot = PROT_READ | PROT_WRITE;
+    dma->regions[1].info.iova.iov_base = (void *)0x5000;
+    dma->regions[1].info.iova.iov_len = 0x1000;
+    dma->regions[1].info.prot = PROT_READ;
+
+    assert_int_equal(3, vfu_addr_to_sg_batch(&vfu_ctx, in, ARRAY_SIZE(in),
+                                             sg, errs));
+
+    assert_int_equal(0, errs[0]);
+    assert_int_equal(0, sg[0].region);
+    assert_int_equal(0, sg[0].offset);
+    assert_int_equal(0x100, sg[0].length);
+    assert_true(sg[0].mappable);
+
+    assert_int_equal(0, errs[1]);
+    assert_int_equal(0, sg[1].region);
+    assert_int_equal(0x100, sg[1].offset);
+
+    assert_int_equal(ENOENT, errs[2]);
+    assert_int_equal(ENOSPC, errs[3]);
+    assert_int_equal(EACCES, errs[4]);
+
+    assert_int_equal(0, errs[5]);
+    assert_int_equal(1, sg[5].region);
+    assert_int_equal(0x200, sg[5].offset);
+    assert_false(sg[5].mappable);
+
+    errno = 0;
+    assert_int_equal(-1, vfu_addr_to_sg_batch(&vfu_ctx, in, 1, sg, NULL));
+    assert_int_equal(EINVAL, errno);
+}
+
+static void
+test_iova_to_vaddr(void **state UNUSED)
+{
+    vfu_ctx_t vfu_ctx = { 0 };
+    const vfu_dma_table_t *table;
+    FILE *fp = tmpfile();
+    char *p;
+
+    assert_non_null(fp);
+    assert_int_equal(0, ftruncate(fileno(fp), 0x4000));
+
+    vfu_ctx.dma = dma_controller_create(&vfu_ctx, 4);
+    assert_non_null(vfu_ctx.dma);
+    table = vfu_get_dma_table(&vfu_ctx);
+    assert_non_null(table);
+    assert_int_equal(0, table->nregions);
+
+    assert_int_equal(0, dma_controller_add_region(vfu_ctx.dma,
+                        (void *)0x10000, 0x4000, dup(fileno(fp)), 0,
+                        PROT_READ | PROT_WRITE));
+    assert_int_equal(1, dma_controller_add_region(vfu_ctx.dma,
+                        (void *)0x20000, 0x1000, -1, 0, PROT_READ));
+    assert_int_equal(2, table->nregions);
+
+    p = vfu_iova_to_vaddr(table, (void *)0x10ff0, 0x20, PROT_READ);
+    assert_ptr_equal(vfu_ctx.dma->regions[0].info.vaddr + 0xff0, p);
+    assert_null(vfu_iova_to_vaddr(table, (void *)0x13ff0, 0x20, PROT_READ));
+    assert_null(vfu_iova_to_vaddr(table, (void *)0x20000, 0x20, PROT_READ));
+    assert_null(vfu_iova_to_vaddr(table, (void *)0x30000, 0x20, PROT_READ));
+
+    assert_int_equal(0, dma_controller_dirty_page_logging_start(vfu_ctx.dma,
+                                                                0x1000));
+    assert_int_equal(0x1000, table->dirty_pgsize);
+    p = vfu_iova_to_vaddr(table, (void *)0x10ff0, 0x20, PROT_WRITE);
+    assert_non_null(p);
+    memset(p, 'A', 0x20);
+    assert_int_equal(0x3, table->regions[0].dirty_bitmap[0]);
+    assert_int_equal(0, dma_controller_dirty_page_logging_stop(vfu_ctx.dma));
+    assert_null(table->regions[0].dirty_bitmap);
+
+    /* dma_controller_unmap_region() is mocked, so undo the mapping here */
+    patch("dma_controller_unmap_region");
+    expect_value(dma_controller_unmap_region, dma, vfu_ctx.dma);
+    expect_value(dma_controller_unmap_region, region,
+                 &vfu_ctx.dma->regions[0]);
+    munmap(vfu_ctx.dma->regions[0].info.mapping.iov_base,
+           vfu_ctx.dma->regions[0].info.mapping.iov_len);
+    close(vfu_ctx.dma->regions[0].fd);
+    dma_controller_remove_regions(vfu_ctx.dma);
+    assert_int_equal(0, table->nregions);
+
+    dma_controller_destroy(vfu_ctx.dma);
+    fclose(fp);
+}
+
+static void
+test_iommu(void **state UNUSED)
+{
+    dma_controller_t *dma = alloca(sizeof(dma_controller_t) +
+                                   sizeof(dma_memory_region_t));
+    struct vfio_user_iommu_mapping maps[] = {
+        { .iova = 0x100000, .size = 0x1000, .gpa = 0x3000,
+          .prot = PROT_READ | PROT_WRITE },
+        { .iova = 0x101000, .size = 0x1000, .gpa = 0x1000,
+          .prot = PROT_READ },
+    };
+    struct vfio_user_iommu_mapping overlap = {
+        .iova = 0x100800, .size = 0x1000, .gpa = 0x1000, .prot = PROT_READ
+    };
+    struct vfio_user_iommu_mapping batch[] = {
+        { .iova = 0x200000, .size = 0x1000, .gpa = 0x1000,
+          .prot = PROT_READ },
+        overlap,
+    };
+    vfu_ctx_t vfu_ctx = { .dma = dma };
+    dma_sg_t sg[2];
+
+    memset(dma, 0, sizeof(*dma) + sizeof(dma_memory_region_t));
+    dma->nregions = 1;
+    dma->regions[0].info.iova.iov_base = (void *)0x1000;
+    dma->regions[0].info.iova.iov_len = 0x4000;
+    dma->regions[0].info.prot = PROT_READ | PROT_WRITE;
+
+    /* no IOMMU */
+    assert_int_equal(-ENOTSUP,
+                     handle_iommu_map_or_unmap(&vfu_ctx, sizeof(maps), true,
+                                               maps));
+
+    dma->iommu = iommu_create(&vfu_ctx);
+    assert_non_null(dma->iommu);
+
+    assert_int_equal(-EINVAL,
+                     handle_iommu_map_or_unmap(&vfu_ctx, sizeof(maps) - 1,
+                                               true, maps));
+    assert_int_equal(0, handle_iommu_map_or_unmap(&vfu_ctx, sizeof(maps), true,
+                                                  maps));
+    assert_int_equal(-EEXIST,
+                     handle_iommu_map_or_unmap(&vfu_ctx, sizeof(overlap), true,
+                                               &overlap));
+
+    /* a batch failing partway adds none of its mappings */
+    assert_int_equal(-EEXIST,
+                     handle_iommu_map_or_unmap(&vfu_ctx, sizeof(batch), true,
+                                               batch));
+    assert_int_equal(-1, dma_addr_to_sg(dma, (vfu_dma_addr_t)0x200000, 0x10,
+                                        sg, 1, PROT_READ));
+    assert_int_equal(ENOENT, errno);
+
+    /* one IOVA page */
+    assert_int_equal(1, dma_addr_to_sg(dma, (vfu_dma_addr_t)0x100010, 0x10,
+                                       sg, 2, PROT_WRITE));
+    assert_int_equal(0, sg[0].region);
+    assert_int_equal(0x2010, sg[0].offset);
+    assert_int_equal(0x10, sg[0].length);
+
+    /* contiguous in IOVA space, not in guest physical memory */
+    assert_int_equal(2, dma_addr_to_sg(dma, (vfu_dma_addr_t)0x100ff0, 0x20,
+                                       sg, 2, PROT_READ));
+    assert_int_equal(0x2ff0, sg[0].offset);
+    assert_int_equal(0x10, sg[0].length);
+    assert_int_equal(0, sg[1].offset);
+    assert_int_equal(0x10, sg[1].length);
+    assert_int_equal(-3, dma_addr_to_sg(dma, (vfu_dma_addr_t)0x100ff0, 0x20,
+                                        sg, 1, PROT_READ));
+
+    /* read-only mapping */
+    assert_int_equal(-1, dma_addr_to_sg(dma, (vfu_dma_addr_t)0x101000, 0x10,
+                                        sg, 1, PROT_WRITE));
+    assert_int_equal(EACCES, errno);
+
+    /* guest physical addresses aren't visible to the device */
+    assert_int_equal(-1, dma_addr_to_sg(dma, (vfu_dma_addr_t)0x1000, 0x10,
+                                        sg, 1, PROT_READ));
+    assert_int_equal(ENOENT, errno);
+
+    /* unmapping must drop the cached translation */
+    assert_int_equal(-ENOENT,
+                     handle_iommu_map_or_unmap(&vfu_ctx, sizeof(overlap),
+                                               false, &overlap));
+    assert_int_equal(0, handle_iommu_map_or_unmap(&vfu_ctx, sizeof(maps[0]),
+                                                  false, maps));
+    assert_int_equal(-1, dma_addr_to_sg(dma, (vfu_dma_addr_t)0x100010, 0x10,
+                                        sg, 1, PROT_READ));
+    assert_int_equal(ENOENT, errno);
+    assert_int_equal(1, dma_addr_to_sg(dma, (vfu_dma_addr_t)0x101000, 0x10,
+                                       sg, 1, PROT_READ));
+
+    iommu_destroy(dma->iommu);
+}
+
+/* Guest memory for the virtqueue tests: rings first, then buffers at 0x1000. */
+#define VIRTQ_TEST_IOVA     0x10000
+#define VIRTQ_TEST_SIZE     0x2000
+
+static dma_controller_t *
+virtq_test_setup(vfu_ctx_t *vfu_ctx, char *mem, int efd)
+{
+    dma_controller_t *dma = calloc(1, sizeof(dma_controller_t) +
+                                      sizeof(dma_memory_region_t));
+    vfu_irqs_t *irqs = calloc(1, sizeof(vfu_irqs_t) + sizeof(int));
+
+    assert_non_null(dma);
+    assert_non_null(irqs);
+
+    dma->vfu_ctx = vfu_ctx;
+    dma->nregions = 1;
+    dma->regions[0].info.iova.iov_base = (void *)VIRTQ_TEST_IOVA;
+    dma->regions[0].info.iova.iov_len = VIRTQ_TEST_SIZE;
+    dma->regions[0].info.vaddr = mem;
+    dma->regions[0].info.prot = PROT_READ | PROT_WRITE;
+
+    irqs->max_ivs = 1;
+    irqs->efds[0] = efd;
+
+    vfu_ctx->dma = dma;
+    vfu_ctx->irqs = irqs;
+    return dma;
+}
+
+static bool
+virtq_test_irq(int efd)
+{
+    eventfd_t val;
+
+    return eventfd_read(efd, &val) == 0;
+}
+
+static void
+test_virtq_split(void **state UNUSED)
+{
+    char *mem = calloc(1, VIRTQ_TEST_SIZE);
+    int efd = eventfd(0, EFD_NONBLOCK);
+    vfu_ctx_t vfu_ctx = { 0 };
+    dma_controller_t *dma = virtq_test_setup(&vfu_ctx, mem, efd);
+    struct vring_desc *desc = (void *)mem;
+    struct vring_desc *indirect = (void *)(mem + 0x400);
+    struct vring_avail *avail = (void *)(mem + 0x100);
+    struct vring_used *used = (void *)(mem + 0x200);
+    vfu_virtq_info_t info = {
+        .size = 4,
+        .desc = (void *)VIRTQ_TEST_IOVA,
+        .driver = (void *)VIRTQ_TEST_IOVA + 0x100,
+        .device = (void *)VIRTQ_TEST_IOVA + 0x200,
+    };
+    uint32_t lens[] = { 0x20, 0x8 };
+    vfu_virtq_elem_t elems[4];
+    struct iovec iov[8];
+    vfu_virtq_t *vq;
+
+    /* a direct chain, and an indirect one */
+    desc[0] = (struct vring_desc) { VIRTQ_TEST_IOVA + 0x1000, 0x10,
+                                    VRING_DESC_F_NEXT, 1 };
+    desc[1] = (struct vring_desc) { VIRTQ_TEST_IOVA + 0x1100, 0x20,
+                                    VRING_DESC_F_WRITE, 0 };
+    desc[2] = (struct vring_desc) { VIRTQ_TEST_IOVA + 0x400,
+                                    2 * sizeof(struct vring_desc),
+                                    VRING_DESC_F_INDIRECT, 0 };
+    indirect[0] = (struct vring_desc) { VIRTQ_TEST_IOVA + 0x1200, 0x8,
+                                        VRING_DESC_F_NEXT, 1 };
+    indirect[1] = (struct vring_desc) { VIRTQ_TEST_IOVA + 0x1300, 0x8,
+                                        VRING_DESC_F_WRITE, 0 };
+    avail->ring[0] = 0;
+    avail->ring[1] = 2;
+    avail->idx = 2;
+
+    /* not a power of 2 */
+    info.size = 3;
+    assert_null(vfu_virtq_create(&vfu_ctx, &info));
+    assert_int_equal(EINVAL, errno);
+    info.size = 4;
+
+    vq = vfu_virtq_create(&vfu_ctx, &info);
+    assert_non_null(vq);
+    assert_int_equal(3, dma->regions[0].refcnt);
+
+    /* the first chain needs two iovecs */
+    assert_int_equal(-1, vfu_virtq_pop(vq, elems, 4, iov, 1));
+    assert_int_equal(ENOBUFS, errno);
+
+    /* only the first chain fits */
+    assert_int_equal(1, vfu_virtq_pop(vq, elems, 4, iov, 3));
+    assert_int_equal(0, elems[0].id);
+    assert_int_equal(1, elems[0].out_num);
+    assert_int_equal(1, elems[0].in_num);
+    assert_ptr_equal(mem + 0x1000, elems[0].iov[0].iov_base);
+    assert_int_equal(0x10, elems[0].iov[0].iov_len);
+    assert_ptr_equal(mem + 0x1100, elems[0].iov[1].iov_base);
+
+    assert_int_equal(1, vfu_virtq_pop(vq, &elems[1], 3, &iov[2], 6));
+    assert_int_equal(2, elems[1].id);
+    assert_int_equal(1, elems[1].out_num);
+    assert_int_equal(1, elems[1].in_num);
+    assert_ptr_equal(mem + 0x1200, elems[1].iov[0].iov_base);
+    assert_ptr_equal(mem + 0x1300, elems[1].iov[1].iov_base);
+
+    assert_int_equal(0, vfu_virtq_pop(vq, elems, 4, iov, 8));
+
+    assert_int_equal(0, vfu_virtq_push(vq, elems, lens, 2));
+    assert_int_equal(2, used->idx);
+    assert_int_equal(0, used->ring[0].id);
+    assert_int_equal(0x20, used->ring[0].len);
+    assert_int_equal(2, used->ring[1].id);
+    assert_int_equal(0x8, used->ring[1].len);
+    assert_true(virtq_test_irq(efd));
+
+    /* the driver suppressed interrupts */
+    avail->ring[2] = 0;
+    avail->idx = 3;
+    avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+    assert_int_equal(1, vfu_virtq_pop(vq, elems, 4, iov, 8));
+    assert_int_equal(0, vfu_virtq_push(vq, elems, lens, 1));
+    assert_int_equal(3, used->idx);
+    assert_false(virtq_test_irq(efd));
+
+    /* a descriptor loop */
+    desc[3] = (struct vring_desc) { VIRTQ_TEST_IOVA + 0x1000, 0x10,
+                                    VRING_DESC_F_NEXT, 3 };
+    avail->ring[3] = 3;
+    avail->idx = 4;
+    assert_int_equal(-1, vfu_virtq_pop(vq, elems, 4, iov, 8));
+    assert_int_equal(EINVAL, errno);
+
+    /* growing an indirect table once it's mapped doesn't make it longer */
+    indirect[1].flags |= VRING_DESC_F_NEXT;
+    indirect[1].next = 2;
+    indirect[2] = (struct vring_desc) { VIRTQ_TEST_IOVA + 0x1400, 0x8,
+                                        VRING_DESC_F_WRITE, 0 };
+    avail->ring[3] = 2;
+    patch("virtq_map_indirect");
+    will_return(virtq_map_indirect, &desc[2].len);
+    will_return(virtq_map_indirect, 3 * sizeof(struct vring_desc));
+    assert_int_equal(-1, vfu_virtq_pop(vq, elems, 4, iov, 8));
+    assert_int_equal(EINVAL, errno);
+
+    vfu_virtq_destroy(vq);
+    assert_int_equal(0, dma->regions[0].refcnt);
+
+    close(efd);
+    free(vfu_ctx.irqs);
+    free(dma);
+    free(mem);
+}
+
+static void
+test_virtq_packed(void **state UNUSED)
+{
+    char *mem = calloc(1, VIRTQ_TEST_SIZE);
+    int efd = eventfd(0, EFD_NONBLOCK);
+    vfu_ctx_t vfu_ctx = { 0 };
+    dma_controller_t *dma = virtq_test_setup(&vfu_ctx, mem, efd);
+    struct vring_packed_desc *desc = (void *)mem;
+    struct vring_packed_desc *indirect = (void *)(mem + 0x400);
+    struct vring_packed_desc_event *driver = (void *)(mem + 0x100);
+    vfu_virtq_info_t info = {
+        .flags = VFU_VIRTQ_F_PACKED | VFU_VIRTQ_F_EVENT_IDX,
+        .size = 4,
+        .desc = (void *)VIRTQ_TEST_IOVA,
+        .driver = (void *)VIRTQ_TEST_IOVA + 0x100,
+        .device = (void *)VIRTQ_TEST_IOVA + 0x200,
+    };
+    const uint16_t avail = 1 << VRING_PACKED_DESC_F_AVAIL;
+    const uint16_t used = 1 << VRING_PACKED_DESC_F_USED;
+    uint32_t lens[] = { 0x20, 0x8 };
+    vfu_virtq_elem_t elems[4];
+    struct iovec iov[8];
+    vfu_virtq_t *vq;
+
+    vq = vfu_virtq_create(&vfu_ctx, &info);
+    assert_non_null(vq);
+    assert_int_equal(0, vfu_virtq_pop(vq, elems, 4, iov, 8));
+
+    /* two chains; the buffer ID is in the last descriptor */
+    desc[0] = (struct vring_packed_desc) { VIRTQ_TEST_IOVA + 0x1000, 0x10, 0,
+                                           VRING_DESC_F_NEXT | avail };
+    desc[1] = (struct vring_packed_desc) { VIRTQ_TEST_IOVA + 0x1100, 0x20, 7,
+                                           VRING_DESC_F_WRITE | avail };
+    desc[2] = (struct vring_packed_desc) { VIRTQ_TEST_IOVA + 0x1200, 0x8, 9,
+                                           VRING_DESC_F_WRITE | avail };
+
+    assert_int_equal(2, vfu_virtq_pop(vq, elems, 4, iov, 8));
+    assert_int_equal(7, elems[0].id);
+    assert_int_equal(2, elems[0].ndescs);
+    assert_int_equal(1, elems[0].out_num);
+    assert_int_equal(1, elems[0].in_num);
+    assert_ptr_equal(mem + 0x1100, elems[0].iov[1].iov_base);
+    assert_int_equal(9, elems[1].id);
+    assert_int_equal(0, elems[1].out_num);
+    assert_int_equal(1, elems[1].in_num);
+
+    /* notify once descriptor 0 has been used */
+    driver->flags = VRING_PACKED_EVENT_FLAG_DESC;
+    driver->off_wrap = 0 | (1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+    assert_int_equal(0, vfu_virtq_push(vq, elems, lens, 1));
+    assert_int_equal(avail | used, desc[0].flags);
+    assert_int_equal(7, desc[0].id);
+    assert_int_equal(0x20, desc[0].len);
+    assert_true(virtq_test_irq(efd));
+
+    /* the event has already passed */
+    assert_int_equal(0, vfu_virtq_push(vq, &elems[1], &lens[1], 1));
+    assert_int_equal(avail | used, desc[2].flags);
+    assert_int_equal(9, desc[2].id);
+    assert_false(virtq_test_irq(efd));
+
+    /* a chain wrapping around the ring flips the driver's wrap counter */
+    desc[3] = (struct vring_packed_desc) { VIRTQ_TEST_IOVA + 0x1000, 0x10, 0,
+                                           VRING_DESC_F_NEXT | avail };
+    desc[0] = (struct vring_packed_desc) { VIRTQ_TEST_IOVA + 0x1100, 0x20, 3,
+                                           VRING_DESC_F_WRITE | used };
+    assert_int_equal(1, vfu_virtq_pop(vq, elems, 4, iov, 8));
+    assert_int_equal(3, elems[0].id);
+    assert_int_equal(2, elems[0].ndescs);
+
+    driver->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    assert_int_equal(0, vfu_virtq_push(vq, elems, lens, 1));
+    assert_int_equal(avail | used, desc[3].flags);
+    assert_false(virtq_test_irq(efd));
+
+    /* growing an indirect table once it's mapped doesn't make it longer */
+    indirect[0] = (struct vring_packed_desc) { VIRTQ_TEST_IOVA + 0x1200, 0x8,
+                                               0, VRING_DESC_F_WRITE };
+    indirect[1] = (struct vring_packed_desc) { VIRTQ_TEST_IOVA + 0x1300, 0x8,
+                                               0, VRING_DESC_F_WRITE };
+    desc[1] = (struct vring_packed_desc) { VIRTQ_TEST_IOVA + 0x400,
+                                           sizeof(*indirect), 5,
+                                           VRING_DESC_F_INDIRECT | used };
+    patch("virtq_map_indirect");
+    will_return(virtq_map_indirect, &desc[1].len);
+    will_return(virtq_map_indirect, 2 * sizeof(*indirect));
+    assert_int_equal(1, vfu_virtq_pop(vq, elems, 4, iov, 8));
+    assert_int_equal(5, elems[0].id);
+    assert_int_equal(1, elems[0].in_num);
+    assert_ptr_equal(mem + 0x1200, elems[0].iov[0].iov_base);
+
+    vfu_virtq_destroy(vq);
+    assert_int_equal(0, dma->regions[0].refcnt);
+
+    close(efd);
+    free(vfu_ctx.irqs);
+    free(dma);
+    free(mem);
+}
+
+static void
+test_nvme_qp(void **state UNUSED)
+{
+    char *mem = calloc(1, VIRTQ_TEST_SIZE);
+    int efd = eventfd(0, EFD_NONBLOCK);
+    vfu_ctx_t vfu_ctx = { 0 };
+    dma_controller_t *dma = virtq_test_setup(&vfu_ctx, mem, efd);
+    uint8_t *sq = (void *)mem;
+    uint32_t *cq = (void *)(mem + 0x100);
+    uint32_t *dbbuf = (void *)(mem + 0x200);
+    uint32_t *eibuf = (void *)(mem + 0x300);
+    vfu_nvme_qp_info_t info = {
+        .qid = 1,
+        .sq_size = 4,
+        .cq_size = 4,
+        .sq_addr = (void *)VIRTQ_TEST_IOVA,
+        .cq_addr = (void *)VIRTQ_TEST_IOVA + 0x100,
+        .irq_enabled = true,
+    };
+    vfu_nvme_cpl_t cpls[] = {
+        { .dw0 = 0x11, .cid = 5, .status = 0 },
+        { .dw0 = 0x22, .cid = 6, .status = 0x2 },
+    };
+    uint8_t sqes[4 * VFU_NVME_SQE_SIZE];
+    vfu_nvme_qp_t *qp;
+
+    qp = vfu_nvme_qp_create(&vfu_ctx, &info);
+    assert_non_null(qp);
+    assert_int_equal(2, dma->regions[0].refcnt);
+
+    memset(sq, 0xa0, VFU_NVME_SQE_SIZE);
+    memset(sq + VFU_NVME_SQE_SIZE, 0xa1, VFU_NVME_SQE_SIZE);
+    assert_int_equal(-1, vfu_nvme_qp_sq_doorbell(qp, 4));
+    assert_int_equal(EINVAL, errno);
+    assert_int_equal(0, vfu_nvme_qp_sq_doorbell(qp, 2));
+    assert_int_equal(2, vfu_nvme_qp_fetch(qp, sqes, 4));
+    assert_memory_equal(sq, sqes, 2 * VFU_NVME_SQE_SIZE);
+    assert_int_equal(0, vfu_nvme_qp_fetch(qp, sqes, 4));
+
+    assert_int_equal(2, vfu_nvme_qp_complete(qp, cpls, 2));
+    assert_int_equal(0x11, cq[0]);
+    assert_int_equal(2 | (1 << 16), cq[2]);         /* SQ head and ID */
+    assert_int_equal(5 | (1 << 16), cq[3]);         /* CID and phase */
+    assert_int_equal(6 | (((0x2 << 1) | 1) << 16), cq[7]);
+    assert_true(virtq_test_irq(efd));
+
+    /* one slot is always left empty; an IRQ that failed is retried */
+    vfu_ctx.irqs->efds[0] = -2;
+    assert_int_equal(1, vfu_nvme_qp_complete(qp, cpls, 2));
+    vfu_ctx.irqs->efds[0] = efd;
+    assert_false(virtq_test_irq(efd));
+    assert_int_equal(0, vfu_nvme_qp_complete(qp, cpls, 0));
+    assert_true(virtq_test_irq(efd));
+    assert_int_equal(0, vfu_nvme_qp_cq_doorbell(qp, 3));
+    assert_int_equal(2, vfu_nvme_qp_complete(qp, cpls, 2));
+    assert_int_equal(1, cq[15] >> 16 & 1);
+    assert_int_equal(0, cq[3] >> 16 & 1);           /* phase flipped */
+    assert_true(virtq_test_irq(efd));
+
+    /* shadow doorbells for queue 1 are the third and fourth slots */
+    assert_int_equal(0, vfu_nvme_qp_set_shadow(qp,
+                                               (void *)VIRTQ_TEST_IOVA + 0x200,
+                                               (void *)VIRTQ_TEST_IOVA + 0x300,
+                                               4));
+    assert_int_equal(6, dma->regions[0].refcnt);
+    assert_int_equal(2, eibuf[2]);
+
+    dbbuf[2] = 0;
+    assert_int_equal(1, vfu_nvme_qp_fetch(qp, sqes, 1));
+    /* busy: no doorbell writes wanted yet */
+    assert_int_equal(2, eibuf[2]);
+    assert_int_equal(1, vfu_nvme_qp_fetch(qp, sqes, 4));
+    assert_int_equal(0, eibuf[2]);
+
+    /* the CQ is full until the driver moves its shadow head */
+    dbbuf[3] = 2;
+    assert_int_equal(0, vfu_nvme_qp_complete(qp, cpls, 1));
+    assert_int_equal(2, eibuf[3]);
+    dbbuf[3] = 3;
+    assert_int_equal(1, vfu_nvme_qp_complete(qp, cpls, 1));
+
+    dbbuf[2] = 9;
+    assert_int_equal(-1, vfu_nvme_qp_fetch(qp, sqes, 4));
+    assert_int_equal(EINVAL, errno);
+
+    vfu_nvme_qp_destroy(qp);
+    assert_int_equal(0, dma->regions[0].refcnt);
+
+    close(efd);
+    free(vfu_ctx.irqs);
+    free(dma);
+    free(mem);
+}
+
+static void
+test_doorbells(void **state UNUSED)
+{
+    vfu_ctx_t *vfu_ctx = vfu_create_ctx(VFU_TRANS_SOCK, "test", 0, NULL,
+                                        VFU_DEV_TYPE_PCI);
+    size_t ps = sysconf(_SC_PAGE_SIZE);
+    uint64_t changed[2];
+    vfu_doorbells_t *dbs;
+    uint32_t *client;
+    uint32_t val = 7;
+    eventfd_t cnt;
+
+    assert_non_null(vfu_ctx);
+
+    dbs = vfu_setup_region_doorbells(vfu_ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                     ps, NULL, VFU_REGION_FLAG_RW, ps, 70);
+    assert_null(dbs);
+    assert_int_equal(EINVAL, errno);
+    dbs = vfu_setup_region_doorbells(vfu_ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                     ps * 2, NULL, VFU_REGION_FLAG_RW, 1, 70);
+    assert_null(dbs);
+    assert_int_equal(EINVAL, errno);
+
+    dbs = vfu_setup_region_doorbells(vfu_ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                     ps * 2, NULL, VFU_REGION_FLAG_RW, ps, 70);
+    assert_non_null(dbs);
+    assert_ptr_equal(dbs,
+                     vfu_ctx->reg_info[VFU_PCI_DEV_BAR0_REGION_IDX].doorbells);
+    assert_int_equal(1,
+        vfu_ctx->reg_info[VFU_PCI_DEV_BAR0_REGION_IDX].nr_mmap_areas);
+
+    /* Map the area the way the client would. */
+    client = mmap(NULL, ps, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  vfu_ctx->reg_info[VFU_PCI_DEV_BAR0_REGION_IDX].fd, ps);
+    assert_true(client != MAP_FAILED);
+
+    assert_int_equal(0, vfu_doorbells_poll(dbs, changed));
+    assert_int_equal(0, changed[0] | changed[1]);
+
+    client[1] = 3;
+    client[65] = 9;
+    client[69] = 1;
+    assert_int_equal(3, vfu_doorbells_poll(dbs, changed));
+    assert_int_equal(1ULL << 1, changed[0]);
+    assert_int_equal((1ULL << 1) | (1ULL << 5), changed[1]);
+    assert_int_equal(3, vfu_doorbells_read(dbs, 1));
+    assert_int_equal(9, vfu_doorbells_read(dbs, 65));
+    assert_int_equal(0, vfu_doorbells_poll(dbs, changed));
+    assert_int_equal(0, vfu_doorbells_wait(dbs, changed, 0, 0));
+
+    /* Trapped accesses go to the same memory and wake the poller. */
+    assert_false(doorbells_contain(dbs, ps - 4, 4));
+    assert_true(doorbells_contain(dbs, ps + 8, 4));
+    assert_int_equal(4, doorbells_access(dbs, (char *)&val, 4, ps + 8, true));
+    assert_int_equal(7, client[2]);
+    assert_int_equal(1, vfu_doorbells_wait(dbs, changed, 0, 0));
+    assert_int_equal(1ULL << 2, changed[0]);
+    assert_int_equal(7, vfu_doorbells_read(dbs, 2));
+    assert_int_equal(0, eventfd_read(vfu_doorbells_get_fd(dbs), &cnt));
+    assert_int_equal(1, cnt);
+
+    munmap(client, ps);
+    vfu_destroy_ctx(vfu_ctx);
+}
+
+static int
+unregister_ok(vfu_ctx_t *vfu_ctx UNUSED, vfu_dma_info_t *info UNUSED)
+{
+    return 0;
+}
+
+static void
+test_dma_group(void **state UNUSED)
+{
+    vfu_dma_group_t *group = vfu_dma_group_create();
+    vfu_ctx_t *ctx[2];
+    size_t ps = sysconf(_SC_PAGE_SIZE);
+    int fd = memfd_create("test", 0);
+    dma_controller_t *dma[2];
+    int i;
+
+    assert_non_null(group);
+    assert_true(fd != -1);
+    assert_int_equal(0, ftruncate(fd, ps * 2));
+
+    for (i = 0; i < 2; i++) {
+        ctx[i] = vfu_create_ctx(VFU_TRANS_SOCK, "test", 0, NULL,
+                                VFU_DEV_TYPE_PCI);
+        assert_non_null(ctx[i]);
+        assert_int_equal(-1, vfu_setup_device_dma_group(ctx[i], group));
+        assert_int_equal(EINVAL, errno);
+        assert_int_equal(0, vfu_setup_device_dma(ctx[i], NULL,
+                                                 unregister_ok));
+        assert_int_equal(0, vfu_setup_device_dma_group(ctx[i], group));
+        dma[i] = ctx[i]->dma;
+
+        /* Each controller owns, and closes, its own fd. */
+        assert_int_equal(0, dma_controller_add_region(dma[i], (void *)0x10000,
+                                                      ps, dup(fd), 0,
+                                                      PROT_READ | PROT_WRITE));
+    }
+
+    /* The same region is mapped once for both. */
+    assert_ptr_equal(dma[0]->regions[0].info.vaddr,
+                     dma[1]->regions[0].info.vaddr);
+    assert_ptr_equal(dma[0]->regions[0].shared, dma[1]->regions[0].shared);
+
+    /* A different range of the same file is mapped separately. */
+    assert_int_equal(1, dma_controller_add_region(dma[1], (void *)0x20000,
+                                                  ps, dup(fd), ps,
+                                                  PROT_READ | PROT_WRITE));
+    assert_true(dma[1]->regions[0].shared != dma[1]->regions[1].shared);
+
+    /* The mapping outlives its first user. */
+    assert_int_equal(0, dma_controller_remove_region(dma[0], (void *)0x10000,
+                                                     ps, unregister_ok,
+                                                     ctx[0]));
+    *(char *)dma[1]->regions[0].info.vaddr = 'x';
+
+    vfu_destroy_ctx(ctx[0]);
+    vfu_destroy_ctx(ctx[1]);
+    vfu_dma_group_destroy(group);
+    close(fd);
+}
+
+/*
+ * A fake client for server-initiated DMA: it completes the most recently sent
+ * outstanding command first, so replies arrive out of order.
+ */
+static struct {
+    struct {
+        uint16_t msg_id;
+        enum vfio_user_command cmd;
+        uint64_t addr;
+        uint32_t count;
+    } pending[64];
+    size_t nr_pending;
+    size_t max_pending;
+    /* Reply to this message with the wrong address, if not -1. */
+    int bad_msg_id;
+    char mem[0x200];
+} dma_client;
+
+static int
+dma_client_send_cmd(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
+                    enum vfio_user_command cmd,
+                    struct iovec *iovecs, size_t nr_iovecs,
+                    bool no_reply UNUSED, uint8_t function UNUSED)
+{
+    struct vfio_user_dma_region_access *dma_access = iovecs[1].iov_base;
+    size_t i = dma_client.nr_pending++;
+
+    assert_true(dma_client.nr_pending <= ARRAY_SIZE(dma_client.pending));
+    assert_true(sizeof(struct vfio_user_header) + sizeof(*dma_access) +
+                dma_access->count <= vfu_ctx->max_msg_size);
+
+    dma_client.pending[i].msg_id = msg_id;
+    dma_client.pending[i].cmd = cmd;
+    dma_client.pending[i].addr = dma_access->addr;
+    dma_client.pending[i].count = dma_access->count;
+
+    if (cmd == VFIO_USER_DMA_WRITE) {
+        assert_int_equal(3, nr_iovecs);
+        assert_int_equal(dma_access->count, iovecs[2].iov_len);
+        memcpy(dma_client.mem + dma_access->addr, iovecs[2].iov_base,
+               dma_access->count);
+    }
+
+    dma_client.max_pending = MAX(dma_client.max_pending,
+                                 dma_client.nr_pending);
+    return 0;
+}
+
+static int
+dma_client_get_reply(vfu_ctx_t *vfu_ctx UNUSED,
+                     struct reply_wait *wait UNUSED,
+                     struct vfio_user_header *hdr, void **datap)
+{
+    struct vfio_user_dma_region_access *dma_access;
+    size_t i = dma_client.nr_pending - 1;
+    size_t body_size = sizeof(*dma_access);
+
+    assert_true(dma_client.nr_pending > 0);
+    dma_client.nr_pending--;
+
+    if (dma_client.pending[i].cmd == VFIO_USER_DMA_READ) {
+        body_size += dma_client.pending[i].count;
+    }
+
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_id = dma_client.pending[i].msg_id;
+    hdr->flags.type = VFIO_USER_F_TYPE_REPLY;
+    hdr->msg_size = sizeof(*hdr) + body_size;
+
+    dma_access = malloc(body_size);
+    assert_non_null(dma_access);
+    dma_access->addr = dma_client.pending[i].addr;
+    dma_access->count = dma_client.pending[i].count;
+
+    if (dma_client.pending[i].cmd == VFIO_USER_DMA_READ) {
+        memcpy(dma_access->data, dma_client.mem + dma_access->addr,
+               dma_access->count);
+    } else {
+        dma_access->count = 0;
+    }
+    if (hdr->msg_id == dma_client.bad_msg_id) {
+        dma_access->addr++;
+    }
+    *datap = dma_access;
+    return 0;
+}
+
+static void
+test_dma_read_write_chunked(void **state UNUSED)
+{
+    struct transport_ops tran = {
+        .send_cmd = dma_client_send_cmd,
+        .get_reply = dma_client_get_reply,
+    };
+    vfu_ctx_t vfu_ctx = {
+        .tran = &tran,
+        /* 16 bytes of DMA data per message. */
+        .max_msg_size = sizeof(struct vfio_user_header) +
+                        sizeof(struct vfio_user_dma_region_access) + 16,
+        .next_msg_id = 0xfff0,
+    };
+    dma_sg_t sg = {
+        .dma_addr = (void *)0x20,
+        .offset = 0x10,
+        .length = 0x1a0,
+    };
+    char buf[0x1a0];
+    size_t i;
+
+    memset(&dma_client, 0, sizeof(dma_client));
+    dma_client.bad_msg_id = -1;
+
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = i;
+    }
+    assert_int_equal(0, vfu_dma_write(&vfu_ctx, &sg, buf));
+    assert_int_equal(0, dma_client.nr_pending);
+    assert_memory_equal(dma_client.mem + 0x30, buf, sizeof(buf));
+
+    memset(buf, 0, sizeof(buf));
+    assert_int_equal(0, vfu_dma_read(&vfu_ctx, &sg, buf));
+    assert_int_equal(0, dma_client.nr_pending);
+    assert_memory_equal(dma_client.mem + 0x30, buf, sizeof(buf));
+
+    /* 26 chunks each way, with the message ID wrapping around. */
+    assert_int_equal(16, dma_client.max_pending);
+    assert_int_equal(0x0024, vfu_ctx.next_msg_id);
+
+    /* A bad reply fails the transfer once the others have been received. */
+    dma_client.bad_msg_id = 0x0026;
+    assert_int_equal(-1, vfu_dma_read(&vfu_ctx, &sg, buf));
+    assert_int_equal(EPROTO, errno);
+    assert_int_equal(0, dma_client.nr_pending);
+}
+
+#define SEND_THREADS 4
+#define SEND_MSGS 1000
+
+static struct {
+    int in_send;
+    int overlaps;
+    uint16_t last[SEND_THREADS];
+    int out_of_order;
+} send_stats;
+
+static int
+send_stats_send_cmd(vfu_ctx_t *vfu_ctx UNUSED, uint16_t msg_id,
+                    enum vfio_user_command cmd UNUSED,
+                    struct iovec *iovecs, size_t nr_iovecs UNUSED,
+                    bool no_reply UNUSED, uint8_t function UNUSED)
+{
+    size_t thread = *(size_t *)iovecs[1].iov_base;
+
+    if (__atomic_fetch_add(&send_stats.in_send, 1, __ATOMIC_SEQ_CST) != 0) {
+        send_stats.overlaps++;
+    }
+    if (msg_id != (uint16_t)(send_stats.last[thread] + 1)) {
+        send_stats.out_of_order++;
+    }
+    send_stats.last[thread] = msg_id;
+    sched_yield();
+    __atomic_fetch_sub(&send_stats.in_send, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+static void *
+send_thread(void *arg)
+{
+    vfu_ctx_t *vfu_ctx = ((void **)arg)[0];
+    size_t thread = (size_t)((void **)arg)[1];
+    struct iovec iovecs[2] = {
+        [1] = { .iov_base = &thread, .iov_len = sizeof(thread) }
+    };
+    struct send_req req = { .iovecs = iovecs, .nr_iovecs = 2 };
+    uint16_t i;
+
+    for (i = 1; i <= SEND_MSGS; i++) {
+        req.msg_id = i;
+        if (send_msg(vfu_ctx, &req) != 0) {
+            return (void *)-1;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Tests that messages sent by several threads at once are sent one at a time,
+ * each thread's in order.
+ */
+static void
+test_send_msg_threads(void **state UNUSED)
+{
+    struct transport_ops tran = { .send_cmd = send_stats_send_cmd };
+    vfu_ctx_t vfu_ctx = {
+        .tran = &tran,
+        .send_lock = PTHREAD_MUTEX_INITIALIZER,
+        .send_cond = PTHREAD_COND_INITIALIZER,
+    };
+    pthread_t threads[SEND_THREADS];
+    void *args[SEND_THREADS][2];
+    void *ret;
+    size_t i;
+
+    memset(&send_stats, 0, sizeof(send_stats));
+
+    for (i = 0; i < SEND_THREADS; i++) {
+        args[i][0] = &vfu_ctx;
+        args[i][1] = (void *)i;
+        assert_int_equal(0, pthread_create(&threads[i], NULL, send_thread,
+                                           args[i]));
+    }
+    for (i = 0; i < SEND_THREADS; i++) {
+        assert_int_equal(0, pthread_join(threads[i], &ret));
+        assert_null(ret);
+        assert_int_equal(SEND_MSGS, send_stats.last[i]);
+    }
+
+    assert_int_equal(0, send_stats.overlaps);
+    assert_int_equal(0, send_stats.out_of_order);
+    assert_null(vfu_ctx.send_queue);
+    assert_false(vfu_ctx.sending);
+}
+
+static void
+test_dma_read_write_direct(void **state UNUSED)
+{
+    dma_controller_t *dma = alloca(sizeof(dma_controller_t) +
+                                   sizeof(dma_memory_region_t));
+    vfu_ctx_t vfu_ctx = { .dma = dma };
+    char mem[0x4000] = { 0 };
+    char bitmap[1] = { 0 };
+    char buf[0x10];
+    dma_memory_region_t *r;
+    dma_sg_t sg;
+
+    memset(dma, 0, sizeof(*dma) + sizeof(*r));
+    dma->nregions = 1;
+    dma->dirty_pgsize = 0x1000;
+    r = &dma->regions[0];
+    r->info.iova.iov_base = (void *)0x10000;
+    r->info.iova.iov_len = sizeof(mem);
+    r->info.vaddr = mem;
+    r->info.prot = PROT_READ;
+    r->dirty_bitmap = bitmap;
+
+    assert_int_equal(1, dma_addr_to_sg(dma, (vfu_dma_addr_t)0x12ff8,
+                                       sizeof(buf), &sg, 1, PROT_READ));
+    assert_true(sg.mappable);
+    memset(buf, 'A', sizeof(buf));
+
+    /* no message is sent, as vfu_ctx.tran is NULL */
+    errno = 0;
+    assert_int_equal(-1, vfu_dma_write(&vfu_ctx, &sg, buf));
+    assert_int_equal(EACCES, errno);
+
+    r->info.prot = PROT_READ | PROT_WRITE;
+    assert_int_equal(0, vfu_dma_write(&vfu_ctx, &sg, buf));
+    assert_memory_equal(mem + 0x2ff8, buf, sizeof(buf));
+    assert_int_equal(0x0c, bitmap[0]);
+
+    memset(buf, 0, sizeof(buf));
+    mem[0x2ff8] = 'B';
+    assert_int_equal(0, vfu_dma_read(&vfu_ctx, &sg, buf));
+    assert_int_equal('B', buf[0]);
+    assert_int_equal('A', buf[sizeof(buf) - 1]);
+}
+
+static void
+test_sg_copy(void **state UNUSED)
+{
+    dma_controller_t *dma = alloca(sizeof(dma_controller_t) +
+                                   2 * sizeof(dma_memory_region_t));
+    vfu_ctx_t vfu_ctx = { .dma = dma };
+    size_t size = 0x80000;
+    char *mem[2], *src, *dst;
+    char bitmap[2][16] = { { 0 } };
+    dma_sg_t sg[2];
+    int i;
+
+    memset(dma, 0, sizeof(*dma) + 2 * sizeof(dma_memory_region_t));
+    dma->nregions = 2;
+    dma->dirty_pgsize = 0x10000;
+    for (i = 0; i < 2; i++) {
+        mem[i] = calloc(1, size);
+        assert_non_null(mem[i]);
+        dma->regions[i].info.iova.iov_base = (void *)(i * size);
+        dma->regions[i].info.iova.iov_len = size;
+        dma->regions[i].info.vaddr = mem[i];
+        dma->regions[i].info.prot = PROT_READ | PROT_WRITE;
+        dma->regions[i].dirty_bitmap = bitmap[i];
+    }
+    src = malloc(size);
+    dst = calloc(1, size);
+    assert_non_null(src);
+    assert_non_null(dst);
+    for (i = 0; i < (int)size; i++) {
+        src[i] = i % 251;
+    }
+
+    /* spans both regions, both large enough for non-temporal stores */
+    assert_int_equal(0, vfu_setup_dma_copy_threshold(&vfu_ctx, 0x1000));
+    assert_int_equal(2, dma_addr_to_sg(dma, (vfu_dma_addr_t)(size - 0x1003),
+                                       size, sg, 2, PROT_READ));
+
+    errno = 0;
+    assert_int_equal(-1, vfu_sg_copy_to(&vfu_ctx, sg, 2, src, size + 1));
+    assert_int_equal(EINVAL, errno);
+
+    assert_int_equal(0, vfu_sg_copy_to(&vfu_ctx, sg, 2, src, size));
+    assert_memory_equal(mem[0] + size - 0x1003, src, 0x1003);
+    assert_memory_equal(mem[1], src + 0x1003, size - 0x1003);
+    assert_int_equal(0x80, (unsigned char)bitmap[0][0]);
+    assert_int_equal(0xff, (unsigned char)bitmap[1][0]);
+
+    assert_int_equal(0, vfu_sg_copy_from(&vfu_ctx, sg, 2, dst, size));
+    assert_memory_equal(dst, src, size);
+
+    /* short copy only touches the first entry */
+    memset(dst, 0, size);
+    assert_int_equal(0, vfu_sg_copy_from(&vfu_ctx, sg, 2, dst, 0x1000));
+    assert_memory_equal(dst, src, 0x1000);
+    assert_int_equal(0, dst[0x1000]);
+
+    free(src);
+    free(dst);
+    free(mem[0]);
+    free(mem[1]);
+}
+
 static void
 test_vfu_setup_device_dma(void **state UNUSED)
 {
@@ -1717,6 +2732,1551 @@ test_dirty_pages_without_dma(UNUSED void **state)
     assert_int_equal(0xabcd, r);
 }
 
+static vfu_ctx_t *reset_ctx;
+
+static int
+record_reset(vfu_ctx_t *vfu_ctx, vfu_reset_type_t type UNUSED)
+{
+    reset_ctx = vfu_ctx;
+    return 0;
+}
+
+static void
+test_functions(UNUSED void **state)
+{
+    vfu_ctx_t *vfu_ctx = vfu_create_ctx(VFU_TRANS_SOCK, "test", 0, NULL,
+                                        VFU_DEV_TYPE_PCI);
+    struct vfio_user_header hdr = {
+        .cmd = VFIO_USER_DEVICE_RESET,
+        .flags = {
+            .type = VFIO_USER_F_TYPE_COMMAND,
+            .function = 2
+        },
+        .msg_size = sizeof(hdr)
+    };
+    struct iovec _iovecs = { 0 };
+    struct iovec *iovecs = NULL;
+    size_t nr_iovecs = 0;
+    bool free_iovec_data = false;
+    vfu_ctx_t *fn_ctx;
+    int fds = 0;
+
+    assert_non_null(vfu_ctx);
+
+    assert_null(vfu_create_function(vfu_ctx, 0, NULL));
+    assert_int_equal(EINVAL, errno);
+    assert_null(vfu_create_function(vfu_ctx, VFU_PCI_MAX_FUNCTIONS, NULL));
+    assert_int_equal(EINVAL, errno);
+
+    fn_ctx = vfu_create_function(vfu_ctx, 2, (void *)0xbeef);
+    assert_non_null(fn_ctx);
+    assert_ptr_equal((void *)0xbeef, vfu_get_private(fn_ctx));
+    assert_null(vfu_create_function(vfu_ctx, 2, NULL));
+    assert_int_equal(EEXIST, errno);
+    assert_null(vfu_create_function(fn_ctx, 3, NULL));
+    assert_int_equal(EINVAL, errno);
+
+    /* The DMA controller is shared, and only set up through function 0. */
+    assert_int_equal(-1, vfu_setup_device_dma(fn_ctx, NULL, NULL));
+    assert_int_equal(EINVAL, errno);
+    assert_int_equal(0, vfu_setup_device_dma(vfu_ctx, NULL, NULL));
+    assert_ptr_equal(vfu_ctx->dma, fn_ctx->dma);
+
+    assert_int_equal(0, vfu_pci_init(vfu_ctx, VFU_PCI_TYPE_CONVENTIONAL,
+                                     PCI_HEADER_TYPE_NORMAL, 0));
+    assert_int_equal(0, vfu_pci_init(fn_ctx, VFU_PCI_TYPE_CONVENTIONAL,
+                                     PCI_HEADER_TYPE_NORMAL, 0));
+    assert_int_equal(0, vfu_setup_device_reset_cb(fn_ctx, record_reset));
+    assert_int_equal(0, vfu_realize_ctx(vfu_ctx));
+    assert_true(fn_ctx->realized);
+    assert_int_equal(0x80, vfu_ctx->pci.config_space->hdr.htype.raw);
+    assert_int_equal(0, fn_ctx->pci.config_space->hdr.htype.raw);
+    assert_null(vfu_create_function(vfu_ctx, 3, NULL));
+    assert_int_equal(EINVAL, errno);
+
+    reset_ctx = NULL;
+    assert_int_equal(0, exec_command(vfu_ctx, &hdr, sizeof(hdr), &fds, 0,
+                                     NULL, NULL, &_iovecs, &iovecs,
+                                     &nr_iovecs, &free_iovec_data));
+    assert_ptr_equal(fn_ctx, reset_ctx);
+
+    hdr.flags.function = 3;
+    assert_int_equal(-EINVAL, exec_command(vfu_ctx, &hdr, sizeof(hdr), &fds,
+                                           0, NULL, NULL, &_iovecs, &iovecs,
+                                           &nr_iovecs, &free_iovec_data));
+
+    /* Commands for the whole device can't be sent to a function. */
+    hdr.flags.function = 2;
+    hdr.cmd = VFIO_USER_DIRTY_PAGES;
+    assert_int_equal(-EINVAL, exec_command(vfu_ctx, &hdr, sizeof(hdr), &fds,
+                                           0, NULL, NULL, &_iovecs, &iovecs,
+                                           &nr_iovecs, &free_iovec_data));
+
+    /* Destroying a function detaches it from function 0. */
+    vfu_destroy_ctx(fn_ctx);
+    assert_null(vfu_ctx->functions[2]);
+    vfu_destroy_ctx(vfu_ctx);
+}
+
+static uint16_t sriov_num_vfs;
+
+static int
+record_sriov(vfu_ctx_t *vfu_ctx UNUSED, uint16_t num_vfs)
+{
+    sriov_num_vfs = num_vfs;
+    return 0;
+}
+
+static ssize_t
+sriov_cfg_write(vfu_ctx_t *vfu_ctx, size_t off, uint32_t val, size_t count)
+{
+    return pci_config_space_access(vfu_ctx, (char *)&val, count,
+                                   PCI_CFG_SPACE_SIZE + off, true);
+}
+
+static int
+closed_get_request(vfu_ctx_t *vfu_ctx UNUSED,
+                   struct vfio_user_header *hdr UNUSED, int *fds UNUSED,
+                   size_t *nr_fds UNUSED)
+{
+    return -ENOMSG;
+}
+
+static void
+test_sriov(UNUSED void **state)
+{
+    vfu_ctx_t *vfu_ctx = vfu_create_ctx(VFU_TRANS_SOCK, "test", 0, NULL,
+                                        VFU_DEV_TYPE_PCI);
+    struct sriovcap cap = {
+        .hdr.id = PCI_EXT_CAP_ID_SRIOV,
+        .initial_vfs = 4,
+        .total_vfs = 4,
+        .vf_offset = 0,
+        .vf_stride = 2,
+        .vf_did = 0x1234,
+        .sup_pgsize = 0x553,
+    };
+    struct vfio_user_header hdr = {
+        .cmd = VFIO_USER_DEVICE_RESET,
+        .flags = {
+            .type = VFIO_USER_F_TYPE_COMMAND,
+            .function = 8
+        },
+        .msg_size = sizeof(hdr)
+    };
+    struct iovec _iovecs = { 0 };
+    struct iovec *iovecs = NULL;
+    size_t nr_iovecs = 0;
+    bool free_iovec_data = false;
+    struct transport_ops tran;
+    struct sriovcap *sriov;
+    vfu_ctx_t *vf;
+    int fds = 0;
+
+    assert_non_null(vfu_ctx);
+    assert_int_equal(0, vfu_pci_init(vfu_ctx, VFU_PCI_TYPE_EXPRESS,
+                                     PCI_HEADER_TYPE_NORMAL, 0));
+    assert_null(vfu_create_vf(vfu_ctx, 0, NULL));
+    assert_int_equal(EINVAL, errno);
+
+    /* VF routing IDs must fit the header and not alias the PF. */
+    assert_int_equal(-1, vfu_pci_add_capability(vfu_ctx, 0,
+                                                VFU_CAP_FLAG_EXTENDED, &cap));
+    assert_int_equal(EINVAL, errno);
+    cap.vf_offset = 250;
+    assert_int_equal(-1, vfu_pci_add_capability(vfu_ctx, 0,
+                                                VFU_CAP_FLAG_EXTENDED, &cap));
+    assert_int_equal(EINVAL, errno);
+    cap.vf_offset = 8;
+    assert_int_equal(PCI_CFG_SPACE_SIZE,
+                     vfu_pci_add_capability(vfu_ctx, 0, VFU_CAP_FLAG_EXTENDED,
+                                            &cap));
+    sriov = (void *)pci_config_space_ptr(vfu_ctx, PCI_CFG_SPACE_SIZE);
+    assert_int_equal(1, sriov->sys_pgsize);
+
+    assert_int_equal(-1, vfu_setup_vf_region(vfu_ctx,
+                                             VFU_PCI_DEV_BAR0_REGION_IDX,
+                                             0x3000, NULL,
+                                             VFU_REGION_FLAG_RW |
+                                             VFU_REGION_FLAG_MEM));
+    assert_int_equal(EINVAL, errno);
+    assert_int_equal(0, vfu_setup_vf_region(vfu_ctx,
+                                            VFU_PCI_DEV_BAR0_REGION_IDX,
+                                            0x4000, NULL,
+                                            VFU_REGION_FLAG_RW |
+                                            VFU_REGION_FLAG_MEM));
+    assert_int_equal(0, vfu_setup_device_sriov_cb(vfu_ctx, record_sriov));
+
+    assert_null(vfu_create_vf(vfu_ctx, 4, NULL));
+    assert_int_equal(EINVAL, errno);
+    vf = vfu_create_vf(vfu_ctx, 0, NULL);
+    assert_non_null(vf);
+    assert_null(vfu_create_vf(vfu_ctx, 0, NULL));
+    assert_int_equal(EEXIST, errno);
+    assert_int_equal(0xffff, vf->pci.config_space->hdr.id.vid);
+    assert_int_equal(0x4000, vf->reg_info[VFU_PCI_DEV_BAR0_REGION_IDX].size);
+    assert_int_equal(-1, vfu_setup_region(vf, VFU_PCI_DEV_BAR1_REGION_IDX,
+                                          0x1000, NULL, VFU_REGION_FLAG_RW,
+                                          NULL, 0, -1));
+    assert_int_equal(EINVAL, errno);
+    assert_int_equal(0, vfu_setup_device_reset_cb(vf, record_reset));
+    assert_int_equal(0, vfu_realize_ctx(vfu_ctx));
+
+    /* VF BAR sizing. */
+    assert_int_equal(4, sriov_cfg_write(vfu_ctx, PCI_SRIOV_BAR, 0xffffffff,
+                                        4));
+    assert_int_equal(0xffffc000, sriov->bar[0]);
+    assert_int_equal(4, sriov_cfg_write(vfu_ctx, PCI_SRIOV_BAR + 4,
+                                        0xffffffff, 4));
+    assert_int_equal(0, sriov->bar[1]);
+
+    assert_int_equal(-EINVAL, sriov_cfg_write(vfu_ctx, PCI_SRIOV_SYS_PGSIZE,
+                                              0x4, 4));
+    assert_int_equal(4, sriov_cfg_write(vfu_ctx, PCI_SRIOV_SYS_PGSIZE,
+                                        0x2, 4));
+    assert_int_equal(-EINVAL, sriov_cfg_write(vfu_ctx, PCI_SRIOV_NUM_VF, 5,
+                                              2));
+    assert_int_equal(2, sriov_cfg_write(vfu_ctx, PCI_SRIOV_NUM_VF, 2, 2));
+    assert_int_equal(-EPERM, sriov_cfg_write(vfu_ctx, PCI_SRIOV_VF_OFFSET, 1,
+                                             2));
+
+    /* VFs can't be reached before VF Enable is set. */
+    assert_int_equal(-EINVAL, exec_command(vfu_ctx, &hdr, sizeof(hdr), &fds,
+                                           0, NULL, NULL, &_iovecs, &iovecs,
+                                           &nr_iovecs, &free_iovec_data));
+
+    assert_int_equal(2, sriov_cfg_write(vfu_ctx, PCI_SRIOV_CTRL,
+                                        PCI_SRIOV_CTRL_VFE |
+                                        PCI_SRIOV_CTRL_MSE, 2));
+    assert_int_equal(2, sriov_num_vfs);
+    assert_int_equal(-EBUSY, sriov_cfg_write(vfu_ctx, PCI_SRIOV_NUM_VF, 1,
+                                             2));
+
+    reset_ctx = NULL;
+    assert_int_equal(0, exec_command(vfu_ctx, &hdr, sizeof(hdr), &fds, 0,
+                                     NULL, NULL, &_iovecs, &iovecs,
+                                     &nr_iovecs, &free_iovec_data));
+    assert_ptr_equal(vf, reset_ctx);
+
+    /* VF 1 was never created, and 9 isn't a VF routing ID. */
+    hdr.flags.function = 10;
+    assert_int_equal(-EINVAL, exec_command(vfu_ctx, &hdr, sizeof(hdr), &fds,
+                                           0, NULL, NULL, &_iovecs, &iovecs,
+                                           &nr_iovecs, &free_iovec_data));
+    hdr.flags.function = 9;
+    assert_int_equal(-EINVAL, exec_command(vfu_ctx, &hdr, sizeof(hdr), &fds,
+                                           0, NULL, NULL, &_iovecs, &iovecs,
+                                           &nr_iovecs, &free_iovec_data));
+
+    assert_int_equal(2, sriov_cfg_write(vfu_ctx, PCI_SRIOV_CTRL, 0, 2));
+    assert_int_equal(0, sriov_num_vfs);
+    hdr.flags.function = 8;
+    assert_int_equal(-EINVAL, exec_command(vfu_ctx, &hdr, sizeof(hdr), &fds,
+                                           0, NULL, NULL, &_iovecs, &iovecs,
+                                           &nr_iovecs, &free_iovec_data));
+
+    /* Losing the client disables the VFs. */
+    assert_int_equal(2, sriov_cfg_write(vfu_ctx, PCI_SRIOV_CTRL,
+                                        PCI_SRIOV_CTRL_VFE, 2));
+    assert_int_equal(2, sriov_num_vfs);
+    tran = *vfu_ctx->tran;
+    tran.get_request = closed_get_request;
+    vfu_ctx->tran = &tran;
+    assert_int_equal(-ENOTCONN, process_request(vfu_ctx));
+    assert_int_equal(0, sriov_num_vfs);
+    assert_int_equal(0, sriov->ctrl);
+    assert_int_equal(0, sriov->num_vfs);
+    assert_int_equal(0, vfu_ctx->sriov.nr_vfs);
+
+    vfu_destroy_ctx(vfu_ctx);
+
+    /* VF routing IDs 2, 4, 6 and 8 can't coexist with function 4. */
+    vfu_ctx = vfu_create_ctx(VFU_TRANS_SOCK, "test", 0, NULL,
+                             VFU_DEV_TYPE_PCI);
+    assert_non_null(vfu_ctx);
+    assert_int_equal(0, vfu_pci_init(vfu_ctx, VFU_PCI_TYPE_EXPRESS,
+                                     PCI_HEADER_TYPE_NORMAL, 0));
+    cap.vf_offset = 2;
+    assert_int_equal(PCI_CFG_SPACE_SIZE,
+                     vfu_pci_add_capability(vfu_ctx, 0, VFU_CAP_FLAG_EXTENDED,
+                                            &cap));
+    assert_non_null(vfu_create_function(vfu_ctx, 4, NULL));
+    assert_int_equal(-1, vfu_realize_ctx(vfu_ctx));
+    assert_int_equal(EINVAL, errno);
+    vfu_destroy_ctx(vfu_ctx);
+}
+
+/*
+ * Queues a connection for the next accept() on "listener", proposing a version
+ * naming "device", and returns the client end.
+ */
+static int
+listener_connect(vfu_listener_t *listener, const char *device)
+{
+    struct {
+        struct vfio_user_version v;
+        char json[64];
+    } __attribute__((packed)) version = {
+        .v = { .major = LIB_VFIO_USER_MAJOR, .minor = LIB_VFIO_USER_MINOR }
+    };
+    size_t len;
+    int sv[2];
+
+    assert_int_equal(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    patch("accept");
+    expect_value(accept, sockfd, vfu_listener_get_poll_fd(listener));
+    will_return(accept, sv[1]);
+
+    len = snprintf(version.json, sizeof(version.json),
+                   "{\"device\":\"%s\"}", device) + 1;
+    assert_int_equal(0, tran_sock_send(sv[0], 0x1, false, VFIO_USER_VERSION,
+                                       &version, sizeof(version.v) + len));
+    return sv[0];
+}
+
+static void
+test_listener(UNUSED void **state)
+{
+    struct vfio_user_header hdr;
+    vfu_listener_t *listener;
+    uint16_t msg_id = 0x1;
+    vfu_ctx_t *ctx[2];
+    vfu_ctx_t *other;
+    void *data;
+    size_t len;
+    int sock[3];
+
+    listener = vfu_create_listener("listener", 0);
+    assert_non_null(listener);
+
+    ctx[0] = vfu_create_ctx(VFU_TRANS_SOCK, "dev0", LIBVFIO_USER_FLAG_SHARED,
+                            NULL, VFU_DEV_TYPE_PCI);
+    ctx[1] = vfu_create_ctx(VFU_TRANS_SOCK, "dev1", LIBVFIO_USER_FLAG_SHARED,
+                            NULL, VFU_DEV_TYPE_PCI);
+    other = vfu_create_ctx(VFU_TRANS_SOCK, "dev1", LIBVFIO_USER_FLAG_SHARED,
+                           NULL, VFU_DEV_TYPE_PCI);
+    assert_non_null(ctx[0]);
+    assert_non_null(ctx[1]);
+    assert_non_null(other);
+    assert_int_equal(0, vfu_listener_add_ctx(listener, ctx[0]));
+    assert_int_equal(0, vfu_listener_add_ctx(listener, ctx[1]));
+    assert_int_equal(-1, vfu_listener_add_ctx(listener, ctx[1]));
+    assert_int_equal(EINVAL, errno);
+    assert_int_equal(-1, vfu_listener_add_ctx(listener, other));
+    assert_int_equal(EEXIST, errno);
+
+    assert_int_equal(-1, vfu_attach_ctx(ctx[1]));
+    assert_int_equal(EAGAIN, errno);
+    assert_int_equal(vfu_listener_get_poll_fd(listener),
+                     vfu_get_poll_fd(ctx[1]));
+
+    /* The connection goes to the named device. */
+    sock[0] = listener_connect(listener, "dev1");
+    assert_ptr_equal(ctx[1], vfu_listener_accept(listener));
+    assert_int_equal(0, tran_sock_recv_alloc(sock[0], SOCK_STREAM, &hdr, true,
+                                             &msg_id, &data, &len));
+    assert_int_equal(LIB_VFIO_USER_MAJOR,
+                     ((struct vfio_user_version *)data)->major);
+    free(data);
+    assert_int_equal(0, vfu_attach_ctx(ctx[1]));
+    assert_true(vfu_get_poll_fd(ctx[1]) != vfu_listener_get_poll_fd(listener));
+    assert_int_equal(-1, vfu_attach_ctx(ctx[0]));
+    assert_int_equal(EAGAIN, errno);
+
+    /* Unknown and busy devices are refused. */
+    sock[1] = listener_connect(listener, "dev2");
+    assert_null(vfu_listener_accept(listener));
+    assert_int_equal(ENOENT, errno);
+    assert_int_equal(-ENOENT, tran_sock_recv_alloc(sock[1], SOCK_STREAM,
+                                                   &hdr, true, &msg_id, &data,
+                                                   &len));
+    sock[2] = listener_connect(listener, "dev1");
+    assert_null(vfu_listener_accept(listener));
+    assert_int_equal(EBUSY, errno);
+
+    /* Destroyed contexts are no longer routed to. */
+    vfu_destroy_ctx(ctx[0]);
+    close(sock[2]);
+    sock[2] = listener_connect(listener, "dev0");
+    assert_null(vfu_listener_accept(listener));
+    assert_int_equal(ENOENT, errno);
+
+    vfu_destroy_ctx(ctx[1]);
+    vfu_destroy_ctx(other);
+    vfu_destroy_listener(listener);
+    close(sock[0]);
+    close(sock[1]);
+    close(sock[2]);
+}
+
+/*
+ * Tests that a non-blocking listener receives versions as they arrive, drops
+ * clients that hang up half-way, and routes a blocking connection.
+ */
+static void
+test_listener_nb(UNUSED void **state)
+{
+    struct {
+        struct vfio_user_header hdr;
+        struct vfio_user_version v;
+        char json[32];
+    } __attribute__((packed)) msg = {
+        .hdr = {
+            .msg_id = 0x1,
+            .cmd = VFIO_USER_VERSION,
+            .msg_size = sizeof(msg)
+        },
+        .v = { .major = LIB_VFIO_USER_MAJOR, .minor = LIB_VFIO_USER_MINOR },
+        .json = "{\"device\":\"dev0\"}"
+    };
+    size_t part = sizeof(msg.hdr) + sizeof(msg.v);
+    struct vfio_user_header hdr;
+    vfu_listener_t *listener;
+    uint16_t msg_id = 0x1;
+    vfu_ctx_t *ctx;
+    int sv[2], hup[2];
+    void *data;
+    size_t len;
+
+    listener = vfu_create_listener("listener", LIBVFIO_USER_FLAG_ATTACH_NB);
+    assert_non_null(listener);
+    ctx = vfu_create_ctx(VFU_TRANS_SOCK, "dev0", LIBVFIO_USER_FLAG_SHARED,
+                         NULL, VFU_DEV_TYPE_PCI);
+    assert_non_null(ctx);
+    assert_int_equal(0, vfu_listener_add_ctx(listener, ctx));
+    assert_int_equal(vfu_listener_get_poll_fd(listener),
+                     vfu_get_poll_fd(ctx));
+    patch("accept");
+
+    /* A client that hangs up before the end of its version is dropped. */
+    assert_int_equal(0, socketpair(AF_UNIX, SOCK_STREAM, 0, hup));
+    expect_any(accept, sockfd);
+    will_return(accept, hup[1]);
+    assert_int_equal(part, send(hup[0], &msg, part, 0));
+    assert_null(vfu_listener_accept(listener));
+    assert_int_equal(EAGAIN, errno);
+    close(hup[0]);
+    expect_any(accept, sockfd);
+    will_return(accept, -1);
+    assert_null(vfu_listener_accept(listener));
+    assert_int_equal(EAGAIN, errno);
+    assert_int_equal(-1, fcntl(hup[1], F_GETFD));
+
+    /* Nothing blocks while the version arrives piecemeal. */
+    assert_int_equal(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    expect_any(accept, sockfd);
+    will_return(accept, sv[1]);
+    assert_int_equal(part, send(sv[0], &msg, part, 0));
+    assert_null(vfu_listener_accept(listener));
+    assert_int_equal(EAGAIN, errno);
+    expect_any(accept, sockfd);
+    will_return(accept, -1);
+    assert_null(vfu_listener_accept(listener));
+    assert_int_equal(EAGAIN, errno);
+
+    assert_int_equal(sizeof(msg) - part,
+                     send(sv[0], (char *)&msg + part, sizeof(msg) - part, 0));
+    expect_any(accept, sockfd);
+    will_return(accept, -1);
+    assert_ptr_equal(ctx, vfu_listener_accept(listener));
+    assert_int_equal(0, fcntl(sv[1], F_GETFL) & O_NONBLOCK);
+    assert_int_equal(0, tran_sock_recv_alloc(sv[0], SOCK_STREAM, &hdr, true,
+                                             &msg_id, &data, &len));
+    free(data);
+    assert_int_equal(0, vfu_attach_ctx(ctx));
+
+    vfu_destroy_ctx(ctx);
+    vfu_destroy_listener(listener);
+    close(sv[0]);
+}
+
+/*
+ * Connects a client to the realized, non-blocking @ctx and returns its socket,
+ * which is a SOCK_SEQPACKET one if LIBVFIO_USER_FLAG_SEQPACKET is in @flags.
+ * The connection is a UNIX one even for VFU_TRANS_TCP. The client accepts
+ * posted interrupts.
+ */
+static int
+connect_ctx(vfu_ctx_t *ctx, int flags)
+{
+    static const char caps[] = "{\"capabilities\":{\"vm_interrupt\":true}}";
+    struct {
+        struct vfio_user_version version;
+        char caps[sizeof(caps)];
+    } version = {
+        .version = {
+            .major = LIB_VFIO_USER_MAJOR, .minor = LIB_VFIO_USER_MINOR
+        }
+    };
+    int type = flags & LIBVFIO_USER_FLAG_SEQPACKET ? SOCK_SEQPACKET :
+                                                     SOCK_STREAM;
+    struct vfio_user_header hdr;
+    void *data;
+    size_t len;
+    int sv[2];
+
+    assert_int_equal(0, socketpair(AF_UNIX, type, 0, sv));
+    patch("accept");
+    expect_value(accept, sockfd, vfu_get_poll_fd(ctx));
+    will_return(accept, sv[1]);
+    memcpy(version.caps, caps, sizeof(caps));
+    assert_int_equal(0, tran_sock_send(sv[0], 0x1, false, VFIO_USER_VERSION,
+                                       &version, sizeof(version)));
+    assert_int_equal(0, vfu_attach_ctx(ctx));
+    assert_int_equal(0, tran_sock_recv_alloc(sv[0], type, &hdr, true, NULL,
+                                             &data, &len));
+    free(data);
+
+    return sv[0];
+}
+
+/*
+ * Returns a non-blocking, realized context connected to the returned client
+ * socket, see connect_ctx().
+ */
+static vfu_ctx_t *
+create_connected_ctx(int *sock, vfu_trans_t trans, int flags)
+{
+    vfu_ctx_t *ctx;
+
+    ctx = vfu_create_ctx(trans, trans == VFU_TRANS_TCP ? "127.0.0.1:0" : "test",
+                         LIBVFIO_USER_FLAG_ATTACH_NB | flags, NULL,
+                         VFU_DEV_TYPE_PCI);
+    assert_non_null(ctx);
+    assert_int_equal(0, vfu_pci_init(ctx, VFU_PCI_TYPE_CONVENTIONAL,
+                                     PCI_HEADER_TYPE_NORMAL, 0));
+    assert_int_equal(0, vfu_realize_ctx(ctx));
+
+    *sock = connect_ctx(ctx, flags);
+    return ctx;
+}
+
+/*
+ * Tests that a client command that arrives while waiting for the reply to a
+ * server-initiated command is queued, makes the poll fd readable, and is
+ * processed by vfu_run_ctx().
+ */
+static void
+test_get_reply_queues_cmds(UNUSED void **state)
+{
+    struct vfio_device_info dev_info = { .argsz = sizeof(dev_info) };
+    struct pollfd pfd = { .events = POLLIN };
+    struct reply_wait wait = { .first_id = 0x3, .nr = 1 };
+    struct vfio_user_header hdr;
+    uint32_t val = 0xcafe;
+    uint16_t msg_id = 0x2;
+    vfu_ctx_t *ctx;
+    void *data;
+    size_t len;
+    int sock;
+
+    ctx = create_connected_ctx(&sock, VFU_TRANS_SOCK, 0);
+    ctx->tran->add_reply_wait(ctx, &wait);
+
+    assert_int_equal(0, tran_sock_send(sock, msg_id, false,
+                                       VFIO_USER_DEVICE_GET_INFO,
+                                       &dev_info, sizeof(dev_info)));
+    assert_int_equal(0, tran_sock_send(sock, 0x3, true, 0,
+                                       &val, sizeof(val)));
+
+    /* Only the reply is returned, the command is queued. */
+    assert_int_equal(0, ctx->tran->get_reply(ctx, &wait, &hdr, &data));
+    ctx->tran->del_reply_wait(ctx, &wait);
+    assert_int_equal(0x3, hdr.msg_id);
+    assert_true(ctx->tran->has_pending(ctx));
+    pfd.fd = vfu_get_poll_fd(ctx);
+    assert_int_equal(1, poll(&pfd, 1, 0));
+    assert_int_equal(0xcafe, *(uint32_t *)data);
+    free(data);
+
+    /* Nothing is left on the socket, but the command is processed. */
+    assert_int_equal(0, vfu_run_ctx(ctx));
+    assert_false(ctx->tran->has_pending(ctx));
+    assert_int_equal(0, poll(&pfd, 1, 0));
+    memset(&dev_info, 0, sizeof(dev_info));
+    len = sizeof(dev_info);
+    assert_int_equal(0, tran_sock_recv(sock, SOCK_STREAM, &hdr, true, &msg_id,
+                                       &dev_info, &len));
+    assert_int_equal(ctx->nr_regions, dev_info.num_regions);
+
+    vfu_destroy_ctx(ctx);
+    close(sock);
+}
+
+/*
+ * Tests that a client that keeps sending commands while we wait for a reply
+ * only gets so many queued before the connection fails.
+ */
+static void
+test_get_reply_queue_limit(UNUSED void **state)
+{
+    struct vfio_device_info dev_info = { .argsz = sizeof(dev_info) };
+    struct reply_wait wait = { .first_id = 0x100, .nr = 1 };
+    struct vfio_user_header hdr;
+    uint16_t msg_id;
+    vfu_ctx_t *ctx;
+    void *data;
+    int sock;
+
+    ctx = create_connected_ctx(&sock, VFU_TRANS_SOCK, 0);
+
+    for (msg_id = 0; msg_id <= 64; msg_id++) {
+        assert_int_equal(0, tran_sock_send(sock, msg_id, false,
+                                           VFIO_USER_DEVICE_GET_INFO,
+                                           &dev_info, sizeof(dev_info)));
+    }
+
+    ctx->tran->add_reply_wait(ctx, &wait);
+    assert_int_equal(-ENOBUFS, ctx->tran->get_reply(ctx, &wait, &hdr, &data));
+    ctx->tran->del_reply_wait(ctx, &wait);
+
+    vfu_destroy_ctx(ctx);
+    close(sock);
+}
+
+/*
+ * Tests that a reply that arrives while vfu_run_ctx() reads is kept for the
+ * thread waiting for it, which then doesn't read the socket itself.
+ */
+static void
+test_get_request_keeps_replies(UNUSED void **state)
+{
+    struct vfio_device_info dev_info = { .argsz = sizeof(dev_info) };
+    struct reply_wait wait = { .first_id = 0x5, .nr = 2 };
+    struct vfio_user_header hdr;
+    uint32_t val = 0xcafe;
+    vfu_ctx_t *ctx;
+    void *data;
+    size_t len;
+    int sock;
+
+    ctx = create_connected_ctx(&sock, VFU_TRANS_SOCK, 0);
+    ctx->tran->add_reply_wait(ctx, &wait);
+
+    assert_int_equal(0, tran_sock_send(sock, 0x6, true, 0,
+                                       &val, sizeof(val)));
+    assert_int_equal(0, tran_sock_send(sock, 0x2, false,
+                                       VFIO_USER_DEVICE_GET_INFO,
+                                       &dev_info, sizeof(dev_info)));
+    assert_int_equal(0, vfu_run_ctx(ctx));
+    len = sizeof(dev_info);
+    assert_int_equal(0, tran_sock_recv(sock, SOCK_STREAM, &hdr, true, NULL,
+                                       &dev_info, &len));
+
+    /* The socket is empty, so this would block if it read it. */
+    assert_int_equal(0, ctx->tran->get_reply(ctx, &wait, &hdr, &data));
+    ctx->tran->del_reply_wait(ctx, &wait);
+    assert_int_equal(0x6, hdr.msg_id);
+    assert_int_equal(0xcafe, *(uint32_t *)data);
+    free(data);
+
+    vfu_destroy_ctx(ctx);
+    close(sock);
+}
+
+/*
+ * Tests that the replies to pipelined requests are sent together, and that
+ * the client gets them in order.
+ */
+static void
+test_reply_cork(UNUSED void **state)
+{
+    struct vfio_device_info dev_info = { .argsz = sizeof(dev_info) };
+    struct vfio_user_header hdr;
+    uint16_t msg_id;
+    vfu_ctx_t *ctx;
+    size_t len;
+    int sock;
+
+    ctx = create_connected_ctx(&sock, VFU_TRANS_SOCK, 0);
+
+    for (msg_id = 0x10; msg_id < 0x13; msg_id++) {
+        assert_int_equal(0, tran_sock_send(sock, msg_id, false,
+                                           VFIO_USER_DEVICE_GET_INFO,
+                                           &dev_info, sizeof(dev_info)));
+    }
+
+    /* No reply is sent on its own. */
+    patch("tran_sock_send_iovec");
+    assert_int_equal(0, vfu_run_ctx(ctx));
+    assert_false(ctx->tran->has_pending(ctx));
+    assert_int_equal(0, ((tran_sock_t *)ctx->tran_data)->cork_len);
+
+    for (msg_id = 0x10; msg_id < 0x13; msg_id++) {
+        memset(&dev_info, 0, sizeof(dev_info));
+        len = sizeof(dev_info);
+        assert_int_equal(0, tran_sock_recv(sock, SOCK_STREAM, &hdr, true,
+                                           &msg_id, &dev_info, &len));
+        assert_int_equal(ctx->nr_regions, dev_info.num_regions);
+    }
+
+    vfu_destroy_ctx(ctx);
+    close(sock);
+}
+
+/*
+ * Tests that a request received in pieces is processed once whole, and that
+ * has_pending() doesn't count those not received yet.
+ */
+static void
+test_get_request_partial(UNUSED void **state)
+{
+    struct vfio_device_info dev_info = { .argsz = sizeof(dev_info) };
+    struct vfio_user_header hdr = {
+        .msg_id = 0x10,
+        .cmd = VFIO_USER_DEVICE_GET_INFO,
+        .msg_size = sizeof(hdr) + sizeof(dev_info),
+    };
+    char buf[sizeof(hdr) + sizeof(dev_info)];
+    uint16_t msg_id = 0x10;
+    vfu_ctx_t *ctx;
+    size_t len;
+    int sock;
+
+    ctx = create_connected_ctx(&sock, VFU_TRANS_SOCK, 0);
+
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), &dev_info, sizeof(dev_info));
+
+    assert_int_equal(8, write(sock, buf, 8));
+    assert_int_equal(0, vfu_run_ctx(ctx));
+    assert_false(ctx->tran->has_pending(ctx));
+
+    assert_int_equal(sizeof(buf) - 8, write(sock, buf + 8, sizeof(buf) - 8));
+    assert_int_equal(0, vfu_run_ctx(ctx));
+    assert_false(ctx->tran->has_pending(ctx));
+
+    memset(&dev_info, 0, sizeof(dev_info));
+    len = sizeof(dev_info);
+    assert_int_equal(0, tran_sock_recv(sock, SOCK_STREAM, &hdr, true, &msg_id,
+                                       &dev_info, &len));
+    assert_int_equal(ctx->nr_regions, dev_info.num_regions);
+
+    vfu_destroy_ctx(ctx);
+    close(sock);
+}
+
+/*
+ * Tests that with LIBVFIO_USER_FLAG_SEQPACKET each message is received, and
+ * each reply sent, as a single record, and that a record whose size doesn't
+ * match its header is rejected.
+ */
+static void
+test_seqpacket(UNUSED void **state)
+{
+    struct vfio_device_info dev_info = { .argsz = sizeof(dev_info) };
+    struct {
+        struct vfio_user_header hdr;
+        struct vfio_device_info dev_info;
+    } msg;
+    struct reply_wait wait = { .first_id = 0x3, .nr = 1 };
+    struct vfio_user_header hdr;
+    uint32_t val = 0xcafe;
+    uint16_t msg_id;
+    vfu_ctx_t *ctx;
+    void *data;
+    int sock;
+
+    ctx = create_connected_ctx(&sock, VFU_TRANS_SOCK,
+                               LIBVFIO_USER_FLAG_SEQPACKET);
+
+    for (msg_id = 0x10; msg_id < 0x12; msg_id++) {
+        assert_int_equal(0, tran_sock_send(sock, msg_id, false,
+                                           VFIO_USER_DEVICE_GET_INFO,
+                                           &dev_info, sizeof(dev_info)));
+    }
+    /* Each read returns a single record, so a single request. */
+    assert_int_equal(0, vfu_run_ctx(ctx));
+    assert_false(ctx->tran->has_pending(ctx));
+    assert_int_equal(0, vfu_run_ctx(ctx));
+    /* The receive buffer is kept for the next message. */
+    assert_non_null(((tran_sock_t *)ctx->tran_data)->rx);
+
+    /* Replies are not coalesced. */
+    for (msg_id = 0x10; msg_id < 0x12; msg_id++) {
+        memset(&msg, 0, sizeof(msg));
+        assert_int_equal(sizeof(msg), recv(sock, &msg, sizeof(msg), MSG_TRUNC));
+        assert_int_equal(msg_id, msg.hdr.msg_id);
+        assert_int_equal(sizeof(msg), msg.hdr.msg_size);
+        assert_int_equal(ctx->nr_regions, msg.dev_info.num_regions);
+    }
+
+    /* A reply body is picked up from the record already received. */
+    assert_int_equal(0, tran_sock_send(sock, 0x3, true, 0,
+                                       &val, sizeof(val)));
+    ctx->tran->add_reply_wait(ctx, &wait);
+    assert_int_equal(0, ctx->tran->get_reply(ctx, &wait, &hdr, &data));
+    ctx->tran->del_reply_wait(ctx, &wait);
+    assert_int_equal(0x3, hdr.msg_id);
+    assert_int_equal(0xcafe, *(uint32_t *)data);
+    free(data);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.hdr.msg_id = 0x20;
+    msg.hdr.cmd = VFIO_USER_DEVICE_GET_INFO;
+    msg.hdr.flags.type = VFIO_USER_F_TYPE_COMMAND;
+    msg.hdr.msg_size = sizeof(msg) + 1;
+    msg.dev_info.argsz = sizeof(dev_info);
+    assert_int_equal(sizeof(msg), send(sock, &msg, sizeof(msg), 0));
+    assert_int_equal(-EINVAL, ctx->tran->get_request(ctx, &hdr, NULL, NULL));
+
+    vfu_destroy_ctx(ctx);
+    close(sock);
+
+    /* The shared listener is a stream socket. */
+    assert_null(vfu_create_ctx(VFU_TRANS_SOCK, "test",
+                               LIBVFIO_USER_FLAG_SHARED |
+                               LIBVFIO_USER_FLAG_SEQPACKET, NULL,
+                               VFU_DEV_TYPE_PCI));
+    assert_int_equal(EINVAL, errno);
+}
+
+/*
+ * Tests that with VFU_TRANS_TCP no fds are exchanged: regions are not
+ * mappable, and the client can't be sent fds.
+ */
+static void
+test_tcp(UNUSED void **state)
+{
+    vfu_ctx_t *ctx;
+    int sock;
+
+    assert_null(vfu_create_ctx(VFU_TRANS_TCP, "127.0.0.1", 0, NULL,
+                               VFU_DEV_TYPE_PCI));
+    assert_int_equal(EINVAL, errno);
+    assert_null(vfu_create_ctx(VFU_TRANS_TCP, "127.0.0.1:0",
+                               LIBVFIO_USER_FLAG_SEQPACKET, NULL,
+                               VFU_DEV_TYPE_PCI));
+    assert_int_equal(EINVAL, errno);
+
+    ctx = vfu_create_ctx(VFU_TRANS_TCP, ":0", 0, NULL, VFU_DEV_TYPE_PCI);
+    assert_non_null(ctx);
+    assert_int_equal(0, vfu_setup_region(ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                         0x1000, NULL, VFU_REGION_FLAG_RW,
+                                         NULL, 0, 1));
+    assert_int_equal(-1, ctx->reg_info[VFU_PCI_DEV_BAR0_REGION_IDX].fd);
+    assert_null(ctx->reg_info[VFU_PCI_DEV_BAR0_REGION_IDX].mmap_areas);
+    vfu_destroy_ctx(ctx);
+
+    ctx = create_connected_ctx(&sock, VFU_TRANS_TCP, 0);
+    assert_true(((tran_sock_t *)ctx->tran_data)->tcp);
+    assert_int_equal(0, ctx->client_max_fds);
+    vfu_destroy_ctx(ctx);
+    close(sock);
+}
+
+static ssize_t
+irq_bar_access(vfu_ctx_t *vfu_ctx, UNUSED char *buf, size_t count,
+               UNUSED loff_t offset, UNUSED bool is_write)
+{
+    assert_int_equal(0, vfu_irq_trigger(vfu_ctx, 1));
+    assert_int_equal(0, vfu_irq_trigger(vfu_ctx, 65));
+    assert_int_equal(0, vfu_irq_trigger(vfu_ctx, 1));
+    return count;
+}
+
+/*
+ * Tests that interrupts without an eventfd are posted as
+ * VFIO_USER_VM_INTERRUPT messages, only if the client accepts them, that the
+ * ones triggered while processing a request are sent together after its reply,
+ * and that those of other functions are posted on the connection of function
+ * 0.
+ */
+static void
+test_irq_post(UNUSED void **state)
+{
+    struct {
+        struct vfio_user_region_access access;
+        uint32_t val;
+    } msg = {
+        .access = {
+            .region = VFU_PCI_DEV_BAR0_REGION_IDX,
+            .count = sizeof(uint32_t)
+        }
+    };
+    struct vfio_user_header hdr;
+    uint16_t msg_id = 0x2;
+    uint32_t *subindexes;
+    vfu_ctx_t *ctx, *fn_ctx;
+    size_t len;
+    int sock;
+
+    ctx = vfu_create_ctx(VFU_TRANS_SOCK, "test", LIBVFIO_USER_FLAG_ATTACH_NB,
+                         NULL, VFU_DEV_TYPE_PCI);
+    assert_non_null(ctx);
+    assert_int_equal(0, vfu_pci_init(ctx, VFU_PCI_TYPE_CONVENTIONAL,
+                                     PCI_HEADER_TYPE_NORMAL, 0));
+    assert_int_equal(0, vfu_setup_region(ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                         0x1000, irq_bar_access,
+                                         VFU_REGION_FLAG_RW, NULL, 0, -1));
+    assert_int_equal(0, vfu_setup_device_nr_irqs(ctx, VFU_DEV_MSIX_IRQ, 70));
+    fn_ctx = vfu_create_function(ctx, 2, NULL);
+    assert_non_null(fn_ctx);
+    assert_int_equal(0, vfu_pci_init(fn_ctx, VFU_PCI_TYPE_CONVENTIONAL,
+                                     PCI_HEADER_TYPE_NORMAL, 0));
+    assert_int_equal(0, vfu_setup_device_nr_irqs(fn_ctx, VFU_DEV_MSIX_IRQ, 4));
+    assert_int_equal(0, vfu_realize_ctx(ctx));
+
+    /* Not before a client accepting them is connected. */
+    assert_int_equal(-1, vfu_irq_trigger(ctx, 3));
+    assert_int_equal(ENOENT, errno);
+    assert_int_equal(-1, vfu_irq_trigger(fn_ctx, 3));
+    assert_int_equal(ENOENT, errno);
+
+    sock = connect_ctx(ctx, 0);
+
+    /* Outside of a request the interrupt is sent right away. */
+    assert_int_equal(0, vfu_irq_trigger(ctx, 3));
+    assert_int_equal(0, tran_sock_recv_alloc(sock, SOCK_STREAM, &hdr, false,
+                                             NULL, (void **)&subindexes, &len));
+    assert_int_equal(VFIO_USER_VM_INTERRUPT, hdr.cmd);
+    assert_true(hdr.flags.no_reply);
+    assert_int_equal(sizeof(uint32_t), len);
+    assert_int_equal(3, subindexes[0]);
+    free(subindexes);
+
+    assert_int_equal(0, tran_sock_send(sock, msg_id, false,
+                                       VFIO_USER_REGION_WRITE,
+                                       &msg, sizeof(msg)));
+    assert_int_equal(0, vfu_run_ctx(ctx));
+
+    len = sizeof(msg.access);
+    assert_int_equal(0, tran_sock_recv(sock, SOCK_STREAM, &hdr, true, &msg_id,
+                                       &msg.access, &len));
+    assert_int_equal(0, tran_sock_recv_alloc(sock, SOCK_STREAM, &hdr, false,
+                                             NULL, (void **)&subindexes, &len));
+    assert_int_equal(VFIO_USER_VM_INTERRUPT, hdr.cmd);
+    assert_int_equal(2 * sizeof(uint32_t), len);
+    assert_int_equal(1, subindexes[0]);
+    assert_int_equal(65, subindexes[1]);
+    free(subindexes);
+
+    assert_int_equal(0, vfu_irq_trigger(fn_ctx, 3));
+    assert_int_equal(0, tran_sock_recv_alloc(sock, SOCK_STREAM, &hdr, false,
+                                             NULL, (void **)&subindexes, &len));
+    assert_int_equal(VFIO_USER_VM_INTERRUPT, hdr.cmd);
+    assert_int_equal(2, hdr.flags.function);
+    assert_int_equal(sizeof(uint32_t), len);
+    assert_int_equal(3, subindexes[0]);
+    free(subindexes);
+
+    vfu_destroy_ctx(ctx);
+    close(sock);
+}
+
+static uint32_t co_bar_val;
+static int co_dma_ret;
+
+/*
+ * Writes fetch the value from the client's memory, so they wait for it; reads
+ * yield once.
+ */
+static ssize_t
+co_bar_access(vfu_ctx_t *vfu_ctx, char *buf, size_t count,
+              UNUSED loff_t offset, bool is_write)
+{
+    dma_sg_t sg;
+
+    if (is_write) {
+        assert_int_equal(1, vfu_addr_to_sg(vfu_ctx, (vfu_dma_addr_t)0x10000,
+                                           count, &sg, 1, PROT_READ));
+        co_dma_ret = vfu_dma_read(vfu_ctx, &sg, &co_bar_val);
+    } else {
+        assert_int_equal(0, vfu_yield(vfu_ctx));
+        memcpy(buf, &co_bar_val, count);
+    }
+    return count;
+}
+
+static int
+co_dma_unregister(UNUSED vfu_ctx_t *vfu_ctx, UNUSED vfu_dma_info_t *info)
+{
+    return 0;
+}
+
+/*
+ * Tests that with LIBVFIO_USER_FLAG_COROUTINES a request waiting for a DMA
+ * read doesn't hold back the next one, and completes once the client replies,
+ * or fails if it goes away. A DMA unmap waits for it, and holds back the next
+ * request.
+ */
+static void
+test_coroutines(UNUSED void **state)
+{
+    struct vfio_user_dma_region dma_region = {
+        .addr = 0x10000,
+        .size = 0x1000,
+        .prot = PROT_READ | PROT_WRITE
+    };
+    struct vfio_user_dma_region dma_region2 = {
+        .addr = 0x20000,
+        .size = 0x1000,
+        .prot = PROT_READ | PROT_WRITE
+    };
+    struct pollfd pfd = { .events = POLLIN };
+    struct {
+        struct vfio_user_region_access access;
+        uint32_t val;
+    } msg = {
+        .access = {
+            .region = VFU_PCI_DEV_BAR0_REGION_IDX,
+            .count = sizeof(uint32_t)
+        }
+    };
+    struct {
+        struct vfio_user_dma_region_access access;
+        uint32_t val;
+    } dma_reply;
+    struct vfio_user_dma_region_access *dma_access;
+    struct vfio_user_header hdr;
+    uint16_t msg_id, dma_msg_id;
+    vfu_ctx_t *ctx;
+    size_t len;
+    int sock;
+
+    ctx = vfu_create_ctx(VFU_TRANS_SOCK, "test",
+                         LIBVFIO_USER_FLAG_ATTACH_NB |
+                         LIBVFIO_USER_FLAG_COROUTINES, NULL,
+                         VFU_DEV_TYPE_PCI);
+    assert_non_null(ctx);
+    assert_int_equal(0, vfu_pci_init(ctx, VFU_PCI_TYPE_CONVENTIONAL,
+                                     PCI_HEADER_TYPE_NORMAL, 0));
+    assert_int_equal(0, vfu_setup_region(ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                         0x1000, co_bar_access,
+                                         VFU_REGION_FLAG_RW, NULL, 0, -1));
+    assert_int_equal(0, vfu_setup_device_dma(ctx, NULL, co_dma_unregister));
+    assert_int_equal(0, vfu_realize_ctx(ctx));
+    sock = connect_ctx(ctx, 0);
+
+    assert_int_equal(-1, vfu_yield(ctx));
+    assert_int_equal(EINVAL, errno);
+
+    msg_id = 0x2;
+    assert_int_equal(0, tran_sock_send(sock, msg_id, false, VFIO_USER_DMA_MAP,
+                                       &dma_region, sizeof(dma_region)));
+    assert_int_equal(0, vfu_run_ctx(ctx));
+    assert_int_equal(0, tran_sock_recv(sock, SOCK_STREAM, &hdr, true, &msg_id,
+                                       NULL, NULL));
+    assert_int_equal(0, tran_sock_send(sock, msg_id, false, VFIO_USER_DMA_MAP,
+                                       &dma_region2, sizeof(dma_region2)));
+    assert_int_equal(0, vfu_run_ctx(ctx));
+    assert_int_equal(0, tran_sock_recv(sock, SOCK_STREAM, &hdr, true, &msg_id,
+                                       NULL, NULL));
+    pfd.fd = vfu_get_poll_fd(ctx);
+
+    co_bar_val = 0;
+    msg.val = 0xdead;
+    assert_int_equal(0, tran_sock_send(sock, 0x3, false,
+                                       VFIO_USER_REGION_WRITE,
+                                       &msg, sizeof(msg)));
+    assert_int_equal(0, tran_sock_send(sock, 0x4, false,
+                                       VFIO_USER_REGION_READ,
+                                       &msg.access, sizeof(msg.access)));
+    assert_int_equal(0, vfu_run_ctx(ctx));
+
+    /*
+     * The write asks for the value, and the read completes meanwhile, once
+     * called again for it.
+     */
+    assert_int_equal(0, tran_sock_recv_alloc(sock, SOCK_STREAM, &hdr, false,
+                                             NULL, (void **)&dma_access, &len));
+    assert_int_equal(VFIO_USER_DMA_READ, hdr.cmd);
+    assert_int_equal(0x10000, dma_access->addr);
+    assert_int_equal(sizeof(uint32_t), dma_access->count);
+    dma_reply.access = *dma_access;
+    dma_msg_id = hdr.msg_id;
+    free(dma_access);
+    assert_int_equal(1, poll(&pfd, 1, 0));
+    assert_int_equal(0, vfu_run_ctx(ctx));
+    assert_int_equal(0, poll(&pfd, 1, 0));
+    msg_id = 0x4;
+    len = sizeof(msg);
+    assert_int_equal(0, tran_sock_recv(sock, SOCK_STREAM, &hdr, true, &msg_id,
+                                       &msg, &len));
+    assert_int_equal(0, msg.val);
+
+    /* Neither the unmap nor the read after it run while the write waits. */
+    assert_int_equal(0, tran_sock_send(sock, 0x6, false, VFIO_USER_DMA_UNMAP,
+                                       &dma_region2, sizeof(dma_region2)));
+    assert_int_equal(0, tran_sock_send(sock, 0x7, false,
+                                       VFIO_USER_REGION_READ,
+                                       &msg.access, sizeof(msg.access)));
+    assert_int_equal(0, vfu_run_ctx(ctx));
+    assert_int_equal(-1, recv(sock, &hdr, sizeof(hdr), MSG_DONTWAIT));
+    assert_int_equal(EAGAIN, errno);
+    assert_int_equal(0, poll(&pfd, 1, 0));
+
+    dma_reply.val = 0xbeef;
+    assert_int_equal(0, tran_sock_send(sock, dma_msg_id, true,
+                                       VFIO_USER_DMA_READ,
+                                       &dma_reply, sizeof(dma_reply)));
+    assert_int_equal(0, vfu_run_ctx(ctx));
+    msg_id = 0x3;
+    len = sizeof(msg.access);
+    assert_int_equal(0, tran_sock_recv(sock, SOCK_STREAM, &hdr, true, &msg_id,
+                                       &msg.access, &len));
+    assert_int_equal(0, co_dma_ret);
+    assert_int_equal(0xbeef, co_bar_val);
+
+    /* Then the unmap, and the read, which yields once. */
+    while (poll(&pfd, 1, 0) == 1) {
+        assert_int_equal(0, vfu_run_ctx(ctx));
+    }
+    msg_id = 0x6;
+    assert_int_equal(0, tran_sock_recv(sock, SOCK_STREAM, &hdr, true, &msg_id,
+                                       NULL, NULL));
+    msg_id = 0x7;
+    len = sizeof(msg);
+    assert_int_equal(0, tran_sock_recv(sock, SOCK_STREAM, &hdr, true, &msg_id,
+                                       &msg, &len));
+    assert_int_equal(0xbeef, msg.val);
+
+    assert_int_equal(0, tran_sock_send(sock, 0x5, false,
+                                       VFIO_USER_REGION_WRITE,
+                                       &msg, sizeof(msg)));
+    assert_int_equal(0, vfu_run_ctx(ctx));
+    close(sock);
+    assert_int_equal(-1, vfu_run_ctx(ctx));
+    assert_int_equal(ENOTCONN, errno);
+    assert_int_equal(-1, co_dma_ret);
+
+    vfu_destroy_ctx(ctx);
+}
+
+/*
+ * Tests that requests over the rate limit are held back, and that the time is
+ * accounted for.
+ */
+static void
+test_rate_limit(UNUSED void **state)
+{
+    vfu_rate_limit_t limit = { .ops_per_sec = 1, .ops_burst = 2 };
+    struct {
+        struct vfio_user_region_access access;
+        uint32_t val;
+    } msg = {
+        .access = {
+            .region = VFU_PCI_DEV_CFG_REGION_IDX,
+            .count = sizeof(uint32_t)
+        }
+    };
+    vfu_rate_limit_stats_t stats;
+    struct vfio_user_header hdr;
+    uint16_t msg_id;
+    vfu_ctx_t *ctx;
+    size_t len;
+    int sock;
+
+    ctx = create_connected_ctx(&sock, VFU_TRANS_SOCK, 0);
+    assert_int_equal(0, vfu_setup_rate_limit(ctx, &limit));
+
+    for (msg_id = 0x2; msg_id < 0x5; msg_id++) {
+        assert_int_equal(0, tran_sock_send(sock, msg_id, false,
+                                           VFIO_USER_REGION_READ,
+                                           &msg.access, sizeof(msg.access)));
+    }
+
+    /* The burst goes through, and its replies aren't held back. */
+    assert_int_equal(-1, vfu_run_ctx(ctx));
+    assert_int_equal(EBUSY, errno);
+    for (msg_id = 0x2; msg_id < 0x4; msg_id++) {
+        len = sizeof(msg);
+        assert_int_equal(0, tran_sock_recv(sock, SOCK_STREAM, &hdr, true,
+                                           &msg_id, &msg, &len));
+    }
+    assert_int_equal(-1, vfu_run_ctx(ctx));
+    assert_int_equal(EBUSY, errno);
+
+    vfu_get_rate_limit_stats(ctx, &stats);
+    assert_int_equal(1, stats.nr_throttled);
+    assert_true(stats.delay_ns > 0 && stats.delay_ns <= 1000000000);
+    assert_true(stats.throttled_ns >= stats.delay_ns);
+
+    assert_int_equal(0, vfu_setup_rate_limit(ctx, NULL));
+    assert_int_equal(0, vfu_run_ctx(ctx));
+    len = sizeof(msg);
+    assert_int_equal(0, tran_sock_recv(sock, SOCK_STREAM, &hdr, true, &msg_id,
+                                       &msg, &len));
+    vfu_get_rate_limit_stats(ctx, &stats);
+    assert_int_equal(1, stats.nr_throttled);
+    assert_int_equal(0, stats.delay_ns);
+
+    vfu_destroy_ctx(ctx);
+    close(sock);
+}
+
+static uint32_t worker_bar1_vals[2];
+static int worker_nr_bar1;
+static bool worker_bar0_waited;
+static int worker_dma_errno;
+
+/* BAR0 waits for both BAR1 writes, which would never come if it held them. */
+static ssize_t
+worker_bar_access(vfu_ctx_t *vfu_ctx, char *buf, size_t count, loff_t offset,
+                  bool is_write, int region)
+{
+    dma_sg_t sg = { .dma_addr = (void *)0x10000, .length = sizeof(uint32_t) };
+    int i;
+
+    if (region == VFU_PCI_DEV_BAR1_REGION_IDX) {
+        worker_bar1_vals[worker_nr_bar1] = *(uint32_t *)buf;
+        __atomic_add_fetch(&worker_nr_bar1, 1, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    for (i = 0; i < 5000; i++) {
+        if (__atomic_load_n(&worker_nr_bar1, __ATOMIC_ACQUIRE) == 2) {
+            worker_bar0_waited = true;
+            break;
+        }
+        usleep(1000);
+    }
+    if (offset == 0 && vfu_dma_write(vfu_ctx, &sg, buf) == -1) {
+        worker_dma_errno = errno;
+    }
+    return is_write && offset == 0 ? (ssize_t)count : -1;
+}
+
+static ssize_t
+worker_bar0_access(vfu_ctx_t *vfu_ctx, char *buf, size_t count, loff_t offset,
+                   bool is_write)
+{
+    return worker_bar_access(vfu_ctx, buf, count, offset, is_write,
+                             VFU_PCI_DEV_BAR0_REGION_IDX);
+}
+
+static ssize_t
+worker_bar1_access(vfu_ctx_t *vfu_ctx, char *buf, size_t count, loff_t offset,
+                   bool is_write)
+{
+    return worker_bar_access(vfu_ctx, buf, count, offset, is_write,
+                             VFU_PCI_DEV_BAR1_REGION_IDX);
+}
+
+/*
+ * Tests that region accesses handed to workers are replied to as each
+ * completes, in order within a region but not across them, and that workers
+ * can exchange DMA messages meanwhile.
+ */
+static void
+test_region_workers(UNUSED void **state)
+{
+    struct {
+        struct vfio_user_region_access access;
+        uint32_t val;
+    } msg = {
+        .access = { .count = sizeof(uint32_t) }
+    };
+    struct {
+        struct vfio_user_dma_region_access access;
+        uint32_t val;
+    } dma;
+    struct vfio_user_header hdr;
+    uint16_t msg_ids[3];
+    bool dma_seen = false;
+    vfu_ctx_t *ctx;
+    size_t len;
+    int i, sock;
+
+    ctx = vfu_create_ctx(VFU_TRANS_SOCK, "test", LIBVFIO_USER_FLAG_ATTACH_NB,
+                         NULL, VFU_DEV_TYPE_PCI);
+    assert_non_null(ctx);
+    assert_int_equal(0, vfu_pci_init(ctx, VFU_PCI_TYPE_CONVENTIONAL,
+                                     PCI_HEADER_TYPE_NORMAL, 0));
+    assert_int_equal(0, vfu_setup_region(ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                         0x1000, worker_bar0_access,
+                                         VFU_REGION_FLAG_RW, NULL, 0, -1));
+    assert_int_equal(0, vfu_setup_region(ctx, VFU_PCI_DEV_BAR1_REGION_IDX,
+                                         0x1000, worker_bar1_access,
+                                         VFU_REGION_FLAG_RW, NULL, 0, -1));
+    assert_int_equal(-1, vfu_setup_region_workers(ctx, 0));
+    assert_int_equal(EINVAL, errno);
+    assert_int_equal(0, vfu_setup_region_workers(ctx, 2));
+    assert_int_equal(-1, vfu_setup_region_workers(ctx, 2));
+    assert_int_equal(EEXIST, errno);
+    assert_int_equal(0, vfu_realize_ctx(ctx));
+    sock = connect_ctx(ctx, 0);
+
+    msg.access.region = VFU_PCI_DEV_BAR0_REGION_IDX;
+    msg.val = 0xbeef;
+    assert_int_equal(0, tran_sock_send(sock, 0x2, false,
+                                       VFIO_USER_REGION_WRITE,
+                                       &msg, sizeof(msg)));
+    msg.access.region = VFU_PCI_DEV_BAR1_REGION_IDX;
+    for (i = 0; i < 2; i++) {
+        msg.val = 0xcafe + i;
+        assert_int_equal(0, tran_sock_send(sock, 0x3 + i, false,
+                                           VFIO_USER_REGION_WRITE,
+                                           &msg, sizeof(msg)));
+    }
+    assert_int_equal(0, vfu_run_ctx(ctx));
+
+    /* BAR0's DMA write comes among the replies and must be answered first. */
+    for (i = 0; i < 3; ) {
+        assert_int_equal(sizeof(hdr), recv(sock, &hdr, sizeof(hdr),
+                                           MSG_WAITALL));
+        len = hdr.msg_size - sizeof(hdr);
+        if (hdr.flags.type == VFIO_USER_F_TYPE_COMMAND) {
+            assert_false(dma_seen);
+            assert_int_equal(VFIO_USER_DMA_WRITE, hdr.cmd);
+            assert_int_equal(sizeof(dma), len);
+            assert_int_equal(len, recv(sock, &dma, len, MSG_WAITALL));
+            assert_int_equal(0x10000, dma.access.addr);
+            assert_int_equal(0xbeef, dma.val);
+            assert_int_equal(0, tran_sock_send(sock, hdr.msg_id, true,
+                                               VFIO_USER_DMA_WRITE,
+                                               &dma.access,
+                                               sizeof(dma.access)));
+            dma_seen = true;
+            continue;
+        }
+        assert_int_equal(sizeof(msg.access), len);
+        assert_int_equal(len, recv(sock, &msg.access, len, MSG_WAITALL));
+        msg_ids[i++] = hdr.msg_id;
+    }
+    /* BAR0 completes after the first BAR1 write has been replied to. */
+    assert_true(dma_seen);
+    assert_int_equal(0x3, msg_ids[0]);
+    assert_int_equal(0x2 + 0x4, msg_ids[1] + msg_ids[2]);
+    assert_true(worker_bar0_waited);
+    assert_int_equal(0, worker_dma_errno);
+    assert_int_equal(0xcafe, worker_bar1_vals[0]);
+    assert_int_equal(0xcafe + 1, worker_bar1_vals[1]);
+
+    /* A failed access is replied to with its error. */
+    msg.access.region = VFU_PCI_DEV_BAR0_REGION_IDX;
+    msg.access.offset = 0x4;
+    assert_int_equal(0, tran_sock_send(sock, 0x5, false,
+                                       VFIO_USER_REGION_WRITE,
+                                       &msg, sizeof(msg)));
+    assert_int_equal(0, vfu_run_ctx(ctx));
+    msg_ids[0] = 0x5;
+    assert_true(tran_sock_recv(sock, SOCK_STREAM, &hdr, true, &msg_ids[0],
+                               NULL, NULL) < 0);
+    assert_int_equal(1, hdr.flags.error);
+
+    vfu_destroy_ctx(ctx);
+    close(sock);
+}
+
+static void
+test_clone(UNUSED void **state)
+{
+    struct pmcap pm = { .hdr.id = PCI_CAP_ID_PM, .pmcs.nsfrst = 0x1 };
+    vfu_ctx_t *tmpl, *clone[2];
+    uint16_t cmd = PCI_COMMAND_MEMORY;
+    int i;
+
+    tmpl = vfu_create_ctx(VFU_TRANS_SOCK, "test", 0, NULL, VFU_DEV_TYPE_PCI);
+    assert_non_null(tmpl);
+    assert_int_equal(0, vfu_pci_init(tmpl, VFU_PCI_TYPE_EXPRESS,
+                                     PCI_HEADER_TYPE_NORMAL, 0));
+    vfu_pci_set_id(tmpl, 0xdead, 0xbeef, 0xcafe, 0xbabe);
+    assert_int_equal(0, vfu_setup_region(tmpl, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                         0x1000, NULL,
+                                         VFU_REGION_FLAG_RW |
+                                         VFU_REGION_FLAG_MEM,
+                                         NULL, 0, -1));
+    assert_int_equal(0, vfu_setup_device_dma(tmpl, NULL, NULL));
+    assert_int_equal(PCI_STD_HEADER_SIZEOF,
+                     vfu_pci_add_capability(tmpl, 0, 0, &pm));
+
+    /* Only realized contexts are templates. */
+    assert_null(vfu_clone_ctx(tmpl, "test", 0, NULL));
+    assert_int_equal(EINVAL, errno);
+    assert_int_equal(0, vfu_realize_ctx(tmpl));
+
+    for (i = 0; i < 2; i++) {
+        clone[i] = vfu_clone_ctx(tmpl, "test", 0, &clone[i]);
+        assert_non_null(clone[i]);
+        assert_true(clone[i]->realized);
+        assert_ptr_equal(&clone[i], vfu_get_private(clone[i]));
+        assert_ptr_equal(tmpl->reg_info, clone[i]->reg_info);
+        assert_non_null(clone[i]->dma);
+        assert_true(clone[i]->pci.config_space != tmpl->pci.config_space);
+        assert_memory_equal(tmpl->pci.config_space, clone[i]->pci.config_space,
+                            PCI_CFG_SPACE_EXP_SIZE);
+        assert_int_equal(PCI_STD_HEADER_SIZEOF,
+                         vfu_pci_find_capability(clone[i], false,
+                                                 PCI_CAP_ID_PM));
+    }
+    assert_int_equal(2, tmpl->nr_clones);
+
+    /* Clones have their own config space but not their own regions. */
+    assert_int_equal(sizeof(cmd),
+                     pci_config_space_access(clone[0], (char *)&cmd,
+                                             sizeof(cmd), PCI_COMMAND, true));
+    assert_int_equal(PCI_COMMAND_MEMORY,
+                     clone[0]->pci.config_space->hdr.cmd.raw);
+    assert_int_equal(0, clone[1]->pci.config_space->hdr.cmd.raw);
+    assert_int_equal(0, tmpl->pci.config_space->hdr.cmd.raw);
+    assert_int_equal(-1, vfu_setup_region(clone[0], VFU_PCI_DEV_BAR1_REGION_IDX,
+                                          0x1000, NULL,
+                                          VFU_REGION_FLAG_RW, NULL, 0, -1));
+    assert_int_equal(EINVAL, errno);
+    assert_int_equal(-1, vfu_setup_region(tmpl, VFU_PCI_DEV_BAR1_REGION_IDX,
+                                          0x1000, NULL,
+                                          VFU_REGION_FLAG_RW, NULL, 0, -1));
+    assert_int_equal(EINVAL, errno);
+
+    /* Clones are not templates. */
+    assert_null(vfu_clone_ctx(clone[0], "test", 0, NULL));
+    assert_int_equal(EINVAL, errno);
+
+    vfu_destroy_ctx(clone[0]);
+    vfu_destroy_ctx(clone[1]);
+    assert_int_equal(0, tmpl->nr_clones);
+    vfu_destroy_ctx(tmpl);
+}
+
+static void
+test_info_cache(UNUSED void **state)
+{
+    struct iovec mmap_areas[] = {
+        { .iov_base = (void *)0x0, .iov_len = 0x1000 },
+        { .iov_base = (void *)0x2000, .iov_len = 0x1000 }
+    };
+    struct vfio_device_info dev_info = { .argsz = sizeof(dev_info) };
+    struct vfio_irq_info irq_info = { .argsz = sizeof(irq_info) };
+    struct vfio_irq_info irq_info_out = { 0 };
+    struct vfio_device_info dev_info_out = { 0 };
+    struct vfio_region_info *vfio_reg;
+    struct info_cache *cache;
+    vfu_ctx_t *ctx;
+    size_t i;
+
+    ctx = vfu_create_ctx(VFU_TRANS_SOCK, "test", 0, NULL, VFU_DEV_TYPE_PCI);
+    assert_non_null(ctx);
+    assert_int_equal(0, vfu_pci_init(ctx, VFU_PCI_TYPE_CONVENTIONAL,
+                                     PCI_HEADER_TYPE_NORMAL, 0));
+    assert_int_equal(0, vfu_setup_region(ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                         0x4000, NULL, VFU_REGION_FLAG_RW,
+                                         mmap_areas, 2, 0));
+    assert_int_equal(0, vfu_setup_device_nr_irqs(ctx, VFU_DEV_MSIX_IRQ, 4));
+    assert_null(ctx->info_cache);
+    assert_int_equal(0, vfu_realize_ctx(ctx));
+    cache = ctx->info_cache;
+    assert_non_null(cache);
+
+    /* The cached replies are the ones built on demand. */
+    assert_int_equal(0, handle_device_get_info(ctx, sizeof(dev_info),
+                                               &dev_info, &dev_info_out));
+    assert_memory_equal(&dev_info_out, &cache->dev_info, sizeof(dev_info_out));
+    irq_info.index = VFU_DEV_MSIX_IRQ;
+    assert_int_equal(0, handle_device_get_irq_info(ctx, sizeof(irq_info),
+                                                   &irq_info, &irq_info_out));
+    assert_memory_equal(&irq_info_out, &cache->irq_info[VFU_DEV_MSIX_IRQ],
+                        sizeof(irq_info_out));
+    assert_int_equal(4, cache->irq_info[VFU_DEV_MSIX_IRQ].count);
+
+    ctx->client_max_fds = 2;
+    for (i = 0; i < ctx->nr_regions; i++) {
+        int *fds = NULL;
+        size_t nr_fds = 0;
+
+        assert_int_equal(0, dev_get_reginfo(ctx, i, sizeof(*vfio_reg),
+                                            &vfio_reg, &fds, &nr_fds));
+        assert_memory_equal(vfio_reg, &cache->reg_hdr[i], sizeof(*vfio_reg));
+        if (vfio_reg->argsz == sizeof(*vfio_reg)) {
+            assert_null(cache->reg_caps[i]);
+            free(vfio_reg);
+            continue;
+        }
+        assert_int_equal(VFU_PCI_DEV_BAR0_REGION_IDX, i);
+        assert_non_null(cache->reg_caps[i]);
+        free(vfio_reg);
+        assert_int_equal(0, dev_get_reginfo(ctx, i, cache->reg_hdr[i].argsz,
+                                            &vfio_reg, &fds, &nr_fds));
+        assert_memory_equal(vfio_reg, cache->reg_caps[i], vfio_reg->argsz);
+        assert_int_equal(2, nr_fds);
+        free(vfio_reg);
+        free(fds);
+    }
+
+    /* Changing the device layout drops the cache. */
+    assert_int_equal(0, vfu_setup_device_nr_irqs(ctx, VFU_DEV_MSIX_IRQ, 8));
+    assert_null(ctx->info_cache);
+
+    vfu_destroy_ctx(ctx);
+}
+
+static void
+test_device_get_all_info(UNUSED void **state)
+{
+    struct iovec mmap_areas[] = {
+        { .iov_base = (void *)0x0, .iov_len = 0x1000 },
+        { .iov_base = (void *)0x2000, .iov_len = 0x1000 }
+    };
+    struct vfio_device_info dev_info = { .argsz = sizeof(dev_info) };
+    struct iovec _iovecs[2] = { { 0 } };
+    struct iovec *iovecs = NULL;
+    size_t nr_iovecs = 0, nr_fds = 0, size, i;
+    struct info_cache *cache;
+    int *fds = NULL;
+    vfu_ctx_t *ctx;
+
+    ctx = vfu_create_ctx(VFU_TRANS_SOCK, "test", 0, NULL, VFU_DEV_TYPE_PCI);
+    assert_non_null(ctx);
+    assert_int_equal(0, vfu_pci_init(ctx, VFU_PCI_TYPE_CONVENTIONAL,
+                                     PCI_HEADER_TYPE_NORMAL, 0));
+    assert_int_equal(0, vfu_setup_region(ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                         0x4000, NULL, VFU_REGION_FLAG_RW,
+                                         mmap_areas, 2, 0xbeef));
+    assert_int_equal(0, vfu_realize_ctx(ctx));
+    cache = ctx->info_cache;
+    assert_non_null(cache);
+
+    size = sizeof(dev_info) + sizeof(cache->irq_info);
+    for (i = 0; i < ctx->nr_regions; i++) {
+        size += cache->reg_hdr[i].argsz;
+    }
+    assert_int_equal(size, cache->all_info.argsz);
+    assert_int_equal(2, cache->nr_all_fds);
+
+    /* Too small, only the size is returned. */
+    assert_int_equal(0, handle_device_get_all_info(ctx, sizeof(dev_info),
+                                                   &dev_info, _iovecs,
+                                                   &iovecs, &nr_iovecs,
+                                                   &fds, &nr_fds));
+    assert_ptr_equal(_iovecs, iovecs);
+    assert_int_equal(2, nr_iovecs);
+    assert_ptr_equal(&cache->all_info, _iovecs[1].iov_base);
+    assert_int_equal(sizeof(dev_info), _iovecs[1].iov_len);
+    assert_null(fds);
+
+    /* The fds don't fit. */
+    dev_info.argsz = size;
+    ctx->client_max_fds = 1;
+    assert_int_equal(-E2BIG, handle_device_get_all_info(ctx, sizeof(dev_info),
+                                                        &dev_info, _iovecs,
+                                                        &iovecs, &nr_iovecs,
+                                                        &fds, &nr_fds));
+
+    ctx->client_max_fds = 2;
+    assert_int_equal(0, handle_device_get_all_info(ctx, sizeof(dev_info),
+                                                   &dev_info, _iovecs,
+                                                   &iovecs, &nr_iovecs,
+                                                   &fds, &nr_fds));
+    assert_int_equal(3 + ctx->nr_regions, nr_iovecs);
+    assert_ptr_equal(&cache->all_info, iovecs[1].iov_base);
+    assert_ptr_equal(cache->irq_info, iovecs[2].iov_base);
+    assert_ptr_equal(cache->reg_caps[VFU_PCI_DEV_BAR0_REGION_IDX],
+                     iovecs[3 + VFU_PCI_DEV_BAR0_REGION_IDX].iov_base);
+    assert_ptr_equal(&cache->reg_hdr[VFU_PCI_DEV_BAR1_REGION_IDX],
+                     iovecs[3 + VFU_PCI_DEV_BAR1_REGION_IDX].iov_base);
+    for (i = 1, size = 0; i < nr_iovecs; i++) {
+        size += iovecs[i].iov_len;
+    }
+    assert_int_equal(cache->all_info.argsz, size);
+    assert_int_equal(2, nr_fds);
+    assert_int_equal(0xbeef, fds[0]);
+    assert_int_equal(0xbeef, fds[1]);
+    free(iovecs);
+    free(fds);
+
+    vfu_destroy_ctx(ctx);
+}
+
 static void
 test_device_set_irqs(UNUSED void **state)
 {
@@ -1908,6 +4468,18 @@ main(void)
         cmocka_unit_test_setup(test_dma_map_return_value, setup),
         cmocka_unit_test_setup(test_dma_map_sg, setup),
         cmocka_unit_test_setup(test_dma_addr_to_sg, setup),
+        cmocka_unit_test_setup(test_dma_addr_to_sg_batch, setup),
+        cmocka_unit_test_setup(test_iova_to_vaddr, setup),
+        cmocka_unit_test_setup(test_iommu, setup),
+        cmocka_unit_test_setup(test_virtq_split, setup),
+        cmocka_unit_test_setup(test_virtq_packed, setup),
+        cmocka_unit_test_setup(test_nvme_qp, setup),
+        cmocka_unit_test_setup(test_doorbells, setup),
+        cmocka_unit_test_setup(test_dma_group, setup),
+        cmocka_unit_test_setup(test_dma_read_write_chunked, setup),
+        cmocka_unit_test_setup(test_dma_read_write_direct, setup),
+        cmocka_unit_test_setup(test_send_msg_threads, setup),
+        cmocka_unit_test_setup(test_sg_copy, setup),
         cmocka_unit_test_setup(test_vfu_setup_device_dma, setup),
         cmocka_unit_test_setup(test_migration_state_transitions, setup),
         cmocka_unit_test_setup_teardown(test_setup_migration_region_too_small,
@@ -1939,6 +4511,24 @@ main(void)
         cmocka_unit_test_setup(test_should_exec_command, setup),
         cmocka_unit_test_setup(test_exec_command, setup),
         cmocka_unit_test_setup(test_dirty_pages_without_dma, setup),
+        cmocka_unit_test_setup(test_functions, setup),
+        cmocka_unit_test_setup(test_sriov, setup),
+        cmocka_unit_test_setup(test_listener, setup),
+        cmocka_unit_test_setup(test_listener_nb, setup),
+        cmocka_unit_test_setup(test_get_reply_queues_cmds, setup),
+        cmocka_unit_test_setup(test_get_reply_queue_limit, setup),
+        cmocka_unit_test_setup(test_get_request_keeps_replies, setup),
+        cmocka_unit_test_setup(test_reply_cork, setup),
+        cmocka_unit_test_setup(test_get_request_partial, setup),
+        cmocka_unit_test_setup(test_seqpacket, setup),
+        cmocka_unit_test_setup(test_tcp, setup),
+        cmocka_unit_test_setup(test_irq_post, setup),
+        cmocka_unit_test_setup(test_coroutines, setup),
+        cmocka_unit_test_setup(test_rate_limit, setup),
+        cmocka_unit_test_setup(test_region_workers, setup),
+        cmocka_unit_test_setup(test_clone, setup),
+        cmocka_unit_test_setup(test_info_cache, setup),
+        cmocka_unit_test_setup(test_device_get_all_info, setup),
         cmocka_unit_test_setup(test_device_set_irqs, setup),
     };
 